@@ -0,0 +1,30 @@
+# - Try to find liburing library and headers
+# Once done, this will define
+#
+#  LIBURING_FOUND - system has liburing
+#  LIBURING_INCLUDE_DIRS - the liburing include directories
+#  LIBURING_LIBRARIES - link these to use liburing
+
+FIND_PATH(LIBURING_INCLUDE liburing.h
+  ${LIBURING_PREFIX}/include
+  /usr/include
+)
+
+FIND_LIBRARY(LIBURING_LIB
+  NAMES
+    uring
+  PATHS
+    /usr/lib
+    ${LIBURING_PREFIX}/lib
+)
+
+IF(LIBURING_INCLUDE AND LIBURING_LIB)
+  SET(LIBURING_FOUND TRUE)
+  SET(LIBURING_INCLUDE_DIRS ${LIBURING_INCLUDE})
+  SET(LIBURING_LIBRARIES ${LIBURING_LIB})
+ELSE(LIBURING_INCLUDE AND LIBURING_LIB)
+  SET(LIBURING_FOUND FALSE)
+  SET(LIBURING_LIBRARIES "")
+ENDIF(LIBURING_INCLUDE AND LIBURING_LIB)
+
+MARK_AS_ADVANCED( LIBURING_LIB LIBURING_INCLUDE )
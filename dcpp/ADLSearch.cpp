@@ -30,6 +30,7 @@
 #include "File.h"
 #include "SimpleXML.h"
 #include "StringTokenizer.h"
+#include "Thread.h"
 
 #ifdef USE_PCRE
 #include "pcrecpp.h"
@@ -52,11 +53,19 @@ bUseRegexp(false)
 void ADLSearch::Prepare(StringMap& params) {
     // Prepare quick search of substrings
     stringSearchList.clear();
+    bUseRegexp = false;
+    regexp.reset();
     #ifdef USE_PCRE
     if(searchString.find("$Re:") == 0){
         regexpstring.clear();
         regexpstring=searchString.substr(4);
         bUseRegexp = true;
+
+        // Compiled once here rather than for every name
+        pcrecpp::RE_Options options;
+        options.set_utf8(true);
+        options.set_caseless(true);
+        regexp = std::make_shared<pcrecpp::RE>(regexpstring, options);
     } else {
     #endif
         // Replace parameters such as %[nick]
@@ -118,7 +127,7 @@ string ADLSearch::SizeTypeToString(ADLSearch::SizeType t) {
     case SizeGibiBytes: return "GiB";
     }
 }
-int64_t ADLSearch::GetSizeBase() {
+int64_t ADLSearch::GetSizeBase() const {
     switch(typeFileSize) {
     default:
     case SizeBytes:     return (int64_t)1;
@@ -168,27 +177,27 @@ bool ADLSearch::MatchesDirectory(const string& d) {
 }
 
 bool ADLSearch::SearchAll(const string& s) {
-    #ifdef USE_PCRE
-    if(bUseRegexp){
-        pcrecpp::RE_Options options;
-        options.set_utf8(true);
-        options.set_caseless(true);
-        pcrecpp::RE regexp(regexpstring, options);
-        if(regexp.FullMatch(s))
-            return true;
-        else
-            return false;
-    } else {
-    #endif
+    if(bUseRegexp) {
+        return SearchRegexp(s);
+    }
+
     // Match all substrings
-        for(StringSearch::List::iterator i = stringSearchList.begin(); i != stringSearchList.end(); ++i) {
-            if(!i->match(s)) {
-                return false;
-            }
+    string lower;
+    Text::toLower(s, lower);
+    for(StringSearch::List::iterator i = stringSearchList.begin(); i != stringSearchList.end(); ++i) {
+        if(!i->matchLower(lower)) {
+            return false;
         }
-        return !stringSearchList.empty();
-    #ifdef USE_PCRE
     }
+    return !stringSearchList.empty();
+}
+
+bool ADLSearch::SearchRegexp(const string& s) const {
+    #ifdef USE_PCRE
+    return regexp->FullMatch(s);
+    #else
+    (void)s;
+    return false;
     #endif
 }
 
@@ -323,7 +332,7 @@ void ADLSearchManager::Save()
     }
 }
 
-void ADLSearchManager::MatchesFile(DestDirList& destDirVector, DirectoryListing::File *currentFile, string& fullPath) {
+void ADLSearchManager::MatchesFile(DestDirList& destDirVector, DirectoryListing::File *currentFile, const vector<size_t>& searches) {
     // Add to any substructure being stored
     for(auto id = destDirVector.begin(); id != destDirVector.end(); ++id) {
         if(id->subdir != NULL) {
@@ -340,33 +349,32 @@ void ADLSearchManager::MatchesFile(DestDirList& destDirVector, DirectoryListing:
         return;
     }
 
-    string filePath = fullPath + "\\" + currentFile->getName();
     // Match searches
-    for(auto is = collection.begin(); is != collection.end(); ++is) {
+    for(auto i = searches.begin(); i != searches.end(); ++i) {
+        auto is = collection.begin() + *i;
         if(destDirVector[is->ddIndex].fileAdded) {
             continue;
         }
-        if(is->MatchesFile(currentFile->getName(), filePath, currentFile->getSize())) {
-            DirectoryListing::File *copyFile = new DirectoryListing::File(*currentFile, true);
-            destDirVector[is->ddIndex].dir->files.push_back(copyFile);
-            destDirVector[is->ddIndex].fileAdded = true;
-
-            if(is->isAutoQueue){
-                try {
-                    QueueManager::getInstance()->add(SETTING(DOWNLOAD_DIRECTORY) + currentFile->getName(),
-                        currentFile->getSize(), currentFile->getTTH(), getUser());
-                } catch(const Exception&) { }
-            }
 
-            if(breakOnFirst) {
-                // Found a match, search no more
-                break;
-            }
+        DirectoryListing::File *copyFile = new DirectoryListing::File(*currentFile, true);
+        destDirVector[is->ddIndex].dir->files.push_back(copyFile);
+        destDirVector[is->ddIndex].fileAdded = true;
+
+        if(is->isAutoQueue){
+            try {
+                QueueManager::getInstance()->add(SETTING(DOWNLOAD_DIRECTORY) + currentFile->getName(),
+                    currentFile->getSize(), currentFile->getTTH(), getUser());
+            } catch(const Exception&) { }
+        }
+
+        if(breakOnFirst) {
+            // Found a match, search no more
+            break;
         }
     }
 }
 
-void ADLSearchManager::MatchesDirectory(DestDirList& destDirVector, DirectoryListing::Directory* currentDir, string& fullPath) {
+void ADLSearchManager::MatchesDirectory(DestDirList& destDirVector, DirectoryListing::Directory* currentDir, string& fullPath, const vector<size_t>& searches) {
     // Add to any substructure being stored
     for(auto id = destDirVector.begin(); id != destDirVector.end(); ++id) {
         if(id->subdir != NULL) {
@@ -383,18 +391,18 @@ void ADLSearchManager::MatchesDirectory(DestDirList& destDirVector, DirectoryLis
     }
 
     // Match searches
-    for(auto is = collection.begin(); is != collection.end(); ++is) {
+    for(auto i = searches.begin(); i != searches.end(); ++i) {
+        auto is = collection.begin() + *i;
         if(destDirVector[is->ddIndex].subdir != NULL) {
             continue;
         }
-        if(is->MatchesDirectory(currentDir->getName())) {
-            destDirVector[is->ddIndex].subdir =
-                new DirectoryListing::AdlDirectory(fullPath, destDirVector[is->ddIndex].dir, currentDir->getName());
-            destDirVector[is->ddIndex].dir->directories.push_back(destDirVector[is->ddIndex].subdir);
-            if(breakOnFirst) {
-                // Found a match, search no more
-                break;
-            }
+
+        destDirVector[is->ddIndex].subdir =
+            new DirectoryListing::AdlDirectory(fullPath, destDirVector[is->ddIndex].dir, currentDir->getName());
+        destDirVector[is->ddIndex].dir->directories.push_back(destDirVector[is->ddIndex].subdir);
+        if(breakOnFirst) {
+            // Found a match, search no more
+            break;
         }
     }
 }
@@ -455,20 +463,225 @@ void ADLSearchManager::matchListing(DirectoryListing& aDirList) noexcept {
     PrepareDestinationDirectories(destDirs, aDirList.getRoot(), params);
     setBreakOnFirst(BOOLSETTING(ADLS_BREAK_ON_FIRST));
 
-    string path(aDirList.getRoot()->getName());
-    matchRecurse(destDirs, aDirList.getRoot(), path);
+    // Find all matches first, spread over several threads; the destination directories are
+    // then built walking the listing in order, as the outcome depends on what came before
+    PatternSet sets[ADLSearch::TypeLast];
+    for(int i = ADLSearch::TypeFirst; i < ADLSearch::TypeLast; ++i) {
+        sets[i].build(collection, (ADLSearch::SourceType)i);
+    }
+
+    DirectoryListing::Directory* root = aDirList.getRoot();
+    vector<pair<DirectoryListing::Directory*, string> > dirs(1, make_pair(root, root->getName()));
+    size_t items = 1 + root->files.size();
+    for(size_t i = 0; i < dirs.size(); ++i) {
+        auto& children = dirs[i].first->directories;
+        for(auto j = children.begin(); j != children.end(); ++j) {
+            dirs.push_back(make_pair(*j, dirs[i].second + "\\" + (*j)->getName()));
+            items += 1 + (*j)->files.size();
+        }
+    }
+
+    // Parts of about the same number of files and directories
+    size_t threads = items < 10000 ? 1 : min(8U, Thread::getProcessorCount());
+    size_t parts = threads * 4;
+    vector<size_t> bounds(1, 0);
+    for(size_t i = 0, n = 0; i < dirs.size(); ++i) {
+        n += 1 + dirs[i].first->files.size();
+        if(n * parts >= items * bounds.size() || i + 1 == dirs.size()) {
+            bounds.push_back(i + 1);
+        }
+    }
+
+    vector<MatchMap> found(bounds.size() - 1);
+    Thread::runParallel(found.size(), threads, [&](size_t i) {
+        findMatches(dirs, bounds[i], bounds[i + 1], sets, found[i]);
+    });
+
+    MatchMap matches;
+    for(auto i = found.begin(); i != found.end(); ++i) {
+        matches.insert(make_move_iterator(i->begin()), make_move_iterator(i->end()));
+    }
+
+    string path(root->getName());
+    matchRecurse(destDirs, root, path, matches);
 
     FinalizeDestinationDirectories(destDirs, aDirList.getRoot());
 }
 
-void ADLSearchManager::matchRecurse(DestDirList &aDestList, DirectoryListing::Directory* aDir, string &aPath) {
+void ADLSearchManager::PatternSet::build(const SearchCollection& collection, ADLSearch::SourceType type) {
+    patterns.clear();
+    needed.assign(collection.size(), vector<MultiStringSearch::Mask>());
+
+    // Where each distinct pattern went
+    unordered_map<string, pair<size_t, size_t> > ids;
+
+    for(size_t i = 0; i < collection.size(); ++i) {
+        const ADLSearch& search = collection[i];
+        if(!search.isActive || search.sourceType != type || search.bUseRegexp) {
+            continue;
+        }
+
+        for(auto j = search.stringSearchList.begin(); j != search.stringSearchList.end(); ++j) {
+            auto id = ids.find(j->getPattern());
+            if(id == ids.end()) {
+                if(patterns.empty() || patterns.back().size() == MultiStringSearch::MAX_PATTERNS) {
+                    patterns.push_back(MultiStringSearch());
+                }
+                patterns.back().add(j->getPattern());
+                id = ids.insert(make_pair(j->getPattern(), make_pair(patterns.size() - 1, patterns.back().size() - 1))).first;
+            }
+
+            auto& mask = needed[i];
+            mask.resize(patterns.size(), 0);
+            mask[id->second.first] |= MultiStringSearch::Mask(1) << id->second.second;
+        }
+    }
+
+    for(auto i = patterns.begin(); i != patterns.end(); ++i) {
+        i->build();
+    }
+}
+
+void ADLSearchManager::PatternSet::match(const string& lower, vector<MultiStringSearch::Mask>& found) const {
+    found.resize(patterns.size());
+    for(size_t i = 0; i < patterns.size(); ++i) {
+        found[i] = patterns[i].matchLower(lower, patterns[i].getAll());
+    }
+}
+
+bool ADLSearchManager::PatternSet::matches(size_t search, const vector<MultiStringSearch::Mask>& found) const {
+    const auto& mask = needed[search];
+    for(size_t i = 0; i < mask.size(); ++i) {
+        if((found[i] & mask[i]) != mask[i]) {
+            return false;
+        }
+    }
+    // Searches without substrings match nothing
+    return !mask.empty();
+}
+
+void ADLSearchManager::findMatches(const vector<pair<DirectoryListing::Directory*, string> >& dirs, size_t first, size_t last,
+    const PatternSet (&sets)[ADLSearch::TypeLast], MatchMap& matches) const
+{
+    // Only the searches that may match anything, each kept to its kind of item
+    vector<size_t> dirSearches, fileSearches;
+    for(size_t i = 0; i < collection.size(); ++i) {
+        if(collection[i].isActive) {
+            (collection[i].sourceType == ADLSearch::OnlyDirectory ? dirSearches : fileSearches).push_back(i);
+        }
+    }
+
+    vector<MultiStringSearch::Mask> nameFound, pathFound;
+    string lower, path;
+
+    for(size_t d = first; d < last; ++d) {
+        DirectoryListing::Directory* dir = dirs[d].first;
+
+        // The root is only a container
+        if(d > 0 && !dir->getName().empty()) {
+            bool folded = false;
+            for(auto i = dirSearches.begin(); i != dirSearches.end(); ++i) {
+                const ADLSearch& search = collection[*i];
+                bool match;
+                if(search.bUseRegexp) {
+                    match = search.SearchRegexp(dir->getName());
+                } else {
+                    if(!folded) {
+                        lower.clear();
+                        Text::toLower(dir->getName(), lower);
+                        sets[ADLSearch::OnlyDirectory].match(lower, nameFound);
+                        folded = true;
+                    }
+                    match = sets[ADLSearch::OnlyDirectory].matches(*i, nameFound);
+                }
+                if(match) {
+                    matches[dir].dir.push_back(*i);
+                }
+            }
+        }
+
+        for(size_t f = 0; f < dir->files.size(); ++f) {
+            DirectoryListing::File* file = dir->files[f];
+            if(file->getName().empty()) {
+                continue;
+            }
+
+            bool nameFolded = false, pathMade = false, pathFolded = false;
+            for(auto i = fileSearches.begin(); i != fileSearches.end(); ++i) {
+                const ADLSearch& search = collection[*i];
+
+                int64_t size = file->getSize();
+                if(size >= 0) {
+                    if(search.minFileSize >= 0 && size < search.minFileSize * search.GetSizeBase()) {
+                        continue;
+                    }
+                    if(search.maxFileSize >= 0 && size > search.maxFileSize * search.GetSizeBase()) {
+                        continue;
+                    }
+                }
+
+                bool match;
+                if(search.sourceType == ADLSearch::OnlyFile) {
+                    if(search.bUseRegexp) {
+                        match = search.SearchRegexp(file->getName());
+                    } else {
+                        if(!nameFolded) {
+                            lower.clear();
+                            Text::toLower(file->getName(), lower);
+                            sets[ADLSearch::OnlyFile].match(lower, nameFound);
+                            nameFolded = true;
+                        }
+                        match = sets[ADLSearch::OnlyFile].matches(*i, nameFound);
+                    }
+                } else {
+                    if(!pathMade) {
+                        path = dirs[d].second + "\\" + file->getName();
+                        pathMade = true;
+                    }
+                    if(search.bUseRegexp) {
+                        match = search.SearchRegexp(path);
+                    } else {
+                        if(!pathFolded) {
+                            string lowerPath;
+                            Text::toLower(path, lowerPath);
+                            sets[ADLSearch::FullPath].match(lowerPath, pathFound);
+                            pathFolded = true;
+                        }
+                        match = sets[ADLSearch::FullPath].matches(*i, pathFound);
+                    }
+                }
+                if(match) {
+                    matches[dir].files.push_back(make_pair(f, *i));
+                    if(breakOnFirst) {
+                        // The first match always wins for files
+                        break;
+                    }
+                }
+            }
+        }
+    }
+}
+
+void ADLSearchManager::matchRecurse(DestDirList &aDestList, DirectoryListing::Directory* aDir, string &aPath, const MatchMap& matches) {
+    static const Matches none;
+    vector<size_t> searches;
+
     for(DirectoryListing::Directory::Iter dirIt = aDir->directories.begin(); dirIt != aDir->directories.end(); ++dirIt) {
         string tmpPath = aPath + "\\" + (*dirIt)->getName();
-        MatchesDirectory(aDestList, *dirIt, tmpPath);
-        matchRecurse(aDestList, *dirIt, tmpPath);
+        auto m = matches.find(*dirIt);
+        MatchesDirectory(aDestList, *dirIt, tmpPath, m == matches.end() ? none.dir : m->second.dir);
+        matchRecurse(aDestList, *dirIt, tmpPath, matches);
     }
+
+    auto m = matches.find(aDir);
+    const auto& files = m == matches.end() ? none.files : m->second.files;
+    auto k = files.begin();
     for(DirectoryListing::File::Iter fileIt = aDir->files.begin(); fileIt != aDir->files.end(); ++fileIt) {
-        MatchesFile(aDestList, *fileIt, aPath);
+        searches.clear();
+        for(size_t j = fileIt - aDir->files.begin(); k != files.end() && k->first == j; ++k) {
+            searches.push_back(k->second);
+        }
+        MatchesFile(aDestList, *fileIt, searches);
     }
     StepUpDirectory(aDestList);
 }
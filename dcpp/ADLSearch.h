@@ -29,6 +29,8 @@
 #include "Singleton.h"
 #include "DirectoryListing.h"
 
+namespace pcrecpp { class RE; }
+
 namespace dcpp {
 class AdlSearchManager;
 
@@ -74,7 +76,7 @@ public:
     SizeType typeFileSize;
     SizeType StringToSizeType(const string& s);
     string SizeTypeToString(SizeType t);
-    int64_t GetSizeBase();
+    int64_t GetSizeBase() const;
 
     // Name of the destination directory (empty = 'ADLSearch') and its index
     string destDir;
@@ -89,9 +91,12 @@ private:
     //decide if regexp should be used
     bool bUseRegexp;
     string regexpstring;
+    // Compiled by Prepare
+    std::shared_ptr<pcrecpp::RE> regexp;
     // Substring searches
     StringSearch::List stringSearchList;
     bool SearchAll(const string& s);
+    bool SearchRegexp(const string& s) const;
 };
 
 ///  Class that holds all active searches
@@ -128,12 +133,36 @@ public:
     void matchListing(DirectoryListing& /*aDirList*/) noexcept;
 
 private:
+    // Searches matching a directory and its files, in collection order
+    struct Matches {
+        vector<size_t> dir;
+        // Index of a file in the directory and a search it matches
+        vector<pair<size_t, size_t> > files;
+    };
+    typedef unordered_map<const DirectoryListing::Directory*, Matches> MatchMap;
+
+    // Substring patterns of the searches on one kind of text, all found in a single pass
+    struct PatternSet {
+        vector<MultiStringSearch> patterns;
+        // For each search of the collection, the patterns it needs from each element of patterns
+        vector<vector<MultiStringSearch::Mask> > needed;
+
+        void build(const SearchCollection& collection, ADLSearch::SourceType type);
+        bool empty() const { return patterns.empty(); }
+        void match(const string& lower, vector<MultiStringSearch::Mask>& found) const;
+        bool matches(size_t search, const vector<MultiStringSearch::Mask>& found) const;
+    };
+
+    // Find the matches of a part of the listing; safe to run in parallel
+    void findMatches(const vector<pair<DirectoryListing::Directory*, string> >& dirs, size_t first, size_t last,
+        const PatternSet (&sets)[ADLSearch::TypeLast], MatchMap& matches) const;
+
     // @internal
-    void matchRecurse(DestDirList& /*aDestList*/, DirectoryListing::Directory* /*aDir*/, string& /*aPath*/);
+    void matchRecurse(DestDirList& /*aDestList*/, DirectoryListing::Directory* /*aDir*/, string& /*aPath*/, const MatchMap& matches);
     // Search for file match
-    void MatchesFile(DestDirList& destDirVector, DirectoryListing::File *currentFile, string& fullPath);
+    void MatchesFile(DestDirList& destDirVector, DirectoryListing::File *currentFile, const vector<size_t>& searches);
     // Search for directory match
-    void MatchesDirectory(DestDirList& destDirVector, DirectoryListing::Directory* currentDir, string& fullPath);
+    void MatchesDirectory(DestDirList& destDirVector, DirectoryListing::Directory* currentDir, string& fullPath, const vector<size_t>& searches);
     // Step up directory
     void StepUpDirectory(DestDirList& destDirVector);
     // Prepare destination directory indexing
@@ -21,6 +21,7 @@
 #include "BZUtils.h"
 #include "Exception.h"
 #include "format.h"
+#include "Thread.h"
 
 namespace dcpp {
 
@@ -103,4 +104,304 @@ bool UnBZFilter::operator()(const void* in, size_t& insize, void* out, size_t& o
     return err == BZ_OK;
 }
 
+namespace {
+
+const uint64_t BLOCK_MAGIC = 0x314159265359ULL;
+const uint64_t END_MAGIC = 0x177245385090ULL;
+const int MAGIC_BITS = 48;
+const int CRC_BITS = 32;
+
+uint64_t getBits(const uint8_t* src, uint64_t start, int n) {
+    uint64_t ret = 0;
+    for(uint64_t i = start, iend = start + n; i < iend; ++i) {
+        ret = (ret << 1) | ((src[i / 8] >> (7 - i % 8)) & 1);
+    }
+    return ret;
+}
+
+uint32_t combineCrc(uint32_t crc, uint32_t blockCrc) {
+    return ((crc << 1) | (crc >> 31)) ^ blockCrc;
+}
+
+/** Decompress a complete stream, @return False if it's corrupt */
+bool decompressStream(const string& in, string& out) {
+    bz_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if(BZ2_bzDecompressInit(&zs, 0, 0) != BZ_OK)
+        return false;
+
+    zs.next_in = const_cast<char*>(in.data());
+    zs.avail_in = in.size();
+
+    int err = BZ_OK;
+    while(err == BZ_OK) {
+        size_t n = out.size();
+        out.resize(n + 256*1024);
+        zs.next_out = &out[n];
+        zs.avail_out = out.size() - n;
+        err = BZ2_bzDecompress(&zs);
+        out.resize(out.size() - zs.avail_out);
+        if(err == BZ_OK && zs.avail_in == 0 && zs.avail_out != 0)
+            break;
+    }
+    BZ2_bzDecompressEnd(&zs);
+    return err == BZ_STREAM_END;
+}
+
+size_t getThreads() {
+    return max(1U, min(8U, Thread::getProcessorCount()));
+}
+
+} // unnamed namespace
+
+void BZBitWriter::put(uint32_t value, int n) {
+    buf = (buf << n) | (value & ((1U << n) - 1));
+    count += n;
+    while(count >= 8) {
+        count -= 8;
+        data += (char)(buf >> count);
+    }
+    buf &= (1U << count) - 1;
+}
+
+void BZBitWriter::append(const uint8_t* src, uint64_t start, uint64_t n) {
+    src += start / 8;
+    int shift = start % 8;
+    for(; n >= 8; n -= 8, ++src) {
+        put(shift ? (src[0] << shift) | (src[1] >> (8 - shift)) : src[0], 8);
+    }
+    if(n > 0) {
+        put((uint32_t)getBits(src, shift, (int)n), (int)n);
+    }
+}
+
+void BZBitWriter::finish() {
+    if(count > 0) {
+        put(0, 8 - count);
+    }
+}
+
+ParallelBZFilter::ParallelBZFilter() : threads(getThreads()), outputPos(0), crc(0), finished(false) {
+    output.put('B', 8);
+    output.put('Z', 8);
+    output.put('h', 8);
+    output.put('9', 8);
+}
+
+bool ParallelBZFilter::operator()(const void* in, size_t& insize, void* out, size_t& outsize) {
+    if(outsize == 0)
+        return 0;
+
+    if(outputPos < output.data.size()) {
+        // Hand out what's done before taking more
+        insize = 0;
+    } else if(insize > 0) {
+        input.append((const char*)in, insize);
+        if(input.size() >= threads * CHUNK_SIZE) {
+            compress(false);
+        }
+    } else if(!finished) {
+        compress(true);
+        finished = true;
+    }
+
+    outsize = min(outsize, output.data.size() - outputPos);
+    memcpy(out, output.data.data() + outputPos, outsize);
+    outputPos += outsize;
+    if(outputPos == output.data.size()) {
+        output.data.clear();
+        outputPos = 0;
+    }
+
+    return !finished || !output.data.empty();
+}
+
+void ParallelBZFilter::compress(bool finishing) {
+    size_t chunks = finishing ? (input.size() + CHUNK_SIZE - 1) / CHUNK_SIZE : input.size() / CHUNK_SIZE;
+
+    for(size_t first = 0; first < chunks; first += threads) {
+        size_t n = min(threads, chunks - first);
+        vector<string> streams(n);
+        vector<char> ok(n, false);
+
+        Thread::runParallel(n, threads, [&](size_t i) {
+            size_t pos = (first + i) * CHUNK_SIZE;
+            size_t len = min(CHUNK_SIZE, input.size() - pos);
+            string& s = streams[i];
+            s.resize(len + len / 100 + 600);
+            unsigned int slen = s.size();
+            ok[i] = BZ2_bzBuffToBuffCompress(&s[0], &slen, const_cast<char*>(input.data() + pos), len, 9, 0, 30) == BZ_OK;
+            s.resize(slen);
+        });
+
+        for(size_t i = 0; i < n; ++i) {
+            if(!ok[i])
+                throw Exception(_("Error during compression"));
+            splice(streams[i]);
+        }
+    }
+
+    input.erase(0, min(input.size(), chunks * CHUNK_SIZE));
+
+    if(finishing) {
+        output.put((uint32_t)(END_MAGIC >> 24), 24);
+        output.put((uint32_t)END_MAGIC, 24);
+        output.put(crc >> 16, 16);
+        output.put(crc, 16);
+        output.finish();
+    }
+}
+
+void ParallelBZFilter::splice(const string& stream) {
+    // The stream is "BZh9", one block and the end of stream marker with the crc of the block
+    const uint8_t* s = (const uint8_t*)stream.data();
+    uint64_t bits = stream.size() * 8;
+    if(bits < 32 + 2 * (MAGIC_BITS + CRC_BITS) || getBits(s, 32, MAGIC_BITS) != BLOCK_MAGIC)
+        throw Exception(_("Error during compression"));
+
+    uint32_t blockCrc = (uint32_t)getBits(s, 32 + MAGIC_BITS, CRC_BITS);
+
+    // The end marker is followed by up to 7 bits of padding
+    uint64_t blockEnd = 0;
+    for(int pad = 0; pad < 8; ++pad) {
+        uint64_t pos = bits - pad - MAGIC_BITS - CRC_BITS;
+        if(getBits(s, pos, MAGIC_BITS) == END_MAGIC && getBits(s, pos + MAGIC_BITS, CRC_BITS) == blockCrc) {
+            blockEnd = pos;
+            break;
+        }
+    }
+    if(blockEnd == 0)
+        throw Exception(_("Error during compression"));
+
+    output.append(s, 32, blockEnd - 32);
+    crc = combineCrc(crc, blockCrc);
+}
+
+ParallelUnBZFilter::ParallelUnBZFilter() : threads(getThreads()), level(0), end(NONE), scanPos(32), window(0),
+    outputPos(0), crc(0), finished(false)
+{
+}
+
+bool ParallelUnBZFilter::operator()(const void* in, size_t& insize, void* out, size_t& outsize) {
+    if(outsize == 0)
+        return 0;
+
+    if(outputPos < output.size() || finished) {
+        insize = 0;
+    } else {
+        bool last = insize == 0;
+        input.append((const char*)in, insize);
+
+        if(level == 0 && input.size() >= 4) {
+            if(input.compare(0, 3, "BZh") != 0 || input[3] < '1' || input[3] > '9')
+                throw Exception(_("Error during decompression"));
+            level = input[3];
+        }
+
+        scan();
+
+        // The blocks are complete up to the next header or the end marker and its crc
+        bool haveEnd = end != NONE && input.size() * 8 >= end + MAGIC_BITS + CRC_BITS;
+        size_t complete = haveEnd ? blocks.size() : blocks.empty() ? 0 : blocks.size() - 1;
+
+        if(complete >= threads || (complete > 0 && (haveEnd || last))) {
+            decompress(min(complete, threads));
+        } else if(haveEnd) {
+            if(crc != getBits((const uint8_t*)input.data(), end + MAGIC_BITS, CRC_BITS))
+                throw Exception(_("Error during decompression"));
+            finished = true;
+        } else if(last) {
+            throw Exception(_("Error during decompression"));
+        }
+    }
+
+    outsize = min(outsize, output.size() - outputPos);
+    memcpy(out, output.data() + outputPos, outsize);
+    outputPos += outsize;
+    if(outputPos == output.size()) {
+        output.clear();
+        outputPos = 0;
+    }
+
+    return !finished || !output.empty();
+}
+
+void ParallelUnBZFilter::scan() {
+    if(level == 0 || end != NONE)
+        return;
+
+    const uint8_t* s = (const uint8_t*)input.data();
+    const uint64_t mask = (uint64_t(1) << MAGIC_BITS) - 1;
+    for(uint64_t iend = input.size() * 8; scanPos < iend; ++scanPos) {
+        window = ((window << 1) | ((s[scanPos / 8] >> (7 - scanPos % 8)) & 1)) & mask;
+        if(window == BLOCK_MAGIC) {
+            blocks.push_back(scanPos + 1 - MAGIC_BITS);
+        } else if(window == END_MAGIC) {
+            // Only a candidate: the pattern may be part of the last block's data, see decompress
+            end = scanPos + 1 - MAGIC_BITS;
+            ++scanPos;
+            break;
+        }
+    }
+}
+
+void ParallelUnBZFilter::decompress(size_t n) {
+    const uint8_t* s = (const uint8_t*)input.data();
+    auto blockEnd = [this](size_t i) { return i + 1 < blocks.size() ? blocks[i + 1] : end; };
+
+    vector<string> out(n);
+    vector<char> ok(n, false);
+
+    Thread::runParallel(n, threads, [&](size_t i) {
+        // Make a stream of its own out of each block
+        uint64_t start = blocks[i];
+        BZBitWriter stream;
+        stream.data.reserve((blockEnd(i) - start) / 8 + 32);
+        stream.put('B', 8);
+        stream.put('Z', 8);
+        stream.put('h', 8);
+        stream.put(level, 8);
+        stream.append(s, start, blockEnd(i) - start);
+        stream.put((uint32_t)(END_MAGIC >> 24), 24);
+        stream.put((uint32_t)END_MAGIC, 24);
+        stream.put((uint32_t)getBits(s, start + MAGIC_BITS, 16), 16);
+        stream.put((uint32_t)getBits(s, start + MAGIC_BITS + 16, 16), 16);
+        stream.finish();
+        ok[i] = decompressStream(stream.data, out[i]);
+    });
+
+    size_t done = 0;
+    for(; done < n; ++done) {
+        if(!ok[done]) {
+            // The data of a block may contain the header or the end pattern; join the part after
+            // it to the block and try again, which leaves a corrupt stream failing once the input runs out
+            if(done + 1 < blocks.size()) {
+                blocks.erase(blocks.begin() + done + 1);
+            } else if(end != NONE) {
+                // The scan picks up after the false end
+                end = NONE;
+            } else {
+                throw Exception(_("Error during decompression"));
+            }
+            break;
+        }
+        output += out[done];
+        crc = combineCrc(crc, (uint32_t)getBits(s, blocks[done] + MAGIC_BITS, CRC_BITS));
+    }
+
+    // Drop the input of the finished blocks
+    uint64_t next = done < blocks.size() ? blocks[done] : end;
+    blocks.erase(blocks.begin(), blocks.begin() + done);
+
+    size_t drop = next / 8;
+    input.erase(0, drop);
+    for(auto i = blocks.begin(); i != blocks.end(); ++i) {
+        *i -= drop * 8;
+    }
+    if(end != NONE) {
+        end -= drop * 8;
+    }
+    scanPos -= drop * 8;
+}
+
 } // namespace dcpp
@@ -56,4 +56,80 @@ private:
     bz_stream zs;
 };
 
+/** Writes bit strings, as bzip2 blocks aren't byte aligned */
+class BZBitWriter {
+public:
+    BZBitWriter() : buf(0), count(0) { }
+
+    /** Append the low n (at most 24) bits of value */
+    void put(uint32_t value, int n);
+    /** Append n bits of src starting at bit start */
+    void append(const uint8_t* src, uint64_t start, uint64_t n);
+    /** Pad the last byte with zeros */
+    void finish();
+
+    /** Completed bytes */
+    string data;
+private:
+    uint32_t buf;
+    int count;
+};
+
+/**
+ * Compresses in blocks on several threads. The blocks are spliced into a single bzip2 stream
+ * that any bzip2 decompressor can read.
+ */
+class ParallelBZFilter {
+public:
+    ParallelBZFilter();
+    /** @see BZFilter::operator() */
+    bool operator()(const void* in, size_t& insize, void* out, size_t& outsize);
+private:
+    /** Input per block, small enough that bzip2 never splits it in two (its initial run-length
+        encoding grows data by at most 5/4 and a level 9 block holds 899981 bytes) */
+    static const size_t CHUNK_SIZE = 700*1000;
+
+    void compress(bool finishing);
+    void splice(const string& stream);
+
+    size_t threads;
+    string input;
+    BZBitWriter output;
+    size_t outputPos;
+    uint32_t crc;
+    bool finished;
+};
+
+/**
+ * Decompresses on several threads by locating the block boundaries of the stream and
+ * decompressing the blocks independently.
+ */
+class ParallelUnBZFilter {
+public:
+    ParallelUnBZFilter();
+    /** @see UnBZFilter::operator() */
+    bool operator()(const void* in, size_t& insize, void* out, size_t& outsize);
+private:
+    static const uint64_t NONE = ~uint64_t(0);
+
+    void scan();
+    void decompress(size_t n);
+
+    size_t threads;
+    char level;
+
+    string input;
+    /** Bit positions of the block headers found in input */
+    vector<uint64_t> blocks;
+    /** Bit position of the likely end of stream marker in input, NONE until found */
+    uint64_t end;
+    uint64_t scanPos;
+    uint64_t window;
+
+    string output;
+    size_t outputPos;
+    uint32_t crc;
+    bool finished;
+};
+
 } // namespace dcpp
@@ -23,6 +23,7 @@
 #include "TimerManager.h"
 #include "SettingsManager.h"
 
+#include "File.h"
 #include "Streams.h"
 #include "SSLSocket.h"
 #include "CryptoManager.h"
@@ -30,23 +31,300 @@
 
 #include "ThrottleManager.h"
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
 namespace dcpp {
 
 // Polling is used for tasks...should be fixed...
 #define POLL_TIMEOUT 250
+#define LONG_TIMEOUT 30000
+#define SHORT_TIMEOUT 1000
+
+#ifdef __linux__
+namespace {
+
+/**
+ * Finds the plain file behind an upload stream, which may be limited to a range of it.
+ * @return The descriptor of the file, or -1 when the stream has to be read
+ */
+int getPlainFile(InputStream* is, int64_t& offset, int64_t& left) {
+    int64_t limit = -1;
+    if(LimitedInputStream<true>* l = dynamic_cast<LimitedInputStream<true>*>(is)) {
+        limit = (int64_t)l->getMaxBytes();
+        is = l->getStream();
+    }
+
+    File* f = dynamic_cast<File*>(is);
+    if(!f)
+        return -1;
+
+    offset = f->getPos();
+    left = f->getSize() - offset;
+    if(limit != -1)
+        left = min(left, limit);
+    return left > 0 ? f->getDescriptor() : -1;
+}
+
+}
+
+/**
+ * An I/O thread waiting for the events of its sockets with epoll. Sockets are spread over a small
+ * fixed pool of these; everything a socket does (handshakes, reads, writes, file transfers and
+ * listener callbacks) happens on the thread of its reactor, without blocking on any one socket,
+ * except for the work handed to a Worker.
+ */
+class BufferedSocket::Reactor : public Thread {
+public:
+    Reactor() : stop(false) {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(epfd == -1 || wakeFd == -1) {
+            string error = Util::translateError(errno);
+            closeFds();
+            throw ThreadException(error);
+        }
+
+        epoll_event ev = { EPOLLIN, { 0 } };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, wakeFd, &ev);
+
+        start();
+    }
+
+    ~Reactor() {
+        stop = true;
+        wake();
+        join();
+        closeFds();
+    }
+
+    /** @return The reactor for a new socket, starting the pool on first use */
+    static Reactor* pick() {
+        Lock l(poolCs);
+        if(pool.empty()) {
+            // Listeners may block on disk I/O, so keep a few even on a single core
+            size_t n = min(max(Thread::getProcessorCount(), 2U), 4U);
+            for(size_t i = 0; i < n; ++i) {
+                pool.push_back(unique_ptr<Reactor>(new Reactor));
+            }
+        }
+        return pool[next++ % pool.size()].get();
+    }
+
+    /** Stops and joins the pool; no sockets may be left */
+    static void shutdown() {
+        Lock l(poolCs);
+        pool.clear();
+        next = 0;
+    }
+
+    /** Have the socket processed by this reactor soon. Thread-safe. */
+    void schedule(BufferedSocket* s) {
+        {
+            FastLock l(cs);
+            if(s->queued)
+                return;
+            s->queued = true;
+            ready.push_back(s);
+        }
+        wake();
+    }
+
+    /** Sets the epoll events of the socket, 0 to stop watching it */
+    void watch(BufferedSocket* s, uint32_t aEvents) {
+        if(s->events == aEvents)
+            return;
+
+        epoll_event ev = { aEvents, { s } };
+        int op = s->events == 0 ? EPOLL_CTL_ADD : aEvents == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+        if(epoll_ctl(epfd, op, s->sock->sock, &ev) == 0 || op == EPOLL_CTL_DEL) {
+            s->events = aEvents;
+        } else {
+            dcdebug("Reactor: epoll_ctl failed: %d\n", errno);
+        }
+    }
+
+    /** Whether the socket should be processed every TICK as well, for timeouts and retries */
+    void setTimer(BufferedSocket* s, bool on) {
+        if(on) {
+            timers.insert(s);
+        } else {
+            timers.erase(s);
+        }
+    }
+
+    /** Forget the socket and delete it once the current events have been handled */
+    void destroy(BufferedSocket* s) {
+        if(s->sock.get() && s->sock->sock != INVALID_SOCKET)
+            watch(s, 0);
+        timers.erase(s);
+        {
+            FastLock l(cs);
+            if(s->queued) {
+                ready.erase(std::remove(ready.begin(), ready.end(), s), ready.end());
+                s->queued = false;
+            }
+        }
+        s->dead = true;
+        graveyard.push_back(s);
+    }
+
+private:
+    enum { TICK = ThrottleManager::REFILL_INTERVAL, MAX_EVENTS = 64 };
+
+    static CriticalSection poolCs;
+    static vector<unique_ptr<Reactor> > pool;
+    static size_t next;
+
+    int epfd;
+    int wakeFd;
+    volatile bool stop;
+
+    FastCriticalSection cs;
+    vector<BufferedSocket*> ready;
+
+    unordered_set<BufferedSocket*> timers;
+    vector<BufferedSocket*> graveyard;
+
+    void wake() {
+        uint64_t one = 1;
+        ssize_t ret = ::write(wakeFd, &one, sizeof(one));
+        (void)ret;
+    }
+
+    void closeFds() {
+        if(epfd != -1)
+            ::close(epfd);
+        if(wakeFd != -1)
+            ::close(wakeFd);
+    }
+
+    virtual int run() {
+        setThreadName("SocketReactor");
+
+        epoll_event evs[MAX_EVENTS];
+        vector<BufferedSocket*> batch;
+        uint64_t lastTick = GET_TICK();
+
+        while(!stop) {
+            int n = epoll_wait(epfd, evs, MAX_EVENTS, timers.empty() ? -1 : TICK);
+            if(n == -1 && errno != EINTR) {
+                dcdebug("Reactor: epoll_wait failed: %d\n", errno);
+                Thread::sleep(TICK);
+                continue;
+            }
+
+            for(int i = 0; i < n; ++i) {
+                BufferedSocket* s = static_cast<BufferedSocket*>(evs[i].data.ptr);
+                if(!s) {
+                    uint64_t count;
+                    ssize_t ret = ::read(wakeFd, &count, sizeof(count));
+                    (void)ret;
+                } else if(!s->dead) {
+                    s->handle(evs[i].events);
+                }
+            }
+
+            {
+                FastLock l(cs);
+                batch.swap(ready);
+                for(auto i = batch.begin(); i != batch.end(); ++i)
+                    (*i)->queued = false;
+            }
+            for(auto i = batch.begin(); i != batch.end(); ++i) {
+                if(!(*i)->dead)
+                    (*i)->process();
+            }
+            batch.clear();
+
+            uint64_t now = GET_TICK();
+            if(!timers.empty() && now >= lastTick + TICK) {
+                lastTick = now;
+                batch.assign(timers.begin(), timers.end());
+                for(auto i = batch.begin(); i != batch.end(); ++i) {
+                    if(!(*i)->dead)
+                        (*i)->process();
+                }
+                batch.clear();
+            }
+
+            for(auto i = graveyard.begin(); i != graveyard.end(); ++i)
+                delete *i;
+            graveyard.clear();
+        }
+        return 0;
+    }
+};
+
+CriticalSection BufferedSocket::Reactor::poolCs;
+vector<unique_ptr<BufferedSocket::Reactor> > BufferedSocket::Reactor::pool;
+size_t BufferedSocket::Reactor::next = 0;
+
+/**
+ * Does work that blocks - resolving a host name, negotiating with the socks proxy or an offloaded
+ * listener - on a short-lived thread of its own, then hands the socket back to its reactor, which
+ * joins the thread.
+ */
+class BufferedSocket::Worker : public Thread {
+public:
+    Worker(BufferedSocket* s_, const std::function<void ()>& f_) : s(s_), f(f_) { }
+
+private:
+    BufferedSocket* s;
+    std::function<void ()> f;
+
+    virtual int run() {
+        setThreadName("SocketWorker");
+
+        string error;
+        try {
+            f();
+        } catch(const Exception& e) {
+            error = e.getError();
+        }
+
+        Lock l(s->cs);
+        s->workError = error;
+        s->working = false;
+        s->reactor->schedule(s);
+        return 0;
+    }
+};
+#endif
+
 
 BufferedSocket::BufferedSocket(char aSeparator) :
 separator(aSeparator), mode(MODE_LINE), dataBytes(0), rollback(0), state(STARTING),
-disconnecting(false)
+disconnecting(false), readPaused(0)
+#ifdef __linux__
+, reactor(Reactor::pick()), events(0), queued(false), dead(false), handshaking(false), tcpPending(false),
+working(false), linesPending(false), parsePos(0), parseLeft(0), deadline(0), retryAt(0), blocked(false), readPending(false),
+readThrottled(false), writeThrottled(false), sendPos(0)
+#endif
 {
+#ifndef __linux__
     start();
+#endif
 
     sockets.inc();
 }
 
 Atomic<long,memory_ordering_strong> BufferedSocket::sockets(0);
 
+void BufferedSocket::waitShutdown() {
+    while(sockets > 0)
+        Thread::sleep(100);
+#ifdef __linux__
+    Reactor::shutdown();
+#endif
+}
+
 BufferedSocket::~BufferedSocket() {
+    // Once the count drops, ThrottleManager may be deleted
+    downBucket.release();
+    upBucket.release();
     sockets.dec();
 }
 
@@ -111,8 +389,7 @@ void BufferedSocket::connect(const string& aAddress, uint16_t aPort, uint16_t lo
     addTask(CONNECT, new ConnectInfo(aAddress, aPort, localPort, natRole, proxy && (SETTING(OUTGOING_CONNECTIONS) == SettingsManager::OUTGOING_SOCKS5)));
 }
 
-#define LONG_TIMEOUT 30000
-#define SHORT_TIMEOUT 1000
+#ifndef __linux__
 void BufferedSocket::threadConnect(const string& aAddr, uint16_t aPort, uint16_t localPort, NatRoles natRole, bool proxy) {
     dcassert(state == STARTING);
 
@@ -171,22 +448,78 @@ void BufferedSocket::threadAccept() {
     }
 }
 
-void BufferedSocket::threadRead() {
+#endif
+
+bool BufferedSocket::offloaded() const {
+#ifdef __linux__
+    return worker.get() != NULL;
+#else
+    return false;
+#endif
+}
+
+void BufferedSocket::pauseReading() {
+    Lock l(cs);
+    readPaused++;
+}
+
+void BufferedSocket::resumeReading() {
+    Lock l(cs);
+    dcassert(readPaused > 0);
+    if(--readPaused == 0) {
+#ifdef __linux__
+        // Watch for input again, and read what may be buffered already
+        reactor->schedule(this);
+#endif
+    }
+}
+
+bool BufferedSocket::isReadPaused() {
+    Lock l(cs);
+    return readPaused > 0;
+}
+
+/** @return Whether any data was received */
+bool BufferedSocket::threadRead() {
     if(state != RUNNING)
-        return;
+        return false;
 
-    int left = (mode == MODE_DATA) ? ThrottleManager::getInstance()->read(sock.get(), &inbuf[0], (int)inbuf.size()) : sock->read(&inbuf[0], (int)inbuf.size());
-    if(left == -1) {
+#ifndef __linux__
+    if(isReadPaused()) {
+        Thread::sleep(ThrottleManager::REFILL_INTERVAL);
+        return false;
+    }
+#endif
+
+    int left = (mode == MODE_DATA) ? ThrottleManager::getInstance()->read(downBucket, sock.get(), &inbuf[0], (int)inbuf.size()) : sock->read(&inbuf[0], (int)inbuf.size());
+    if(left == ThrottleManager::THROTTLED) {
+#ifdef __linux__
+        readThrottled = true;
+#else
+        Thread::sleep(ThrottleManager::REFILL_INTERVAL);
+#endif
+        return false;
+    } else if(left == -1) {
         // EWOULDBLOCK, no data received...
-        return;
+        return false;
     } else if(left == 0) {
         // This socket has been closed...
         throw SocketException(_("Connection closed"));
     }
+
+    parse(0, left);
+    return true;
+}
+
+/**
+ * Hands left bytes of inbuf, from bufpos on, to the listeners. On Linux, parsing stops when a
+ * listener offloads work, and the rest is kept for flushLines.
+ */
+void BufferedSocket::parse(int bufpos, int left) {
     string::size_type pos = 0;
     // always uncompressed data
     string l;
-    int bufpos = 0, total = left;
+    const int total = bufpos + left;
 
     while (left > 0) {
         switch (mode) {
@@ -215,6 +548,8 @@ void BufferedSocket::threadRead() {
                         if(pos > 0) // check empty (only pipe) command and don't waste cpu with it ;o)
                             fire(BufferedSocketListener::Line(), l.substr(0, pos));
                         l.erase (0, pos + 1 /* separator char */);
+                        if(offloaded())
+                            break;
                     }
                     // store remainder
                     line = l;
@@ -224,7 +559,7 @@ void BufferedSocket::threadRead() {
             case MODE_LINE:
                 // Special to autodetect nmdc connections...
                 if(separator == 0) {
-                    if(inbuf[0] == '$') {
+                    if(inbuf[bufpos] == '$') {
                         separator = '|';
                     } else {
                         separator = '\n';
@@ -236,7 +571,7 @@ void BufferedSocket::threadRead() {
                         fire(BufferedSocketListener::Line(), l.substr(0, pos));
                     l.erase (0, pos + 1 /* separator char */);
                     if (l.length() < (size_t)left) left = l.length();
-                    if (mode != MODE_LINE) {
+                    if (mode != MODE_LINE || offloaded()) {
                         // we changed mode; remainder of l is invalid.
                         l.clear();
                         bufpos = total - left;
@@ -248,7 +583,7 @@ void BufferedSocket::threadRead() {
                 line = l;
                 break;
             case MODE_DATA:
-                while(left > 0) {
+                while(left > 0 && !offloaded()) {
                     if(dataBytes == -1) {
                         fire(BufferedSocketListener::Data(), &inbuf[bufpos], left);
                         bufpos += (left - rollback);
@@ -264,11 +599,22 @@ void BufferedSocket::threadRead() {
                         if(dataBytes == 0) {
                             mode = MODE_LINE;
                             fire(BufferedSocketListener::ModeChange());
+                            break; // the rest is handled in the new mode
                         }
                     }
                 }
                 break;
         }
+
+#ifdef __linux__
+        if(offloaded()) {
+            // Lines already taken out of the input wait in line, the rest in inbuf
+            linesPending = true;
+            parsePos = total - left;
+            parseLeft = left;
+            return;
+        }
+#endif
     }
 
     if(mode == MODE_LINE && line.size() > static_cast<size_t>(SETTING(MAX_COMMAND_LENGTH))) {
@@ -276,6 +622,7 @@ void BufferedSocket::threadRead() {
     }
 }
 
+#ifndef __linux__
 void BufferedSocket::threadSendFile(InputStream* file) {
     if(state != RUNNING)
         return;
@@ -332,7 +679,7 @@ void BufferedSocket::threadSendFile(InputStream* file) {
                 written = sock->write(&writeBuf[writePos], writeSize);
             } else {
                 writeSize = min(sockSize / 2, writeBuf.size() - writePos);
-                written = ThrottleManager::getInstance()->write(sock.get(), &writeBuf[writePos], writeSize);
+                written = ThrottleManager::getInstance()->write(upBucket, sock.get(), &writeBuf[writePos], writeSize);
             }
 
             if(written > 0) {
@@ -340,6 +687,8 @@ void BufferedSocket::threadSendFile(InputStream* file) {
 
                 fire(BufferedSocketListener::BytesSent(), 0, written);
 
+            } else if(written == ThrottleManager::THROTTLED) {
+                Thread::sleep(ThrottleManager::REFILL_INTERVAL);
             } else if(written == -1) {
                 if(!readDone && readPos < readBuf.size()) {
                     // Read a little since we're blocking anyway...
@@ -371,6 +720,8 @@ void BufferedSocket::threadSendFile(InputStream* file) {
     }
 }
 
+#endif
+
 void BufferedSocket::write(const char* aBuf, size_t aLen) noexcept {
     if(!sock.get())
         return;
@@ -381,6 +732,7 @@ void BufferedSocket::write(const char* aBuf, size_t aLen) noexcept {
     writeBuf.insert(writeBuf.end(), aBuf, aBuf+aLen);
 }
 
+#ifndef __linux__
 void BufferedSocket::threadSendData() {
     if(state != RUNNING)
         return;
@@ -490,7 +842,502 @@ int BufferedSocket::run() {
     return 0;
 }
 
+void BufferedSocket::offload(const std::function<void ()>& f) {
+    // This thread serves no other socket
+    f();
+}
+
+#else // __linux__
+
+void BufferedSocket::handle(uint32_t aEvents) {
+    if(aEvents & EPOLLOUT)
+        blocked = false;
+
+    if((aEvents & (EPOLLIN | EPOLLERR | EPOLLHUP)) && !handshaking) {
+        try {
+            readSome();
+        } catch(const Exception& e) {
+            fail(e.getError());
+        }
+    }
+
+    if(!dead)
+        process();
+}
+
+/** Reads what has arrived; bounded so that one busy socket doesn't starve the others */
+void BufferedSocket::readSome() {
+    if(offloaded() || isReadPaused()) {
+        // inbuf may still hold unparsed input, or the socket decrypted data
+        readPending = true;
+        return;
+    }
+
+    readPending = false;
+    for(int i = 0; i < 16; ++i) {
+        if(state != RUNNING || !threadRead() || offloaded()) {
+            // Picked up again on the next tick
+            readPending = readThrottled;
+            return;
+        }
+        if(isReadPaused()) {
+            // Picked up again when resumed
+            readPending = true;
+            return;
+        }
+    }
+    // Decrypted data may be buffered where epoll can't see it
+    readPending = true;
+    reactor->schedule(this);
+}
+
+/** Makes whatever progress the socket allows on the pending work and tasks */
+void BufferedSocket::process() {
+    readThrottled = writeThrottled = false;
+    try {
+        if(!reapWorker()) {
+            updateEvents();
+            return;
+        }
+
+        if(linesPending)
+            flushLines();
+
+        if(readPending && !handshaking)
+            readSome();
+
+        if(!dispatch()) {
+            reactor->destroy(this);
+            return;
+        }
+    } catch(const Exception& e) {
+        fail(e.getError());
+        // Let the remaining tasks, such as the shutdown, through
+        reactor->schedule(this);
+    }
+
+    updateEvents();
+}
+
+/**
+ * Works through the queued tasks, in order, as far as possible without blocking.
+ * @return False when the socket has been shut down
+ */
+bool BufferedSocket::dispatch() {
+    while(true) {
+        if(offloaded())
+            return true;
+
+        if(handshaking) {
+            if(disconnecting) {
+                handshaking = false;
+            } else if(!handshake()) {
+                return true;
+            }
+        }
+
+        if(fileSend.get()) {
+            if(disconnecting) {
+                fileSend.reset();
+            } else if(!sendFile()) {
+                return true;
+            }
+        }
+
+        if(sendPos < sendBuf.size()) {
+            if(disconnecting) {
+                sendBuf.clear();
+                sendPos = 0;
+            } else if(!sendData()) {
+                return true;
+            }
+        }
+
+        pair<Tasks, unique_ptr<TaskData> > p;
+        {
+            Lock l(cs);
+            if(tasks.empty())
+                return true;
+            p = move(tasks.front());
+            tasks.pop_front();
+        }
+
+        if(p.first == SHUTDOWN) {
+            return false;
+        } else if(p.first == UPDATED) {
+            fire(BufferedSocketListener::Updated());
+            continue;
+        }
+
+        if(state == STARTING) {
+            if(p.first == CONNECT) {
+                beginConnect(static_cast<ConnectInfo*>(p.second.release()));
+            } else if(p.first == ACCEPTED) {
+                dcdebug("threadAccept\n");
+                state = RUNNING;
+                handshaking = true;
+                deadline = GET_TICK() + LONG_TIMEOUT;
+            } else {
+                dcdebug("%d unexpected in STARTING state\n", p.first);
+            }
+        } else if(state == RUNNING) {
+            if(p.first == SEND_DATA) {
+                Lock l(cs);
+                writeBuf.swap(sendBuf);
+                sendPos = 0;
+            } else if(p.first == SEND_FILE) {
+                InputStream* is = static_cast<SendFileInfo*>(p.second.get())->stream;
+                dcassert(is != NULL);
+                size_t sockSize = (size_t)sock->getSocketOptInt(SO_SNDBUF);
+                size_t bufSize = max(sockSize, (size_t)64*1024);
+
+                // Plain files go without copying unless the socket encrypts in user space; compressed and in-memory data is buffered
+                FileSend* f = new FileSend(is, sockSize / 2);
+                if(sock->canSendFile())
+                    f->fd = getPlainFile(is, f->offset, f->left);
+                if(f->fd != -1) {
+                    f->chunk = bufSize;
+                } else {
+                    f->buf.resize(bufSize);
+                }
+                fileSend.reset(f);
+            } else if(p.first == DISCONNECT) {
+                fail(_("Disconnected"));
+            } else {
+                dcdebug("%d unexpected in RUNNING state\n", p.first);
+            }
+        }
+    }
+}
+
+void BufferedSocket::offload(const std::function<void ()>& f) {
+    startWorker(f);
+}
+
+/** Runs f on a Worker; the socket neither reads nor dispatches until the Worker has been reaped */
+void BufferedSocket::startWorker(const std::function<void ()>& f) {
+    dcassert(!worker.get());
+    {
+        Lock l(cs);
+        working = true;
+        workError.clear();
+    }
+
+    worker.reset(new Worker(this, f));
+    try {
+        worker->start();
+    } catch(const ThreadException&) {
+        worker.reset();
+        Lock l(cs);
+        working = false;
+        throw;
+    }
+}
+
+/**
+ * Joins the Worker once it is done, failing the socket with its error if it had one.
+ * @return False while the Worker is still running
+ */
+bool BufferedSocket::reapWorker() {
+    if(!worker.get())
+        return true;
+
+    string error;
+    {
+        Lock l(cs);
+        if(working)
+            return false;
+        error.swap(workError);
+    }
+
+    worker->join();
+    worker.reset();
+    // Decrypted data may have been left buffered meanwhile
+    readPending = true;
+
+    if(!error.empty())
+        throw SocketException(error);
+    return true;
+}
+
+/** Continues parsing the input that was left when a listener offloaded work */
+void BufferedSocket::flushLines() {
+    linesPending = false;
+
+    string::size_type pos;
+    while((pos = line.find(separator)) != string::npos) {
+        string l = line.substr(0, pos);
+        line.erase(0, pos + 1);
+        if(pos > 0)
+            fire(BufferedSocketListener::Line(), l);
+        if(offloaded()) {
+            linesPending = true;
+            return;
+        }
+    }
+
+    int left = parseLeft;
+    parseLeft = 0;
+    if(left > 0)
+        parse(parsePos, left);
+}
+
+void BufferedSocket::beginConnect(ConnectInfo* ci) {
+    dcassert(state == STARTING);
+
+    dcdebug("threadConnect %s:%d/%d\n", ci->addr.c_str(), (int)ci->localPort, (int)ci->port);
+    fire(BufferedSocketListener::Connecting());
+
+    connectInfo.reset(ci);
+    deadline = GET_TICK() + LONG_TIMEOUT;
+    retryAt = 0;
+    handshaking = true;
+    state = RUNNING;
+
+    startConnect();
+}
+
+void BufferedSocket::startConnect() {
+    dcdebug("threadConnect attempt to addr \"%s\"\n", connectInfo->addr.c_str());
+    tcpPending = true;
+    if(connectInfo->proxy || inet_addr(connectInfo->addr.c_str()) == INADDR_NONE) {
+        // Resolving and the socks negotiation block
+        Socket* s = sock.get();
+        string addr = connectInfo->addr;
+        uint16_t port = connectInfo->port;
+        bool proxy = connectInfo->proxy;
+        startWorker([=] {
+            if(proxy) {
+                s->socksConnect(addr, port, LONG_TIMEOUT);
+            } else {
+                s->connect(addr, port);
+            }
+        });
+    } else {
+        sock->connect(connectInfo->addr, connectInfo->port);
+    }
+}
+
+/** Advances a connect or accept. @return Whether it is complete */
+bool BufferedSocket::handshake() {
+    uint64_t now = GET_TICK();
+    if(now > deadline)
+        throw SocketException(_("Connection timeout"));
+
+    if(!connectInfo.get()) {
+        if(!sock->waitAccepted(0))
+            return false;
+        handshaking = false;
+        return true;
+    }
+
+    try {
+        if(retryAt != 0) {
+            if(now < retryAt)
+                return false;
+            retryAt = 0;
+            startConnect();
+            if(offloaded())
+                return false;
+        }
+
+        if(tcpPending) {
+            // Wait for the TCP connection before any TLS handshake; until then the socket is watched for writing
+            if(!sock->Socket::waitConnected(0))
+                return false;
+            tcpPending = false;
+        }
+
+        if(!sock->waitConnected(0))
+            return false;
+    } catch(const SSLSocketException&) {
+        throw;
+    } catch(const SocketException&) {
+        if(connectInfo->natRole == NAT_NONE)
+            throw;
+        retryAt = now + SHORT_TIMEOUT;
+        return false;
+    }
+
+    connectInfo.reset();
+    handshaking = false;
+    fire(BufferedSocketListener::Connected());
+    return true;
+}
+
+/**
+ * Sends the current file until the socket is full, or for a while before letting other sockets
+ * have their turn.
+ * @return Whether the whole file has been sent
+ */
+bool BufferedSocket::sendFile() {
+    if(fileSend->fd != -1)
+        return sendPlainFile();
+
+    FileSend& f = *fileSend;
+    size_t budget = f.buf.size() * 4;
+
+    while(true) {
+        if(f.pos == f.end) {
+            if(f.readDone) {
+                fileSend.reset();
+                fire(BufferedSocketListener::TransmitDone());
+                return true;
+            }
+
+            size_t bytesRead = f.buf.size();
+            size_t actual = f.stream->read(&f.buf[0], bytesRead);
+
+            if(bytesRead > 0) {
+                fire(BufferedSocketListener::BytesSent(), bytesRead, 0);
+            }
+
+            f.pos = 0;
+            f.end = actual;
+            if(actual == 0)
+                f.readDone = true;
+            continue;
+        }
+
+        if(budget == 0) {
+            reactor->schedule(this);
+            return false;
+        }
+
+        size_t writeSize;
+        int written;
+        if(f.retry != 0) {
+            // workaround for OpenSSL (crashes when previous write failed and now retrying with different writeSize)
+            writeSize = f.retry;
+            written = sock->write(&f.buf[f.pos], writeSize);
+        } else {
+            writeSize = min(f.chunk, f.end - f.pos);
+            written = ThrottleManager::getInstance()->write(upBucket, sock.get(), &f.buf[f.pos], writeSize);
+        }
+
+        if(written > 0) {
+            // The tokens of a retried write were taken in full; a partial write leaves some of them unused
+            f.retry = f.retry > (size_t)written ? f.retry - written : 0;
+            f.pos += written;
+            budget -= min(budget, (size_t)written);
+
+            fire(BufferedSocketListener::BytesSent(), 0, written);
+        } else if(written == ThrottleManager::THROTTLED) {
+            writeThrottled = true;
+            return false;
+        } else if(written == -1) {
+            f.retry = writeSize;
+            blocked = true;
+            return false;
+        }
+    }
+}
+
+/** sendFile for files sent with sendfile, without copying them through user space */
+bool BufferedSocket::sendPlainFile() {
+    FileSend& f = *fileSend;
+    size_t budget = f.chunk * 4;
+
+    while(f.left > 0) {
+        if(budget == 0) {
+            reactor->schedule(this);
+            return false;
+        }
+
+        size_t len = (size_t)min((int64_t)f.chunk, f.left);
+        int sent;
+        try {
+            sent = ThrottleManager::getInstance()->sendFile(upBucket, sock.get(), f.fd, f.offset, len);
+        } catch(const SSLSocketException&) {
+            // The TLS session is gone, there is nothing to fall back on
+            throw;
+        } catch(const SocketException&) {
+            if(f.sent > 0)
+                throw;
+
+            // Not every file system supports sendfile; nothing was sent, so the stream can still be read normally
+            dcdebug("sendfile failed, falling back to buffered sending\n");
+            f.fd = -1;
+            f.buf.resize(max(f.chunk, (size_t)64*1024));
+            f.chunk /= 2;
+            return sendFile();
+        }
+
+        if(sent > 0) {
+            f.left -= sent;
+            f.sent += sent;
+            budget -= min(budget, (size_t)sent);
+
+            fire(BufferedSocketListener::BytesSent(), sent, sent);
+        } else if(sent == ThrottleManager::THROTTLED) {
+            writeThrottled = true;
+            return false;
+        } else if(sent == -1) {
+            blocked = true;
+            return false;
+        }
+    }
+
+    fileSend.reset();
+    fire(BufferedSocketListener::TransmitDone());
+    return true;
+}
+
+/** @return Whether all of sendBuf has been sent */
+bool BufferedSocket::sendData() {
+    while(sendPos < sendBuf.size()) {
+        int n = sock->write(&sendBuf[sendPos], sendBuf.size() - sendPos);
+        if(n == -1) {
+            blocked = true;
+            return false;
+        }
+        sendPos += n;
+    }
+    sendBuf.clear();
+    sendPos = 0;
+    return true;
+}
+
+void BufferedSocket::updateEvents() {
+    if(dead)
+        return;
+
+    // Nothing is read or sent for a socket whose Worker hasn't been reaped; it will be scheduled
+    bool isOffloaded = offloaded();
+    // Nor read while paused; resuming schedules it
+    bool paused = isReadPaused();
+
+    uint32_t want = 0;
+    if(!sock.get() || sock->sock == INVALID_SOCKET || state != RUNNING || isOffloaded) {
+        want = 0;
+    } else if(handshaking) {
+        want = (tcpPending && retryAt == 0) ? EPOLLOUT : EPOLLIN;
+    } else {
+        // Level triggered, so a read that has to wait for tokens or a listener mustn't be watched meanwhile
+        want = (readThrottled || paused ? 0 : (uint32_t)EPOLLIN) | (blocked ? (uint32_t)EPOLLOUT : 0);
+    }
+
+    if(sock.get() && sock->sock != INVALID_SOCKET)
+        reactor->watch(this, want);
+    reactor->setTimer(this, (handshaking && state == RUNNING && !isOffloaded) || readThrottled || writeThrottled);
+}
+
+#endif // __linux__
+
 void BufferedSocket::fail(const string& aError) {
+#ifdef __linux__
+    // Stop watching the descriptor before it is closed and possibly reused
+    if(sock.get() && sock->sock != INVALID_SOCKET)
+        reactor->watch(this, 0);
+    handshaking = false;
+    connectInfo.reset();
+    fileSend.reset();
+    sendBuf.clear();
+    sendPos = 0;
+    readThrottled = writeThrottled = false;
+    linesPending = false;
+    parseLeft = 0;
+#endif
     if(sock.get()) {
         sock->disconnect();
     }
@@ -509,7 +1356,12 @@ void BufferedSocket::shutdown() {
 
 void BufferedSocket::addTask(Tasks task, TaskData* data) {
     dcassert(task == DISCONNECT || task == SHUTDOWN || task == UPDATED || sock.get());
-    tasks.push_back(make_pair(task, unique_ptr<TaskData>(data))); taskSem.signal();
+    tasks.push_back(make_pair(task, unique_ptr<TaskData>(data)));
+#ifdef __linux__
+    reactor->schedule(this);
+#else
+    taskSem.signal();
+#endif
 }
 
 } // namespace dcpp
@@ -26,10 +26,29 @@
 #include "Util.h"
 #include "Socket.h"
 #include "Atomic.h"
+#include "ThrottleManager.h"
 
 namespace dcpp {
 
-class BufferedSocket : public Speaker<BufferedSocketListener>, private Thread {
+/**
+ * Socket with line, compressed and data modes, whose I/O happens asynchronously. On Linux, all
+ * sockets are driven by a small fixed pool of epoll threads; elsewhere each socket has its own thread.
+ *
+ * Listeners are called from that I/O thread, which on Linux serves many other sockets (hubs
+ * included), so they must not block: work that may wait on the disk or on other threads goes
+ * through offload(). The listeners known to block are:
+ *  - UploadManager's handling of file requests (opening files, building file lists), offloaded
+ *  - DownloadManager's data, queued to DownloadWriter, which pauses reading when the disk falls
+ *    behind; finishing a download waits for the queue, and is offloaded, while dropping a
+ *    failed one waits here, as the connection is deleted right after its Failed listeners
+ *  - incoming searches, answered by SearchResponder
+ *  - finished downloads, moved by QueueManager's FileMover
+ */
+class BufferedSocket : public Speaker<BufferedSocketListener>
+#ifndef __linux__
+    , private Thread
+#endif
+{
 public:
     enum Modes {
         MODE_LINE,
@@ -59,10 +78,8 @@ public:
         }
     }
 
-    static void waitShutdown() {
-        while(sockets > 0)
-            Thread::sleep(100);
-    }
+    /** Wait for all sockets to be gone, then stop the I/O threads */
+    static void waitShutdown();
 
     void accept(const Socket& srv, bool secure, bool allowUntrusted);
     void connect(const string& aAddress, uint16_t aPort, bool secure, bool allowUntrusted, bool proxy);
@@ -96,6 +113,19 @@ public:
 
     void disconnect(bool graceless = false) noexcept { Lock l(cs); if(graceless) disconnecting = true; addTask(DISCONNECT, 0); }
 
+    /**
+     * Run f, which may block, away from the I/O thread. Until it returns the socket neither reads
+     * nor handles its tasks, so f may use the socket as a listener would. Call from a listener.
+     */
+    void offload(const std::function<void ()>& f);
+
+    /**
+     * Stop reading, for a listener that can't keep up with the data; thread-safe. The socket keeps
+     * sending, and reads again once resumeReading() has been called as often.
+     */
+    void pauseReading();
+    void resumeReading();
+
     string getLocalIp() const { return sock->getLocalIp(); }
     uint16_t getLocalPort() const { return sock->getLocalPort(); }
 
@@ -139,7 +169,9 @@ private:
 
     CriticalSection cs;
 
+#ifndef __linux__
     Semaphore taskSem;
+#endif
     deque<pair<Tasks, unique_ptr<TaskData> > > tasks;
 
     Modes mode;
@@ -154,20 +186,108 @@ private:
     std::unique_ptr<Socket> sock;
     State state;
     bool disconnecting;
+    /** Number of pauseReading() calls not yet resumed, guarded by cs */
+    int readPaused;
+
+    /** Shares of the bandwidth limits */
+    ThrottleManager::Bucket downBucket;
+    ThrottleManager::Bucket upBucket;
+
+    bool threadRead();
+    bool isReadPaused();
+    void parse(int bufpos, int left);
+    /** @return Whether a listener has handed work to a Worker that hasn't been reaped yet */
+    bool offloaded() const;
+
+#ifdef __linux__
+    class Reactor;
+    class Worker;
+
+    /** A file being sent, a buffer at a time or straight from a plain file */
+    struct FileSend {
+        FileSend(InputStream* stream_, size_t chunk_) : stream(stream_), pos(0), end(0), chunk(chunk_), retry(0), readDone(false),
+            fd(-1), offset(0), left(0), sent(0) { }
+        InputStream* stream;
+        ByteVector buf;
+        size_t pos;
+        size_t end;
+        size_t chunk;
+        /** Size of the write to repeat; OpenSSL wants a write that failed retried with the same size */
+        size_t retry;
+        bool readDone;
 
+        /** Descriptor of the plain file sent with sendfile, -1 when the stream is read into buf */
+        int fd;
+        int64_t offset;
+        int64_t left;
+        int64_t sent;
+    };
+
+    /** The I/O thread driving this socket; everything below is only used from it */
+    Reactor* reactor;
+
+    /** Registered epoll events, 0 when not registered */
+    uint32_t events;
+    /** Waiting in the ready list of the reactor, guarded by it */
+    bool queued;
+    bool dead;
+
+    /** A connect or accept is in progress */
+    bool handshaking;
+    /** Waiting for the TCP connection of an outgoing connect */
+    bool tcpPending;
+    /** A Worker thread is doing a blocking part of the work, such as resolving; guarded by cs */
+    bool working;
+    /** What the last Worker failed with, guarded by cs */
+    string workError;
+    unique_ptr<Worker> worker;
+    /** Input left unparsed when a listener offloaded work: lines in line, then inbuf from parsePos */
+    bool linesPending;
+    int parsePos;
+    int parseLeft;
+    unique_ptr<ConnectInfo> connectInfo;
+    uint64_t deadline;
+    uint64_t retryAt;
+
+    /** A write would have blocked */
+    bool blocked;
+    /** The read burst was cut short while data may still be buffered */
+    bool readPending;
+    /** Out of bandwidth tokens; retried on the next tick of the reactor */
+    bool readThrottled;
+    bool writeThrottled;
+
+    size_t sendPos;
+    unique_ptr<FileSend> fileSend;
+
+    void handle(uint32_t aEvents);
+    void process();
+    bool dispatch();
+    void readSome();
+    void startWorker(const std::function<void ()>& f);
+    bool reapWorker();
+    void flushLines();
+    void beginConnect(ConnectInfo* ci);
+    void startConnect();
+    bool handshake();
+    bool sendFile();
+    bool sendPlainFile();
+    bool sendData();
+    void updateEvents();
+#else
     virtual int run();
 
     void threadConnect(const string& aAddr, uint16_t aPort, uint16_t localPort, NatRoles natRole, bool proxy);
     void threadAccept();
-    void threadRead();
     void threadSendFile(InputStream* is);
     void threadSendData();
 
-    void fail(const string& aError);
-    static Atomic<long,memory_ordering_strong> sockets;
-
     bool checkEvents();
     void checkSocket();
+#endif
+
+    void fail(const string& aError);
+    static Atomic<long,memory_ordering_strong> sockets;
 
     void setSocket(std::unique_ptr<Socket> s);
     void shutdown();
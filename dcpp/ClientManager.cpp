@@ -36,6 +36,7 @@
 #endif
 #include "FinishedManager.h"//sdc
 #include "QueueManager.h"
+#include "SearchResponder.h"
 
 namespace dcpp {
 
@@ -69,6 +70,7 @@ void ClientManager::putClient(Client* aClient) {
         Lock l(cs);
         clients.remove(aClient);
     }
+    SearchResponder::getInstance()->removeClient(aClient);
     aClient->shutdown();
     delete aClient;
 }
@@ -440,23 +442,36 @@ void ClientManager::send(AdcCommand& cmd, const CID& cid) {
     Lock l(cs);
     auto i = onlineUsers.find(cid);
     if(i != onlineUsers.end()) {
-        OnlineUser& u = *i->second;
-        if(cmd.getType() == AdcCommand::TYPE_UDP && !u.getIdentity().isUdpActive()) {
-            if(u.getUser()->isNMDC()
+        send(cmd, *i->second);
+    }
+}
+
+void ClientManager::send(vector<AdcCommand>& cmds, const CID& cid) {
+    Lock l(cs);
+    auto i = onlineUsers.find(cid);
+    if(i != onlineUsers.end()) {
+        for(auto j = cmds.begin(); j != cmds.end(); ++j) {
+            send(*j, *i->second);
+        }
+    }
+}
+
+void ClientManager::send(AdcCommand& cmd, OnlineUser& u) {
+    if(cmd.getType() == AdcCommand::TYPE_UDP && !u.getIdentity().isUdpActive()) {
+        if(u.getUser()->isNMDC()
 #ifdef WITH_DHT
-                || u.getClientBase().getType() == Client::DHT
+            || u.getClientBase().getType() == Client::DHT
 #endif
-                                                              )
-                return;
-            cmd.setType(AdcCommand::TYPE_DIRECT);
-            cmd.setTo(u.getIdentity().getSID());
-            u.getClient().send(cmd);
-        } else {
-            try {
-                udp.writeTo(u.getIdentity().getIp(), static_cast<uint16_t>(Util::toInt(u.getIdentity().getUdpPort())), cmd.toString(getMe()->getCID()));
-            } catch(const SocketException&) {
-                dcdebug("Socket exception sending ADC UDP command\n");
-            }
+                                                          )
+            return;
+        cmd.setType(AdcCommand::TYPE_DIRECT);
+        cmd.setTo(u.getIdentity().getSID());
+        u.getClient().send(cmd);
+    } else {
+        try {
+            udp.writeTo(u.getIdentity().getIp(), static_cast<uint16_t>(Util::toInt(u.getIdentity().getUdpPort())), cmd.toString(getMe()->getCID()));
+        } catch(const SocketException&) {
+            dcdebug("Socket exception sending ADC UDP command\n");
         }
     }
 }
@@ -475,6 +490,10 @@ void ClientManager::on(NmdcSearch, Client* aClient, const string& aSeeker, int a
 {
     Speaker<ClientManagerListener>::fire(ClientManagerListener::IncomingSearch(), aString);
 
+    SearchResponder::getInstance()->respond(aClient, aSeeker, aSearchType, aSize, aFileType, aString);
+}
+
+void ClientManager::respond(Client* aClient, const string& aSeeker, int aSearchType, int64_t aSize, int aFileType, const string& aString) {
     bool isPassive = (aSeeker.compare(0, 4, "Hub:") == 0);
     bool isTTHSearch = ((aFileType == SearchManager::TYPE_TTH) && (aString.compare(0, 4, "TTH:") == 0));
 
@@ -545,6 +564,10 @@ void ClientManager::on(NmdcSearch, Client* aClient, const string& aSeeker, int a
 }
 
 void ClientManager::on(AdcSearch, Client* c, const AdcCommand& adc, const CID& from) noexcept {
+    SearchResponder::getInstance()->respond(c, adc, from);
+}
+
+void ClientManager::respond(Client* c, const AdcCommand& adc, const CID& from) {
     bool isUdpActive = false;
     {
         Lock l(cs);
@@ -63,6 +63,11 @@ public:
     uint64_t search(StringList& who, int aSizeMode, int64_t aSize, int aFileType, const string& aString, const string& aToken, const StringList& aExtList, void* aOwner = 0);
     void cancelSearch(void* aOwner);
 
+    /** Answers an incoming NMDC search; called by the SearchResponder workers */
+    void respond(Client* aClient, const string& aSeeker, int aSearchType, int64_t aSize, int aFileType, const string& aString);
+    /** Answers an incoming ADC search; called by the SearchResponder workers */
+    void respond(Client* aClient, const AdcCommand& adc, const CID& from);
+
     void infoUpdated();
 
     UserPtr getUser(const string& aNick, const string& aHubUrl) noexcept;
@@ -133,6 +138,8 @@ public:
     UserPtr& getMe();
 
     void send(AdcCommand& c, const CID& to);
+    /** Sends several commands to the same user, looking it up once */
+    void send(vector<AdcCommand>& cmds, const CID& to);
     void connect(const HintedUser& user, const string& token);
     void privateMessage(const HintedUser& user, const string& msg, bool thirdPerson);
     void userCommand(const HintedUser& user, const UserCommand& uc, StringMap& params, bool compatibility);
@@ -195,6 +202,8 @@ private:
     }
 
     void updateNick(const OnlineUser& user) noexcept;
+    /** Sends a command to an online user; cs must be held */
+    void send(AdcCommand& cmd, OnlineUser& u);
 
     /// @return OnlineUser* found by CID and hint; discard any user that doesn't match the hint.
     OnlineUser* findOnlineUserHint(const CID& cid, const string& hintUrl) const {
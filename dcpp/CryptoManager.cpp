@@ -42,12 +42,22 @@ CryptoManager::CryptoManager()
 {
     SSL_library_init();
 
-    clientContext.reset(SSL_CTX_new(TLSv1_client_method()));
-    clientVerContext.reset(SSL_CTX_new(TLSv1_client_method()));
-    serverContext.reset(SSL_CTX_new(TLSv1_server_method()));
-    serverVerContext.reset(SSL_CTX_new(TLSv1_server_method()));
+    // Negotiate the best version both sides have, at least TLS 1.0
+    clientContext.reset(SSL_CTX_new(SSLv23_client_method()));
+    clientVerContext.reset(SSL_CTX_new(SSLv23_client_method()));
+    serverContext.reset(SSL_CTX_new(SSLv23_server_method()));
+    serverVerContext.reset(SSL_CTX_new(SSLv23_server_method()));
 
     if(clientContext && clientVerContext && serverContext && serverVerContext) {
+        SSL_CTX* contexts[] = { clientContext, clientVerContext, serverContext, serverVerContext };
+        for(size_t i = 0; i < sizeof(contexts) / sizeof(contexts[0]); ++i) {
+            SSL_CTX_set_options(contexts[i], SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+#ifdef SSL_OP_ENABLE_KTLS
+            // Let the kernel encrypt the records when it supports the cipher, so that uploads can use sendfile
+            SSL_CTX_set_options(contexts[i], SSL_OP_ENABLE_KTLS);
+#endif
+        }
+
         dh.reset(DH_new());
 
         static unsigned char dh4096_p[]={
@@ -28,6 +28,8 @@
 #include "SearchManager.h"
 #include "QueueManager.h"
 #include "ClientManager.h"
+#include "SearchResponder.h"
+#include "DownloadWriter.h"
 #include "HashManager.h"
 #include "LogManager.h"
 #include "FavoriteManager.h"
@@ -84,8 +86,10 @@ void startup(void (*f)(void*, const string&), void* p) {
     CryptoManager::newInstance();
     SearchManager::newInstance();
     ClientManager::newInstance();
+    SearchResponder::newInstance();
     ConnectionManager::newInstance();
     DownloadManager::newInstance();
+    DownloadWriter::newInstance();
     UploadManager::newInstance();
     ThrottleManager::newInstance();
     QueueManager::newInstance();
@@ -144,7 +148,6 @@ void shutdown() {
 #ifdef WITH_DHT
     dht::DHT::deleteInstance();
 #endif
-    ThrottleManager::getInstance()->shutdown();
 #ifdef LUA_SCRIPT
     ScriptManager::deleteInstance();
 #endif
@@ -163,6 +166,7 @@ void shutdown() {
     SettingsManager::getInstance()->save();
 
     //WindowManager::deleteInstance();
+    SearchResponder::deleteInstance();
     UPnPManager::deleteInstance();
     ConnectivityManager::deleteInstance();
     ADLSearchManager::deleteInstance();
@@ -174,10 +178,12 @@ void shutdown() {
     UploadManager::deleteInstance();
     QueueManager::deleteInstance();
     ConnectionManager::deleteInstance();
+    DownloadWriter::deleteInstance();
     SearchManager::deleteInstance();
     FavoriteManager::deleteInstance();
     ClientManager::deleteInstance();
     HashManager::deleteInstance();
+    Thread::shutdownParallel();
     LogManager::deleteInstance();
     SettingsManager::deleteInstance();
     TimerManager::deleteInstance();
@@ -29,7 +29,6 @@
 #include "BZUtils.h"
 #include "CryptoManager.h"
 #include "ShareManager.h"
-#include "SimpleXMLReader.h"
 #include "File.h"
 
 #ifdef ff
@@ -88,39 +87,82 @@ void DirectoryListing::loadFile(const string& name) {
 
     dcpp::File ff(name, dcpp::File::READ, dcpp::File::OPEN);
     if(Util::stricmp(ext, ".bz2") == 0) {
-        FilteredInputStream<UnBZFilter, false> f(&ff);
+        FilteredInputStream<ParallelUnBZFilter, false> f(&ff);
         loadXML(f, false);
     } else if(Util::stricmp(ext, ".xml") == 0) {
         loadXML(ff, false);
     }
 }
 
-class ListLoader : public dcpp::SimpleXMLReader::CallBack {
+/**
+ * Parser specialised for file lists. Tags are tokenized in place in the read buffer and attribute
+ * values are only copied out when they are used to build the listing, so parsing allocates little
+ * more than the listing itself.
+ */
+class ListLoader : boost::noncopyable {
 public:
     ListLoader(DirectoryListing::Directory* root, bool aUpdating) : cur(root),
                                                                     base("/"),
                                                                     inListing(false),
                                                                     updating(aUpdating),
                                                                     m_is_mediainfo_list(false),
-                                                                    m_is_first_check_mediainfo_list(false)
+                                                                    m_is_first_check_mediainfo_list(false),
+                                                                    pos(0),
+                                                                    bufStart(NULL)
     {
     }
 
-    virtual ~ListLoader() { }
-
-    virtual void startTag(const string& name, StringPairList& attribs, bool simple);
-    virtual void endTag(const string& name, const string& data);
+    void parse(InputStream& is, size_t maxSize);
 
     const string& getBase() const { return base; }
 private:
+    static const size_t BUF_SIZE = 256*1024;
+    /** Longest tag that may span reads */
+    static const size_t MAX_TAG_SIZE = 1024*1024;
+    static const size_t MAX_NESTING = 32;
+
+    enum Tag { TAG_OTHER, TAG_FILE_LISTING, TAG_DIRECTORY, TAG_FILE };
+    enum Attrib { ATTR_NAME, ATTR_SIZE, ATTR_TTH, ATTR_INCOMPLETE, ATTR_BASE, ATTR_TS, ATTR_MV, ATTR_MA, ATTR_WH, ATTR_BR,
+        ATTR_ENCODING, ATTR_LAST };
+
+    /** Attribute value as found in the read buffer, entities not decoded */
+    struct Value {
+        const char* start;
+        size_t len;
+    };
+
+    size_t process(const char* begin, const char* end);
+    void element(const char* p, const char* end);
+    void parseAttribs(const char* p, const char* end);
+
+    void startTag(Tag tag, bool simple);
+    void endTag(Tag tag);
+
+    bool has(Attrib a) const { return values[a].len > 0; }
+    string get(Attrib a) const;
+    int64_t getInt(Attrib a) const { return has(a) ? strtoll(values[a].start, NULL, 10) : 0; }
+
+    static bool isSpace(char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n'; }
+    static Tag getTag(const char* name, size_t len);
+    static Attrib getAttrib(const char* name, size_t len);
+
+    void error(const char* at, const char* e) const;
+
     DirectoryListing::Directory* cur;
 
-    StringMap params;
     string base;
     bool inListing;
     bool updating;
     bool m_is_mediainfo_list;
     bool m_is_first_check_mediainfo_list;
+
+    string encoding;
+    vector<Tag> elements;
+    Value values[ATTR_LAST];
+
+    /** Stream offset of bufStart, for error messages */
+    size_t pos;
+    const char* bufStart;
 };
 
 string DirectoryListing::updateXML(const string& xml) {
@@ -131,39 +173,317 @@ string DirectoryListing::updateXML(const string& xml) {
 string DirectoryListing::loadXML(InputStream& is, bool updating) {
     ListLoader ll(getRoot(), updating);
 
-    dcpp::SimpleXMLReader(&ll).parse(is, SETTING(MAX_FILELIST_SIZE) ? (size_t)SETTING(MAX_FILELIST_SIZE)*1024*1024 : 0);
+    ll.parse(is, SETTING(MAX_FILELIST_SIZE) ? (size_t)SETTING(MAX_FILELIST_SIZE)*1024*1024 : 0);
 
     return ll.getBase();
 }
 
-static const string sFileListing = "FileListing";
-static const string sBase = "Base";
-static const string sDirectory = "Directory";
-static const string sIncomplete = "Incomplete";
-static const string sFile = "File";
-static const string sName = "Name";
-static const string sSize = "Size";
-static const string sTTH = "TTH";
-static const string sBR = "BR";
-static const string sWH = "WH";
-static const string sMVideo = "MV";
-static const string sMAudio = "MA";
-static const string sTS = "TS";
-
-void ListLoader::startTag(const string& name, StringPairList& attribs, bool simple) {
+void ListLoader::error(const char* at, const char* e) const {
+    throw SimpleXMLException(Util::toString(pos + (at - bufStart)) + ": " + e);
+}
+
+void ListLoader::parse(InputStream& is, size_t maxSize) {
+    string buf(BUF_SIZE, 0);
+    size_t len = 0;
+    size_t bytesRead = 0;
+
+    while(true) {
+        if(len == buf.size()) {
+            // A single tag filling the whole buffer
+            if(buf.size() >= MAX_TAG_SIZE) {
+                bufStart = &buf[0];
+                error(bufStart + len, "Buffer overflow");
+            }
+            buf.resize(buf.size() * 2);
+        }
+
+        size_t n = buf.size() - len;
+        n = is.read(&buf[len], n);
+
+        bufStart = &buf[0];
+        if(maxSize > 0 && (bytesRead + n) > maxSize)
+            error(bufStart + len, "Greater than maximum allowed size");
+
+        if(n == 0) {
+            if(!elements.empty())
+                error(bufStart + len, "Unexpected end of stream");
+            return;
+        }
+
+        bytesRead += n;
+        len += n;
+
+        // Keep whatever incomplete tag is left for the next round
+        size_t done = process(bufStart, bufStart + len);
+        memmove(&buf[0], &buf[done], len - done);
+        len -= done;
+        pos += done;
+    }
+}
+
+size_t ListLoader::process(const char* begin, const char* end) {
+    const char* p = begin;
+    while(true) {
+        // Character data isn't used in file lists
+        p = static_cast<const char*>(memchr(p, '<', end - p));
+        if(!p)
+            return end - begin;
+
+        if(end - p < 4)
+            break;
+
+        if(p[1] == '?') {
+            // <?xml version="1.0" encoding="..." ?>
+            const char* e = p + 2;
+            while((e = static_cast<const char*>(memchr(e, '?', end - e))) != NULL && e + 1 < end && e[1] != '>')
+                ++e;
+            if(!e || e + 1 >= end)
+                break;
+
+            const char* n = p + 2;
+            while(n < e && !isSpace(*n))
+                ++n;
+            if(n - p == 5 && memcmp(p + 2, "xml", 3) == 0) {
+                parseAttribs(n, e);
+                if(has(ATTR_ENCODING))
+                    encoding = Text::toLower(get(ATTR_ENCODING));
+            }
+            p = e + 2;
+        } else if(p[1] == '!') {
+            if(p[2] == '-' && p[3] == '-') {
+                const char* e = p + 4;
+                while((e = static_cast<const char*>(memchr(e, '-', end - e))) != NULL && e + 2 < end && (e[1] != '-' || e[2] != '>'))
+                    ++e;
+                if(!e || e + 2 >= end)
+                    break;
+                p = e + 3;
+            } else if(p[2] == '[') {
+                // <![CDATA[...]]>, character data that may well look like tags
+                if(end - p < 9)
+                    break;
+                if(memcmp(p + 3, "CDATA[", 6) != 0)
+                    error(p, "Expecting CDATA section");
+                const char* e = p + 9;
+                while((e = static_cast<const char*>(memchr(e, ']', end - e))) != NULL && e + 2 < end && (e[1] != ']' || e[2] != '>'))
+                    ++e;
+                if(!e || e + 2 >= end)
+                    break;
+                p = e + 3;
+            } else {
+                // <!DOCTYPE ...>
+                const char* e = static_cast<const char*>(memchr(p, '>', end - p));
+                if(!e)
+                    break;
+                p = e + 1;
+            }
+        } else if(p[1] == '/') {
+            const char* e = static_cast<const char*>(memchr(p, '>', end - p));
+            if(!e)
+                break;
+
+            const char* n = p + 2;
+            const char* ne = n;
+            while(ne < e && !isSpace(*ne))
+                ++ne;
+            if(elements.empty() || elements.back() != getTag(n, ne - n))
+                error(p, "Mismatched end tag");
+
+            endTag(elements.back());
+            elements.pop_back();
+            p = e + 1;
+        } else {
+            // Find the end of the tag, which may be quoted in attribute values
+            const char* e = p + 1;
+            while(e && e < end && *e != '>') {
+                if(*e == '"' || *e == '\'') {
+                    e = static_cast<const char*>(memchr(e + 1, *e, end - (e + 1)));
+                    if(!e)
+                        break;
+                }
+                ++e;
+            }
+            if(!e || e >= end)
+                break;
+
+            element(p, e);
+            p = e + 1;
+        }
+    }
+    return p - begin;
+}
+
+void ListLoader::element(const char* p, const char* end) {
+    const char* n = p + 1;
+    const char* ne = n;
+    while(ne < end && !isSpace(*ne) && *ne != '/')
+        ++ne;
+    if(ne == n)
+        error(p, "Expecting element name");
+
+    if(elements.size() >= MAX_NESTING)
+        error(p, "Max nesting exceeded");
+
+    bool simple = end[-1] == '/';
+    Tag tag = getTag(n, ne - n);
+
+    if(tag != TAG_OTHER) {
+        parseAttribs(ne, simple ? end - 1 : end);
+    }
+
+    if(simple) {
+        startTag(tag, true);
+    } else {
+        elements.push_back(tag);
+        startTag(tag, false);
+    }
+}
+
+void ListLoader::parseAttribs(const char* p, const char* end) {
+    for(auto i = 0; i < ATTR_LAST; ++i) {
+        values[i].len = 0;
+    }
+
+    while(true) {
+        while(p < end && isSpace(*p))
+            ++p;
+        if(p == end)
+            break;
+
+        const char* n = p;
+        while(p < end && *p != '=' && !isSpace(*p))
+            ++p;
+        size_t nlen = p - n;
+
+        while(p < end && isSpace(*p))
+            ++p;
+        if(nlen == 0 || p == end || *p != '=')
+            error(p, "Expecting attribute name");
+        ++p;
+        while(p < end && isSpace(*p))
+            ++p;
+        if(p == end || (*p != '"' && *p != '\''))
+            error(p, "Expecting attribute value");
+
+        const char* v = p + 1;
+        p = static_cast<const char*>(memchr(v, *p, end - v));
+        if(!p)
+            error(v, "Expecting attribute value");
+
+        Attrib a = getAttrib(n, nlen);
+        if(a != ATTR_LAST) {
+            values[a].start = v;
+            values[a].len = p - v;
+        }
+        ++p;
+    }
+}
+
+ListLoader::Tag ListLoader::getTag(const char* name, size_t len) {
+    if(len == 4 && memcmp(name, "File", 4) == 0)
+        return TAG_FILE;
+    if(len == 9 && memcmp(name, "Directory", 9) == 0)
+        return TAG_DIRECTORY;
+    if(len == 11 && memcmp(name, "FileListing", 11) == 0)
+        return TAG_FILE_LISTING;
+    return TAG_OTHER;
+}
+
+ListLoader::Attrib ListLoader::getAttrib(const char* name, size_t len) {
+    switch(len) {
+    case 2:
+        if(memcmp(name, "TS", 2) == 0) return ATTR_TS;
+        if(memcmp(name, "MV", 2) == 0) return ATTR_MV;
+        if(memcmp(name, "MA", 2) == 0) return ATTR_MA;
+        if(memcmp(name, "WH", 2) == 0) return ATTR_WH;
+        if(memcmp(name, "BR", 2) == 0) return ATTR_BR;
+        break;
+    case 3:
+        if(memcmp(name, "TTH", 3) == 0) return ATTR_TTH;
+        break;
+    case 4:
+        if(memcmp(name, "Name", 4) == 0) return ATTR_NAME;
+        if(memcmp(name, "Size", 4) == 0) return ATTR_SIZE;
+        if(memcmp(name, "Base", 4) == 0) return ATTR_BASE;
+        break;
+    case 8:
+        if(memcmp(name, "encoding", 8) == 0) return ATTR_ENCODING;
+        break;
+    case 10:
+        if(memcmp(name, "Incomplete", 10) == 0) return ATTR_INCOMPLETE;
+        break;
+    }
+    return ATTR_LAST;
+}
+
+string ListLoader::get(Attrib a) const {
+    const Value& v = values[a];
+    if(v.len == 0)
+        return Util::emptyString;
+
+    string ret;
+    const char* p = v.start;
+    const char* end = v.start + v.len;
+    if(!memchr(p, '&', v.len)) {
+        ret.assign(p, v.len);
+    } else {
+        ret.reserve(v.len);
+        while(p < end) {
+            const char* amp = static_cast<const char*>(memchr(p, '&', end - p));
+            if(!amp) {
+                ret.append(p, end);
+                break;
+            }
+            ret.append(p, amp);
+
+            const char* semi = static_cast<const char*>(memchr(amp, ';', end - amp));
+            if(!semi)
+                error(amp, "Invalid entity");
+
+            size_t n = semi - amp - 1;
+            const char* e = amp + 1;
+            if(n == 2 && memcmp(e, "lt", 2) == 0) {
+                ret += '<';
+            } else if(n == 2 && memcmp(e, "gt", 2) == 0) {
+                ret += '>';
+            } else if(n == 3 && memcmp(e, "amp", 3) == 0) {
+                ret += '&';
+            } else if(n == 4 && memcmp(e, "quot", 4) == 0) {
+                ret += '"';
+            } else if(n == 4 && memcmp(e, "apos", 4) == 0) {
+                ret += '\'';
+            } else if(n == 0 || *e != '#') {
+                error(amp, "Invalid entity");
+            }
+            // Numeric references are skipped, as SimpleXMLReader does
+
+            p = semi + 1;
+        }
+    }
+
+    if(!encoding.empty() && encoding != Text::utf8) {
+        ret = Text::toUtf8(ret, encoding);
+    }
+    return ret;
+}
+
+void ListLoader::startTag(Tag tag, bool simple) {
     if(inListing) {
-        if(name == sFile) {
-            const string& n = getAttrib(attribs, sName, 0);
-            if(n.empty())
+        if(tag == TAG_FILE) {
+            if(!has(ATTR_NAME) || !has(ATTR_SIZE) || !has(ATTR_TTH))
                 return;
-            const string& s = getAttrib(attribs, sSize, 1);
-            if(s.empty())
-                return;
-            auto size = Util::toInt64(s);
-            const string& h = getAttrib(attribs, sTTH, 2);
-            if(h.empty())
+
+            string n = get(ATTR_NAME);
+            if(n.empty())
                 return;
-             TTHValue tth(h); /// @todo verify validity?
+            auto size = getInt(ATTR_SIZE);
+
+            // Base32 decoding needs the nul
+            char h[64];
+            size_t hlen = min(values[ATTR_TTH].len, sizeof(h) - 1);
+            memcpy(h, values[ATTR_TTH].start, hlen);
+            h[hlen] = 0;
+            TTHValue tth;
+            Encoder::fromBase32(h, tth.data, TTHValue::BYTES); /// @todo verify validity?
 
             if(updating) {
                 // just update the current file if it is already there.
@@ -181,31 +501,31 @@ void ListLoader::startTag(const string& name, StringPairList& attribs, bool simp
 
             DirectoryListing::File* f = new DirectoryListing::File(cur, n, size, tth);
 
-            string l_ts = "";
+            bool ts = false;
 
             if (!m_is_first_check_mediainfo_list){
                 m_is_first_check_mediainfo_list = true;
-                l_ts = getAttrib(attribs, sTS, 3);
-                m_is_mediainfo_list = !l_ts.empty();
+                ts = has(ATTR_TS);
+                m_is_mediainfo_list = ts;
             }
             else if (m_is_mediainfo_list) {
-                l_ts = getAttrib(attribs, sTS, 3);
+                ts = has(ATTR_TS);
             }
 
-            if (!l_ts.empty()){
-                f->mediaInfo.video_info = getAttrib(attribs, sMVideo, 3);
-                f->mediaInfo.audio_info = getAttrib(attribs, sMAudio, 3);
-                f->mediaInfo.resolution = getAttrib(attribs, sWH, 3);
-                f->mediaInfo.bitrate    = atoi(getAttrib(attribs, sBR, 4).c_str());
+            if (ts){
+                f->mediaInfo.video_info = get(ATTR_MV);
+                f->mediaInfo.audio_info = get(ATTR_MA);
+                f->mediaInfo.resolution = get(ATTR_WH);
+                f->mediaInfo.bitrate    = (int)getInt(ATTR_BR);
             }
 
             cur->files.push_back(f);
-        } else if(name == sDirectory) {
-            const string& n = getAttrib(attribs, sName, 0);
+        } else if(tag == TAG_DIRECTORY) {
+            string n = get(ATTR_NAME);
             if(n.empty()) {
                 throw SimpleXMLException(_("Directory missing name attribute"));
             }
-            bool incomp = getAttrib(attribs, sIncomplete, 1) == "1";
+            bool incomp = values[ATTR_INCOMPLETE].len == 1 && values[ATTR_INCOMPLETE].start[0] == '1';
             DirectoryListing::Directory* d = NULL;
             if(updating) {
                 for(auto i = cur->directories.begin(); i != cur->directories.end(); ++i) {
@@ -226,11 +546,11 @@ void ListLoader::startTag(const string& name, StringPairList& attribs, bool simp
 
             if(simple) {
                 // To handle <Directory Name="..." />
-                endTag(name, Util::emptyString);
+                endTag(tag);
             }
         }
-    } else if(name == sFileListing) {
-        const string& b = getAttrib(attribs, sBase, 2);
+    } else if(tag == TAG_FILE_LISTING) {
+        string b = get(ATTR_BASE);
         if(!b.empty() && b[0] == '/' && b[b.size()-1] == '/') {
             base = b;
         }
@@ -254,16 +574,16 @@ void ListLoader::startTag(const string& name, StringPairList& attribs, bool simp
 
         if(simple) {
             // To handle <Directory Name="..." />
-            endTag(name, Util::emptyString);
+            endTag(tag);
         }
     }
 }
 
-void ListLoader::endTag(const string& name, const string&) {
+void ListLoader::endTag(Tag tag) {
     if(inListing) {
-        if(name == sDirectory) {
+        if(tag == TAG_DIRECTORY) {
             cur = cur->getParent();
-        } else if(name == sFileListing) {
+        } else if(tag == TAG_FILE_LISTING) {
             // cur should be root now...
             inListing = false;
         }
@@ -27,6 +27,7 @@
 #include "File.h"
 #include "FilteredFile.h"
 #include "MerkleCheckOutputStream.h"
+#include "DownloadWriter.h"
 #include "UserConnection.h"
 #include "ZUtils.h"
 #include "extra/ipfilter.h"
@@ -254,6 +255,15 @@ void DownloadManager::startData(UserConnection* aSource, int64_t start, int64_t
 
         d->setFile(new MerkleStream(d->getTigerTree(), d->getFile(), d->getStartPos()));
         d->setFlag(Download::FLAG_TTH_CHECK);
+
+        // Hash and write on the writer threads, leaving this one to read from the connection
+        d->setFile(new DownloadWriter::Stream(d->getFile(), [aSource](bool pause) {
+            if(pause) {
+                aSource->pauseReading();
+            } else {
+                aSource->resumeReading();
+            }
+        }));
     }
 
     // Check that we don't get too many bytes
@@ -291,11 +301,19 @@ void DownloadManager::on(UserConnectionListener::Data, UserConnection* aSource,
         d->tick();
 
         if(d->getFile()->eof()) {
-            endData(aSource);
             aSource->setLineMode(0);
+            // Finishing waits for the writer threads to catch up
+            aSource->offload([this, aSource] {
+                try {
+                    endData(aSource);
+                } catch(const Exception& e) {
+                    failDownload(aSource, e.getError());
+                }
+            });
         }
     } catch(const Exception& e) {
-        failDownload(aSource, e.getError());
+        string error = e.getError();
+        aSource->offload([this, aSource, error] { failDownload(aSource, error); });
     }
 }
 
@@ -390,6 +408,8 @@ void DownloadManager::onFailed(UserConnection* aSource, const string& aError) {
         Lock l(cs);
         idlers.erase(remove(idlers.begin(), idlers.end(), aSource), idlers.end());
     }
+    // Not offloaded: the connection deletes itself once the Failed listeners return. Dropping
+    // the download waits for its writer thread, which a failed transfer can afford
     failDownload(aSource, aError);
 }
 
@@ -419,6 +439,8 @@ void DownloadManager::removeDownload(Download* d) {
             try {
                 d->getFile()->flush();
             } catch(const Exception&) {
+                // Some of what was received never made it to the file
+                d->resetPos();
             }
         }
     }
@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2001-2012 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "stdinc.h"
+#include "DownloadWriter.h"
+
+namespace dcpp {
+
+DownloadWriter::DownloadWriter() : stop(false) {
+    // Hashing is the bottleneck on fast connections, so use all the cores there are
+    size_t n = max(2U, min(8U, Thread::getProcessorCount()));
+    for(size_t i = 0; i < n; ++i) {
+        workers.push_back(unique_ptr<Worker>(new Worker(*this)));
+        workers.back()->start();
+    }
+}
+
+DownloadWriter::~DownloadWriter() {
+    stop = true;
+    for(size_t i = 0; i < workers.size(); ++i)
+        s.signal();
+    for(auto i = workers.begin(); i != workers.end(); ++i)
+        (*i)->join();
+}
+
+void DownloadWriter::schedule(Stream* stream) {
+    {
+        Lock l(cs);
+        ready.push_back(stream);
+    }
+    s.signal();
+}
+
+DownloadWriter::Stream* DownloadWriter::next() {
+    s.wait();
+    if(stop)
+        return 0;
+
+    Lock l(cs);
+    dcassert(!ready.empty());
+    Stream* stream = ready.front();
+    ready.pop_front();
+    return stream;
+}
+
+int DownloadWriter::Worker::run() {
+    setThreadName("DownloadWriter");
+
+    while(Stream* stream = writer.next()) {
+        writer.process(stream);
+    }
+    return 0;
+}
+
+void DownloadWriter::process(Stream* stream) {
+    for(int n = 0; ; ++n) {
+        ByteVector buf;
+        {
+            Lock l(stream->cs);
+            if(stream->buffers.empty() || !stream->error.empty()) {
+                stream->scheduled = false;
+                stream->progress();
+                return;
+            }
+
+            if(n == FAIR_SHARE) {
+                // Still scheduled; the stream goes to the back of the line
+                schedule(stream);
+                return;
+            }
+
+            buf.swap(stream->buffers.front());
+            stream->buffers.pop_front();
+        }
+
+        string error;
+        try {
+            stream->s->write(&buf[0], buf.size());
+        } catch(const Exception& e) {
+            error = e.getError();
+        }
+
+        Lock l(stream->cs);
+        stream->queued -= buf.size();
+        if(!error.empty()) {
+            // Whatever is left would go after the failed part, so it's of no use
+            stream->error = error;
+            stream->buffers.clear();
+            stream->queued = 0;
+        }
+        stream->progress();
+    }
+}
+
+DownloadWriter::Stream::~Stream() {
+    {
+        // Like the buffered streams, don't lose what was received
+        Lock l(cs);
+        wait();
+    }
+    delete s;
+}
+
+size_t DownloadWriter::Stream::write(const void* buf, size_t len) {
+    if(len == 0)
+        return 0;
+
+    bool schedule = false;
+    {
+        Lock l(cs);
+        checkError();
+
+        const uint8_t* b = static_cast<const uint8_t*>(buf);
+        if(!buffers.empty() && buffers.back().size() + len <= CHUNK_SIZE) {
+            buffers.back().insert(buffers.back().end(), b, b + len);
+        } else {
+            buffers.push_back(ByteVector(b, b + len));
+        }
+        queued += len;
+
+        if(queued > MAX_QUEUED && !paused && pause) {
+            // Under cs, so that the writer thread can't resume before this pauses
+            paused = true;
+            pause(true);
+        }
+
+        if(!scheduled) {
+            scheduled = true;
+            schedule = true;
+        }
+    }
+
+    if(schedule)
+        DownloadWriter::getInstance()->schedule(this);
+    return len;
+}
+
+size_t DownloadWriter::Stream::flush() {
+    {
+        Lock l(cs);
+        wait();
+        checkError();
+    }
+    return s->flush();
+}
+
+void DownloadWriter::Stream::wait() {
+    // The writer thread lets go of the stream once it has written all of it, or failed to
+    while(scheduled) {
+        waiting = true;
+        cs.unlock();
+        drained.wait();
+        cs.lock();
+    }
+}
+
+void DownloadWriter::Stream::progress() {
+    if(waiting) {
+        waiting = false;
+        drained.signal();
+    }
+    if(paused && queued <= MAX_QUEUED / 2) {
+        paused = false;
+        pause(false);
+    }
+}
+
+void DownloadWriter::Stream::checkError() const {
+    if(!error.empty())
+        throw FileException(error);
+}
+
+} // namespace dcpp
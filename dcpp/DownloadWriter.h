@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2001-2012 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include "typedefs.h"
+#include "Singleton.h"
+#include "Thread.h"
+#include "Semaphore.h"
+#include "CriticalSection.h"
+#include "Streams.h"
+
+namespace dcpp {
+
+/**
+ * Writes downloaded data on a few threads of its own, so that checking it against the tree and
+ * writing it to disk don't hold up reading from the connection. Each download's data is still
+ * written in order, by one thread at a time; different downloads are written in parallel.
+ */
+class DownloadWriter : public Singleton<DownloadWriter> {
+public:
+    /**
+     * Queues what is written to it for a writer thread to pass on to the underlying stream.
+     * The errors of the underlying stream are thrown by the next write or flush. Writing never
+     * blocks: while too much is queued, the connection is asked to stop reading. Flushing and
+     * deleting the stream wait for the writer thread, so they don't belong on the connection's
+     * I/O thread, see BufferedSocket::offload.
+     */
+    class Stream : public OutputStream {
+    public:
+        using OutputStream::write;
+
+        /** Called with true when the connection should stop reading, with false when it may go on */
+        typedef std::function<void (bool)> PauseF;
+
+        Stream(OutputStream* aStream, const PauseF& aPause = PauseF()) : s(aStream), pause(aPause), queued(0),
+            scheduled(false), waiting(false), paused(false) { }
+        virtual ~Stream();
+
+        virtual size_t write(const void* buf, size_t len);
+        /** Waits for everything queued to be written, then flushes the underlying stream */
+        virtual size_t flush();
+
+    private:
+        friend class DownloadWriter;
+
+        OutputStream* s;
+        PauseF pause;
+
+        CriticalSection cs;
+        deque<ByteVector> buffers;
+        size_t queued;
+        /** Waiting for or being written by a writer thread */
+        bool scheduled;
+        /** A flush is waiting for the writer thread */
+        bool waiting;
+        Semaphore drained;
+        /** The connection has been asked to stop reading */
+        bool paused;
+        string error;
+
+        /** Waits, with cs held, until the writer thread is done with what was queued */
+        void wait();
+        /** With cs held: wakes a waiting flush and lets the connection read again once the queue is down */
+        void progress();
+        void checkError() const;
+    };
+
+private:
+    friend class Singleton<DownloadWriter>;
+
+    enum {
+        /** Per download, before the connection stops reading; about a second of a fast connection */
+        MAX_QUEUED = 8*1024*1024,
+        /** Buffers are merged up to this size so that writes to the tree and the disk stay large */
+        CHUNK_SIZE = 256*1024,
+        /** Buffers written for one download before letting the others have a go */
+        FAIR_SHARE = 16
+    };
+
+    class Worker : public Thread {
+    public:
+        Worker(DownloadWriter& aWriter) : writer(aWriter) { }
+    private:
+        DownloadWriter& writer;
+        virtual int run();
+    };
+
+    friend class Worker;
+
+    CriticalSection cs;
+    deque<Stream*> ready;
+    Semaphore s;
+    bool stop;
+    vector<unique_ptr<Worker> > workers;
+
+    DownloadWriter();
+    virtual ~DownloadWriter();
+
+    void schedule(Stream* stream);
+    /** @return The next stream with data to write, 0 when shutting down */
+    Stream* next();
+    void process(Stream* stream);
+};
+
+} // namespace dcpp
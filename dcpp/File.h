@@ -63,6 +63,9 @@ public:
     // not sure if the client code needs this...
     int extendFile(int64_t len) noexcept;
 
+    /** The descriptor, for system calls such as sendfile that work on the file directly */
+    int getDescriptor() const noexcept { return h; }
+
 #endif // !_WIN32
 
     File(const string& aFileName, int access, int mode);
@@ -0,0 +1,227 @@
+/*
+ * Copyright (C) 2001-2012 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "stdinc.h"
+#include "FileReader.h"
+
+#include "File.h"
+
+#ifdef USE_LIBURING
+#include <liburing.h>
+#include <stdlib.h>
+#endif
+
+namespace dcpp {
+
+#ifdef USE_LIBURING
+
+namespace {
+
+/** Reads of at least this much, so that the queue does its job */
+const size_t MIN_BLOCK_SIZE = 64 * 1024;
+const size_t ALIGNMENT = 4096;
+
+/** @return false if io_uring can't be used for the file, before anything was read */
+bool readAsync(File& aFile, size_t bufferSize, int64_t& total, const FileReader::DataCallback& callback) {
+    const int64_t start = aFile.getPos();
+    int64_t size = aFile.getSize();
+    size_t blockSize = max(MIN_BLOCK_SIZE, bufferSize / FileReader::QUEUE_DEPTH);
+    blockSize -= blockSize % ALIGNMENT;
+
+    // A single read has nothing to overlap with
+    if(size - start <= (int64_t)blockSize)
+        return false;
+
+    io_uring ring;
+    if(io_uring_queue_init(FileReader::QUEUE_DEPTH, &ring, 0) < 0)
+        return false;
+
+    iovec buffers[FileReader::QUEUE_DEPTH];
+    size_t allocated = 0;
+    for(; allocated < FileReader::QUEUE_DEPTH; ++allocated) {
+        if(posix_memalign(&buffers[allocated].iov_base, ALIGNMENT, blockSize) != 0)
+            break;
+        buffers[allocated].iov_len = blockSize;
+    }
+
+    if(allocated < FileReader::QUEUE_DEPTH) {
+        for(size_t i = 0; i < allocated; ++i)
+            free(buffers[i].iov_base);
+        io_uring_queue_exit(&ring);
+        return false;
+    }
+
+    // Registering spares the kernel mapping the buffers for every read, but may exceed RLIMIT_MEMLOCK
+    bool fixed = io_uring_register_buffers(&ring, buffers, FileReader::QUEUE_DEPTH) == 0;
+
+    struct Slot {
+        int64_t offset;
+        size_t len;
+        /** Read so far; a short read is resubmitted for the rest */
+        size_t done;
+        int res;
+        bool complete;
+    } slots[FileReader::QUEUE_DEPTH];
+
+    const int fd = aFile.getDescriptor();
+    int64_t next = start;
+    /** Slots in the order their reads were queued, which is the order the data is handed on */
+    deque<int> order;
+
+    auto submit = [&](int slot) {
+        io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+        Slot& s = slots[slot];
+        uint8_t* buf = static_cast<uint8_t*>(buffers[slot].iov_base) + s.done;
+        s.res = 0;
+        s.complete = false;
+        if(fixed) {
+            io_uring_prep_read_fixed(sqe, fd, buf, s.len - s.done, s.offset + s.done, slot);
+        } else {
+            io_uring_prep_read(sqe, fd, buf, s.len - s.done, s.offset + s.done);
+        }
+        io_uring_sqe_set_data(sqe, reinterpret_cast<void*>(static_cast<intptr_t>(slot)));
+    };
+
+    auto queue = [&](int slot) {
+        Slot& s = slots[slot];
+        s.offset = next;
+        s.len = (size_t)min((int64_t)blockSize, size - next);
+        s.done = 0;
+        submit(slot);
+        order.push_back(slot);
+        next += s.len;
+    };
+
+    auto reap = [&]() -> int {
+        // Submits whatever was queued since the last time and waits, in a single call
+        int ret = io_uring_submit_and_wait(&ring, 1);
+        if(ret < 0 && ret != -EINTR)
+            return ret;
+
+        unsigned head;
+        unsigned n = 0;
+        io_uring_cqe* cqe;
+        io_uring_for_each_cqe(&ring, head, cqe) {
+            Slot& s = slots[reinterpret_cast<intptr_t>(io_uring_cqe_get_data(cqe))];
+            s.res = cqe->res;
+            s.complete = true;
+            n++;
+        }
+        io_uring_cq_advance(&ring, n);
+        return 0;
+    };
+
+    for(int i = 0; i < FileReader::QUEUE_DEPTH && next < size; ++i)
+        queue(i);
+
+    string error;
+    while(!order.empty()) {
+        int slot = order.front();
+        Slot& s = slots[slot];
+
+        int ret = 0;
+        while(!s.complete && ret == 0)
+            ret = reap();
+        if(ret < 0) {
+            error = Util::translateError(-ret);
+            break;
+        }
+
+        if(s.res < 0) {
+            error = Util::translateError(-s.res);
+            break;
+        }
+
+        if(s.res > 0 && (size_t)s.res < s.len - s.done) {
+            // Only whole blocks may be handed on, so the rest is read first; the slot stays in front
+            s.done += s.res;
+            submit(slot);
+            continue;
+        }
+
+        order.pop_front();
+        s.done += s.res;
+
+        if(s.done > 0) {
+            total += s.done;
+            if(!callback(buffers[slot].iov_base, s.done))
+                break;
+        }
+
+        if(s.res == 0) {
+            // The file got shorter since it was opened; the slots queued beyond its end are discarded
+            break;
+        }
+
+        if(next < size)
+            queue(slot);
+    }
+
+    // The kernel may still be reading into the buffers
+    io_uring_submit(&ring);
+    for(auto i = order.begin(); i != order.end(); ++i) {
+        while(!slots[*i].complete && reap() == 0)
+            ;
+    }
+
+    if(fixed)
+        io_uring_unregister_buffers(&ring);
+    io_uring_queue_exit(&ring);
+    for(size_t i = 0; i < FileReader::QUEUE_DEPTH; ++i)
+        free(buffers[i].iov_base);
+
+    aFile.setPos(start + total);
+
+    if(!error.empty())
+        throw FileException(error);
+    return true;
+}
+
+} // namespace
+
+#endif // USE_LIBURING
+
+int64_t FileReader::read(File& aFile, const DataCallback& callback) {
+#ifdef USE_LIBURING
+    int64_t total = 0;
+    if(readAsync(aFile, bufferSize, total, callback))
+        return total;
+#endif
+    return readSync(aFile, callback);
+}
+
+int64_t FileReader::readSync(File& aFile, const DataCallback& callback) {
+    // No need for more than the file has
+    size_t bufSize = (size_t)max((int64_t)1, min((int64_t)bufferSize, aFile.getSize() - aFile.getPos()));
+    boost::scoped_array<uint8_t> buf(new uint8_t[bufSize]);
+
+    int64_t total = 0;
+    for(;;) {
+        size_t n = bufSize;
+        aFile.read(buf.get(), n);
+        if(n == 0)
+            break;
+
+        total += n;
+        if(!callback(buf.get(), n))
+            break;
+    }
+    return total;
+}
+
+} // namespace dcpp
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2001-2012 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <functional>
+
+#include "typedefs.h"
+
+namespace dcpp {
+
+class File;
+
+/**
+ * Reads a whole file block by block, for hashing and such. With io_uring (Linux, liburing)
+ * several reads are kept in flight into registered buffers so that the disk is busy while the
+ * last block is being processed; elsewhere, or when io_uring can't be set up, it falls back to
+ * plain reads.
+ */
+class FileReader : boost::noncopyable {
+public:
+    /** Gets the blocks in order; return false to stop reading */
+    typedef std::function<bool(const void*, size_t)> DataCallback;
+
+    enum {
+        /** Reads kept in flight when reading asynchronously */
+        QUEUE_DEPTH = 4
+    };
+
+    /** @param aBufferSize Memory to read into, split between the reads in flight */
+    explicit FileReader(size_t aBufferSize) : bufferSize(aBufferSize) { }
+
+    /**
+     * Reads the file from its current position to the end (or until the callback says to stop).
+     * @return Bytes read
+     */
+    int64_t read(File& aFile, const DataCallback& callback);
+
+private:
+    size_t bufferSize;
+
+    int64_t readSync(File& aFile, const DataCallback& callback);
+};
+
+} // namespace dcpp
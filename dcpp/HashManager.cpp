@@ -23,11 +23,13 @@
 #include "SimpleXML.h"
 #include "LogManager.h"
 #include "File.h"
+#include "FileReader.h"
 #include "ZUtils.h"
 #include "SFVReader.h"
 
 #ifndef _WIN32
 #include <sys/mman.h> // mmap, munmap, madvise
+#include <sys/stat.h> // stat for device ids
 #include <signal.h>  // for handling read errors from previous trio
 #include <setjmp.h>
 #endif
@@ -243,10 +245,11 @@ void HashManager::HashStore::addFile(const string& aFileName, uint32_t aTimeStam
     FileInfoIter j = find(fileList.begin(), fileList.end(), fname);
     if (j != fileList.end()) {
         fileList.erase(j);
+        garbage++;
     }
 
     fileList.push_back(FileInfo(fname, tth.getRoot(), aTimeStamp, aUsed));
-    dirty = true;
+    logFile(aFileName, fileList.back());
 }
 
 void HashManager::HashStore::addTree(const TigerTree& tt) noexcept {
@@ -254,8 +257,9 @@ void HashManager::HashStore::addTree(const TigerTree& tt) noexcept {
         try {
             File f(getDataFile(), File::READ | File::WRITE, File::OPEN);
             int64_t index = saveTree(f, tt);
-            treeIndex.insert(make_pair(tt.getRoot(), TreeInfo(tt.getFileSize(), index, tt.getBlockSize())));
-            dirty = true;
+            TreeInfo ti(tt.getFileSize(), index, tt.getBlockSize());
+            treeIndex.insert(make_pair(tt.getRoot(), ti));
+            logTree(tt.getRoot(), ti);
         } catch (const FileException& e) {
             LogManager::getInstance()->message(str(F_("Error saving hash data: %1%") % e.getError()));
         }
@@ -334,7 +338,7 @@ bool HashManager::HashStore::checkTTH(const string& aFileName, int64_t aSize, ui
             TreeIter ti = treeIndex.find(fi.getRoot());
             if (ti == treeIndex.end() || ti->second.getSize() != aSize || fi.getTimeStamp() != aTimeStamp) {
                 i->second.erase(j);
-                dirty = true;
+                logRemove(aFileName);
                 return false;
             }
             return true;
@@ -412,67 +416,127 @@ void HashManager::HashStore::rebuild() {
         File::renameFile(tmpName, origName);
         treeIndex = newTreeIndex;
         fileIndex = newFileIndex;
-        dirty = true;
-        save();
+        // The trees moved in the data file; keep that in the journal in case the compaction fails
+        for (TreeIter i = treeIndex.begin(); i != treeIndex.end(); ++i)
+            logTree(i->first, i->second);
+        compact();
     } catch (const Exception& e) {
         LogManager::getInstance()->message(str(F_("Hashing failed: %1%") % e.getError()));
     }
 }
 
+/*
+ * The index file is an append-only log of binary records, so that saving only
+ * costs as much as what changed since the last save. Each record is a type byte,
+ * a 32-bit payload length and the payload:
+ *  - tree:   root, size, index in the data file and block size
+ *  - file:   root, timestamp and full path
+ *  - remove: full path
+ * Later records supersede earlier ones; once the superseded records outnumber the
+ * live ones the file is rewritten from memory.
+ */
+static const uint32_t INDEX_MAGIC = 0x49484344; // "DCHI"
+static const uint32_t INDEX_VERSION = 1;
+
+enum { RECORD_TREE = 1, RECORD_FILE = 2, RECORD_REMOVE = 3 };
+
+static const size_t RECORD_HEADER = 1 + sizeof(uint32_t);
+
+template<typename T>
+static void append(string& out, const T& value) {
+    out.append((const char*)&value, sizeof(value));
+}
+
+static void appendRecord(string& out, uint8_t type, const string& payload) {
+    append(out, type);
+    append(out, (uint32_t)payload.size());
+    out += payload;
+}
+
+template<typename T>
+static T extract(const char*& p) {
+    T value;
+    memcpy(&value, p, sizeof(value));
+    p += sizeof(value);
+    return value;
+}
+
+void HashManager::HashStore::appendTree(string& out, const TTHValue& root, const TreeInfo& ti) {
+    string payload(root.data, root.data + TTHValue::BYTES);
+    append(payload, ti.getSize());
+    append(payload, ti.getIndex());
+    append(payload, ti.getBlockSize());
+    appendRecord(out, RECORD_TREE, payload);
+}
+
+void HashManager::HashStore::appendFile(string& out, const string& aFileName, const FileInfo& fi) {
+    string payload(fi.getRoot().data, fi.getRoot().data + TTHValue::BYTES);
+    append(payload, fi.getTimeStamp());
+    payload += aFileName;
+    appendRecord(out, RECORD_FILE, payload);
+}
+
+void HashManager::HashStore::logTree(const TTHValue& root, const TreeInfo& ti) {
+    appendTree(journal, root, ti);
+}
+
+void HashManager::HashStore::logFile(const string& aFileName, const FileInfo& fi) {
+    appendFile(journal, aFileName, fi);
+}
+
+void HashManager::HashStore::logRemove(const string& aFileName) {
+    appendRecord(journal, RECORD_REMOVE, aFileName);
+    // Both the removed entry and this record are dead weight now
+    garbage += 2;
+}
+
 void HashManager::HashStore::save() {
-    if (dirty) {
-        try {
-            File ff(getIndexFile() + ".tmp", File::WRITE, File::CREATE | File::TRUNCATE);
-            BufferedOutputStream<false> f(&ff);
-
-            string tmp;
-            string b32tmp;
-
-            f.write(SimpleXML::utf8Header);
-            f.write(LIT("<HashStore Version=\"" HASH_FILE_VERSION_STRING "\">\r\n"));
-
-            f.write(LIT("\t<Trees>\r\n"));
-
-            for (TreeIter i = treeIndex.begin(); i != treeIndex.end(); ++i) {
-                const TreeInfo& ti = i->second;
-                f.write(LIT("\t\t<Hash Type=\"TTH\" Index=\""));
-                f.write(Util::toString(ti.getIndex()));
-                f.write(LIT("\" BlockSize=\""));
-                f.write(Util::toString(ti.getBlockSize()));
-                f.write(LIT("\" Size=\""));
-                f.write(Util::toString(ti.getSize()));
-                f.write(LIT("\" Root=\""));
-                b32tmp.clear();
-                f.write(i->first.toBase32(b32tmp));
-                f.write(LIT("\"/>\r\n"));
-            }
+    if (journal.empty())
+        return;
 
-            f.write(LIT("\t</Trees>\r\n\t<Files>\r\n"));
-
-            for (DirIter i = fileIndex.begin(); i != fileIndex.end(); ++i) {
-                const string& dir = i->first;
-                for (FileInfoIter j = i->second.begin(); j != i->second.end(); ++j) {
-                    const FileInfo& fi = *j;
-                    f.write(LIT("\t\t<File Name=\""));
-                    f.write(SimpleXML::escape(dir + fi.getFileName(), tmp, true));
-                    f.write(LIT("\" TimeStamp=\""));
-                    f.write(Util::toString(fi.getTimeStamp()));
-                    f.write(LIT("\" Root=\""));
-                    b32tmp.clear();
-                    f.write(fi.getRoot().toBase32(b32tmp));
-                    f.write(LIT("\"/>\r\n"));
-                }
-            }
-            f.write(LIT("\t</Files>\r\n</HashStore>"));
-            f.flush();
-            ff.close();
-            File::deleteFile( getIndexFile());
-            File::renameFile(getIndexFile() + ".tmp", getIndexFile());
+    size_t live = treeIndex.size();
+    for (DirIter i = fileIndex.begin(); i != fileIndex.end(); ++i)
+        live += i->second.size();
 
-            dirty = false;
-        } catch (const FileException& e) {
-            LogManager::getInstance()->message(str(F_("Error saving hash data: %1%") % e.getError()));
+    if (garbage > max(live, (size_t)1024)) {
+        compact();
+        return;
+    }
+
+    try {
+        File f(getIndexFile(), File::WRITE, File::OPEN);
+        f.setEndPos(0);
+        f.write(journal);
+        journal.clear();
+    } catch (const FileException& e) {
+        LogManager::getInstance()->message(str(F_("Error saving hash data: %1%") % e.getError()));
+    }
+}
+
+void HashManager::HashStore::compact() {
+    // The snapshot is built aside so that the pending journal survives a failed write
+    string out;
+    append(out, INDEX_MAGIC);
+    append(out, INDEX_VERSION);
+
+    for (TreeIter i = treeIndex.begin(); i != treeIndex.end(); ++i)
+        appendTree(out, i->first, i->second);
+    for (DirIter i = fileIndex.begin(); i != fileIndex.end(); ++i) {
+        for (FileInfoIter j = i->second.begin(); j != i->second.end(); ++j)
+            appendFile(out, i->first + j->getFileName(), *j);
+    }
+
+    try {
+        {
+            File f(getIndexFile() + ".tmp", File::WRITE, File::CREATE | File::TRUNCATE);
+            f.write(out);
         }
+        File::deleteFile(getIndexFile());
+        File::renameFile(getIndexFile() + ".tmp", getIndexFile());
+        journal.clear();
+        garbage = 0;
+    } catch (const FileException& e) {
+        LogManager::getInstance()->message(str(F_("Error saving hash data: %1%") % e.getError()));
     }
 }
 
@@ -498,12 +562,101 @@ private:
 };
 
 void HashManager::HashStore::load() {
+    if (loadIndex())
+        return;
+
+    // No usable binary index: import the XML one of older versions, if any
+    loadXmlIndex();
+    compact();
+}
+
+bool HashManager::HashStore::loadIndex() {
+    string data;
     try {
-        Util::migrate(getIndexFile());
+        File f(getIndexFile(), File::READ, File::OPEN);
+        data = f.read();
+    } catch (const FileException&) {
+        return false;
+    }
+
+    const size_t headerSize = 2 * sizeof(uint32_t);
+    const char* p = data.data();
+    const char* end = p + data.size();
+    if (data.size() < headerSize || extract<uint32_t>(p) != INDEX_MAGIC || extract<uint32_t>(p) != INDEX_VERSION)
+        return false;
+
+    while (end - p >= (ptrdiff_t)RECORD_HEADER) {
+        const char* record = p;
+        uint8_t type = extract<uint8_t>(p);
+        uint32_t len = extract<uint32_t>(p);
+        if ((size_t)(end - p) < len) {
+            // Torn write at the end of the log; drop it so that new records follow valid ones
+            p = record;
+            break;
+        }
+        const char* next = p + len;
+
+        if (type == RECORD_TREE && len == TTHValue::BYTES + 3 * sizeof(int64_t)) {
+            TTHValue root((const uint8_t*)p);
+            p += TTHValue::BYTES;
+            int64_t size = extract<int64_t>(p);
+            int64_t index = extract<int64_t>(p);
+            int64_t blockSize = extract<int64_t>(p);
+            if (treeIndex.find(root) != treeIndex.end())
+                garbage++;
+            treeIndex[root] = TreeInfo(size, index, blockSize);
+        } else if (type == RECORD_FILE && len > TTHValue::BYTES + sizeof(uint32_t)) {
+            TTHValue root((const uint8_t*)p);
+            p += TTHValue::BYTES;
+            uint32_t timeStamp = extract<uint32_t>(p);
+            string file(p, next);
+
+            FileInfoList& fileList = fileIndex[Util::getFilePath(file)];
+            string fname = Util::getFileName(file);
+            FileInfoIter j = find(fileList.begin(), fileList.end(), fname);
+            if (j != fileList.end()) {
+                fileList.erase(j);
+                garbage++;
+            }
+            fileList.push_back(FileInfo(fname, root, timeStamp, false));
+        } else if (type == RECORD_REMOVE) {
+            string file(p, next);
+            DirIter i = fileIndex.find(Util::getFilePath(file));
+            if (i != fileIndex.end()) {
+                FileInfoIter j = find(i->second.begin(), i->second.end(), Util::getFileName(file));
+                if (j != i->second.end())
+                    i->second.erase(j);
+            }
+            garbage += 2;
+        } else {
+            garbage++;
+        }
+        p = next;
+    }
+
+    if (p != end) {
+        try {
+            File f(getIndexFile(), File::WRITE, File::OPEN);
+            f.setSize(p - data.data());
+        } catch (const FileException&) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void HashManager::HashStore::loadXmlIndex() {
+    try {
+        Util::migrate(getXmlIndexFile());
 
         HashLoader l(*this);
-        File f(getIndexFile(), File::READ, File::OPEN);
-        SimpleXMLReader(&l).parse(f);
+        {
+            File f(getXmlIndexFile(), File::READ, File::OPEN);
+            SimpleXMLReader(&l).parse(f);
+        }
+
+        // Keep the old index around but out of the way; it is not updated anymore
+        File::renameFile(getXmlIndexFile(), getXmlIndexFile() + ".bak");
     } catch (const Exception&) {
         // ...
     }
@@ -570,7 +723,7 @@ void HashLoader::endTag(const string& name, const string&) {
 }
 
 HashManager::HashStore::HashStore() :
-    dirty(false) {
+    garbage(0) {
 
     Util::migrate(getDataFile());
 
@@ -607,13 +760,46 @@ void HashManager::HashStore::createDataFile(const string& name) {
     }
 }
 
+/** Identify the device a file lives on so that every device gets a bounded number of readers */
+static uint64_t getDeviceId(const string& aPath) {
+#ifdef _WIN32
+    wchar_t volume[MAX_PATH];
+    DWORD serial = 0;
+    if(::GetVolumePathNameW(Text::utf8ToWide(aPath).c_str(), volume, MAX_PATH) &&
+        ::GetVolumeInformationW(volume, NULL, 0, &serial, NULL, NULL, NULL, 0))
+    {
+        return serial;
+    }
+    return 0;
+#else
+    struct stat st;
+    if(stat(Text::fromUtf8(aPath).c_str(), &st) == 0)
+        return st.st_dev;
+    return 0;
+#endif
+}
+
 void HashManager::Hasher::hashFile(const string& fileName, int64_t size) {
+    const string dir = Util::getFilePath(fileName);
+    uint64_t device;
+    bool cached;
+    {
+        Lock l(cs);
+        device = lastDevice;
+        cached = (dir == lastDir);
+    }
+    // Files are usually queued directory by directory, so a single cached entry avoids most stat calls
+    if(!cached)
+        device = getDeviceId(dir);
+
     Lock l(cs);
-    if (w.insert(make_pair(fileName, size)).second) {
+    lastDir = dir;
+    lastDevice = device;
+    if (w[device].insert(make_pair(fileName, size)).second) {
         if(paused > 0)
-            paused++;
+            deferred++;
         else
-        s.signal();
+            s.signal();
     }
 }
 
@@ -624,7 +810,10 @@ bool HashManager::Hasher::pause() {
 
 void HashManager::Hasher::resume() {
     Lock l(cs);
-    while(--paused > 0)
+    paused = 0;
+    for(; waiting > 0; --waiting)
+        ps.signal();
+    for(; deferred > 0; --deferred)
         s.signal();
 }
 
@@ -635,26 +824,209 @@ bool HashManager::Hasher::isPaused() const {
 
 void HashManager::Hasher::stopHashing(const string& baseDir) {
     Lock l(cs);
-    for (WorkIter i = w.begin(); i != w.end();) {
-        if (Util::strnicmp(baseDir, i->first, baseDir.length()) == 0) {
-            w.erase(i++);
+    for (DeviceIter d = w.begin(); d != w.end();) {
+        WorkMap& files = d->second;
+        for (WorkIter i = files.begin(); i != files.end();) {
+            if (Util::strnicmp(baseDir, i->first, baseDir.length()) == 0) {
+                files.erase(i++);
+            } else {
+                ++i;
+            }
+        }
+        if (files.empty()) {
+            w.erase(d++);
         } else {
-            ++i;
+            ++d;
         }
     }
 }
 
 void HashManager::Hasher::getStats(string& curFile, int64_t& bytesLeft, size_t& filesLeft) {
     Lock l(cs);
-    curFile = currentFile;
-    filesLeft = w.size();
-    if (running)
-        filesLeft++;
+    curFile.clear();
+    filesLeft = 0;
     bytesLeft = 0;
-    for (WorkMap::const_iterator i = w.begin(); i != w.end(); ++i) {
-        bytesLeft += i->second;
+    for (DeviceMap::const_iterator d = w.begin(); d != w.end(); ++d) {
+        filesLeft += d->second.size();
+        for (WorkMap::const_iterator i = d->second.begin(); i != d->second.end(); ++i) {
+            bytesLeft += i->second;
+        }
+    }
+    for (auto i = workers.begin(); i != workers.end(); ++i) {
+        const Worker& worker = **i;
+        if (!worker.running)
+            continue;
+        if (curFile.empty())
+            curFile = worker.currentFile;
+        filesLeft++;
+        bytesLeft += worker.currentSize;
     }
-    bytesLeft += currentSize;
+}
+
+void HashManager::Hasher::shutdown() {
+    stop = true;
+    resume();
+    rs.signal();
+    for (size_t i = 0; i < max(workers.size(), (size_t)1); ++i)
+        s.signal();
+}
+
+/** Large files get their tree leaves hashed on several threads */
+static unsigned getFileThreads(int64_t size) {
+    static const int64_t PARALLEL_MIN_SIZE = 64 * 1024 * 1024;
+    return size >= PARALLEL_MIN_SIZE ? max(SETTING(HASH_FILE_THREADS), 1) : 1;
+}
+
+#ifndef _WIN32
+static void installSigbusHandler();
+static void restoreSigbusHandler();
+#endif
+
+void HashManager::Hasher::start() {
+    pause();
+
+#ifndef _WIN32
+    installSigbusHandler();
+#endif
+
+    int threads = SETTING(HASHER_THREADS);
+    if (threads <= 0)
+        threads = Thread::getProcessorCount();
+
+    for (int i = 0; i < threads; ++i) {
+        workers.push_back(unique_ptr<Worker>(new Worker(*this)));
+        workers.back()->start();
+    }
+}
+
+void HashManager::Hasher::join() {
+    for (auto i = workers.begin(); i != workers.end(); ++i)
+        (*i)->join();
+
+#ifndef _WIN32
+    if (!workers.empty())
+        restoreSigbusHandler();
+#endif
+
+    Lock l(cs);
+    workers.clear();
+}
+
+void HashManager::Hasher::setThreadPriority(Thread::Priority p) {
+    Lock l(cs);
+    for (auto i = workers.begin(); i != workers.end(); ++i)
+        (*i)->setThreadPriority(p);
+}
+
+bool HashManager::Hasher::next(Worker& worker, bool& last) {
+    Lock l(cs);
+    if (paused > 0 || rebuilding) {
+        deferred++;
+        return false;
+    }
+
+    // Take the alphabetically first file among the devices that still have a free reader slot
+    const int perDevice = SETTING(HASHER_THREADS_PER_DEVICE);
+    DeviceIter best = w.end();
+    for (DeviceIter d = w.begin(); d != w.end(); ++d) {
+        if (perDevice > 0 && busy[d->first] >= perDevice)
+            continue;
+        if (best == w.end() || d->second.begin()->first < best->second.begin()->first)
+            best = d;
+    }
+
+    if (best == w.end()) {
+        if (!w.empty())
+            deferred++;
+        return false;
+    }
+
+    WorkIter i = best->second.begin();
+    worker.currentFile = i->first;
+    worker.currentSize = i->second;
+    worker.device = best->first;
+    worker.running = true;
+    best->second.erase(i);
+    if (best->second.empty())
+        w.erase(best);
+    busy[worker.device]++;
+    last = w.empty();
+    return true;
+}
+
+void HashManager::Hasher::done(Worker& worker) {
+    Lock l(cs);
+    worker.currentFile.clear();
+    worker.currentSize = 0;
+    worker.running = false;
+    if (--busy[worker.device] <= 0)
+        busy.erase(worker.device);
+
+    if (rebuilding) {
+        rs.signal();
+        return;
+    }
+
+    // A reader slot was freed; let the workers that were turned away look again
+    if (paused == 0) {
+        for (; deferred > 0; --deferred)
+            s.signal();
+    }
+}
+
+bool HashManager::Hasher::takeRebuild() {
+    Lock l(cs);
+    bool ret = rebuild;
+    rebuild = false;
+    if (ret)
+        rebuilding = true;
+    return ret;
+}
+
+void HashManager::Hasher::waitIdle(const Worker& self) {
+    for (;;) {
+        {
+            Lock l(cs);
+            if (stop)
+                return;
+            bool idle = true;
+            for (auto i = workers.begin(); i != workers.end(); ++i) {
+                if (i->get() != &self && (*i)->running) {
+                    idle = false;
+                    break;
+                }
+            }
+            if (idle)
+                return;
+        }
+        rs.wait();
+    }
+}
+
+void HashManager::Hasher::endRebuild() {
+    Lock l(cs);
+    rebuilding = false;
+    if (paused == 0) {
+        for (; deferred > 0; --deferred)
+            s.signal();
+    }
+}
+
+void HashManager::Hasher::throttle(int64_t bytes) {
+    const int maxHashSpeed = SETTING(MAX_HASH_SPEED);
+    if (maxHashSpeed <= 0 || bytes <= 0)
+        return;
+
+    // The limit is shared by the whole pool: each read reserves its slot on a common timeline
+    uint64_t now = GET_TICK();
+    uint64_t start;
+    {
+        Lock l(cs);
+        start = max(nextRead, now);
+        nextRead = start + bytes * 1000LL / (maxHashSpeed * 1024LL * 1024LL);
+    }
+    if (start > now)
+        Thread::sleep(start - now);
 }
 
 void HashManager::Hasher::instantPause() {
@@ -662,18 +1034,18 @@ void HashManager::Hasher::instantPause() {
     {
         Lock l(cs);
         if(paused > 0) {
-            paused++;
+            waiting++;
             wait = true;
         }
     }
     if(wait)
-        s.wait();
+        ps.wait();
 }
 
 #ifdef _WIN32
 #define BUF_SIZE (256*1024)
 
-bool HashManager::Hasher::fastHash(const string& fname, uint8_t* buf, TigerTree& tth, int64_t size, CRC32Filter* xcrc32) {
+bool HashManager::Hasher::Worker::fastHash(const string& fname, uint8_t* buf, TigerTree& tth, int64_t size, CRC32Filter* xcrc32) {
     HANDLE h = INVALID_HANDLE_VALUE;
     DWORD x, y;
     if (!GetDiskFreeSpaceW(Text::utf8ToWide(Util::getFilePath(fname)).c_str(), &y, &x, &y, &y)) {
@@ -699,7 +1071,6 @@ bool HashManager::Hasher::fastHash(const string& fname, uint8_t* buf, TigerTree&
 
     bool ok = false;
 
-    uint64_t lastRead = GET_TICK();
     if (!::ReadFile(h, hbuf, BUF_SIZE, &hn, &over)) {
         if (GetLastError() == ERROR_HANDLE_EOF) {
             hn = 0;
@@ -718,21 +1089,11 @@ bool HashManager::Hasher::fastHash(const string& fname, uint8_t* buf, TigerTree&
 
     over.Offset = hn;
     size -= hn;
-    while (!stop) {
+    while (!hasher.stop) {
         if (size > 0) {
             // Start a new overlapped read
             ResetEvent(over.hEvent);
-            if (SETTING(MAX_HASH_SPEED) > 0) {
-                uint64_t now = GET_TICK();
-                uint64_t minTime = hn * 1000LL / (SETTING(MAX_HASH_SPEED) * 1024LL * 1024LL);
-                if (lastRead + minTime > now) {
-                    uint64_t diff = now - lastRead;
-                    Thread::sleep(minTime - diff);
-                }
-                lastRead = lastRead + minTime;
-            } else {
-                lastRead = GET_TICK();
-            }
+            hasher.throttle(hn);
             res = ReadFile(h, rbuf, BUF_SIZE, &rn, &over);
         } else {
             rn = 0;
@@ -743,7 +1104,7 @@ bool HashManager::Hasher::fastHash(const string& fname, uint8_t* buf, TigerTree&
             (*xcrc32)(hbuf, hn);
 
         {
-            Lock l(cs);
+            Lock l(hasher.cs);
             currentSize = max(currentSize - hn, _LL(0));
         }
 
@@ -767,7 +1128,7 @@ bool HashManager::Hasher::fastHash(const string& fname, uint8_t* buf, TigerTree&
             }
         }
 
-        instantPause();
+        hasher.instantPause();
 
         *((uint64_t*)&over.Offset) += rn;
         size -= rn;
@@ -784,7 +1145,9 @@ bool HashManager::Hasher::fastHash(const string& fname, uint8_t* buf, TigerTree&
 
 #else // !_WIN32
 
-static sigjmp_buf sb_env;
+// SIGBUS is delivered to the thread touching the bad page, so every worker keeps its own jump target
+static __thread sigjmp_buf* sb_env = NULL;
+static struct sigaction sb_oldact;
 
 static void sigbus_handler(int signum
 #ifndef __HAIKU__
@@ -794,13 +1157,49 @@ static void sigbus_handler(int signum
     // Jump back to the fastHash which will return error. Apparently truncating
     // a file in Solaris sets si_code to BUS_OBJERR
 #ifndef __HAIKU__
-       if (signum == SIGBUS && (info->si_code == BUS_ADRERR || info->si_code == BUS_OBJERR))
-        siglongjmp(sb_env, 1);
+    if (sb_env != NULL && signum == SIGBUS && (info->si_code == BUS_ADRERR || info->si_code == BUS_OBJERR))
+        siglongjmp(*sb_env, 1);
+#endif
+    // Not ours; fall back to the default action once the faulting instruction is retried
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = SIG_DFL;
+    sigaction(SIGBUS, &act, NULL);
+}
+
+// Prepare and setup a signal handler in case of SIGBUS during mmapped file reads.
+// SIGBUS can be sent when the file is truncated or in case of read errors.
+// The handler is process wide, so it is installed once for the whole pool.
+static void installSigbusHandler() {
+    struct sigaction act;
+    sigset_t signalset;
+
+    sigemptyset(&signalset);
+
+    act.sa_handler = NULL;
+#ifndef __HAIKU__
+    act.sa_sigaction = sigbus_handler;
+#endif
+    act.sa_mask = signalset;
+#ifdef SA_SIGINFO
+    act.sa_flags = SA_SIGINFO;
+#else
+    act.sa_flags = NULL;
 #endif
+    if (sigaction(SIGBUS, &act, &sb_oldact) == -1) {
+        dcdebug("Failed to set signal handler for fastHash\n");
+    }
 }
 
-bool HashManager::Hasher::fastHash(const string& filename, uint8_t* , TigerTree& tth, int64_t size, CRC32Filter* xcrc32) {
-    static StreamStore streamStore;
+static void restoreSigbusHandler() {
+    if (sigaction(SIGBUS, &sb_oldact, NULL) == -1) {
+        dcdebug("Failed to reset old signal handler for SIGBUS\n");
+    }
+}
+
+bool HashManager::Hasher::Worker::fastHash(const string& filename, uint8_t* , TigerTree& tth, int64_t size, CRC32Filter* xcrc32) {
+    // Kept per call so that the workers never share one
+    StreamStore streamStore;
 
     if (streamStore.loadTree(filename, tth, -1)){
         printf ("%s: hash [%s] was loaded from Xattr.\n", filename.c_str(), tth.getRoot().toBase32().c_str());
@@ -816,36 +1215,13 @@ bool HashManager::Hasher::fastHash(const string& filename, uint8_t* , TigerTree&
         return false;
     }
 
-    const int maxHashSpeed = SETTING(MAX_HASH_SPEED);
     int64_t pos = 0;
     int64_t size_read = 0;
     void *buf = NULL;
     bool ok = false;
+    sigjmp_buf env;
+    const unsigned threads = getFileThreads(size);
 
-    // Prepare and setup a signal handler in case of SIGBUS during mmapped file reads.
-    // SIGBUS can be sent when the file is truncated or in case of read errors.
-    struct sigaction act, oldact;
-    sigset_t signalset;
-
-    sigemptyset(&signalset);
-
-    act.sa_handler = NULL;
-#ifndef __HAIKU__
-    act.sa_sigaction = sigbus_handler;
-#endif
-    act.sa_mask = signalset;
-#ifdef SA_SIGINFO
-    act.sa_flags = SA_SIGINFO | SA_RESETHAND;
-#else
-    act.sa_flags = NULL;
-#endif
-    if (sigaction(SIGBUS, &act, &oldact) == -1) {
-        dcdebug("Failed to set signal handler for fastHash\n");
-        close(fd);
-        return false;   // Better luck with the slow hash.
-    }
-
-    uint64_t lastRead = GET_TICK();
     unsigned long mmap_flags = static_cast<bool>(SETTING(HASH_BUFFER_PRIVATE))? MAP_PRIVATE : MAP_SHARED;
 #ifdef MAP_POPULATE
     if (static_cast<bool>(SETTING(HASH_BUFFER_POPULATE)))
@@ -855,7 +1231,7 @@ bool HashManager::Hasher::fastHash(const string& filename, uint8_t* , TigerTree&
     if (static_cast<bool>(SETTING(HASH_BUFFER_NORESERVE)))
         mmap_flags |= MAP_NORESERVE;
 #endif
-    while (pos < size && !stop) {
+    while (pos < size && !hasher.stop) {
         size_read = std::min(size - pos, BUF_SIZE);
         buf = mmap(0, size_read, PROT_READ, mmap_flags, fd, pos);
         if(buf == MAP_FAILED) {
@@ -863,39 +1239,31 @@ bool HashManager::Hasher::fastHash(const string& filename, uint8_t* , TigerTree&
         break;
         }
 
-        if (sigsetjmp(sb_env, 1)) {
+        if (sigsetjmp(env, 1)) {
+            sb_env = NULL;
             dcdebug("Caught SIGBUS for file %s\n", filename.c_str());
             break;
         }
+        sb_env = &env;
 
         if (posix_madvise(buf, size_read, POSIX_MADV_SEQUENTIAL | POSIX_MADV_WILLNEED) == -1) {
             dcdebug("Error calling madvise for file %s: %s\n", filename.c_str(), Util::translateError(errno).c_str());
             break;
         }
 
-        if(maxHashSpeed > 0) {
-            uint64_t now = GET_TICK();
-            uint64_t minTime = size_read * 1000LL / (maxHashSpeed * 1024LL * 1024LL);
-            
-            if(lastRead + minTime> now) {
-                uint64_t diff = now - lastRead;
-                Thread::sleep(minTime - diff);
-            }
-            
-            lastRead = lastRead + minTime;
-        } else {
-            lastRead = GET_TICK();
-        }
+        hasher.throttle(size_read);
 
-        tth.update(buf, size_read);
+        tth.update(buf, size_read, threads);
         if(xcrc32)
             (*xcrc32)(buf, size_read);
 
         {
-            Lock l(cs);
+            Lock l(hasher.cs);
             currentSize = max(static_cast<uint64_t>(currentSize - size_read), static_cast<uint64_t>(0));
         }
 
+        sb_env = NULL;
+
         if (munmap(buf, size_read) == -1) {
             dcdebug("Error calling munmap for file %s: %s\n", filename.c_str(), Util::translateError(errno).c_str());
             break;
@@ -904,23 +1272,21 @@ bool HashManager::Hasher::fastHash(const string& filename, uint8_t* , TigerTree&
         buf = NULL;
         pos += size_read;
 
-        instantPause();
+        hasher.instantPause();
 
         if (pos == size) {
             ok = true;
         }
     }
 
+    sb_env = NULL;
+
     if (buf != NULL && buf != MAP_FAILED && munmap(buf, size_read) == -1) {
         dcdebug("Error calling munmap for file %s: %s\n", filename.c_str(), Util::translateError(errno).c_str());
     }
 
     close(fd);
 
-    if (sigaction(SIGBUS, &oldact, NULL) == -1) {
-        dcdebug("Failed to reset old signal handler for SIGBUS\n");
-    }
-
     if (ok)
         streamStore.saveTree(filename, tth);
 
@@ -928,55 +1294,48 @@ bool HashManager::Hasher::fastHash(const string& filename, uint8_t* , TigerTree&
 }
 
 #endif // !_WIN32
-int HashManager::Hasher::run() {
+int HashManager::Hasher::Worker::run() {
     setThreadPriority(Thread::IDLE);
     setThreadName("Hasher");
     uint8_t* buf = NULL;
     bool virtualBuf = true;
     string fname;
     bool last = false;
-    pause();
     for(;;) {
-        s.wait();
-        if(stop)
+        hasher.s.wait();
+        if(hasher.stop)
             break;
-        if(rebuild) {
-            HashManager::getInstance()->doRebuild();
-            rebuild = false;
-            LogManager::getInstance()->message(_("Hash database rebuilt"));
-            continue;
-        }
-        {
-            Lock l(cs);
-            if(!w.empty()) {
-                currentFile = fname = w.begin()->first;
-                currentSize = w.begin()->second;
-                w.erase(w.begin());
-                last = w.empty();
-            } else {
-                last = true;
-                fname.clear();
+        if(hasher.takeRebuild()) {
+            // The store and the data file are rewritten, so let the files in progress finish first
+            hasher.waitIdle(*this);
+            if(!hasher.stop) {
+                HashManager::getInstance()->doRebuild();
+                LogManager::getInstance()->message(_("Hash database rebuilt"));
             }
+            hasher.endRebuild();
+            continue;
         }
-        running = true;
-        instantPause();
+        if(!hasher.next(*this, last))
+            continue;
+
+        fname = currentFile;
+        hasher.instantPause();
 
-        if(!fname.empty()) {
+        {
             int64_t size = File::getSize(fname);
 #ifdef _WIN32
             if(buf == NULL) {
                 virtualBuf = true;
                 buf = (uint8_t*)VirtualAlloc(NULL, 2*BUF_SIZE, MEM_COMMIT, PAGE_READWRITE);
             }
-#else
-            static const int64_t BUF_BYTES = (SETTING(HASH_BUFFER_SIZE_MB) >= 1)? SETTING(HASH_BUFFER_SIZE_MB)*1024*1024 : 0x800000;
-            static const int64_t BUF_SIZE = BUF_BYTES - (BUF_BYTES % getpagesize());
-#endif
-
             if(buf == NULL) {
                 virtualBuf = false;
                 buf = new uint8_t[BUF_SIZE];
             }
+#else
+            static const int64_t BUF_BYTES = (SETTING(HASH_BUFFER_SIZE_MB) >= 1)? SETTING(HASH_BUFFER_SIZE_MB)*1024*1024 : 0x800000;
+            static const int64_t BUF_SIZE = BUF_BYTES - (BUF_BYTES % getpagesize());
+#endif
             try {
                 File f(fname, File::READ, File::OPEN);
                 int64_t bs = max(TigerTree::calcBlockSize(f.getSize(), 10), MIN_BLOCK_SIZE);
@@ -1001,32 +1360,22 @@ int HashManager::Hasher::run() {
 #endif
                     tth = &slowTTH;
                     crc32 = CRC32Filter();
-                    uint64_t lastRead = GET_TICK();
-                    size_t n = 0;
-                    do {
-                        size_t bufSize = BUF_SIZE;
-                        if(SETTING(MAX_HASH_SPEED)> 0) {
-                            uint64_t now = GET_TICK();
-                            uint64_t minTime = n * 1000LL / (SETTING(MAX_HASH_SPEED) * 1024LL * 1024LL);
-                            if(lastRead + minTime> now) {
-                                Thread::sleep(minTime - (now - lastRead));
-                            }
-                            lastRead = lastRead + minTime;
-                        } else {
-                            lastRead = GET_TICK();
-                        }
-                        n = f.read(buf, bufSize);
-                        tth->update(buf, n);
+                    const unsigned threads = getFileThreads(size);
+                    // Reads ahead (with io_uring where available) while the blocks already read are hashed
+                    FileReader(BUF_SIZE).read(f, [&](const void* data, size_t n) -> bool {
+                        hasher.throttle(n);
+                        tth->update(data, n, threads);
                         if(xcrc32)
-                            (*xcrc32)(buf, n);
+                            (*xcrc32)(data, n);
 
                         {
-                            Lock l(cs);
+                            Lock l(hasher.cs);
                             currentSize = max(static_cast<uint64_t>(currentSize - n), static_cast<uint64_t>(0));
                         }
 
-                    instantPause();
-                    } while (n> 0 && !stop);
+                        hasher.instantPause();
+                        return !hasher.stop;
+                    });
                 }
 
                 f.close();
@@ -1045,13 +1394,8 @@ int HashManager::Hasher::run() {
                     LogManager::getInstance()->message(str(F_("Error hashing %1%: %2%") % Util::addBrackets(fname) % e.getError()));
                 }
             }
-            {
-                Lock l(cs);
-                currentFile.clear();
-                currentSize = 0;
-            }
-            running = false;
-            if(buf != NULL && (last || stop)) {
+            hasher.done(*this);
+            if(buf != NULL && (last || hasher.stop)) {
                 if(virtualBuf) {
 #ifdef _WIN32
                     VirtualFree(buf, 0, MEM_RELEASE);
@@ -1062,6 +1406,8 @@ int HashManager::Hasher::run() {
                 buf = NULL;
             }
         }
+        if(buf != NULL && !virtualBuf)
+            delete [] buf;
         return 0;
     }
 
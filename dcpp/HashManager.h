@@ -116,9 +116,9 @@ public:
     bool isHashingPaused() const;
 
 private:
-    class Hasher : public Thread {
+    class Hasher {
     public:
-        Hasher() : stop(false), running(false), paused(0), rebuild(false), currentSize(0) { }
+        Hasher() : stop(false), paused(0), waiting(0), deferred(0), rebuild(false), rebuilding(false), nextRead(0), lastDevice(0) { }
 
         void hashFile(const string& fileName, int64_t size);
 
@@ -128,29 +128,72 @@ private:
         bool isPaused() const;
 
         void stopHashing(const string& baseDir);
-        virtual int run();
-        bool fastHash(const string& fname, uint8_t* buf, TigerTree& tth, int64_t size, CRC32Filter* xcrc32);
         void getStats(string& curFile, int64_t& bytesLeft, size_t& filesLeft);
-        void shutdown() { stop = true; if(paused){ s.signal(); resume();} s.signal(); }
-        void scheduleRebuild() { rebuild = true; if(paused) s.signal(); s.signal(); }
+        void shutdown();
+        void scheduleRebuild() { rebuild = true; s.signal(); }
+
+        /** Start the worker pool; the number of workers is taken from HASHER_THREADS */
+        void start();
+        void join();
+        void setThreadPriority(Thread::Priority p);
 
     private:
+        /** A single hashing thread; workers share the queue and the speed limit of their Hasher */
+        class Worker : public Thread {
+        public:
+            Worker(Hasher& aHasher) : hasher(aHasher), currentSize(0), device(0), running(false) { }
+
+            virtual int run();
+            bool fastHash(const string& fname, uint8_t* buf, TigerTree& tth, int64_t size, CRC32Filter* xcrc32);
+
+            Hasher& hasher;
+            string currentFile;
+            int64_t currentSize;
+            uint64_t device;
+            bool running;
+        };
+
+        friend class Worker;
+
         // Case-sensitive (faster), it is rather unlikely that case changes, and if it does it's harmless.
         // map because it's sorted (to avoid random hash order that would create quite strange shares while hashing)
         typedef map<string, int64_t> WorkMap;
         typedef WorkMap::iterator WorkIter;
 
-        WorkMap w;
+        /** Pending files grouped by the device they live on, so that each device gets a bounded number of readers */
+        typedef unordered_map<uint64_t, WorkMap> DeviceMap;
+        typedef DeviceMap::iterator DeviceIter;
+
+        DeviceMap w;
+        unordered_map<uint64_t, int> busy;
+        vector<unique_ptr<Worker> > workers;
         mutable CriticalSection cs;
         Semaphore s;
+        Semaphore ps;
+        /** Signalled when a worker finishes a file while a rebuild waits for the pool to go idle */
+        Semaphore rs;
 
         bool stop;
-        bool running;
         unsigned paused;
+        /** Workers blocked in instantPause */
+        unsigned waiting;
+        /** Wakeups that found no file they were allowed to hash (paused or device busy) */
+        unsigned deferred;
         bool rebuild;
-        string currentFile;
-        int64_t currentSize;
-
+        /** A worker is rebuilding the store; no new files are handed out until it is done */
+        bool rebuilding;
+        /** Tick at which the next read may start when MAX_HASH_SPEED is set */
+        uint64_t nextRead;
+        string lastDir;
+        uint64_t lastDevice;
+
+        bool next(Worker& worker, bool& last);
+        void done(Worker& worker);
+        bool takeRebuild();
+        /** Wait until every other worker has finished its current file */
+        void waitIdle(const Worker& self);
+        void endRebuild();
+        void throttle(int64_t bytes);
         void instantPause();
     };
 
@@ -172,7 +215,7 @@ private:
         const TTHValue* getTTH(const string& aFileName);
         bool getTree(const TTHValue& root, TigerTree& tth);
         size_t getBlockSize(const TTHValue& root) const;
-        bool isDirty() { return dirty; }
+        bool isDirty() { return !journal.empty(); }
     private:
         /** Root -> tree mapping info, we assume there's only one tree for each root (a collision would mean we've broken tiger...) */
         struct TreeInfo {
@@ -214,14 +257,28 @@ private:
         DirMap fileIndex;
         TreeMap treeIndex;
 
-        bool dirty;
+        /** Encoded index changes not yet appended to the index file */
+        string journal;
+        /** Records in the index file that have been superseded by later ones */
+        size_t garbage;
 
         void createDataFile(const string& name);
 
         bool loadTree(File& dataFile, const TreeInfo& ti, const TTHValue& root, TigerTree& tt);
         int64_t saveTree(File& dataFile, const TigerTree& tt);
 
-        string getIndexFile() { return Util::getPath(Util::PATH_USER_CONFIG) + "HashIndex.xml"; }
+        static void appendTree(string& out, const TTHValue& root, const TreeInfo& ti);
+        static void appendFile(string& out, const string& aFileName, const FileInfo& fi);
+        void logTree(const TTHValue& root, const TreeInfo& ti);
+        void logFile(const string& aFileName, const FileInfo& fi);
+        void logRemove(const string& aFileName);
+        bool loadIndex();
+        void loadXmlIndex();
+        /** Rewrite the index file with only the live entries */
+        void compact();
+
+        string getIndexFile() { return Util::getPath(Util::PATH_USER_CONFIG) + "HashIndex.bin"; }
+        string getXmlIndexFile() { return Util::getPath(Util::PATH_USER_CONFIG) + "HashIndex.xml"; }
         string getDataFile() { return Util::getPath(Util::PATH_USER_CONFIG) + "HashData.dat"; }
     };
 
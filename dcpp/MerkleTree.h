@@ -23,6 +23,7 @@
 #include "TigerHash.h"
 #include "Encoder.h"
 #include "HashValue.h"
+#include "Thread.h"
 
 namespace dcpp {
 
@@ -98,21 +99,81 @@ public:
             return;
 
         do {
+            // Runs of whole leaves are hashed as independent messages side by side
+            if(len - i >= LEAF_BATCH * baseBlockSize) {
+                const uint8_t* msgs[LEAF_BATCH];
+                uint8_t out[LEAF_BATCH * BYTES];
+                for(size_t j = 0; j < LEAF_BATCH; ++j)
+                    msgs[j] = buf + i + j * baseBlockSize;
+                Hasher::hashMulti(msgs, baseBlockSize, zero, LEAF_BATCH, out);
+                for(size_t j = 0; j < LEAF_BATCH; ++j)
+                    addLeafHash(MerkleValue(out + j * BYTES));
+                i += LEAF_BATCH * baseBlockSize;
+                continue;
+            }
+
             size_t n = min(baseBlockSize, len-i);
             Hasher h;
             h.update(&zero, 1);
             h.update(buf + i, n);
-            if((int64_t)baseBlockSize < blockSize) {
-                blocks.push_back(make_pair(MerkleValue(h.finalize()), baseBlockSize));
-                reduceBlocks();
-            } else {
-                leaves.push_back(MerkleValue(h.finalize()));
-            }
+            addLeafHash(MerkleValue(h.finalize()));
             i += n;
         } while(i < len);
         fileSize += len;
     }
 
+    /**
+     * Update the merkle tree, hashing independent parts of the data on several threads.
+     * The resulting tree is identical to the one built by update(data, len).
+     * @param threads Maximum number of threads to use, including the calling one
+     */
+    void update(const void* data, size_t len, unsigned threads) {
+        const uint8_t* buf = (const uint8_t*)data;
+        const size_t unit = (size_t)min(blockSize, (int64_t)PARALLEL_UNIT);
+
+        if(threads < 2 || len < unit * 2) {
+            update(data, len);
+            return;
+        }
+
+        // Subtrees can only be computed separately from a unit boundary on
+        size_t head = (unit - (size_t)(fileSize % unit)) % unit;
+        if(head > 0) {
+            head = min(head, len);
+            update(buf, head);
+            buf += head;
+            len -= head;
+        }
+
+        size_t units = len / unit;
+        if(units > 1) {
+            MerkleList hashes(units);
+            // Runs on the threads kept by Thread::runParallel; none are created per call
+            Thread::runParallel(units, threads, [&](size_t i) {
+                MerkleTree tree(unit);
+                tree.update(buf + i * unit, unit);
+                hashes[i] = MerkleValue(tree.finalize());
+            });
+
+            // Every unit starts on a multiple of its own size, so the stack of partial blocks
+            // only holds larger blocks and the units fold in exactly as single leaves would
+            for(auto i = hashes.begin(); i != hashes.end(); ++i) {
+                if((int64_t)unit == blockSize) {
+                    leaves.push_back(*i);
+                } else {
+                    blocks.push_back(make_pair(*i, (int64_t)unit));
+                    reduceBlocks();
+                }
+            }
+            fileSize += units * unit;
+            buf += units * unit;
+            len -= units * unit;
+        }
+
+        if(len > 0)
+            update(buf, len);
+    }
+
     uint8_t* finalize() {
         // No updates yet, make sure we have at least one leaf for 0-length files...
         if(leaves.empty() && blocks.empty()) {
@@ -161,6 +222,12 @@ public:
     }
 
 private:
+    /** Largest subtree hashed as one piece by the parallel update */
+    static const size_t PARALLEL_UNIT = 1024 * 1024;
+
+    /** Number of leaves handed to Hasher::hashMulti at once */
+    static const size_t LEAF_BATCH = 4 * Hasher::LANES;
+
     typedef pair<MerkleValue, int64_t> MerkleBlock;
     typedef vector<MerkleBlock> MBList;
 
@@ -174,6 +241,15 @@ private:
     /** Final block size */
     int64_t blockSize;
 
+    void addLeafHash(const MerkleValue& hash) {
+        if((int64_t)baseBlockSize < blockSize) {
+            blocks.push_back(make_pair(hash, baseBlockSize));
+            reduceBlocks();
+        } else {
+            leaves.push_back(hash);
+        }
+    }
+
     MerkleValue getHash(int64_t start, int64_t length) {
         dcassert((start % blockSize) == 0);
         if(length <= blockSize) {
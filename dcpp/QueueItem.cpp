@@ -141,20 +141,6 @@ Segment QueueItem::getNextSegment(int64_t blockSize, int64_t wantedSize, int64_t
     }
 
 
-    /* added for PFS */
-    vector<int64_t> posArray;
-    vector<Segment> neededParts;
-
-    if(partialSource) {
-        posArray.reserve(partialSource->getPartialInfo().size());
-
-        // Convert block index to file position
-        for(PartsInfo::const_iterator i = partialSource->getPartialInfo().begin(); i != partialSource->getPartialInfo().end(); ++i)
-            posArray.push_back(min(getSize(), (int64_t)(*i) * blockSize));
-    }
-
-    /***************************/
-
     double donePart = static_cast<double>(getDownloadedBytes()) / getSize();
 
     // We want smaller blocks at the end of the transfer, squaring gives a nice curve...
@@ -167,78 +153,64 @@ Segment QueueItem::getNextSegment(int64_t blockSize, int64_t wantedSize, int64_t
         targetSize = blockSize;
     }
 
-    int64_t start = 0;
-    int64_t curSize = targetSize;
+    vector<Segment> running;
+    running.reserve(downloads.size());
+    for(auto i = downloads.begin(); i != downloads.end(); ++i) {
+        running.push_back((*i)->getSegment());
+    }
 
-    while(start < getSize()) {
-        int64_t end = std::min(getSize(), start + curSize);
-        Segment block(start, end - start);
-        bool overlaps = false;
-        for(auto i = done.begin(); !overlaps && i != done.end(); ++i) {
-            if(curSize <= blockSize) {
-                int64_t dstart = i->getStart();
-                int64_t dend = i->getEnd();
-                // We accept partial overlaps, only consider the block done if it is fully consumed by the done block
-                if(dstart <= start && dend >= end) {
-                    overlaps = true;
+    if(!partialSource) {
+        int64_t start = getNextNeeded(0, blockSize, running);
+        if(start < getSize()) {
+            // As much as is free from there, down to a single block that may partly be done already
+            int64_t busy = getNextBusy(start, running);
+            int64_t curSize = busy >= getSize() ? targetSize : std::max(blockSize, std::min(targetSize, Util::roundDown(busy - start, blockSize)));
+            return Segment(start, std::min(getSize(), start + curSize) - start);
+        }
+    } else {
+        /* added for PFS */
+        const PartsInfo& parts = partialSource->getPartialInfo();
+        vector<Segment> neededParts;
+
+        for(int64_t start = getNextNeeded(0, blockSize, running); start < getSize(); ) {
+            int64_t busy = getNextBusy(start, running);
+            int64_t end = busy >= getSize() ? getSize() : std::max(start + blockSize, Util::roundDown(busy, blockSize));
+            end = std::min(getSize(), end);
+
+            // store all chunks of the source we could need
+            for(PartsInfo::const_iterator j = parts.begin(); j + 1 < parts.end(); j += 2) {
+                int64_t b = std::max(start, std::min(getSize(), (int64_t)(*j) * blockSize));
+                int64_t e = std::min(end, std::min(getSize(), (int64_t)(*(j+1)) * blockSize));
+                if(b < e) {
+                    neededParts.push_back(Segment(b, e - b));
                 }
-            } else {
-                overlaps = block.overlaps(*i);
             }
-        }
 
-        for(auto i = downloads.begin(); !overlaps && i !=downloads.end(); ++i) {
-            overlaps = block.overlaps((*i)->getSegment());
+            start = getNextNeeded(end, blockSize, running);
         }
 
-        if(!overlaps) {
-            if(partialSource) {
-                // store all chunks we could need
-                for(vector<int64_t>::const_iterator j = posArray.begin(); j < posArray.end(); j += 2){
-                    if( (*j <= start && start < *(j+1)) || (start <= *j && *j < end) ) {
-                        int64_t b = max(start, *j);
-                        int64_t e = min(end, *(j+1));
-
-                        // segment must be blockSize aligned
-                        dcassert(b % blockSize == 0);
-                        dcassert(e % blockSize == 0 || e == getSize());
-
-                        bool merged = false;
-                        if(!neededParts.empty())
-                        {
-                            Segment& prev = neededParts.back();
-                            if(b == prev.getEnd() && e > prev.getEnd())
-                            {
-                                 prev.setSize(prev.getSize() + (e - b));
-                                 merged = true;
-                            }
-                        }
-
-                        if(!merged)
-                            neededParts.push_back(Segment(b, e - b));
-                    }
+        if(!neededParts.empty()) {
+            dcdebug("Found partial chunks: %d\n", static_cast<int>(neededParts.size()));
+
+            // Rarest first, so that the parts only few sources have get spread before they go offline
+            vector<Segment*> rarest;
+            size_t minAvailable = std::numeric_limits<size_t>::max();
+            for(auto i = neededParts.begin(); i != neededParts.end(); ++i) {
+                size_t available = getAvailability(i->getStart(), blockSize);
+                if(available < minAvailable) {
+                    minAvailable = available;
+                    rarest.clear();
+                }
+                if(available == minAvailable) {
+                    rarest.push_back(&*i);
                 }
-            } else {
-                return block;
             }
-        }
 
-        if(!partialSource && curSize > blockSize) {
-            curSize -= blockSize;
-        } else {
-            start = end;
-            curSize = targetSize;
-        }
-    }
+            Segment& selected = *rarest[Util::rand(0, rarest.size())];
+            selected.setSize(std::min(selected.getSize(), targetSize));     // request only wanted size
 
-    if(!neededParts.empty()) {
-        // select random chunk for PFS
-        dcdebug("Found partial chunks: %d\n", static_cast<int>(neededParts.size()));
-
-        Segment& selected = neededParts[Util::rand(0, neededParts.size())];
-        selected.setSize(std::min(selected.getSize(), targetSize));     // request only wanted size
-
-        return selected;
+            return selected;
+        }
     }
 
     if(partialSource == NULL && BOOLSETTING(OVERLAP_CHUNKS) && lastSpeed > 0) {
@@ -276,33 +248,92 @@ Segment QueueItem::getNextSegment(int64_t blockSize, int64_t wantedSize, int64_t
     return Segment(0, 0);
 }
 
-int64_t QueueItem::getDownloadedBytes() const {
-    int64_t total = 0;
-    for(auto i = done.begin(); i != done.end(); ++i) {
-        total += i->getSize();
+const Segment* QueueItem::findDone(int64_t pos) const {
+    auto i = done.upper_bound(Segment(pos, std::numeric_limits<int64_t>::max()));
+    if(i == done.begin())
+        return NULL;
+    --i;
+    return i->getEnd() > pos ? &*i : NULL;
+}
+
+int64_t QueueItem::getNextNeeded(int64_t start, int64_t blockSize, const vector<Segment>& running) const {
+    // Jumps over whole finished and running segments rather than going block by block
+    while(start < getSize()) {
+        int64_t end = std::min(getSize(), start + blockSize);
+
+        // Only consider the block done if it is fully consumed by a done segment
+        const Segment* d = findDone(start);
+        if(d && d->getEnd() >= end) {
+            if(d->getEnd() >= getSize())
+                return getSize();
+            start = Util::roundDown(d->getEnd(), blockSize);
+            continue;
+        }
+
+        Segment block(start, end - start);
+        auto r = std::find_if(running.begin(), running.end(), [&block](const Segment& s) { return block.overlaps(s); });
+        if(r == running.end())
+            return start;
+        start = Util::roundUp(r->getEnd(), blockSize);
     }
-    return total;
+    return getSize();
 }
 
-void QueueItem::addSegment(const Segment& segment) {
-    done.insert(segment);
+int64_t QueueItem::getNextBusy(int64_t start, const vector<Segment>& running) const {
+    int64_t busy = getSize();
 
-    // Consolidate segments
-    if(done.size() == 1)
-        return;
+    auto i = done.upper_bound(Segment(start, std::numeric_limits<int64_t>::max()));
+    if(i != done.end())
+        busy = i->getStart();
+    if(i != done.begin() && (--i)->getEnd() > start)
+        return start;
 
-    for(auto i = ++done.begin() ; i != done.end(); ) {
+    for(auto r = running.begin(); r != running.end(); ++r) {
+        if(r->getEnd() > start)
+            busy = std::min(busy, std::max(start, r->getStart()));
+    }
+    return busy;
+}
+
+size_t QueueItem::getAvailability(int64_t pos, int64_t blockSize) const {
+    uint16_t block = (uint16_t)(pos / blockSize);
+    size_t n = 0;
+    for(auto i = sources.begin(); i != sources.end(); ++i) {
+        if(!i->isSet(Source::FLAG_PARTIAL) || !i->getPartialSource()) {
+            n++;
+            continue;
+        }
+
+        // The parts are sorted begin/end pairs, so being inside one means landing after a begin
+        const PartsInfo& parts = i->getPartialSource()->getPartialInfo();
+        if((std::upper_bound(parts.begin(), parts.end(), block) - parts.begin()) % 2 == 1)
+            n++;
+    }
+    return n;
+}
+
+void QueueItem::addSegment(const Segment& segment) {
+    int64_t start = segment.getStart();
+    int64_t end = segment.getEnd();
+
+    // Consolidate with the segments it overlaps or touches
+    auto i = done.upper_bound(Segment(start, std::numeric_limits<int64_t>::max()));
+    if(i != done.begin()) {
         auto prev = i;
         --prev;
-        if(prev->getEnd() >= i->getStart()) {
-            Segment big(prev->getStart(), i->getEnd() - prev->getStart());
-            done.erase(prev);
-            done.erase(i++);
-            done.insert(big);
-        } else {
-            ++i;
-        }
+        if(prev->getEnd() >= start)
+            i = prev;
     }
+
+    while(i != done.end() && i->getStart() <= end) {
+        start = std::min(start, i->getStart());
+        end = std::max(end, i->getEnd());
+        downloadedBytes -= i->getSize();
+        done.erase(i++);
+    }
+
+    done.insert(Segment(start, end - start));
+    downloadedBytes += end - start;
 }
 //Partial
 bool QueueItem::isNeededPart(const PartsInfo& partsInfo, int64_t blockSize)
@@ -137,14 +137,14 @@ public:
     QueueItem(const string& aTarget, int64_t aSize, Priority aPriority, int aFlag,
         time_t aAdded, const TTHValue& tth) :
         Flags(aFlag), target(aTarget), size(aSize),
-        priority(aPriority), added(aAdded), tthRoot(tth), nextPublishingTime(0)
+        priority(aPriority), added(aAdded), tthRoot(tth), nextPublishingTime(0), downloadedBytes(0)
     { }
 
     QueueItem(const QueueItem& rhs) :
-        Flags(rhs), done(rhs.done), downloads(rhs.downloads), target(rhs.target),
+        Flags(rhs), downloads(rhs.downloads), target(rhs.target),
         size(rhs.size), priority(rhs.priority), added(rhs.added), tthRoot(rhs.tthRoot),
         nextPublishingTime(rhs.nextPublishingTime), sources(rhs.sources), badSources(rhs.badSources),
-        tempTarget(rhs.tempTarget)
+        tempTarget(rhs.tempTarget), done(rhs.done), downloadedBytes(rhs.downloadedBytes)
 
     { }
 
@@ -175,7 +175,7 @@ public:
         return false;
     }
 
-    int64_t getDownloadedBytes() const;
+    int64_t getDownloadedBytes() const { return downloadedBytes; }
     double getDownloadedFraction() const { return static_cast<double>(getDownloadedBytes()) / getSize(); }
 
     DownloadList& getDownloads() { return downloads; }
@@ -183,14 +183,10 @@ public:
     bool isChunkDownloaded(int64_t startPos, int64_t& len) const {
         if(len <= 0) return false;
 
-        for(SegmentSet::const_iterator i = done.begin(); i != done.end(); ++i) {
-            int64_t first  = (*i).getStart();
-            int64_t second = (*i).getEnd();
-
-            if(first <= startPos && startPos < second){
-                len = min(len, second - startPos);
-                return true;
-            }
+        const Segment* i = findDone(startPos);
+        if(i) {
+            len = min(len, i->getEnd() - startPos);
+            return true;
         }
 
         return false;
@@ -209,7 +205,7 @@ public:
 
 
     void addSegment(const Segment& segment);
-    void resetDownloaded() { done.clear(); }
+    void resetDownloaded() { done.clear(); downloadedBytes = 0; }
 
     bool isFinished() const {
         return done.size() == 1 && *done.begin() == Segment(0, getSize());
@@ -234,7 +230,8 @@ public:
     const string& getTempTarget();
     void setTempTarget(const string& aTempTarget) { tempTarget = aTempTarget; }
 
-    GETSET(SegmentSet, done, Done);
+    /** The finished parts, sorted, never overlapping nor touching */
+    const SegmentSet& getDone() const { return done; }
     GETSET(DownloadList, downloads, Downloads);
     GETSET(string, target, Target);
     GETSET(int64_t, size, Size);
@@ -249,6 +246,17 @@ private:
     SourceList sources;
     SourceList badSources;
     string tempTarget;
+    SegmentSet done;
+    int64_t downloadedBytes;
+
+    /** @return The finished segment containing pos, NULL if it isn't downloaded yet */
+    const Segment* findDone(int64_t pos) const;
+    /** @return The first block starting at or after start that is needed and not being downloaded, getSize() if none is */
+    int64_t getNextNeeded(int64_t start, int64_t blockSize, const vector<Segment>& running) const;
+    /** @return Where the first finished or running segment at or after start begins */
+    int64_t getNextBusy(int64_t start, const vector<Segment>& running) const;
+    /** @return How many sources have the block at pos */
+    size_t getAvailability(int64_t pos, int64_t blockSize) const;
 
     void addSource(const HintedUser& aUser);
     void removeSource(const UserPtr& aUser, int reason);
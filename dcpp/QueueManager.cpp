@@ -95,12 +95,31 @@ void QueueManager::FileQueue::add(QueueItem* qi) {
         lastInsert = queue.insert(make_pair(const_cast<string*>(&qi->getTarget()), qi)).first;
     else
         lastInsert = queue.insert(lastInsert, make_pair(const_cast<string*>(&qi->getTarget()), qi));
+
+    tthIndex.insert(make_pair(qi->getTTH(), qi));
+    sizeIndex.insert(make_pair(qi->getSize(), qi));
+    changed(qi->getTarget());
+}
+
+template<typename Index, typename Key>
+static void eraseFromIndex(Index& index, const Key& key, QueueItem* qi) {
+    auto range = index.equal_range(key);
+    for(auto i = range.first; i != range.second; ++i) {
+        if(i->second == qi) {
+            index.erase(i);
+            return;
+        }
+    }
+    dcassert(0);
 }
 
 void QueueManager::FileQueue::remove(QueueItem* qi) {
     if(lastInsert != queue.end() && Util::stricmp(*lastInsert->first, qi->getTarget()) == 0)
         ++lastInsert;
     queue.erase(const_cast<string*>(&qi->getTarget()));
+    eraseFromIndex(tthIndex, qi->getTTH(), qi);
+    eraseFromIndex(sizeIndex, qi->getSize(), qi);
+    changed(qi->getTarget());
     delete qi;
 }
 
@@ -110,30 +129,24 @@ QueueItem* QueueManager::FileQueue::find(const string& target) {
 }
 
 void QueueManager::FileQueue::find(QueueItem::List& sl, int64_t aSize, const string& suffix) {
-    for(QueueItem::StringIter i = queue.begin(); i != queue.end(); ++i) {
-        if(i->second->getSize() == aSize) {
-            const string& t = i->second->getTarget();
-            if(suffix.empty() || (suffix.length() < t.length() &&
-                Util::stricmp(suffix.c_str(), t.c_str() + (t.length() - suffix.length())) == 0) )
-                sl.push_back(i->second);
-        }
+    auto range = sizeIndex.equal_range(aSize);
+    for(auto i = range.first; i != range.second; ++i) {
+        const string& t = i->second->getTarget();
+        if(suffix.empty() || (suffix.length() < t.length() &&
+            Util::stricmp(suffix.c_str(), t.c_str() + (t.length() - suffix.length())) == 0) )
+            sl.push_back(i->second);
     }
 }
 
 void QueueManager::FileQueue::find(QueueItem::List& ql, const TTHValue& tth) {
-    for(QueueItem::StringIter i = queue.begin(); i != queue.end(); ++i) {
-        QueueItem* qi = i->second;
-        if(qi->getTTH() == tth) {
-            ql.push_back(qi);
-        }
+    auto range = tthIndex.equal_range(tth);
+    for(auto i = range.first; i != range.second; ++i) {
+        ql.push_back(i->second);
     }
 }
 
 bool QueueManager::FileQueue::exists(const TTHValue& tth) const {
-    for(QueueItem::StringMap::const_iterator i = queue.begin(); i != queue.end(); ++i)
-        if(i->second->getTTH() == tth)
-            return true;
-    return false;
+    return tthIndex.find(tth) != tthIndex.end();
 }
 
 static QueueItem* findCandidate(QueueItem* cand, QueueItem::StringIter start, QueueItem::StringIter end, const StringList& recent) {
@@ -185,6 +198,7 @@ void QueueManager::FileQueue::move(QueueItem* qi, const string& aTarget) {
     if(lastInsert != queue.end() && Util::stricmp(*lastInsert->first, qi->getTarget()) == 0)
         lastInsert = queue.end();
     queue.erase(const_cast<string*>(&qi->getTarget()));
+    changed(qi->getTarget());
     qi->setTarget(aTarget);
     add(qi);
 }
@@ -229,6 +243,7 @@ QueueItem* QueueManager::UserQueue::getNext(const UserPtr& aUser, QueueItem::Pri
             for(QueueItem::Iter j = i->second.begin(); j != i->second.end(); ++j) {
                 QueueItem* qi = *j;
                 QueueItem::SourceConstIter source = qi->getSource(aUser);
+                bool haveSegment = false;
                 if(source->isSet(QueueItem::Source::FLAG_PARTIAL)) {
                     // check partial source
                     int64_t blockSize = HashManager::getInstance()->getBlockSize(qi->getTTH());
@@ -244,6 +259,7 @@ QueueItem* QueueManager::UserQueue::getNext(const UserPtr& aUser, QueueItem::Pri
                         p++;
                         break;
                     }
+                    haveSegment = segment.getSize() > 0;
                 }
                 if(qi->isWaiting()) {
                     return qi;
@@ -253,7 +269,7 @@ QueueItem* QueueManager::UserQueue::getNext(const UserPtr& aUser, QueueItem::Pri
                 if(qi->getDownloads()[0]->getType() == Transfer::TYPE_TREE) {
                     continue;
                 }
-                if(!qi->isSet(QueueItem::FLAG_USER_LIST)) {
+                if(!haveSegment && !qi->isSet(QueueItem::FLAG_USER_LIST)) {
                     int64_t blockSize = HashManager::getInstance()->getBlockSize(qi->getTTH());
                     if(blockSize == 0)
                         blockSize = qi->getSize();
@@ -528,6 +544,10 @@ lastSave(0),
 queueFile(Util::getPath(Util::PATH_USER_CONFIG) + "Queue.xml"),
 rechecker(this),
 dirty(true),
+generation(0),
+journalOk(false),
+journalSize(0),
+lastFullSize(0),
 nextSearch(0)
 {
     TimerManager::getInstance()->addListener(this);
@@ -837,6 +857,11 @@ void QueueManager::setDirty() {
     }
 }
 
+void QueueManager::setDirty(QueueItem* qi) {
+    fileQueue.changed(qi->getTarget());
+    setDirty();
+}
+
 string QueueManager::checkTarget(const string& aTarget, bool checkExistence) {
 #ifdef _WIN32
     if(aTarget.length() > MAX_PATH) {
@@ -893,7 +918,7 @@ bool QueueManager::addSource(QueueItem* qi, const HintedUser& aUser, Flags::Mask
     }
 
     fire(QueueManagerListener::SourcesUpdated(), qi);
-    setDirty();
+    setDirty(qi);
 
     return wantConnection;
 }
@@ -933,53 +958,45 @@ QueueItem::Priority QueueManager::hasDownload(const UserPtr& aUser) noexcept {
     }
     return qi->getPriority();
 }
-namespace {
-typedef unordered_map<TTHValue, const DirectoryListing::File*> TTHMap;
-
-// *** WARNING ***
-// Lock(cs) makes sure that there's only one thread accessing this
-static TTHMap tthMap;
+int QueueManager::matchListing(const DirectoryListing& dl) noexcept {
+    int matches = 0;
+    {
+        Lock l(cs);
+        unordered_set<QueueItem*> matched;
+        matchListing(dl.getRoot(), dl.getUser(), matched);
+        matches = (int)matched.size();
+    }
+    if(matches > 0)
+        ConnectionManager::getInstance()->getDownloadConnection(dl.getUser());
+    return matches;
+}
 
-void buildMap(const DirectoryListing::Directory* dir) noexcept {
+void QueueManager::matchListing(const DirectoryListing::Directory* dir, const HintedUser& aUser, unordered_set<QueueItem*>& matched) noexcept {
     for(DirectoryListing::Directory::List::const_iterator j = dir->directories.begin(); j != dir->directories.end(); ++j) {
         if(!(*j)->getAdls())
-            buildMap(*j);
+            matchListing(*j, aUser, matched);
     }
 
+    QueueItem::List ql;
     for(DirectoryListing::File::List::const_iterator i = dir->files.begin(); i != dir->files.end(); ++i) {
         const DirectoryListing::File* df = *i;
-        tthMap.insert(make_pair(df->getTTH(), df));
-    }
-}
-}
-
-int QueueManager::matchListing(const DirectoryListing& dl) noexcept {
-    int matches = 0;
-    {
-        Lock l(cs);
-        tthMap.clear();
-        buildMap(dl.getRoot());
-
-        for(QueueItem::StringMap::const_iterator i = fileQueue.getQueue().begin(); i != fileQueue.getQueue().end(); ++i) {
-            QueueItem* qi = i->second;
+        ql.clear();
+        fileQueue.find(ql, df->getTTH());
+        for(QueueItem::Iter j = ql.begin(); j != ql.end(); ++j) {
+            QueueItem* qi = *j;
             if(qi->isFinished())
                 continue;
             if(qi->isSet(QueueItem::FLAG_USER_LIST))
                 continue;
-            TTHMap::iterator j = tthMap.find(qi->getTTH());
-            if(j != tthMap.end() && i->second->getSize() == qi->getSize()) {
+            if(df->getSize() == qi->getSize() && matched.insert(qi).second) {
                 try {
-                    addSource(qi, dl.getUser(), QueueItem::Source::FLAG_FILE_NOT_AVAILABLE);
+                    addSource(qi, aUser, QueueItem::Source::FLAG_FILE_NOT_AVAILABLE);
                 } catch(...) {
                     // Ignore...
                 }
-                matches++;
             }
         }
     }
-    if(matches > 0)
-        ConnectionManager::getInstance()->getDownloadConnection(dl.getUser());
-    return matches;
 }
 
 int64_t QueueManager::getPos(const string& target) noexcept {
@@ -1226,7 +1243,9 @@ void QueueManager::moveStuckFile(QueueItem* qi) {
     } else {
         qi->addSegment(Segment(0, qi->getSize()));
         fire(QueueManagerListener::StatusUpdated(), qi);
+        fileQueue.changed(target);
     }
+    setDirty();
 
     fire(QueueManagerListener::RecheckAlreadyFinished(), target);
 }
@@ -1235,7 +1254,7 @@ void QueueManager::rechecked(QueueItem* qi) {
     fire(QueueManagerListener::RecheckDone(), qi->getTarget());
     fire(QueueManagerListener::StatusUpdated(), qi);
 
-    setDirty();
+    setDirty(qi);
 }
 
 void QueueManager::putDownload(Download* aDownload, bool finished) noexcept {
@@ -1311,6 +1330,9 @@ void QueueManager::putDownload(Download* aDownload, bool finished) noexcept {
                                 | (q->isSet(QueueItem::FLAG_MATCH_QUEUE) ? QueueItem::FLAG_MATCH_QUEUE : 0);
                         }
 
+                        // Before it may be removed below
+                        fileQueue.changed(q->getTarget());
+
                         string dir;
                         bool crcError = false;
                         if(aDownload->getType() == Transfer::TYPE_FULL_LIST) {
@@ -1365,7 +1387,7 @@ void QueueManager::putDownload(Download* aDownload, bool finished) noexcept {
 
                             if(downloaded > 0) {
                                 q->addSegment(Segment(aDownload->getStartPos(), downloaded));
-                                setDirty();
+                                setDirty(q);
                             }
                         }
                     }
@@ -1508,7 +1530,7 @@ void QueueManager::removeSource(const string& aTarget, const UserPtr& aUser, int
         q->removeSource(aUser, reason);
 
         fire(QueueManagerListener::SourcesUpdated(), q);
-        setDirty();
+        setDirty(q);
     }
 endCheck:
     if(isRunning && removeConn) {
@@ -1538,7 +1560,7 @@ void QueueManager::removeSource(const UserPtr& aUser, int reason) noexcept {
                 userQueue.remove(qi, aUser);
                 qi->removeSource(aUser, reason);
                 fire(QueueManagerListener::SourcesUpdated(), qi);
-                setDirty();
+                setDirty(qi);
             }
         }
 
@@ -1553,7 +1575,7 @@ void QueueManager::removeSource(const UserPtr& aUser, int reason) noexcept {
                 qi->removeSource(aUser, reason);
                 fire(QueueManagerListener::StatusUpdated(), qi);
                 fire(QueueManagerListener::SourcesUpdated(), qi);
-                setDirty();
+                setDirty(qi);
             }
         }
     }
@@ -1579,7 +1601,7 @@ void QueueManager::setPriority(const string& aTarget, QueueItem::Priority p) noe
                                 q->getOnlineUsers(getConn);
             }
             userQueue.setPriority(q, p);
-            setDirty();
+            setDirty(q);
             fire(QueueManagerListener::StatusUpdated(), q);
         }
     }
@@ -1589,85 +1611,256 @@ void QueueManager::setPriority(const string& aTarget, QueueItem::Priority p) noe
     }
 }
 
-void QueueManager::saveQueue(bool force) noexcept {
-    if(!dirty && !force)
-    return;
+void QueueManager::saveItem(QueueItem* qi, OutputStream& f, string& tmp, string& b32tmp, vector<CID>& cids) const {
+    f.write(LIT("\t<Download Target=\""));
+    f.write(SimpleXML::escape(qi->getTarget(), tmp, true));
+    f.write(LIT("\" Size=\""));
+    f.write(Util::toString(qi->getSize()));
+    f.write(LIT("\" Priority=\""));
+    f.write(Util::toString((int)qi->getPriority()));
+    f.write(LIT("\" Added=\""));
+    f.write(Util::toString(qi->getAdded()));
+    b32tmp.clear();
+    f.write(LIT("\" TTH=\""));
+    f.write(qi->getTTH().toBase32(b32tmp));
+    if(!qi->getDone().empty()) {
+        f.write(LIT("\" TempTarget=\""));
+        f.write(SimpleXML::escape(qi->getTempTarget(), tmp, true));
+    }
+    f.write(LIT("\">\r\n"));
 
-    std::vector<CID> cids;
+    for(QueueItem::SegmentSet::const_iterator i = qi->getDone().begin(); i != qi->getDone().end(); ++i) {
+        f.write(LIT("\t\t<Segment Start=\""));
+        f.write(Util::toString(i->getStart()));
+        f.write(LIT("\" Size=\""));
+        f.write(Util::toString(i->getSize()));
+        f.write(LIT("\"/>\r\n"));
+    }
 
-    try {
-        Lock l(cs);
+    for(QueueItem::SourceConstIter j = qi->sources.begin(); j != qi->sources.end(); ++j) {
+        if(j->isSet(QueueItem::Source::FLAG_PARTIAL)
+#ifdef WITH_DHT
+                                                    || j->getUser().hint == "DHT"
+#endif
+                                                                                  ) continue;
 
-        File ff(getQueueFile() + ".tmp", File::WRITE, File::CREATE | File::TRUNCATE);
-        BufferedOutputStream<false> f(&ff);
-
-        f.write(SimpleXML::utf8Header);
-        f.write(LIT("<Downloads Version=\"" VERSIONSTRING "\">\r\n"));
-        string tmp;
-        string b32tmp;
-        for(QueueItem::StringIter i = fileQueue.getQueue().begin(); i != fileQueue.getQueue().end(); ++i) {
-            QueueItem* qi = i->second;
-            if(!qi->isSet(QueueItem::FLAG_USER_LIST)) {
-                f.write(LIT("\t<Download Target=\""));
-                f.write(SimpleXML::escape(qi->getTarget(), tmp, true));
-                f.write(LIT("\" Size=\""));
-                f.write(Util::toString(qi->getSize()));
-                f.write(LIT("\" Priority=\""));
-                f.write(Util::toString((int)qi->getPriority()));
-                f.write(LIT("\" Added=\""));
-                f.write(Util::toString(qi->getAdded()));
-                b32tmp.clear();
-                f.write(LIT("\" TTH=\""));
-                f.write(qi->getTTH().toBase32(b32tmp));
-                if(!qi->getDone().empty()) {
-                    f.write(LIT("\" TempTarget=\""));
-                    f.write(SimpleXML::escape(qi->getTempTarget(), tmp, true));
-                }
-                f.write(LIT("\">\r\n"));
-
-                for(QueueItem::SegmentSet::const_iterator i = qi->getDone().begin(); i != qi->getDone().end(); ++i) {
-                    f.write(LIT("\t\t<Segment Start=\""));
-                    f.write(Util::toString(i->getStart()));
-                    f.write(LIT("\" Size=\""));
-                    f.write(Util::toString(i->getSize()));
-                    f.write(LIT("\"/>\r\n"));
-                }
+        const CID& cid = j->getUser().user->getCID();
+        const string& hint = j->getUser().hint;
+
+        f.write(LIT("\t\t<Source CID=\""));
+        f.write(cid.toBase32());
+        if(!hint.empty()) {
+            f.write(LIT("\" Hub=\""));
+            f.write(hint);
+        }
+        f.write(LIT("\"/>\r\n"));
+
+        cids.push_back(cid);
+    }
+
+    f.write(LIT("\t</Download>\r\n"));
+}
+
+namespace {
+
+enum JournalRecords {
+    JOURNAL_REMOVE,
+    JOURNAL_ITEM
+};
+
+const char JOURNAL_MAGIC[4] = { 'D', 'C', 'Q', 'J' };
+
+template<typename T>
+void putInt(string& out, T v) {
+    out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+void putString(string& out, const string& str) {
+    putInt(out, static_cast<uint32_t>(str.size()));
+    out += str;
+}
+
+/** Reads the fields of a journal record, failing from the first one that doesn't fit */
+class JournalReader {
+public:
+    JournalReader(const char* aData, size_t aLen) : p(aData), end(aData + aLen), ok(true) { }
+
+    template<typename T>
+    T getInt() {
+        T v = T();
+        if(!check(sizeof(T)))
+            return v;
+        memcpy(&v, p, sizeof(T));
+        p += sizeof(T);
+        return v;
+    }
+
+    string getString() {
+        uint32_t len = getInt<uint32_t>();
+        if(!check(len))
+            return Util::emptyString;
+        string ret(p, len);
+        p += len;
+        return ret;
+    }
+
+    void getBytes(uint8_t* buf, size_t len) {
+        if(!check(len))
+            return;
+        memcpy(buf, p, len);
+        p += len;
+    }
+
+    bool isOk() const { return ok; }
+private:
+    const char* p;
+    const char* end;
+    bool ok;
 
-                for(QueueItem::SourceConstIter j = qi->sources.begin(); j != qi->sources.end(); ++j) {
-                    if(j->isSet(QueueItem::Source::FLAG_PARTIAL)
+    bool check(size_t len) {
+        if(!ok || static_cast<size_t>(end - p) < len)
+            ok = false;
+        return ok;
+    }
+};
+
+}
+
+/** Appends a journal record with the current state of the item with the target, or its removal */
+void QueueManager::journalItem(const string& aTarget, string& out, vector<CID>& cids) const {
+    QueueItem* qi = const_cast<FileQueue&>(fileQueue).find(aTarget);
+    if(qi && qi->isSet(QueueItem::FLAG_USER_LIST))
+        return;
+
+    string rec;
+    if(!qi) {
+        putInt(rec, static_cast<uint8_t>(JOURNAL_REMOVE));
+        putString(rec, aTarget);
+    } else {
+        putInt(rec, static_cast<uint8_t>(JOURNAL_ITEM));
+        putString(rec, qi->getTarget());
+        putInt(rec, qi->getSize());
+        putInt(rec, static_cast<int32_t>(qi->getPriority()));
+        putInt(rec, static_cast<int64_t>(qi->getAdded()));
+        rec.append(reinterpret_cast<const char*>(qi->getTTH().data), TTHValue::BYTES);
+        putString(rec, qi->getDone().empty() ? Util::emptyString : qi->getTempTarget());
+
+        putInt(rec, static_cast<uint32_t>(qi->getDone().size()));
+        for(QueueItem::SegmentSet::const_iterator i = qi->getDone().begin(); i != qi->getDone().end(); ++i) {
+            putInt(rec, i->getStart());
+            putInt(rec, i->getSize());
+        }
+
+        uint32_t n = 0;
+        string sources;
+        for(QueueItem::SourceConstIter j = qi->sources.begin(); j != qi->sources.end(); ++j) {
+            if(j->isSet(QueueItem::Source::FLAG_PARTIAL)
 #ifdef WITH_DHT
-                                                                || j->getUser().hint == "DHT"
+                                                        || j->getUser().hint == "DHT"
 #endif
-                                                                                              ) continue;
+                                                                                      ) continue;
 
-                    const CID& cid = j->getUser().user->getCID();
-                    const string& hint = j->getUser().hint;
+            const CID& cid = j->getUser().user->getCID();
+            sources.append(reinterpret_cast<const char*>(cid.data()), CID::SIZE);
+            putString(sources, j->getUser().hint);
+            cids.push_back(cid);
+            n++;
+        }
+        putInt(rec, n);
+        rec += sources;
+    }
 
-                    f.write(LIT("\t\t<Source CID=\""));
-                    f.write(cid.toBase32());
-                    if(!hint.empty()) {
-                        f.write(LIT("\" Hub=\""));
-                        f.write(hint);
-                    }
-                    f.write(LIT("\"/>\r\n"));
+    CRC32Filter crc;
+    crc(rec.data(), rec.size());
+    putInt(out, static_cast<uint32_t>(rec.size()));
+    putInt(out, crc.getValue());
+    out += rec;
+}
 
-                    cids.push_back(cid);
-                }
+void QueueManager::saveQueue(bool force) noexcept {
+    if(!dirty && !force)
+        return;
+
+    Lock s(saveCs);
+
+    std::vector<CID> cids;
+    string data;
+    bool full;
+    uint32_t gen;
+
+    {
+        Lock l(cs);
 
-                f.write(LIT("\t</Download>\r\n"));
+        StringSet changes;
+        fileQueue.takeChanges(changes);
+
+        // Compact once the journal has grown to a good part of the full queue
+        full = force || !journalOk || journalSize > max(lastFullSize / 4, (int64_t)JOURNAL_MIN_COMPACT);
+        if(full) {
+            gen = ++generation;
+
+            StringOutputStream f(data);
+            f.write(SimpleXML::utf8Header);
+            f.write(LIT("<Downloads Version=\"" VERSIONSTRING "\" Generation=\""));
+            f.write(Util::toString(gen));
+            f.write(LIT("\">\r\n"));
+            string tmp;
+            string b32tmp;
+            for(QueueItem::StringIter i = fileQueue.getQueue().begin(); i != fileQueue.getQueue().end(); ++i) {
+                QueueItem* qi = i->second;
+                if(!qi->isSet(QueueItem::FLAG_USER_LIST)) {
+                    saveItem(qi, f, tmp, b32tmp, cids);
+                }
+            }
+            f.write("</Downloads>\r\n");
+        } else {
+            gen = generation;
+            for(StringSetIter i = changes.begin(); i != changes.end(); ++i) {
+                journalItem(*i, data, cids);
             }
         }
 
-        f.write("</Downloads>\r\n");
-        f.flush();
-        ff.close();
-        File::deleteFile(getQueueFile());
-        File::renameFile(getQueueFile() + ".tmp", getQueueFile());
-
         dirty = false;
+        // Until this save is on disk, anything new has to wait for the next full one
+        journalOk = false;
+    }
+
+    // The disk is only touched now, without blocking downloads and searches
+    bool ok = false;
+    try {
+        if(full) {
+            {
+                File ff(getQueueFile() + ".tmp", File::WRITE, File::CREATE | File::TRUNCATE);
+                ff.write(data);
+            }
+            File::deleteFile(getQueueFile());
+            File::renameFile(getQueueFile() + ".tmp", getQueueFile());
+            lastFullSize = data.size();
+
+            string header(JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+            putInt(header, static_cast<uint32_t>(JOURNAL_VERSION));
+            putInt(header, gen);
+            File(getJournalFile(), File::WRITE, File::CREATE | File::TRUNCATE).write(header);
+            journalSize = header.size();
+        } else if(!data.empty()) {
+            File f(getJournalFile(), File::WRITE, File::OPEN);
+            f.setEndPos(0);
+            f.write(data);
+            journalSize += data.size();
+        }
+        ok = true;
     } catch(const FileException&) {
         // ...
     }
+
+    {
+        Lock l(cs);
+        // A journal missing some changes can't be appended to; the next save will be a full one
+        journalOk = ok && gen == generation;
+        if(!ok)
+            dirty = true;
+    }
+
     // Put this here to avoid very many saves tries when disk is full...
     lastSave = GET_TICK();
 
@@ -1683,6 +1876,110 @@ void QueueManager::saveQueue(bool force) noexcept {
 //#endif
 }
 
+/** Applies the changes journaled since Queue.xml was written */
+void QueueManager::replayJournal() {
+    string data;
+    try {
+        data = File(getJournalFile(), File::READ, File::OPEN).read();
+    } catch(const FileException&) {
+        return;
+    }
+
+    const size_t headerSize = sizeof(JOURNAL_MAGIC) + 2 * sizeof(uint32_t);
+    JournalReader header(data.data(), data.size());
+    uint8_t magic[sizeof(JOURNAL_MAGIC)];
+    header.getBytes(magic, sizeof(magic));
+    uint32_t version = header.getInt<uint32_t>();
+    uint32_t gen = header.getInt<uint32_t>();
+    if(!header.isOk() || memcmp(magic, JOURNAL_MAGIC, sizeof(magic)) != 0 || version != JOURNAL_VERSION || gen != generation) {
+        dcdebug("Queue journal doesn't belong to Queue.xml, ignoring it\n");
+        return;
+    }
+
+    size_t pos = headerSize;
+    size_t records = 0;
+    while(pos < data.size()) {
+        JournalReader r(data.data() + pos, data.size() - pos);
+        uint32_t len = r.getInt<uint32_t>();
+        uint32_t crc = r.getInt<uint32_t>();
+        pos += 2 * sizeof(uint32_t);
+        if(!r.isOk() || len > data.size() - pos)
+            break;
+
+        CRC32Filter check;
+        check(data.data() + pos, len);
+        if(check.getValue() != crc) {
+            // The tail of a write that didn't make it to the disk
+            break;
+        }
+
+        JournalReader rec(data.data() + pos, len);
+        pos += len;
+        records++;
+
+        uint8_t type = rec.getInt<uint8_t>();
+        string target = rec.getString();
+        if(!rec.isOk())
+            continue;
+
+        QueueItem* qi = fileQueue.find(target);
+        if(qi) {
+            fire(QueueManagerListener::Removed(), qi);
+            if(!qi->isFinished())
+                userQueue.remove(qi);
+            fileQueue.remove(qi);
+        }
+
+        if(type != JOURNAL_ITEM)
+            continue;
+
+        int64_t size = rec.getInt<int64_t>();
+        QueueItem::Priority p = static_cast<QueueItem::Priority>(rec.getInt<int32_t>());
+        time_t added = static_cast<time_t>(rec.getInt<int64_t>());
+        TTHValue tth;
+        rec.getBytes(tth.data, TTHValue::BYTES);
+        string tempTarget = rec.getString();
+        if(!rec.isOk() || size <= 0)
+            continue;
+
+        qi = fileQueue.add(target, size, 0, p, tempTarget, added, tth);
+
+        uint32_t segments = rec.getInt<uint32_t>();
+        for(uint32_t i = 0; i < segments && rec.isOk(); ++i) {
+            int64_t start = rec.getInt<int64_t>();
+            int64_t len = rec.getInt<int64_t>();
+            if(rec.isOk() && len > 0 && start >= 0 && (start + len) <= qi->getSize()) {
+                qi->addSegment(Segment(start, len));
+            }
+        }
+        fire(QueueManagerListener::Added(), qi);
+
+        uint32_t sources = rec.getInt<uint32_t>();
+        for(uint32_t i = 0; i < sources && rec.isOk(); ++i) {
+            uint8_t cid[CID::SIZE];
+            rec.getBytes(cid, CID::SIZE);
+            string hubHint = rec.getString();
+            if(!rec.isOk())
+                break;
+
+            try {
+                addSource(qi, HintedUser(ClientManager::getInstance()->getUser(CID(cid)), hubHint), 0);
+            } catch(const Exception&) {
+                // ...
+            }
+        }
+    }
+
+    dcdebug("Replayed %u queue journal records\n", (unsigned)records);
+    if(records > 0) {
+        // Fold them into Queue.xml with the next save
+        setDirty();
+    } else {
+        journalOk = true;
+        journalSize = data.size();
+    }
+}
+
 class QueueLoader : public SimpleXMLReader::CallBack {
 public:
     QueueLoader() : cur(NULL), inDownloads(false) { }
@@ -1704,9 +2001,17 @@ void QueueManager::loadQueue() noexcept {
         File f(getQueueFile(), File::READ, File::OPEN);
         SimpleXMLReader(&l).parse(f);
         dirty = false;
+        lastFullSize = f.getSize();
     } catch(const Exception&) {
         // ...
     }
+
+    {
+        Lock l(cs);
+        replayJournal();
+        StringSet loaded;
+        fileQueue.takeChanges(loaded);
+    }
 }
 
 int QueueManager::countOnlineSources(const string& aTarget) {
@@ -1738,11 +2043,13 @@ static const string sCID = "CID";
 static const string sHubHint = "Hub";
 static const string sSegment = "Segment";
 static const string sStart = "Start";
+static const string sGeneration = "Generation";
 
 void QueueLoader::startTag(const string& name, StringPairList& attribs, bool simple) {
     QueueManager* qm = QueueManager::getInstance();
     if(!inDownloads && name == "Downloads") {
         inDownloads = true;
+        qm->generation = Util::toUInt32(getAttrib(attribs, sGeneration, 1));
     } else if(inDownloads) {
         if(cur == NULL && name == sDownload) {
             int64_t size = Util::toInt64(getAttrib(attribs, sSize, 1));
@@ -216,10 +216,22 @@ private:
         QueueItem::StringMap& getQueue() { return queue; }
         void move(QueueItem* qi, const string& aTarget);
         void remove(QueueItem* qi);
+
+        /** Remembers that the item with the target was added, changed or removed, for the journal */
+        void changed(const string& aTarget) { changes.insert(aTarget); }
+        /** Takes the targets changed since the last call */
+        void takeChanges(StringSet& aChanges) { aChanges.clear(); aChanges.swap(changes); }
     private:
+        typedef unordered_multimap<TTHValue, QueueItem*> TTHIndex;
+        typedef unordered_multimap<int64_t, QueueItem*> SizeIndex;
+
         QueueItem::StringMap queue;
         /** A hint where to insert an item... */
         QueueItem::StringIter lastInsert;
+        /** The items by root and by size, for matching search results and listings without going through them all */
+        TTHIndex tthIndex;
+        SizeIndex sizeIndex;
+        StringSet changes;
     };
 
     /** All queue items indexed by user (this is a cache for the FileQueue really...) */
@@ -266,6 +278,21 @@ private:
     StringList recent;
     /** The queue needs to be saved */
     bool dirty;
+
+    /**
+     * Changes to the queue are appended to Queue.journal, as records of the whole state of the
+     * changed items, and only now and then compacted into a new Queue.xml. The generation ties
+     * the journal to the Queue.xml it applies to, so a journal left behind by a compaction that
+     * didn't finish is ignored.
+     */
+    enum { JOURNAL_VERSION = 1, JOURNAL_MIN_COMPACT = 256*1024 };
+    uint32_t generation;
+    /** The journal on disk belongs to the current generation and can be appended to */
+    bool journalOk;
+    int64_t journalSize;
+    int64_t lastFullSize;
+    /** Serializes writing Queue.xml and the journal, which happens without holding cs */
+    CriticalSection saveCs;
     /** Next search */
     uint64_t nextSearch;
     /** File lists not to delete */
@@ -274,6 +301,8 @@ private:
     static string checkTarget(const string& aTarget, bool checkExsistence);
     /** Add a source to an existing queue item */
     bool addSource(QueueItem* qi, const HintedUser& aUser, Flags::MaskType addBad);
+    /** Adds aUser as a source of the queued files in dir, recursively */
+    void matchListing(const DirectoryListing::Directory* dir, const HintedUser& aUser, unordered_set<QueueItem*>& matched) noexcept;
 
     void processList(const string& name, const HintedUser& user, int flags);
 
@@ -284,6 +313,13 @@ private:
     void rechecked(QueueItem* qi);
 
     void setDirty();
+    /** Marks the item changed as well, so that it gets to the journal */
+    void setDirty(QueueItem* qi);
+
+    string getJournalFile() const { return getQueueFile() + ".journal"; }
+    void saveItem(QueueItem* qi, OutputStream& f, string& tmp, string& b32tmp, vector<CID>& cids) const;
+    void journalItem(const string& aTarget, string& out, vector<CID>& cids) const;
+    void replayJournal();
 
     string getListPath(const HintedUser& user);
 
@@ -99,6 +99,50 @@ bool SSLSocket::waitAccepted(uint32_t millis) {
     }
 }
 
+#ifdef __linux__
+bool SSLSocket::canSendFile() const noexcept {
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    // Only when the kernel took over the record encryption (kTLS), which depends on the kernel,
+    // its tls module and the negotiated cipher; otherwise the data has to go through SSL_write
+    return ssl && BIO_get_ktls_send(SSL_get_wbio(ssl));
+#else
+    return false;
+#endif
+}
+
+int SSLSocket::sendFile(int fd, int64_t& offset, int aLen) {
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    if(!ssl) {
+        return -1;
+    }
+    ossl_ssize_t ret = SSL_sendfile(ssl, fd, offset, aLen, 0);
+    if(ret == 0 && aLen > 0) {
+        throw SocketException(_("File ended unexpectedly"));
+    }
+    if(ret < 0) {
+        int error = errno;
+        int err = SSL_get_error(ssl, (int)ret);
+        if(!BIO_get_ktls_send(SSL_get_wbio(ssl)) ||
+            (err == SSL_ERROR_SYSCALL && (error == EINVAL || error == EOPNOTSUPP || error == ENOSYS)))
+        {
+            // kTLS is off or the file can't be sent this way; nothing was sent, so SSL_write can take over
+            ERR_clear_error();
+            throw SocketException(_("Sending files directly requires kernel TLS"));
+        }
+    }
+    // Anything else is either a retry or fatal for the connection
+    int sent = checkSSL((int)ret);
+    if(sent > 0) {
+        offset += sent;
+        stats.totalUp += sent;
+    }
+    return sent;
+#else
+    throw SocketException(_("Sending files directly requires kernel TLS"));
+#endif
+}
+#endif
+
 bool SSLSocket::waitWant(int ret, uint32_t millis) {
     int err = SSL_get_error(ssl, ret);
     switch(err) {
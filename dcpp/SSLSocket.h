@@ -61,6 +61,10 @@ public:
     virtual bool waitConnected(uint32_t millis);
     virtual bool waitAccepted(uint32_t millis);
 
+#ifdef __linux__
+    virtual bool canSendFile() const noexcept;
+    virtual int sendFile(int fd, int64_t& offset, int aLen);
+#endif
 
 private:
     friend class CryptoManager;
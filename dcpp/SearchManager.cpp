@@ -489,12 +489,14 @@ void SearchManager::respond(const AdcCommand& adc, const CID& from,  bool isUdpA
         return;
     }
 
+    vector<AdcCommand> cmds;
+    cmds.reserve(results.size());
     for(SearchResultList::const_iterator i = results.begin(); i != results.end(); ++i) {
-        AdcCommand cmd = (*i)->toRES(AdcCommand::TYPE_UDP);
+        cmds.push_back((*i)->toRES(AdcCommand::TYPE_UDP));
         if(!token.empty())
-            cmd.addParam("TO", token);
-        ClientManager::getInstance()->send(cmd, from);
+            cmds.back().addParam("TO", token);
     }
+    ClientManager::getInstance()->send(cmds, from);
 }
 
 string SearchManager::getPartsString(const PartsInfo& partsInfo) const {
@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2001-2012 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "stdinc.h"
+#include "SearchResponder.h"
+
+#include "ClientManager.h"
+#include "TimerManager.h"
+
+namespace dcpp {
+
+SearchResponder::SearchResponder() : waiting(0), stop(false) {
+    for(int i = 0; i < WORKERS; ++i) {
+        workers.push_back(unique_ptr<Worker>(new Worker(*this)));
+        workers.back()->start();
+    }
+}
+
+SearchResponder::~SearchResponder() {
+    stop = true;
+    for(size_t i = 0; i < workers.size(); ++i)
+        s.signal();
+    for(auto i = workers.begin(); i != workers.end(); ++i)
+        (*i)->join();
+}
+
+void SearchResponder::respond(Client* aClient, const string& aSeeker, int aSearchType, int64_t aSize, int aFileType, const string& aString) {
+    Search* search = new Search;
+    search->client = aClient;
+    search->seeker = aSeeker;
+    search->searchType = aSearchType;
+    search->size = aSize;
+    search->fileType = aFileType;
+    search->str = aString;
+    // Hubs relay the same search more than once, and impatient users repeat theirs
+    search->key = Util::toString((int64_t)(intptr_t)aClient) + ' ' + aSeeker + ' ' + Util::toString(aSearchType) + ' ' +
+        Util::toString(aSize) + ' ' + Util::toString(aFileType) + ' ' + aString;
+    add(search);
+}
+
+void SearchResponder::respond(Client* aClient, const AdcCommand& adc, const CID& from) {
+    Search* search = new Search;
+    search->client = aClient;
+    search->adc.reset(new AdcCommand(adc));
+    search->from = from;
+    search->key = Util::toString((int64_t)(intptr_t)aClient) + ' ' + adc.toString(from);
+    add(search);
+}
+
+void SearchResponder::add(Search* search) {
+    unique_ptr<Search> p(search);
+    {
+        Lock l(cs);
+        if(searches.size() >= MAX_QUEUED) {
+            stats.dropped++;
+            return;
+        }
+        if(!keys.insert(search->key).second) {
+            stats.duplicates++;
+            return;
+        }
+        search->tick = GET_TICK();
+        searches.push_back(move(p));
+    }
+    s.signal();
+}
+
+void SearchResponder::removeClient(Client* aClient) {
+    {
+        Lock l(cs);
+        for(auto i = searches.begin(); i != searches.end();) {
+            if((*i)->client == aClient) {
+                keys.erase((*i)->key);
+                i = searches.erase(i);
+            } else {
+                ++i;
+            }
+        }
+    }
+
+    // The client must outlive the answers being sent to it
+    while(true) {
+        {
+            Lock l(cs);
+            if(find(busy.begin(), busy.end(), aClient) == busy.end())
+                return;
+            waiting++;
+        }
+        finished.wait();
+    }
+}
+
+SearchResponder::Stats SearchResponder::getStats() const {
+    Lock l(cs);
+    Stats ret = stats;
+    ret.queued = searches.size();
+    return ret;
+}
+
+SearchResponder::Search* SearchResponder::next() {
+    while(true) {
+        s.wait();
+        if(stop)
+            return 0;
+
+        Lock l(cs);
+        // A search dropped by removeClient leaves its signal behind
+        if(searches.empty())
+            continue;
+
+        Search* search = searches.front().release();
+        searches.pop_front();
+        keys.erase(search->key);
+        busy.push_back(search->client);
+
+        uint64_t latency = GET_TICK() - search->tick;
+        stats.answered++;
+        stats.totalLatency += latency;
+        stats.maxLatency = max(stats.maxLatency, latency);
+        return search;
+    }
+}
+
+void SearchResponder::answer(Search& search) {
+    if(search.adc.get()) {
+        ClientManager::getInstance()->respond(search.client, *search.adc, search.from);
+    } else {
+        ClientManager::getInstance()->respond(search.client, search.seeker, search.searchType, search.size, search.fileType, search.str);
+    }
+}
+
+void SearchResponder::done(Search& search) {
+    Lock l(cs);
+    busy.erase(find(busy.begin(), busy.end(), search.client));
+    for(; waiting > 0; --waiting)
+        finished.signal();
+}
+
+int SearchResponder::Worker::run() {
+    setThreadName("SearchResponder");
+    while(true) {
+        unique_ptr<Search> search(responder.next());
+        if(!search.get())
+            break;
+
+        try {
+            responder.answer(*search);
+        } catch(const Exception& e) {
+            dcdebug("SearchResponder: %s\n", e.getError().c_str());
+        }
+        responder.done(*search);
+    }
+    return 0;
+}
+
+} // namespace dcpp
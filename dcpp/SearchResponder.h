@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2001-2012 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include "forward.h"
+#include "typedefs.h"
+#include "Singleton.h"
+#include "Thread.h"
+#include "Semaphore.h"
+#include "CriticalSection.h"
+#include "AdcCommand.h"
+#include "CID.h"
+
+#include <atomic>
+
+namespace dcpp {
+
+/**
+ * Answers incoming searches on a few threads of its own, so that searching the share, resolving
+ * the seeker and sending the results never hold up the hub connection a search came in on.
+ * Searches that are already waiting are not queued again, and when the workers fall behind,
+ * new searches are dropped rather than answered late.
+ */
+class SearchResponder : public Singleton<SearchResponder> {
+public:
+    struct Stats {
+        Stats() : queued(0), answered(0), duplicates(0), dropped(0), totalLatency(0), maxLatency(0) { }
+        /** Searches waiting to be answered */
+        size_t queued;
+        uint64_t answered;
+        uint64_t duplicates;
+        uint64_t dropped;
+        /** Milliseconds between a search coming in and a worker picking it up */
+        uint64_t totalLatency;
+        uint64_t maxLatency;
+    };
+
+    /** Queues an NMDC search, see ClientManager::respond */
+    void respond(Client* aClient, const string& aSeeker, int aSearchType, int64_t aSize, int aFileType, const string& aString);
+    /** Queues an ADC search, see ClientManager::respond */
+    void respond(Client* aClient, const AdcCommand& adc, const CID& from);
+
+    /** Forgets the searches from a hub that is going away, waiting for any being answered */
+    void removeClient(Client* aClient);
+
+    Stats getStats() const;
+
+private:
+    friend class Singleton<SearchResponder>;
+
+    enum {
+        WORKERS = 2,
+        /** Searches that may wait; many more and the seekers will have stopped listening anyway */
+        MAX_QUEUED = 500
+    };
+
+    struct Search {
+        Client* client;
+        string key;
+        uint64_t tick;
+
+        // NMDC
+        string seeker;
+        int searchType;
+        int64_t size;
+        int fileType;
+        string str;
+
+        // ADC
+        unique_ptr<AdcCommand> adc;
+        CID from;
+    };
+
+    class Worker : public Thread {
+    public:
+        Worker(SearchResponder& aResponder) : responder(aResponder) { }
+    private:
+        SearchResponder& responder;
+        virtual int run();
+    };
+
+    friend class Worker;
+
+    mutable CriticalSection cs;
+    deque<unique_ptr<Search> > searches;
+    /** Keys of the waiting searches */
+    unordered_set<string> keys;
+    /** Clients of the searches being answered */
+    vector<Client*> busy;
+    /** removeClient calls waiting for an answer to finish, each woken through finished */
+    int waiting;
+    Semaphore finished;
+    Stats stats;
+
+    Semaphore s;
+    std::atomic<bool> stop;
+    vector<unique_ptr<Worker> > workers;
+
+    SearchResponder();
+    virtual ~SearchResponder();
+
+    void add(Search* search);
+    /** @return The next search to answer, 0 when shutting down */
+    Search* next();
+    void answer(Search& search);
+    void done(Search& search);
+};
+
+} // namespace dcpp
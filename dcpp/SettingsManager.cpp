@@ -96,6 +96,7 @@ const string SettingsManager::settingTags[] =
     "IpFilter", "TextColor", "UseLua", "AllowNatt", "IpTOSValue", "SegmentSize",
     "BindIface", "MinimumSearchInterval", "EnableDynDNS", "AllowUploadOverMultiHubs",
     "UseADLOnlyOnOwnList", "AllowSimUploads", "CheckTargetsPathsOnStart", 
+    "HasherThreads", "HasherThreadsPerDevice", "HashFileThreads", "ShareMonitor", "ShareScanThreads",
     // Int64
     "TotalUpload", "TotalDownload",
     "SENTRY",
@@ -302,6 +303,11 @@ SettingsManager::SettingsManager()
     setDefault(USE_ADL_ONLY_OWN_LIST, false);
     setDefault(ALLOW_SIM_UPLOADS, true);
     setDefault(CHECK_TARGETS_PATHS_ON_START, false);
+    setDefault(HASHER_THREADS, 0); // one per processor
+    setDefault(HASHER_THREADS_PER_DEVICE, 1);
+    setDefault(HASH_FILE_THREADS, 1); // threads per file of 64 MiB and more
+    setDefault(SHARE_MONITOR, true);
+    setDefault(SHARE_SCAN_THREADS, 0); // one per processor
     setSearchTypeDefaults();
 }
 
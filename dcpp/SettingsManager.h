@@ -114,6 +114,7 @@ public:
         IPFILTER, TEXT_COLOR, USE_LUA, ALLOW_NATT, IP_TOS_VALUE, SEGMENT_SIZE,
         BIND_IFACE, MINIMUM_SEARCH_INTERVAL, DYNDNS_ENABLE, ALLOW_UPLOAD_MULTI_HUB,
         USE_ADL_ONLY_OWN_LIST, ALLOW_SIM_UPLOADS, CHECK_TARGETS_PATHS_ON_START,
+        HASHER_THREADS, HASHER_THREADS_PER_DEVICE, HASH_FILE_THREADS, SHARE_MONITOR, SHARE_SCAN_THREADS,
         INT_LAST };
 
     enum Int64Setting { INT64_FIRST = INT_LAST + 1,
@@ -48,13 +48,18 @@
 #include <unistd.h>
 #include <fnmatch.h>
 #endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
 
 #include <limits>
 
 namespace dcpp {
 
 ShareManager::ShareManager() : hits(0), xmlListLen(0), bzXmlListLen(0),
-    xmlDirty(true), forceXmlRefresh(false), refreshDirs(false), update(false), initial(true), listN(0), refreshing(false),
+    xmlDirty(true), forceXmlRefresh(false), refreshDirs(false), update(false), initial(true), listN(0),
+    listGeneration(0), xmlListUsed(0), partialListsSize(0), partialListsGeneration(0), refreshing(false),
     lastXmlUpdate(0), lastFullUpdate(GET_TICK()), bloom(1<<20)
 {
     SettingsManager::getInstance()->addListener(this);
@@ -69,6 +74,7 @@ ShareManager::~ShareManager() {
     QueueManager::getInstance()->removeListener(this);
     HashManager::getInstance()->removeListener(this);
 
+    monitor.shutdown();
     join();
 
     if(bzXmlRef.get()) {
@@ -77,12 +83,67 @@ ShareManager::~ShareManager() {
     }
 }
 
+namespace {
+
+/** The name pool and file order of the trees being built, see Directory::newGeneration */
+FastCriticalSection generationCs;
+StringPool::Ptr generationNames;
+bool generationCaseSensitive = false;
+
+} // unnamed namespace
+
 ShareManager::Directory::Directory(const string& aName, const ShareManager::Directory::Ptr& aParent) :
     size(0),
-    name(aName),
     parent(aParent.get()),
     fileTypes(1 << SearchManager::TYPE_DIRECTORY)
 {
+    setName(aName);
+
+    if(aParent) {
+        names = aParent->names;
+        files = File::Set(File::FileLess(aParent->isCaseSensitive()));
+    } else {
+        FastLock l(generationCs);
+        if(!generationNames)
+            generationNames = new StringPool;
+        names = generationNames;
+        files = File::Set(File::FileLess(generationCaseSensitive));
+    }
+}
+
+void ShareManager::Directory::newGeneration(bool caseSensitive) {
+    FastLock l(generationCs);
+    generationNames = new StringPool;
+    generationCaseSensitive = caseSensitive;
+}
+
+void ShareManager::Directory::File::setName(const string& aName) {
+    StringPool& names = parent->getNames();
+    name = names.add(aName);
+
+    string lower;
+    Text::toLower(aName, lower);
+    lowerName = (lower == aName) ? name : names.add(lower);
+}
+
+void ShareManager::Directory::File::setParent(Directory* aParent) {
+    if(&aParent->getNames() != &parent->getNames()) {
+        // Files merged in from another tree generation
+        StringPool& names = aParent->getNames();
+        const bool folded = (lowerName == name);
+        const StringPool::Id newName = names.add(getName());
+        lowerName = folded ? newName : names.add(getLowerName());
+        name = newName;
+    }
+    parent = aParent;
+}
+
+void ShareManager::Directory::foldName(const string& aName, string& lower) {
+    Text::toLower(aName, lower);
+    if(lower == aName) {
+        // Most names are, no need to keep them twice
+        string().swap(lower);
+    }
 }
 
 string ShareManager::Directory::getADCPath() const noexcept {
@@ -150,14 +211,16 @@ string ShareManager::toVirtual(const TTHValue& tth) const {
 }
 
 string ShareManager::toReal(const string& virtualFile) {
-    Lock l(cs);
     if(virtualFile == "MyList.DcLst") {
         throw ShareException("NMDC-style lists no longer supported, please upgrade your client");
     } else if(virtualFile == Transfer::USER_LIST_NAME_BZ || virtualFile == Transfer::USER_LIST_NAME) {
+        // Must not hold cs, the list is generated without it
         generateXmlList();
+        Lock l(cs);
         return getBZXmlFile();
     }
 
+    Lock l(cs);
     return findFile(virtualFile)->getRealPath();
 }
 
@@ -167,10 +230,9 @@ StringList ShareManager::getRealPaths(const string& virtualPath) {
 
     StringList ret;
 
-    Lock l(cs);
-
     if(*(virtualPath.end() - 1) == '/') {
         // directory
+        Lock l(cs);
         Directory::Ptr d = splitVirtual(virtualPath).first;
 
         // imitate Directory::getRealPath
@@ -227,6 +289,7 @@ MemoryInputStream* ShareManager::getTree(const string& virtualFile) const {
 AdcCommand ShareManager::getFileInfo(const string& aFile) {
     if(aFile == Transfer::USER_LIST_NAME) {
         generateXmlList();
+        Lock l(cs);
         AdcCommand cmd(AdcCommand::CMD_RES);
         cmd.addParam("FN", aFile);
         cmd.addParam("SI", Util::toString(xmlListLen));
@@ -234,6 +297,7 @@ AdcCommand ShareManager::getFileInfo(const string& aFile) {
         return cmd;
     } else if(aFile == Transfer::USER_LIST_NAME_BZ) {
         generateXmlList();
+        Lock l(cs);
 
         AdcCommand cmd(AdcCommand::CMD_RES);
         cmd.addParam("FN", aFile);
@@ -299,8 +363,7 @@ ShareManager::Directory::File::Set::const_iterator ShareManager::findFile(const
     }
 
     auto v = splitVirtual(virtualFile);
-    auto it = find_if(v.first->files.begin(), v.first->files.end(),
-            Directory::File::StringComp(v.second));
+    auto it = v.first->findFile(v.second);
     if(it == v.first->files.end())
         throw ShareException(UserConnection::FILE_NOT_AVAILABLE);
     return it;
@@ -413,7 +476,7 @@ bool ShareManager::loadCache() noexcept {
         SimpleXMLReader xml(&loader);
 
         dcpp::File ff(Util::getPath(Util::PATH_USER_CONFIG) + "files.xml.bz2", dcpp::File::READ, dcpp::File::OPEN);
-        FilteredInputStream<UnBZFilter, false> f(&ff);
+        FilteredInputStream<ParallelUnBZFilter, false> f(&ff);
 
         xml.parse(f);
 
@@ -546,6 +609,7 @@ void ShareManager::removeDirectory(const string& realPath) {
         return;
 
     HashManager::getInstance()->stopHashing(realPath);
+    monitor.unwatch(realPath);
 
     Lock l(cs);
 
@@ -622,9 +686,116 @@ size_t ShareManager::getSharedFiles() const noexcept {
     return tthIndex.size();
 }
 
-ShareManager::Directory::Ptr ShareManager::buildTree(const string& aName, const Directory::Ptr& aParent) {
+/**
+ * Lists directories on a pool of threads, one directory per task. Each directory is only
+ * ever filled in by the task that lists it, and subdirectories are added to their parent
+ * in listing order before being queued, so the tree comes out the same as a serial walk.
+ */
+class ShareManager::TreeBuilder {
+public:
+    TreeBuilder(ShareManager& aSm) : sm(aSm), pending(0) { }
+
+    void build(const string& aName, const Directory::Ptr& dir, unsigned threads) {
+        queue.push_back(make_pair(aName, dir));
+        pending = 1;
+
+        vector<unique_ptr<Worker> > workers;
+        for(unsigned i = 1; i < threads; ++i) {
+            workers.push_back(unique_ptr<Worker>(new Worker(*this)));
+            try {
+                workers.back()->start();
+            } catch(const ThreadException&) {
+                workers.pop_back();
+                break;
+            }
+        }
+
+        s.signal();
+        work();
+
+        for(auto i = workers.begin(); i != workers.end(); ++i) {
+            (*i)->join();
+        }
+    }
+
+private:
+    class Worker : public Thread {
+    public:
+        Worker(TreeBuilder& aBuilder) : builder(aBuilder) { }
+        virtual int run() {
+            setThreadName("ShareScanner");
+            builder.work();
+            return 0;
+        }
+    private:
+        TreeBuilder& builder;
+    };
+
+    void work() {
+        ScanList subdirs;
+        for(;;) {
+            s.wait();
+
+            ScanList::value_type task;
+            {
+                Lock l(cs);
+                if(queue.empty()) {
+                    // Only happens once everything has been listed
+                    s.signal();
+                    return;
+                }
+                // Depth first, to keep the queue short
+                task = queue.back();
+                queue.pop_back();
+            }
+
+            subdirs.clear();
+            sm.scanDirectory(task.first, task.second, subdirs);
+
+            Lock l(cs);
+            queue.insert(queue.end(), subdirs.rbegin(), subdirs.rend());
+            pending += subdirs.size();
+            if(--pending == 0) {
+                s.signal();
+            } else {
+                for(size_t i = 0; i < subdirs.size(); ++i) {
+                    s.signal();
+                }
+            }
+        }
+    }
+
+    ShareManager& sm;
+    ScanList queue;
+    /** Directories queued or being listed */
+    size_t pending;
+    CriticalSection cs;
+    Semaphore s;
+};
+
+ShareManager::Directory::Ptr ShareManager::buildTree(const string& aName, const Directory::Ptr& aParent, bool recurse) {
     auto dir = Directory::create(Util::getLastDir(aName), aParent);
 
+    if(recurse) {
+        int threads = SETTING(SHARE_SCAN_THREADS);
+        TreeBuilder(*this).build(aName, dir, threads > 0 ? threads : Thread::getProcessorCount());
+    } else {
+        // Subdirectories are left empty, for the caller to fill in
+        ScanList subdirs;
+        scanDirectory(aName, dir, subdirs);
+    }
+
+    return dir;
+}
+
+/**
+ * Lists the files of a single directory into dir; subdirectories are added empty and
+ * returned in subdirs along with their real path.
+ */
+void ShareManager::scanDirectory(const string& aName, const Directory::Ptr& dir, ScanList& subdirs) {
+    // Watch before listing so that nothing created meanwhile goes unnoticed
+    monitor.watch(aName);
+
     auto lastFileIter = dir->files.begin();
 
     FileFindIter end;
@@ -667,7 +838,9 @@ ShareManager::Directory::Ptr ShareManager::buildTree(const string& aName, const
             if((Util::stricmp(newName, SETTING(TEMP_DOWNLOAD_DIRECTORY)) != 0)
                     && (Util::stricmp(newName, Util::getPath(Util::PATH_USER_CONFIG)) != 0)
                     && (Util::stricmp(newName, SETTING(LOG_DIRECTORY)) != 0)) {
-                dir->directories[name] = buildTree(newName, dir);
+                auto sub = Directory::create(name, dir);
+                dir->directories[name] = sub;
+                subdirs.push_back(make_pair(newName, sub));
             }
         } else {
             // Not a directory, assume it's a file...make sure we're not sharing the settings file...
@@ -693,8 +866,6 @@ ShareManager::Directory::Ptr ShareManager::buildTree(const string& aName, const
             }
         }
     }
-
-    return dir;
 }
 
 //NOTE: freedcpp [+
@@ -735,7 +906,8 @@ bool ShareManager::checkHidden(const string& aName) const
 //NOTE: freedcpp +]
 
 void ShareManager::updateIndices(Directory& dir) {
-    bloom.add(Text::toLower(dir.getName()));
+    bloom.add(dir.getLowerName());
+    nameIndex.add(dir);
 
     for(auto i = dir.directories.begin(); i != dir.directories.end(); ++i) {
         updateIndices(*i->second);
@@ -751,6 +923,7 @@ void ShareManager::updateIndices(Directory& dir) {
 void ShareManager::rebuildIndices() {
     tthIndex.clear();
     bloom.clear();
+    nameIndex.clear();
 
     for(auto i = directories.begin(); i != directories.end(); ++i) {
         updateIndices(**i);
@@ -768,7 +941,8 @@ void ShareManager::updateIndices(Directory& dir, const Directory::File::Set::ite
             try {
                 LogManager::getInstance()->message(str(F_("Duplicate file will not be shared: %1% (Size: %2% B) Dupe matched against: %3%")
                 % Util::addBrackets(dir.getRealPath(f.getName())) % Util::toString(f.getSize()) % Util::addBrackets(j->second->getParent()->getRealPath(j->second->getName()))));
-            dir.files.erase(i);
+                nameIndex.remove(f);
+                dir.files.erase(i);
             } catch (const ShareException&) { }
             return;
         }
@@ -777,7 +951,8 @@ void ShareManager::updateIndices(Directory& dir, const Directory::File::Set::ite
     dir.addType(getType(f.getName()));
 
     tthIndex.insert(make_pair(f.getTTH(), i));
-    bloom.add(Text::toLower(f.getName()));
+    bloom.add(f.getLowerName());
+    nameIndex.add(f);
 #ifdef WITH_DHT
     dht::IndexManager* im = dht::IndexManager::getInstance();
     if(im && im->isTimeForPublishing())
@@ -785,6 +960,326 @@ void ShareManager::updateIndices(Directory& dir, const Directory::File::Set::ite
 #endif
 }
 
+void ShareManager::removeFile(Directory& dir, const Directory::File::Set::iterator& i) {
+    auto j = tthIndex.find(i->getTTH());
+    if(j != tthIndex.end() && j->second == i) {
+        // A duplicate of this file elsewhere stays unindexed until the next full refresh
+        tthIndex.erase(j);
+        dir.size -= i->getSize();
+    }
+    nameIndex.remove(*i);
+    dir.files.erase(i);
+}
+
+void ShareManager::removeIndices(Directory& dir) {
+    nameIndex.remove(dir);
+
+    for(auto i = dir.directories.begin(); i != dir.directories.end(); ++i) {
+        removeIndices(*i->second);
+    }
+
+    for(auto i = dir.files.begin(); i != dir.files.end(); ++i) {
+        auto j = tthIndex.find(i->getTTH());
+        if(j != tthIndex.end() && j->second == i) {
+            tthIndex.erase(j);
+        }
+        nameIndex.remove(*i);
+    }
+}
+
+void ShareManager::indexNames(Directory& dir) {
+    nameIndex.add(dir);
+
+    for(auto i = dir.directories.begin(); i != dir.directories.end(); ++i) {
+        indexNames(*i->second);
+    }
+
+    for(auto i = dir.files.begin(); i != dir.files.end(); ++i) {
+        nameIndex.add(*i);
+    }
+}
+
+/**
+ * Brings dir in line with scanned, a fresh non-recursive scan of the same directory whose
+ * new subdirectories have been built in full. Removed names stay in the bloom filter and
+ * the type flags, which only costs a few wasted lookups until the next full refresh.
+ * @return Whether anything changed
+ */
+bool ShareManager::applyChanges(Directory& dir, const Directory& scanned) {
+    bool changed = false;
+
+    for(auto i = dir.files.begin(); i != dir.files.end(); ) {
+        auto j = scanned.files.find(*i);
+        if(j == scanned.files.end() || j->getSize() != i->getSize() || j->getTTH() != i->getTTH()) {
+            removeFile(dir, i++);
+            changed = true;
+        } else {
+            ++i;
+        }
+    }
+
+    for(auto i = scanned.files.begin(); i != scanned.files.end(); ++i) {
+        if(dir.files.find(*i) != dir.files.end())
+            continue;
+
+        auto added = dir.files.insert(*i);
+        const_cast<Directory::File&>(*added.first).setParent(&dir);
+        updateIndices(dir, added.first);
+        changed = true;
+    }
+
+    for(auto i = dir.directories.begin(); i != dir.directories.end(); ) {
+        if(scanned.directories.find(i->first) == scanned.directories.end()) {
+            removeIndices(*i->second);
+            dir.directories.erase(i++);
+            changed = true;
+        } else {
+            ++i;
+        }
+    }
+
+    for(auto i = scanned.directories.begin(); i != scanned.directories.end(); ++i) {
+        if(dir.directories.find(i->first) != dir.directories.end())
+            continue;
+
+        i->second->setParent(&dir);
+        dir.directories[i->first] = i->second;
+        updateIndices(*i->second);
+        changed = true;
+    }
+
+    if(nameIndex.isFragmented()) {
+        nameIndex.clear();
+        for(auto i = directories.begin(); i != directories.end(); ++i) {
+            indexNames(**i);
+        }
+    }
+
+    return changed;
+}
+
+/**
+ * Rescans the given real directories (not their subdirectories, unless new) and applies
+ * the differences to the tree in place, instead of rebuilding the whole share.
+ */
+void ShareManager::refreshChanged(const StringList& realDirs) {
+    bool changed = false;
+    bool full = false;
+
+    {
+        Lock rl(refreshCs);
+        for(auto i = realDirs.begin(); i != realDirs.end() && !full; ++i) {
+            const string& path = *i;
+
+            {
+                Lock l(cs);
+                // Several real directories merged into one virtual root can't be told apart
+                // in the tree, so a partial rescan of one of them would drop the others' files
+                for(auto j = shares.begin(); j != shares.end(); ++j) {
+                    if(Util::strnicmp(path, j->first, j->first.length()) != 0)
+                        continue;
+                    for(auto k = shares.begin(); k != shares.end(); ++k) {
+                        if(k != j && Util::stricmp(k->second, j->second) == 0)
+                            full = true;
+                    }
+                    break;
+                }
+                if(full || !getDirectory(path))
+                    continue;
+            }
+
+            if(!checkHidden(path))
+                continue;
+
+            Directory::Ptr scanned = buildTree(path, Directory::Ptr(), false);
+
+            StringList added;
+            {
+                Lock l(cs);
+                Directory::Ptr d = getDirectory(path);
+                if(!d)
+                    continue;
+                for(auto j = scanned->directories.begin(); j != scanned->directories.end(); ++j) {
+                    if(d->directories.find(j->first) == d->directories.end())
+                        added.push_back(j->first);
+                }
+            }
+
+            for(auto j = added.begin(); j != added.end(); ++j) {
+                scanned->directories[*j] = buildTree(path + *j + PATH_SEPARATOR, scanned);
+            }
+
+            {
+                Lock l(cs);
+                Directory::Ptr d = getDirectory(path);
+                if(d && applyChanges(*d, *scanned)) {
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    if(full) {
+        refresh(true);
+        return;
+    }
+
+    if(changed) {
+        setDirty();
+        ClientManager::getInstance()->infoUpdated();
+    }
+}
+
+ShareManager::Monitor::Monitor() : fd(-1), stop(false) {
+}
+
+ShareManager::Monitor::~Monitor() {
+    shutdown();
+}
+
+void ShareManager::Monitor::enable() {
+#ifdef __linux__
+    Lock l(cs);
+    if(fd != -1)
+        return;
+
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(fd == -1) {
+        LogManager::getInstance()->message(str(F_("Share monitoring unavailable: %1%") % Util::translateError(errno)));
+        return;
+    }
+
+    stop = false;
+    try {
+        start();
+    } catch(const ThreadException& e) {
+        LogManager::getInstance()->message(str(F_("Share monitoring unavailable: %1%") % e.getError()));
+        ::close(fd);
+        fd = -1;
+    }
+#endif
+}
+
+void ShareManager::Monitor::shutdown() {
+    stop = true;
+    join();
+
+#ifdef __linux__
+    Lock l(cs);
+    if(fd != -1) {
+        ::close(fd);
+        fd = -1;
+    }
+    watches.clear();
+#endif
+}
+
+void ShareManager::Monitor::watch(const string& aDir) {
+#ifdef __linux__
+    Lock l(cs);
+    if(fd == -1)
+        return;
+
+    uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ONLYDIR;
+    if(!BOOLSETTING(FOLLOW_LINKS))
+        mask |= IN_DONT_FOLLOW;
+
+    int wd = inotify_add_watch(fd, Text::fromUtf8(aDir).c_str(), mask);
+    if(wd == -1) {
+        if(errno == ENOSPC) {
+            // Out of watches (fs.inotify.max_user_watches); changes below this directory will
+            // only be seen by full refreshes
+            dcdebug("Can't monitor %s: watch limit reached\n", aDir.c_str());
+        }
+        return;
+    }
+    watches[wd] = aDir;
+#endif
+}
+
+void ShareManager::Monitor::unwatch(const string& aPath) {
+#ifdef __linux__
+    Lock l(cs);
+    for(auto i = watches.begin(); i != watches.end(); ) {
+        if(Util::strnicmp(i->second, aPath, aPath.length()) == 0) {
+            inotify_rm_watch(fd, i->first);
+            watches.erase(i++);
+        } else {
+            ++i;
+        }
+    }
+#endif
+}
+
+int ShareManager::Monitor::run() {
+    setThreadName("ShareMonitor");
+
+#ifdef __linux__
+    // Changes are applied once the directories have been quiet for a second, or after
+    // ten seconds at most when they never are (long copies into the share)
+    const int QUIET = 1000;
+    const uint64_t MAX_DELAY = 10 * 1000;
+
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(inotify_event))));
+    set<string> changed;
+    bool overflow = false;
+    uint64_t first = 0;
+
+    while(!stop) {
+        pollfd p = { fd, POLLIN, 0 };
+        if(poll(&p, 1, QUIET) > 0) {
+            ssize_t len;
+            while((len = ::read(fd, buf, sizeof(buf))) > 0) {
+                Lock l(cs);
+                for(char* ptr = buf; ptr < buf + len; ) {
+                    const inotify_event* ev = reinterpret_cast<const inotify_event*>(ptr);
+                    ptr += sizeof(inotify_event) + ev->len;
+
+                    if(ev->mask & IN_Q_OVERFLOW) {
+                        overflow = true;
+                        continue;
+                    }
+
+                    auto i = watches.find(ev->wd);
+                    if(i == watches.end())
+                        continue;
+
+                    if(ev->mask & IN_IGNORED) {
+                        // The directory is gone; its parent reports the removal
+                        watches.erase(i);
+                    } else {
+                        changed.insert(i->second);
+                    }
+                }
+            }
+
+            if(!first && (overflow || !changed.empty()))
+                first = GET_TICK();
+            if(!first || GET_TICK() - first < MAX_DELAY)
+                continue;
+        }
+
+        if(ShareManager::getInstance()->isRefreshing()) {
+            // Kept for when it is done: the running refresh may have passed the changes already
+            continue;
+        }
+
+        if(overflow) {
+            // Events were lost, only a full refresh can tell what changed
+            ShareManager::getInstance()->refresh(true);
+        } else if(!changed.empty()) {
+            ShareManager::getInstance()->refreshChanged(StringList(changed.begin(), changed.end()));
+        }
+
+        changed.clear();
+        overflow = false;
+        first = 0;
+    }
+#endif
+
+    return 0;
+}
+
 void ShareManager::refresh(bool dirs /* = false */, bool aUpdate /* = true */, bool block /* = false */) noexcept {
     if(refreshing.exchange(true) == true) {
         LogManager::getInstance()->message(_("File list refresh in progress, please wait for it to finish before trying to refresh again"));
@@ -797,8 +1292,11 @@ void ShareManager::refresh(bool dirs /* = false */, bool aUpdate /* = true */, b
     join();
     bool cached = false;
     if(initial) {
+        Directory::newGeneration(BOOLSETTING(CASESENSITIVE_FILELIST));
         cached = loadCache();
         initial = false;
+        if(BOOLSETTING(SHARE_MONITOR))
+            monitor.enable();
     }
     try {
         start();
@@ -830,11 +1328,15 @@ int ShareManager::run() {
         refreshDirs = false;
 
     if(refreshDirs) {
+        Lock rl(refreshCs);
         HashManager::HashPauser pauser;
         LogManager::getInstance()->message(_("File list refresh initiated"));
 
         lastFullUpdate = GET_TICK();
 
+        // The new tree gets its own name pool, so that the names of the old one go away with it
+        Directory::newGeneration(BOOLSETTING(CASESENSITIVE_FILELIST));
+
         DirList newDirs;
         for(auto i = dirs.begin(); i != dirs.end(); ++i) {
             if (checkHidden(i->second)) {
@@ -853,6 +1355,7 @@ int ShareManager::run() {
             }
 
             rebuildIndices();
+            listGeneration++;
         }
         refreshDirs = false;
 
@@ -885,127 +1388,214 @@ void ShareManager::getBloom(ByteVector& v, size_t k, size_t m, size_t h) const {
 }
 
 void ShareManager::generateXmlList() {
-    Lock l(cs);
-    if(forceXmlRefresh || (xmlDirty && (lastXmlUpdate + 15 * 60 * 1000 < GET_TICK() || lastXmlUpdate < lastFullUpdate))) {
-        listN++;
+    // Only one list is generated at a time; the share lock is only held to serialize the tree
+    Lock ll(listCs);
 
-        try {
-            string tmp2;
-            string indent;
+    string newXmlName;
+    {
+        Lock l(cs);
+        if(!(forceXmlRefresh || (xmlDirty && (lastXmlUpdate + 15 * 60 * 1000 < GET_TICK() || lastXmlUpdate < lastFullUpdate))))
+            return;
+
+        // Changes made from now on will dirty the list again
+        xmlDirty = false;
+        forceXmlRefresh = false;
+        lastXmlUpdate = GET_TICK();
+
+        listN++;
+        newXmlName = Util::getPath(Util::PATH_USER_CONFIG) + "files" + Util::toString(listN) + ".xml.bz2";
+    }
 
-            string newXmlName = Util::getPath(Util::PATH_USER_CONFIG) + "files" + Util::toString(listN) + ".xml.bz2";
+    try {
+        int64_t newXmlListLen;
+        TTHValue newXmlRoot, newBzXmlRoot;
+        {
+            File f(newXmlName, File::WRITE, File::TRUNCATE | File::CREATE);
+            // We don't care about the leaves...
+            CalcOutputStream<TTFilter<1024*1024*1024>, false> bzTree(&f);
+            FilteredOutputStream<ParallelBZFilter, false> bzipper(&bzTree);
+            CountOutputStream<false> count(&bzipper);
+            CalcOutputStream<TTFilter<1024*1024*1024>, false> newXmlFile(&count);
+
+            newXmlFile.write(SimpleXML::utf8Header);
+            newXmlFile.write("<FileListing Version=\"1\" CID=\"" + ClientManager::getInstance()->getMe()->getCID().toBase32() + "\" Base=\"/\" Generator=\"" APPNAME " " VERSIONSTRING "\">\r\n");
+
+            // Snapshot all roots at once, so that a refresh can't leave the list with some roots from
+            // before it and some from after, then compress without blocking the share
+            string xml, tmp2, indent;
             {
-                File f(newXmlName, File::WRITE, File::TRUNCATE | File::CREATE);
-                // We don't care about the leaves...
-                CalcOutputStream<TTFilter<1024*1024*1024>, false> bzTree(&f);
-                FilteredOutputStream<BZFilter, false> bzipper(&bzTree);
-                CountOutputStream<false> count(&bzipper);
-                CalcOutputStream<TTFilter<1024*1024*1024>, false> newXmlFile(&count);
-
-                newXmlFile.write(SimpleXML::utf8Header);
-                newXmlFile.write("<FileListing Version=\"1\" CID=\"" + ClientManager::getInstance()->getMe()->getCID().toBase32() + "\" Base=\"/\" Generator=\"" APPNAME " " VERSIONSTRING "\">\r\n");
+                Lock l(cs);
+                StringOutputStream sos(xml);
                 for(auto i = directories.begin(); i != directories.end(); ++i) {
-                    (*i)->toXml(newXmlFile, indent, tmp2, true);
+                    (*i)->toXml(sos, indent, tmp2, true);
                 }
-                newXmlFile.write("</FileListing>");
-                newXmlFile.flush();
-
-                xmlListLen = count.getCount();
+            }
+            newXmlFile.write(xml);
+            string().swap(xml);
+            newXmlFile.write("</FileListing>");
+            newXmlFile.flush();
 
-                newXmlFile.getFilter().getTree().finalize();
-                bzTree.getFilter().getTree().finalize();
+            newXmlListLen = count.getCount();
 
-                xmlRoot = newXmlFile.getFilter().getTree().getRoot();
-                bzXmlRoot = bzTree.getFilter().getTree().getRoot();
-            }
-            const string XmlListFileName = Util::getPath(Util::PATH_USER_CONFIG) + "files.xml.bz2";
-            if(bzXmlRef.get()) {
-                bzXmlRef.reset();
-                try {
-                    File::renameFile(XmlListFileName, XmlListFileName + ".bak");
-                } catch(const FileException&) { }
-            }
+            newXmlFile.getFilter().getTree().finalize();
+            bzTree.getFilter().getTree().finalize();
 
+            newXmlRoot = newXmlFile.getFilter().getTree().getRoot();
+            newBzXmlRoot = bzTree.getFilter().getTree().getRoot();
+        }
+        const string XmlListFileName = Util::getPath(Util::PATH_USER_CONFIG) + "files.xml.bz2";
+        if(bzXmlRef.get()) {
+            bzXmlRef.reset();
             try {
-                File::renameFile(newXmlName, XmlListFileName);
-                newXmlName = XmlListFileName;
-            } catch(const FileException&) {
-                // Ignore, this is for caching only...
-            }
-            try {
-                File::copyFile(XmlListFileName, XmlListFileName + ".bak");
+                File::renameFile(XmlListFileName, XmlListFileName + ".bak");
             } catch(const FileException&) { }
-            bzXmlRef = unique_ptr<File>(new File(newXmlName, File::READ, File::OPEN));
+        }
+
+        try {
+            File::renameFile(newXmlName, XmlListFileName);
+            newXmlName = XmlListFileName;
+        } catch(const FileException&) {
+            // Ignore, this is for caching only...
+        }
+        try {
+            File::copyFile(XmlListFileName, XmlListFileName + ".bak");
+        } catch(const FileException&) { }
+        bzXmlRef = unique_ptr<File>(new File(newXmlName, File::READ, File::OPEN));
+
+        {
+            Lock l(cs);
+            xmlListLen = newXmlListLen;
+            xmlRoot = newXmlRoot;
+            bzXmlRoot = newBzXmlRoot;
             setBZXmlFile(newXmlName);
             bzXmlListLen = File::getSize(newXmlName);
-            LogManager::getInstance()->message(str(F_("File list %1% generated") % Util::addBrackets(bzXmlFile)));
-        } catch(const Exception&) {
-            // No new file lists...
         }
+        LogManager::getInstance()->message(str(F_("File list %1% generated") % Util::addBrackets(newXmlName)));
+    } catch(const Exception&) {
+        // No new file lists...
+    }
+}
 
-        xmlDirty = false;
-        forceXmlRefresh = false;
-        lastXmlUpdate = GET_TICK();
+ShareManager::ListPtr ShareManager::getXmlList() {
+    generateXmlList();
+
+    string bzFile;
+    TTHValue root;
+    {
+        Lock l(cs);
+        bzFile = getBZXmlFile();
+        root = bzXmlRoot;
+    }
+
+    // Others asking meanwhile wait for this unpacking instead of doing their own
+    Lock l(listCacheCs);
+    if(!xmlList || xmlListBzRoot != root) {
+        xmlList.reset();
+
+        string bz2 = File(bzFile, File::READ, File::OPEN).read();
+        std::shared_ptr<string> xml = std::make_shared<string>();
+        CryptoManager::getInstance()->decodeBZ2(reinterpret_cast<const uint8_t*>(bz2.data()), bz2.size(), *xml);
+
+        xmlList = xml;
+        xmlListBzRoot = root;
     }
+    xmlListUsed = GET_TICK();
+    return xmlList;
 }
 
-MemoryInputStream* ShareManager::generatePartialList(const string& dir, bool recurse) const {
+ShareManager::ListPtr ShareManager::generatePartialList(const string& dir, bool recurse) const {
     if(dir[0] != '/' || dir[dir.size()-1] != '/')
-        return 0;
+        return ListPtr();
 
-    string xml = SimpleXML::utf8Header;
+    string key = dir + (recurse ? '+' : '-');
+    {
+        Lock l(listCacheCs);
+        if(partialListsGeneration == listGeneration) {
+            auto i = partialLists.find(key);
+            if(i != partialLists.end())
+                return i->second;
+        }
+    }
+
+    std::shared_ptr<string> ret = std::make_shared<string>(SimpleXML::utf8Header);
+    string& xml = *ret;
     string tmp;
     xml += "<FileListing Version=\"1\" CID=\"" + ClientManager::getInstance()->getMe()->getCID().toBase32() + "\" Base=\"" + SimpleXML::escape(dir, tmp, false) + "\" Generator=\"" APPNAME " " VERSIONSTRING "\">\r\n";
     StringOutputStream sos(xml);
     string indent = "\t";
 
-    Lock l(cs);
-    if(dir == "/") {
-        for(auto i = directories.begin(); i != directories.end(); ++i) {
-            tmp.clear();
-            (*i)->toXml(sos, indent, tmp, recurse);
-        }
-    } else {
-        string::size_type i = 1, j = 1;
+    uint32_t generation;
+    {
+        Lock l(cs);
+        generation = listGeneration;
+        if(dir == "/") {
+            for(auto i = directories.begin(); i != directories.end(); ++i) {
+                tmp.clear();
+                (*i)->toXml(sos, indent, tmp, recurse);
+            }
+        } else {
+            string::size_type i = 1, j = 1;
 
-        Directory::Ptr root;
+            Directory::Ptr root;
 
-        bool first = true;
-        while( (i = dir.find('/', j)) != string::npos) {
-            if(i == j) {
-                j++;
-                continue;
-            }
+            bool first = true;
+            while( (i = dir.find('/', j)) != string::npos) {
+                if(i == j) {
+                    j++;
+                    continue;
+                }
 
-            if(first) {
-                first = false;
-                auto it = getByVirtual(dir.substr(j, i-j));
+                if(first) {
+                    first = false;
+                    auto it = getByVirtual(dir.substr(j, i-j));
 
-                if(it == directories.end())
-                    return 0;
-                root = *it;
+                    if(it == directories.end())
+                        return ListPtr();
+                    root = *it;
 
-            } else {
-                auto it2 = root->directories.find(dir.substr(j, i-j));
-                if(it2 == root->directories.end()) {
-                    return 0;
+                } else {
+                    auto it2 = root->directories.find(dir.substr(j, i-j));
+                    if(it2 == root->directories.end()) {
+                        return ListPtr();
+                    }
+                    root = it2->second;
                 }
-                root = it2->second;
+                j = i + 1;
             }
-            j = i + 1;
-        }
 
-        if(!root)
-            return 0;
+            if(!root)
+                return ListPtr();
 
-        for(auto it2 = root->directories.begin(); it2 != root->directories.end(); ++it2) {
-            it2->second->toXml(sos, indent, tmp, recurse);
+            for(auto it2 = root->directories.begin(); it2 != root->directories.end(); ++it2) {
+                it2->second->toXml(sos, indent, tmp, recurse);
+            }
+            root->filesToXml(sos, indent, tmp);
         }
-        root->filesToXml(sos, indent, tmp);
     }
 
     xml += "</FileListing>";
-    return new MemoryInputStream(xml);
+
+    {
+        Lock l(listCacheCs);
+        if(partialListsGeneration != generation) {
+            // Lists made before the share changed have to go; ones made since are kept
+            if(generation < partialListsGeneration)
+                return ret;
+            partialLists.clear();
+            partialListsSize = 0;
+            partialListsGeneration = generation;
+        }
+
+        if(partialListsSize + xml.size() > PARTIAL_LIST_CACHE_SIZE) {
+            partialLists.clear();
+            partialListsSize = 0;
+        }
+
+        if(partialLists.insert(make_pair(key, ret)).second)
+            partialListsSize += xml.size();
+    }
+
+    return ret;
 }
 
 #define LITERAL(n) n, sizeof(n)-1
@@ -1174,37 +1764,228 @@ SearchManager::TypeModes ShareManager::getType(const string& aFileName) const no
     return SearchManager::TYPE_ANY;
 }
 
+namespace {
+    inline bool isWordChar(char c) { return (uint8_t)c >= 0x80 || isalnum((uint8_t)c); }
+
+    /** Splits a (lowercase) name into words: runs of letters and digits, any non-ASCII byte included */
+    void splitWords(const string& aText, StringList& words) {
+        string::size_type i = 0;
+        while(i < aText.size()) {
+            while(i < aText.size() && !isWordChar(aText[i]))
+                ++i;
+            string::size_type j = i;
+            while(j < aText.size() && isWordChar(aText[j]))
+                ++j;
+            if(j > i)
+                words.push_back(aText.substr(i, j - i));
+            i = j;
+        }
+    }
+}
+
+void ShareManager::NameIndex::clear() {
+    entries.clear();
+    // Id 0 means "not indexed"
+    entries.push_back(Entry(0, 0));
+    vocabulary.clear();
+    postings.clear();
+    wordIds.clear();
+    suffixes.clear();
+    sorted = 0;
+    dead = 0;
+}
+
+uint32_t ShareManager::NameIndex::addWord(const string& aWord) {
+    auto i = wordIds.find(aWord);
+    if(i != wordIds.end())
+        return i->second;
+
+    uint32_t word = (uint32_t)vocabulary.size();
+    wordIds.insert(make_pair(aWord, word));
+    vocabulary.push_back(aWord);
+    postings.push_back(vector<uint32_t>());
+    for(size_t j = 0; j + MIN_PIECE <= aWord.size(); ++j)
+        suffixes.push_back(make_pair(word, (uint32_t)j));
+    return word;
+}
+
+void ShareManager::NameIndex::sortSuffixes() const {
+    if(sorted == suffixes.size())
+        return;
+
+    const StringList& v = vocabulary;
+    auto less = [&v](const Suffix& a, const Suffix& b) {
+        return v[a.first].compare(a.second, string::npos, v[b.first], b.second, string::npos) < 0;
+    };
+    sort(suffixes.begin() + sorted, suffixes.end(), less);
+    inplace_merge(suffixes.begin(), suffixes.begin() + sorted, suffixes.end(), less);
+    sorted = suffixes.size();
+}
+
+uint32_t ShareManager::NameIndex::add(const string& aLower, Directory* aDir, const Directory::File* aFile) {
+    uint32_t id = (uint32_t)entries.size();
+    entries.push_back(Entry(aDir, aFile));
+
+    StringList w;
+    splitWords(aLower, w);
+    sort(w.begin(), w.end());
+    w.erase(unique(w.begin(), w.end()), w.end());
+    for(auto i = w.begin(); i != w.end(); ++i) {
+        postings[addWord(*i)].push_back(id);
+    }
+    return id;
+}
+
+void ShareManager::NameIndex::add(Directory& dir) {
+    uint32_t id = dir.getNameId();
+    // Ids left over from before a clear may be stale
+    if(id == 0 || id >= entries.size() || entries[id].dir != &dir || entries[id].file) {
+        dir.setNameId(add(dir.getLowerName(), &dir, 0));
+    }
+}
+
+void ShareManager::NameIndex::add(const Directory::File& f) {
+    uint32_t id = f.getNameId();
+    if(id == 0 || id >= entries.size() || entries[id].file != &f) {
+        const_cast<Directory::File&>(f).setNameId(add(f.getLowerName(), f.getParent(), &f));
+    }
+}
+
+void ShareManager::NameIndex::remove(Directory& dir) {
+    uint32_t id = dir.getNameId();
+    if(id != 0 && id < entries.size() && entries[id].dir == &dir && !entries[id].file) {
+        entries[id] = Entry(0, 0);
+        dead++;
+    }
+    dir.setNameId(0);
+}
+
+void ShareManager::NameIndex::remove(const Directory::File& f) {
+    uint32_t id = f.getNameId();
+    if(id != 0 && id < entries.size() && entries[id].file == &f) {
+        entries[id] = Entry(0, 0);
+        dead++;
+    }
+    const_cast<Directory::File&>(f).setNameId(0);
+}
+
+bool ShareManager::NameIndex::find(const string& aPattern, vector<uint32_t>& ids) const {
+    // A name containing the pattern contains each of its words within one of its own
+    StringList pieces;
+    splitWords(aPattern, pieces);
+    sortSuffixes();
+
+    bool found = false;
+    vector<uint32_t> matches;
+    for(auto i = pieces.begin(); i != pieces.end(); ++i) {
+        // Not in the index
+        if(i->size() < MIN_PIECE)
+            continue;
+
+        // The suffixes starting with the piece are adjacent in the sorted list
+        const string& piece = *i;
+        const StringList& v = vocabulary;
+        auto j = lower_bound(suffixes.begin(), suffixes.end(), piece, [&v](const Suffix& a, const string& b) {
+            return v[a.first].compare(a.second, string::npos, b) < 0;
+        });
+        vector<uint32_t> hitWords;
+        for(; j != suffixes.end() && v[j->first].compare(j->second, piece.size(), piece) == 0; ++j)
+            hitWords.push_back(j->first);
+        // A word may contain the piece more than once
+        sort(hitWords.begin(), hitWords.end());
+        hitWords.erase(unique(hitWords.begin(), hitWords.end()), hitWords.end());
+
+        matches.clear();
+        for(auto w = hitWords.begin(); w != hitWords.end(); ++w)
+            matches.insert(matches.end(), postings[*w].begin(), postings[*w].end());
+        if(hitWords.size() > 1) {
+            sort(matches.begin(), matches.end());
+            matches.erase(unique(matches.begin(), matches.end()), matches.end());
+        }
+
+        // Not worth restricting the walk for
+        if(matches.size() > entries.size() / 4)
+            continue;
+
+        if(!found) {
+            ids.swap(matches);
+            found = true;
+        } else {
+            vector<uint32_t> both;
+            set_intersection(ids.begin(), ids.end(), matches.begin(), matches.end(), back_inserter(both));
+            ids.swap(both);
+        }
+    }
+    return found;
+}
+
+/**
+ * Picks the term with the fewest candidates in the name index and collects the names that
+ * really match it; the walk then only has to visit the paths leading to these. Every result
+ * has to match all terms, so this skips nothing the full walk would have found.
+ * @param adc The ADC search the terms come from, for its exclusions
+ */
+unique_ptr<ShareManager::SearchPrune> ShareManager::getPrune(const MultiStringSearch& terms, const AdcSearch* adc) const {
+    size_t term = terms.size();
+    vector<uint32_t> best, ids;
+    for(size_t i = 0; i < terms.size(); ++i) {
+        ids.clear();
+        if(nameIndex.find(terms.getPattern(i), ids) && (term == terms.size() || ids.size() < best.size())) {
+            best.swap(ids);
+            term = i;
+        }
+    }
+
+    unique_ptr<SearchPrune> prune;
+    if(term == terms.size())
+        return prune;
+
+    prune.reset(new SearchPrune);
+    const string& pattern = terms.getPattern(term);
+    prune->term = 0;
+    for(size_t i = 0; i < terms.size(); ++i) {
+        if(terms.getPattern(i) == pattern)
+            prune->term |= MultiStringSearch::Mask(1) << i;
+    }
+
+    StringSearch match(pattern);
+    for(auto i = best.begin(); i != best.end(); ++i) {
+        const Directory* d;
+        if(const Directory::File* f = nameIndex.getFile(*i)) {
+            if(!match.matchLower(f->getLowerName()))
+                continue;
+            prune->files.insert(f);
+            d = f->getParent();
+        } else if((d = nameIndex.getDirectory(*i)) != 0) {
+            // Like the walk, excluded directory names don't satisfy a term
+            if(!match.matchLower(d->getLowerName()) || (adc && adc->isExcluded(d->getLowerName().c_str())))
+                continue;
+        } else {
+            continue;
+        }
+
+        for(; d && prune->dirs.insert(d).second; d = d->getParent())
+            ;   // Empty
+    }
+    return prune;
+}
+
 /**
  * Alright, the main point here is that when searching, a search string is most often found in
- * the filename, not directory name, so we want to make that case faster. Also, we want to
- * avoid changing StringLists unless we absolutely have to --> this should only be done if a string
- * has been matched in the directory name. This new stringlist should also be used in all descendants,
- * but not the parents...
+ * the filename, not directory name, so we want to make that case faster. Search strings matched
+ * in a directory name are dropped from the remaining ones for all descendants, but not the parents.
+ * Names are matched in their lower-case form against all remaining strings in a single pass.
  */
-void ShareManager::Directory::search(SearchResultList& aResults, StringSearch::List& aStrings, int aSearchType, int64_t aSize, int aFileType, Client* aClient, StringList::size_type maxResults) const noexcept {
+void ShareManager::Directory::search(SearchResultList& aResults, const MultiStringSearch& aStrings, MultiStringSearch::Mask remaining, int aSearchType, int64_t aSize, int aFileType, Client* aClient, StringList::size_type maxResults, const SearchPrune* prune) const noexcept {
     // Skip everything if there's nothing to find here (doh! =)
     if(!hasType(aFileType))
         return;
 
-    StringSearch::List* cur = &aStrings;
-    unique_ptr<StringSearch::List> newStr;
-
     // Find any matches in the directory name
-    for(auto k = aStrings.begin(); k != aStrings.end(); ++k) {
-        if(k->match(name)) {
-            if(!newStr.get()) {
-                newStr = unique_ptr<StringSearch::List>(new StringSearch::List(aStrings));
-            }
-            newStr->erase(remove(newStr->begin(), newStr->end(), *k), newStr->end());
-        }
-    }
-
-    if(newStr.get() != 0) {
-        cur = newStr.get();
-    }
+    remaining &= ~aStrings.matchLower(getLowerName(), remaining);
 
     bool sizeOk = (aSearchType != SearchManager::SIZE_ATLEAST) || (aSize == 0);
-    if( (cur->empty()) &&
+    if( (remaining == 0) &&
         (((aFileType == SearchManager::TYPE_ANY) && sizeOk) || (aFileType == SearchManager::TYPE_DIRECTORY)) ) {
         // We satisfied all the search words! Add the directory...(NMDC searches don't support directory size)
         SearchResultPtr sr(new SearchResult(SearchResult::TYPE_DIRECTORY, 0, getFullName(), TTHValue()));
@@ -1212,19 +1993,20 @@ void ShareManager::Directory::search(SearchResultList& aResults, StringSearch::L
         ShareManager::getInstance()->setHits(ShareManager::getInstance()->getHits()+1);
     }
 
+    // Only names found by the index can satisfy the pruning term
+    bool pending = prune && prune->isPending(remaining);
+
     if(aFileType != SearchManager::TYPE_DIRECTORY) {
         for(auto i = files.begin(); i != files.end(); ++i) {
+            if(pending && prune->files.find(&*i) == prune->files.end())
+                continue;
 
             if(aSearchType == SearchManager::SIZE_ATLEAST && aSize > i->getSize()) {
                 continue;
             } else if(aSearchType == SearchManager::SIZE_ATMOST && aSize < i->getSize()) {
                 continue;
             }
-            auto j = cur->begin();
-            for(; j != cur->end() && j->match(i->getName()); ++j)
-                ;   // Empty
-
-            if(j != cur->end())
+            if(aStrings.matchLower(i->getLowerName(), remaining) != remaining)
                 continue;
 
             // Check file type...
@@ -1240,7 +2022,9 @@ void ShareManager::Directory::search(SearchResultList& aResults, StringSearch::L
     }
 
     for(auto l = directories.begin(); (l != directories.end()) && (aResults.size() < maxResults); ++l) {
-        l->second->search(aResults, *cur, aSearchType, aSize, aFileType, aClient, maxResults);
+        if(pending && prune->dirs.find(l->second.get()) == prune->dirs.end())
+            continue;
+        l->second->search(aResults, aStrings, remaining, aSearchType, aSize, aFileType, aClient, maxResults, prune);
     }
 }
 
@@ -1265,17 +2049,16 @@ void ShareManager::search(SearchResultList& results, const string& aString, int
     if(!bloom.match(sl))
         return;
 
-    StringSearch::List ssl;
-    for(auto i = sl.begin(); i != sl.end(); ++i) {
-        if(!i->empty()) {
-            ssl.push_back(StringSearch(*i));
-        }
-    }
-    if(ssl.empty())
+    MultiStringSearch ssl(sl);
+    // Without all of its terms a search would return what it doesn't ask for
+    if(ssl.empty() || ssl.isTruncated())
         return;
 
+    auto prune = getPrune(ssl, 0);
     for(auto j = directories.begin(); (j != directories.end()) && (results.size() < maxResults); ++j) {
-        (*j)->search(results, ssl, aSearchType, aSize, aFileType, aClient, maxResults);
+        if(prune && prune->dirs.find(j->get()) == prune->dirs.end())
+            continue;
+        (*j)->search(results, ssl, ssl.getAll(), aSearchType, aSize, aFileType, aClient, maxResults, prune.get());
     }
 }
 
@@ -1283,7 +2066,7 @@ namespace {
     inline uint16_t toCode(char a, char b) { return (uint16_t)a | ((uint16_t)b)<<8; }
 }
 
-ShareManager::AdcSearch::AdcSearch(const StringList& params) : include(&includeX), gt(0),
+ShareManager::AdcSearch::AdcSearch(const StringList& params) : gt(0),
     lt(numeric_limits<int64_t>::max()), hasRoot(false), isDirectory(false)
 {
     for(auto i = params.begin(); i != params.end(); ++i) {
@@ -1295,11 +2078,11 @@ ShareManager::AdcSearch::AdcSearch(const StringList& params) : include(&includeX
         if(toCode('T', 'R') == cmd) {
             hasRoot = true;
             root = TTHValue(p.substr(2));
-            return;
+            break;
         } else if(toCode('A', 'N') == cmd) {
-            includeX.push_back(StringSearch(p.substr(2)));
+            include.add(p.substr(2));
         } else if(toCode('N', 'O') == cmd) {
-            exclude.push_back(StringSearch(p.substr(2)));
+            exclude.add(p.substr(2));
         } else if(toCode('E', 'X') == cmd) {
             ext.push_back(p.substr(2));
         } else if(toCode('G', 'R') == cmd) {
@@ -1317,14 +2100,9 @@ ShareManager::AdcSearch::AdcSearch(const StringList& params) : include(&includeX
             isDirectory = (p[2] == '2');
         }
     }
-}
 
-bool ShareManager::AdcSearch::isExcluded(const string& str) {
-    for(auto i = exclude.begin(); i != exclude.end(); ++i) {
-        if(i->match(str))
-            return true;
-    }
-    return false;
+    include.build();
+    exclude.build();
 }
 
 bool ShareManager::AdcSearch::hasExt(const string& name) {
@@ -1341,36 +2119,30 @@ bool ShareManager::AdcSearch::hasExt(const string& name) {
     return false;
 }
 
-void ShareManager::Directory::search(SearchResultList& aResults, AdcSearch& aStrings, StringList::size_type maxResults) const noexcept {
-    StringSearch::List* cur = aStrings.include;
-    StringSearch::List* old = aStrings.include;
-
-    unique_ptr<StringSearch::List> newStr;
-
-    // Find any matches in the directory name
-    for(auto k = cur->begin(); k != cur->end(); ++k) {
-        if(k->match(name) && !aStrings.isExcluded(name)) {
-            if(!newStr.get()) {
-                newStr = unique_ptr<StringSearch::List>(new StringSearch::List(*cur));
-            }
-            newStr->erase(remove(newStr->begin(), newStr->end(), *k), newStr->end());
-        }
-    }
-
-    if(newStr.get() != 0) {
-        cur = newStr.get();
+void ShareManager::Directory::search(SearchResultList& aResults, AdcSearch& aStrings, MultiStringSearch::Mask remaining, StringList::size_type maxResults, const SearchPrune* prune) const noexcept {
+    // Find any matches in the directory name; unlike NMDC searches, they only count for the
+    // files of this directory
+    MultiStringSearch::Mask cur = remaining;
+    MultiStringSearch::Mask found = aStrings.include.matchLower(getLowerName(), cur);
+    if(found && !aStrings.isExcluded(getLowerName().c_str())) {
+        cur &= ~found;
     }
 
     bool sizeOk = (aStrings.gt == 0);
-    if( cur->empty() && aStrings.ext.empty() && sizeOk ) {
+    if( cur == 0 && aStrings.ext.empty() && sizeOk ) {
         // We satisfied all the search words! Add the directory...
         SearchResultPtr sr(new SearchResult(SearchResult::TYPE_DIRECTORY, getSize(), getFullName(), TTHValue()));
         aResults.push_back(sr);
         ShareManager::getInstance()->setHits(ShareManager::getInstance()->getHits()+1);
     }
 
+    // Only names found by the index can satisfy the pruning term
+    bool pending = prune && prune->isPending(cur);
+
     if(!aStrings.isDirectory) {
         for(auto i = files.begin(); i != files.end(); ++i) {
+            if(pending && prune->files.find(&*i) == prune->files.end())
+                continue;
 
             if(!(i->getSize() >= aStrings.gt)) {
                 continue;
@@ -1378,14 +2150,10 @@ void ShareManager::Directory::search(SearchResultList& aResults, AdcSearch& aStr
                 continue;
             }
 
-            if(aStrings.isExcluded(i->getName()))
+            if(aStrings.isExcluded(i->getLowerName()))
                 continue;
 
-            auto j = cur->begin();
-            for(; j != cur->end() && j->match(i->getName()); ++j)
-                ;   // Empty
-
-            if(j != cur->end())
+            if(aStrings.include.matchLower(i->getLowerName(), cur) != cur)
                 continue;
 
             // Check file type...
@@ -1403,9 +2171,10 @@ void ShareManager::Directory::search(SearchResultList& aResults, AdcSearch& aStr
     }
 
     for(auto l = directories.begin(); (l != directories.end()) && (aResults.size() < maxResults); ++l) {
-        l->second->search(aResults, aStrings, maxResults);
+        if(pending && prune->dirs.find(l->second.get()) == prune->dirs.end())
+            continue;
+        l->second->search(aResults, aStrings, remaining, maxResults, prune);
     }
-    aStrings.include = old;
 }
 
 void ShareManager::search(SearchResultList& results, const StringList& params, StringList::size_type maxResults) noexcept {
@@ -1425,13 +2194,20 @@ void ShareManager::search(SearchResultList& results, const StringList& params, S
         return;
     }
 
-    for(auto i = srch.includeX.begin(); i != srch.includeX.end(); ++i) {
-        if(!bloom.match(i->getPattern()))
+    // Without all of its terms a search would return what it doesn't ask for
+    if(srch.include.isTruncated() || srch.exclude.isTruncated())
+        return;
+
+    for(size_t i = 0; i < srch.include.size(); ++i) {
+        if(!bloom.match(srch.include.getPattern(i)))
             return;
     }
 
+    auto prune = getPrune(srch.include, &srch);
     for(auto j = directories.begin(); (j != directories.end()) && (results.size() < maxResults); ++j) {
-        (*j)->search(results, srch, maxResults);
+        if(prune && prune->dirs.find(j->get()) == prune->dirs.end())
+            continue;
+        (*j)->search(results, srch, srch.include.getAll(), maxResults, prune.get());
     }
 }
 
@@ -1511,6 +2287,16 @@ void ShareManager::on(TimerManagerListener::Minute, uint64_t tick) noexcept {
             refresh(true, true);
         }
     }
+
+    // The unpacked list may run to hundreds of MiB; drop it once no upload has used it for a while
+    Lock l(listCacheCs);
+    if(xmlList) {
+        if(!xmlList.unique()) {
+            xmlListUsed = tick;
+        } else if(xmlListUsed + XML_LIST_IDLE < tick) {
+            xmlList.reset();
+        }
+    }
 }
 
 } // namespace dcpp
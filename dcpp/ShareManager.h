@@ -32,6 +32,9 @@
 #include "MerkleTree.h"
 #include "Pointer.h"
 #include "Atomic.h"
+#include "StringPool.h"
+
+#include <atomic>
 
 #ifdef WITH_DHT
 namespace dht {
@@ -70,14 +73,23 @@ public:
     TTHValue getTTH(const string& virtualFile) const;
 
     void refresh(bool dirs = false, bool aUpdate = true, bool block = false) noexcept;
-    void setDirty() { xmlDirty = true; }
+    void setDirty() { xmlDirty = true; listGeneration++; }
 
     void search(SearchResultList& l, const string& aString, int aSearchType, int64_t aSize, int aFileType, Client* aClient, StringList::size_type maxResults) noexcept;
     void search(SearchResultList& l, const StringList& params, StringList::size_type maxResults) noexcept;
 
     StringPairList getDirectories() const noexcept;
 
-    MemoryInputStream* generatePartialList(const string& dir, bool recurse) const;
+    /** A generated file list, shared by the uploads sending it */
+    typedef std::shared_ptr<const string> ListPtr;
+
+    /**
+     * @return The uncompressed full list, unpacked once per generated list and kept while it is asked for
+     * @throw Exception When the compressed list can't be read or unpacked
+     */
+    ListPtr getXmlList();
+    /** @return The partial list, cached until the share changes; NULL if the directory isn't shared */
+    ListPtr generatePartialList(const string& dir, bool recurse) const;
     MemoryInputStream* getTree(const string& virtualFile) const;
 
     AdcCommand getFileInfo(const string& aFile);
@@ -103,6 +115,7 @@ public:
 
     string getOwnListFile() {
         generateXmlList();
+        Lock l(cs);
         return getBZXmlFile();
     }
 
@@ -115,64 +128,92 @@ public:
     GETSET(string, bzXmlFile, BZXmlFile);
 private:
     struct AdcSearch;
+    struct SearchPrune;
     class Directory : public FastAlloc<Directory>, public intrusive_ptr_base<Directory>, boost::noncopyable {
     public:
         typedef boost::intrusive_ptr<Directory> Ptr;
         typedef unordered_map<string, Ptr, noCaseStringHash, noCaseStringEq> Map;
         typedef Map::iterator MapIter;
 
+        /**
+         * Files are numerous, so they are kept small: their names live in the pool of their
+         * directory, and each set they are kept in carries the case sensitivity in effect when
+         * its tree was built rather than reading the setting on every comparison.
+         */
         struct File {
             struct StringComp {
-                StringComp(const string& s) : a(s) { }
+                StringComp(const string& s, bool aCaseSensitive) : a(s), caseSensitive(aCaseSensitive) { }
                 bool operator()(const File& b) const {
-                if (BOOLSETTING(CASESENSITIVE_FILELIST))
-                    return strcmp(a.c_str(), b.getName().c_str()) == 0;
-                else
-                    return Util::stricmp(a, b.getName()) == 0;
+                    if (caseSensitive)
+                        return strcmp(a.c_str(), b.getName()) == 0;
+                    else
+                        return Util::stricmp(a.c_str(), b.getName()) == 0;
                 }
 
                 const string& a;
+                bool caseSensitive;
             private:
                 StringComp& operator=(const StringComp&);
             };
             struct FileLess {
+                FileLess(bool aCaseSensitive = false) : caseSensitive(aCaseSensitive) { }
                 bool operator()(const File& a, const File& b) const {
-                    if (BOOLSETTING(CASESENSITIVE_FILELIST))
-                        return (strcmp(a.getName().c_str(), b.getName().c_str()) < 0);
+                    if (caseSensitive)
+                        return (strcmp(a.getName(), b.getName()) < 0);
                     else
                         return (Util::stricmp(a.getName(), b.getName()) < 0);
                 }
+
+                bool caseSensitive;
             };
             typedef set<File, FileLess> Set;
 
-            File() : size(0), parent(0) { }
+            File() : size(0), parent(0), name(StringPool::EMPTY), lowerName(StringPool::EMPTY), nameId(0) { }
             File(const string& aName, int64_t aSize, const Directory::Ptr& aParent, const TTHValue& aRoot) :
-            name(aName), tth(aRoot), size(aSize), parent(aParent.get()) { }
+            tth(aRoot), size(aSize), parent(aParent.get()), nameId(0) { setName(aName); }
+            // Copies are not in the name index until added to it
             File(const File& rhs) :
-            name(rhs.getName()), tth(rhs.getTTH()), size(rhs.getSize()), parent(rhs.getParent()) { }
+            tth(rhs.getTTH()), size(rhs.getSize()), parent(rhs.getParent()), name(rhs.name), lowerName(rhs.lowerName), nameId(0) { }
 
             ~File() { }
 
             File& operator=(const File& rhs) {
-                name = rhs.name; size = rhs.size; parent = rhs.parent; tth = rhs.tth;
+                name = rhs.name; lowerName = rhs.lowerName; size = rhs.size; parent = rhs.parent; tth = rhs.tth;
                 return *this;
             }
 
             bool operator==(const File& rhs) const {
-                if (BOOLSETTING(CASESENSITIVE_FILELIST))
-                    return getParent() == rhs.getParent() && (strcmp(getName().c_str(), rhs.getName().c_str()) == 0);
+                if (getParent()->isCaseSensitive())
+                    return getParent() == rhs.getParent() && (strcmp(getName(), rhs.getName()) == 0);
                 else
                     return getParent() == rhs.getParent() && (Util::stricmp(getName(), rhs.getName()) == 0);
             }
 
-            string getADCPath() const { return parent->getADCPath() + name; }
-            string getFullName() const { return parent->getFullName() + name; }
-            string getRealPath() const { return parent->getRealPath(name); }
+            string getADCPath() const { return parent->getADCPath() + getName(); }
+            string getFullName() const { return parent->getFullName() + getName(); }
+            string getRealPath() const { return parent->getRealPath(getName()); }
+
+            const char* getName() const { return parent->getNames().get(name); }
+            void setName(const string& aName);
+            /** Lower-case name, for searches */
+            const char* getLowerName() const { return parent->getNames().get(lowerName); }
 
-            GETSET(string, name, Name);
             GETSET(TTHValue, tth, TTH);
             GETSET(int64_t, size, Size);
-            GETSET(Directory*, parent, Parent);
+
+            Directory* getParent() const { return parent; }
+            /** Move the file to another directory, taking its names over to that directory's pool */
+            void setParent(Directory* aParent);
+
+        private:
+            Directory* parent;
+            StringPool::Id name;
+            /** Same as name when that's lower-case already */
+            StringPool::Id lowerName;
+
+        public:
+            /** Entry in the name index, 0 when not indexed */
+            GETSET(uint32_t, nameId, NameId);
         };
 
         int64_t size;
@@ -192,18 +233,39 @@ private:
 
         int64_t getSize() const noexcept;
 
-        void search(SearchResultList& aResults, StringSearch::List& aStrings, int aSearchType, int64_t aSize, int aFileType, Client* aClient, StringList::size_type maxResults) const noexcept;
-        void search(SearchResultList& aResults, AdcSearch& aStrings, StringList::size_type maxResults) const noexcept;
+        void search(SearchResultList& aResults, const MultiStringSearch& aStrings, MultiStringSearch::Mask remaining, int aSearchType, int64_t aSize, int aFileType, Client* aClient, StringList::size_type maxResults, const SearchPrune* prune) const noexcept;
+        void search(SearchResultList& aResults, AdcSearch& aStrings, MultiStringSearch::Mask remaining, StringList::size_type maxResults, const SearchPrune* prune) const noexcept;
 
         void toXml(OutputStream& xmlFile, string& indent, string& tmp2, bool fullList) const;
         void filesToXml(OutputStream& xmlFile, string& indent, string& tmp2) const;
 
-        File::Set::const_iterator findFile(const string& aFile) const { return find_if(files.begin(), files.end(), Directory::File::StringComp(aFile)); }
+        File::Set::const_iterator findFile(const string& aFile) const { return find_if(files.begin(), files.end(), Directory::File::StringComp(aFile, isCaseSensitive())); }
 
         void merge(const Ptr& source);
 
-        GETSET(string, name, Name);
+        /** Sets lower to the lower-case form of aName, or clears it when that's aName itself */
+        static void foldName(const string& aName, string& lower);
+
+        const string& getName() const { return name; }
+        void setName(const string& aName) { name = aName; foldName(name, lowerName); }
+        /** Lower-case name, for searches */
+        const string& getLowerName() const { return lowerName.empty() ? name : lowerName; }
+
+        /** Pool of the names of the files, shared with the rest of the tree the directory was built in */
+        StringPool& getNames() const { return *names; }
+        /** Whether files is ordered case-sensitively, see CASESENSITIVE_FILELIST */
+        bool isCaseSensitive() const { return files.key_comp().caseSensitive; }
+
+        /**
+         * Start a new generation of trees: roots created from now on, and the directories below
+         * them, get a new name pool and the given file order. The pool of an older generation is
+         * freed along with the last directory using it.
+         */
+        static void newGeneration(bool caseSensitive);
+
         GETSET(Directory*, parent, Parent);
+        /** Entry in the name index, 0 when not indexed */
+        GETSET(uint32_t, nameId, NameId);
     private:
         friend void intrusive_ptr_release(intrusive_ptr_base<Directory>*);
 
@@ -213,6 +275,11 @@ private:
         /** Set of flags that say which SearchManager::TYPE_* a directory contains */
         uint32_t fileTypes;
 
+        string name;
+        /** Empty when the same as name */
+        string lowerName;
+
+        StringPool::Ptr names;
     };
 
     friend class Directory;
@@ -226,11 +293,11 @@ private:
     struct AdcSearch {
         AdcSearch(const StringList& params);
 
-        bool isExcluded(const string& str);
+        /** @param aLower A lower-case name */
+        bool isExcluded(const char* aLower) const { return exclude.matchLower(aLower, exclude.getAll()) != 0; }
         bool hasExt(const string& name);
-        StringSearch::List* include;
-        StringSearch::List includeX;
-        StringSearch::List exclude;
+        MultiStringSearch include;
+        MultiStringSearch exclude;
         StringList ext;
         StringList noExt;
 
@@ -243,6 +310,86 @@ private:
         bool isDirectory;
     };
 
+    /**
+     * Maps the words of shared file and directory names to the entries carrying them, so
+     * that searches only need to walk the paths leading to possible matches. Entries are
+     * added as the tree is indexed and tombstoned when removed.
+     */
+    class NameIndex {
+    public:
+        NameIndex() : sorted(0), dead(0) { clear(); }
+
+        void add(Directory& dir);
+        void add(const Directory::File& f);
+        void remove(Directory& dir);
+        void remove(const Directory::File& f);
+        void clear();
+
+        /** Whether tombstones make up enough of the index for a rebuild to be worth it */
+        bool isFragmented() const { return dead > 1024 && dead > entries.size() / 2; }
+
+        /**
+         * Collects the entries whose name may contain aPattern (lowercase); matches still have
+         * to be checked. Fails when the pattern is too unselective to be worth looking up.
+         */
+        bool find(const string& aPattern, vector<uint32_t>& ids) const;
+
+        /** Directory of an entry, or of the file it names */
+        Directory* getDirectory(uint32_t id) const { return entries[id].dir; }
+        /** File an entry names, 0 for directories and removed entries */
+        const Directory::File* getFile(uint32_t id) const { return entries[id].file; }
+
+    private:
+        struct Entry {
+            Entry(Directory* aDir, const Directory::File* aFile) : dir(aDir), file(aFile) { }
+            Directory* dir;
+            const Directory::File* file;
+        };
+
+        /** Word id and offset of a suffix of that word */
+        typedef pair<uint32_t, uint32_t> Suffix;
+
+        /** Shorter pieces of a pattern match too many words to narrow a search down */
+        enum { MIN_PIECE = 3 };
+
+        uint32_t add(const string& aName, Directory* aDir, const Directory::File* aFile);
+        uint32_t addWord(const string& aWord);
+        /** Merge the suffixes of the words added since the last lookup into the sorted ones */
+        void sortSuffixes() const;
+
+        vector<Entry> entries;
+        /** Distinct words of the indexed names */
+        StringList vocabulary;
+        /** For each word, the ids of the entries whose name contains it, in increasing order */
+        vector<vector<uint32_t> > postings;
+        unordered_map<string, uint32_t> wordIds;
+        /**
+         * Suffixes of at least MIN_PIECE characters of every word, sorted on their text up to
+         * sorted; the words containing a pattern are those having a suffix it's a prefix of.
+         * Only touched with the share lock held, like the rest of the index.
+         */
+        mutable vector<Suffix> suffixes;
+        mutable size_t sorted;
+        size_t dead;
+    };
+
+    /** Restricts a search walk to the paths leading to the names matching one of its terms */
+    struct SearchPrune {
+        /** The term the restriction is based on (several bits when it was given more than once) */
+        MultiStringSearch::Mask term;
+        /** Directories matching the term and those on the way to matching names */
+        unordered_set<const Directory*> dirs;
+        unordered_set<const Directory::File*> files;
+
+        /** Whether the walk is still restricted, i.e. the term hasn't been matched by a directory yet */
+        bool isPending(MultiStringSearch::Mask remaining) const { return (remaining & term) != 0; }
+    };
+
+    NameIndex nameIndex;
+
+    unique_ptr<SearchPrune> getPrune(const MultiStringSearch& terms, const AdcSearch* adc) const;
+    void indexNames(Directory& dir);
+
     int64_t xmlListLen;
     TTHValue xmlRoot;
     int64_t bzXmlListLen;
@@ -257,12 +404,34 @@ private:
 
     int listN;
 
+    enum { PARTIAL_LIST_CACHE_SIZE = 16*1024*1024 };
+    /** Milliseconds the unpacked full list is kept after the last upload of it has ended */
+    enum { XML_LIST_IDLE = 10*60*1000 };
+
+    /** Bumped on every change to the share, so that cached lists can tell they're stale */
+    std::atomic<uint32_t> listGeneration;
+
+    /** The unpacked full list and the root of the compressed list it came from */
+    ListPtr xmlList;
+    TTHValue xmlListBzRoot;
+    /** When the unpacked list was last seen in use */
+    uint64_t xmlListUsed;
+
+    typedef unordered_map<string, ListPtr> PartialListMap;
+    /** Partial lists by directory, with a '+' or '-' appended for the recursion flag */
+    mutable PartialListMap partialLists;
+    mutable size_t partialListsSize;
+    mutable uint32_t partialListsGeneration;
+    mutable CriticalSection listCacheCs;
+
     Atomic<bool,memory_ordering_strong> refreshing;
 
     uint64_t lastXmlUpdate;
     uint64_t lastFullUpdate;
 
     mutable CriticalSection cs;
+    /** Serializes file list generation, which runs without holding cs; always taken before cs */
+    CriticalSection listCs;
 
     // List of root directory items
     typedef std::list<Directory::Ptr> DirList;
@@ -275,6 +444,38 @@ private:
     friend class ::dht::IndexManager;
 #endif
 
+    /**
+     * Watches the shared directories for changes so that they can be applied to the tree
+     * without a full refresh. Only implemented with inotify (Linux); elsewhere it never
+     * reports anything and the periodic full refresh remains the only way to pick up changes.
+     */
+    class Monitor : public Thread {
+    public:
+        Monitor();
+        ~Monitor();
+
+        /** Start monitoring; does nothing when already running or unsupported */
+        void enable();
+        /** Watch a single directory (not its subdirectories) */
+        void watch(const string& aDir);
+        /** Forget the watches of aPath and everything below it */
+        void unwatch(const string& aPath);
+        void shutdown();
+
+    private:
+        virtual int run();
+
+        int fd;
+        bool stop;
+        /** Watch descriptor -> watched directory */
+        unordered_map<int, string> watches;
+        CriticalSection cs;
+    };
+
+    Monitor monitor;
+    /** Serializes full and incremental refreshes */
+    CriticalSection refreshCs;
+
     typedef unordered_map<TTHValue, Directory::File::Set::const_iterator> HashFileMap;
     typedef HashFileMap::iterator HashFileIter;
 
@@ -284,13 +485,25 @@ private:
 
     Directory::File::Set::const_iterator findFile(const string& virtualFile) const;
 
-    Directory::Ptr buildTree(const string& aName, const Directory::Ptr& aParent);
+    /** Real path and node of directories still to be listed */
+    typedef vector<pair<string, Directory::Ptr> > ScanList;
+
+    class TreeBuilder;
+    friend class TreeBuilder;
+
+    Directory::Ptr buildTree(const string& aName, const Directory::Ptr& aParent, bool recurse = true);
+    void scanDirectory(const string& aName, const Directory::Ptr& dir, ScanList& subdirs);
     bool checkHidden(const string& aName) const;
 
     void rebuildIndices();
 
     void updateIndices(Directory& aDirectory);
     void updateIndices(Directory& dir, const Directory::File::Set::iterator& i);
+    void removeIndices(Directory& dir);
+    void removeFile(Directory& dir, const Directory::File::Set::iterator& i);
+
+    void refreshChanged(const StringList& realDirs);
+    bool applyChanges(Directory& dir, const Directory& scanned);
 
     Directory::Ptr merge(const Directory::Ptr& directory);
 
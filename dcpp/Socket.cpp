@@ -50,6 +50,11 @@
 #include <net/if.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <poll.h>
+#endif
+
+#ifdef __linux__
+#include <sys/sendfile.h>
 #endif
 
 #ifdef __HAIKU__
@@ -440,6 +445,25 @@ int Socket::write(const void* aBuffer, int aLen) {
     return sent;
 }
 
+#ifdef __linux__
+int Socket::sendFile(int fd, int64_t& offset, int aLen) {
+    off_t pos = offset;
+    ssize_t sent;
+    do {
+        sent = ::sendfile(sock, fd, &pos, aLen);
+    } while (sent < 0 && getLastError() == EINTR);
+
+    if(check((int)sent, true) == 0 && aLen > 0) {
+        throw SocketException(_("File ended unexpectedly"));
+    }
+    if(sent > 0) {
+        stats.totalUp += sent;
+        offset = pos;
+    }
+    return (int)sent;
+}
+#endif
+
 /**
 * Sends data, will block until all data has been sent or an exception occurs
 * @param aBuffer Buffer with data
@@ -521,6 +545,49 @@ void Socket::writeTo(const string& aAddr, uint16_t aPort, const void* aBuffer, i
  * @throw SocketException Select or the connection attempt failed.
  */
 int Socket::wait(uint32_t millis, int waitFor) {
+#ifndef _WIN32
+    // poll has no FD_SETSIZE limit on the descriptor values, which thousands of connections exceed
+    pollfd pfd = { sock, 0, 0 };
+    if(waitFor & WAIT_CONNECT) {
+        dcassert(!(waitFor & WAIT_READ) && !(waitFor & WAIT_WRITE));
+        pfd.events = POLLOUT;
+    } else {
+        if(waitFor & WAIT_READ)
+            pfd.events |= POLLIN;
+        if(waitFor & WAIT_WRITE)
+            pfd.events |= POLLOUT;
+    }
+
+    int result;
+    do {
+        result = poll(&pfd, 1, millis);
+    } while (result < 0 && getLastError() == EINTR);
+    check(result);
+
+    if(waitFor & WAIT_CONNECT) {
+        if(pfd.revents == 0)
+            return 0;
+
+        int y = 0;
+        socklen_t z = sizeof(y);
+        check(getsockopt(sock, SOL_SOCKET, SO_ERROR, (char*)&y, &z));
+
+        if(y != 0)
+            throw SocketException(y);
+        return WAIT_CONNECT;
+    }
+
+    // Errors and hangups are reported as ready so that the following read or write reports them
+    int ret = WAIT_NONE;
+    if((waitFor & WAIT_READ) && (pfd.revents & (POLLIN | POLLERR | POLLHUP))) {
+        ret |= WAIT_READ;
+    }
+    if((waitFor & WAIT_WRITE) && (pfd.revents & (POLLOUT | POLLERR | POLLHUP))) {
+        ret |= WAIT_WRITE;
+    }
+
+    return ret;
+#else
     timeval tv;
     fd_set rfd, wfd, efd;
     fd_set *rfdp = NULL, *wfdp = NULL;
@@ -587,6 +654,7 @@ int Socket::wait(uint32_t millis, int waitFor) {
     }
 
     return waitFor;
+#endif
 }
 
 bool Socket::waitConnected(uint32_t millis) {
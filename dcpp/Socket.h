@@ -96,6 +96,18 @@ public:
     void writeAll(const void* aBuffer, int aLen, uint32_t timeout = 0);
     virtual int write(const void* aBuffer, int aLen);
     int write(const string& aData) { return write(aData.data(), (int)aData.length()); }
+#ifdef __linux__
+    /** Whether sendFile can be used; encrypted sockets can only when the kernel does the encryption */
+    virtual bool canSendFile() const noexcept { return true; }
+    /**
+     * Sends part of a file straight from the page cache, without copying it through user space.
+     * @param offset Where to start in the file, advanced past the bytes sent.
+     * @return Number of bytes sent or -1 if the call would block.
+     * @throw SocketException On any failure, including files that can't be sent this way; an
+     * SSLSocketException when the connection can't be used any more.
+     */
+    virtual int sendFile(int fd, int64_t& offset, int aLen);
+#endif
     virtual void writeTo(const string& aIp, uint16_t aPort, const void* aBuffer, int aLen, bool proxy = true);
     void writeTo(const string& aIp, uint16_t aPort, const string& aData) { writeTo(aIp, aPort, aData.data(), (int)aData.length()); }
     virtual void shutdown() noexcept;
@@ -106,6 +106,25 @@ private:
     uint8_t* buf;
 };
 
+/** Reads a buffer that is shared, without copying it, with the other streams reading it */
+class SharedInputStream : public InputStream {
+public:
+    SharedInputStream(const std::shared_ptr<const string>& aBuf) : buf(aBuf), pos(0) { }
+
+    virtual size_t read(void* tgt, size_t& len) {
+        len = min(len, buf->size() - pos);
+        memcpy(tgt, buf->data() + pos, len);
+        pos += len;
+        return len;
+    }
+
+    size_t getSize() const { return buf->size(); }
+
+private:
+    std::shared_ptr<const string> buf;
+    size_t pos;
+};
+
 class IOStream : public InputStream, public OutputStream {
 };
 
@@ -124,6 +143,9 @@ public:
         return x;
     }
 
+    InputStream* getStream() const { return s; }
+    uint64_t getMaxBytes() const { return maxBytes; }
+
 private:
     InputStream* s;
     uint64_t maxBytes;
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2001-2012 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "stdinc.h"
+#include "StringPool.h"
+
+namespace dcpp {
+
+StringPool::StringPool() : chunkCount(0), used(CHUNK_SIZE), table(1024, NONE), count(0) {
+    memset(chunks, 0, sizeof(chunks));
+
+    // Id 0 is the empty string
+    append("", 0);
+}
+
+StringPool::~StringPool() {
+    for(size_t i = 0; i < chunkCount; ++i) {
+        delete[] chunks[i];
+    }
+}
+
+size_t StringPool::hash(const char* aStr, size_t aLen) {
+    // FNV-1a
+    size_t h = 2166136261U;
+    for(size_t i = 0; i < aLen; ++i) {
+        h = (h ^ (uint8_t)aStr[i]) * 16777619U;
+    }
+    return h;
+}
+
+StringPool::Id StringPool::append(const char* aStr, size_t aLen) {
+    // Length, string and nul, keeping the lengths aligned
+    size_t needed = (sizeof(uint16_t) + aLen + 1 + 1) & ~size_t(1);
+    if(used + needed > CHUNK_SIZE) {
+        // Ids only have room for this many chunks
+        if(chunkCount == MAX_CHUNKS)
+            throw std::bad_alloc();
+        chunks[chunkCount++] = new char[CHUNK_SIZE];
+        used = 0;
+    }
+
+    char* p = chunks[chunkCount - 1] + used;
+    *reinterpret_cast<uint16_t*>(p) = (uint16_t)aLen;
+    memcpy(p + sizeof(uint16_t), aStr, aLen);
+    p[sizeof(uint16_t) + aLen] = 0;
+
+    Id id = (Id)(((chunkCount - 1) << CHUNK_BITS) | used);
+    used += needed;
+    return id;
+}
+
+StringPool::Id StringPool::add(const char* aStr, size_t aLen) {
+    if(aLen == 0)
+        return EMPTY;
+
+    // Names are much shorter, but don't let anything overflow the length field
+    aLen = min(aLen, (size_t)UINT16_MAX);
+
+    FastLock l(cs);
+
+    size_t mask = table.size() - 1;
+    size_t i = hash(aStr, aLen) & mask;
+    for(; table[i] != NONE; i = (i + 1) & mask) {
+        if(length(table[i]) == aLen && memcmp(get(table[i]), aStr, aLen) == 0)
+            return table[i];
+    }
+
+    Id id = append(aStr, aLen);
+    table[i] = id;
+
+    // Keep the table at most half full
+    if(++count * 2 > table.size()) {
+        vector<Id> old(table.size() * 2, NONE);
+        old.swap(table);
+        mask = table.size() - 1;
+        for(auto j = old.begin(); j != old.end(); ++j) {
+            if(*j == NONE)
+                continue;
+            size_t k = hash(get(*j), length(*j)) & mask;
+            while(table[k] != NONE)
+                k = (k + 1) & mask;
+            table[k] = *j;
+        }
+    }
+
+    return id;
+}
+
+size_t StringPool::getMemoryUsage() const {
+    return chunkCount * CHUNK_SIZE + table.size() * sizeof(Id);
+}
+
+} // namespace dcpp
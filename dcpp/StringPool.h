@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2001-2012 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include "typedefs.h"
+#include "CriticalSection.h"
+#include "Pointer.h"
+
+namespace dcpp {
+
+/**
+ * Append-only store of short strings (such as file names) referred to by 32-bit ids.
+ * Equal strings are stored once. Strings are kept in large chunks that are never moved or
+ * freed while the pool lives, so reading them needs no locking; adding is thread-safe.
+ * Users drop a pool as a whole once nothing refers to its strings anymore.
+ */
+class StringPool : public intrusive_ptr_base<StringPool>, boost::noncopyable {
+public:
+    typedef boost::intrusive_ptr<StringPool> Ptr;
+    typedef uint32_t Id;
+
+    /** The id of the empty string */
+    enum { EMPTY = 0 };
+
+    StringPool();
+    ~StringPool();
+
+    /**
+     * @return The id of a string equal to aStr, which is added if not pooled yet
+     * @throw std::bad_alloc when the ids are exhausted
+     */
+    Id add(const char* aStr, size_t aLen);
+    Id add(const string& aStr) { return add(aStr.data(), aStr.size()); }
+
+    /** @return The nul-terminated string with the given id */
+    const char* get(Id id) const { return chunks[id >> CHUNK_BITS] + (id & CHUNK_MASK) + sizeof(uint16_t); }
+    size_t length(Id id) const { return *reinterpret_cast<const uint16_t*>(chunks[id >> CHUNK_BITS] + (id & CHUNK_MASK)); }
+
+    /** Bytes taken by the strings and their lookup table */
+    size_t getMemoryUsage() const;
+
+private:
+    enum {
+        CHUNK_BITS = 20,
+        CHUNK_SIZE = 1 << CHUNK_BITS,
+        CHUNK_MASK = CHUNK_SIZE - 1,
+        MAX_CHUNKS = 1 << (32 - CHUNK_BITS)
+    };
+
+    static const Id NONE = ~Id(0);
+
+    static size_t hash(const char* aStr, size_t aLen);
+    Id append(const char* aStr, size_t aLen);
+
+    /** Fixed-size so that readers never see it move */
+    char* chunks[MAX_CHUNKS];
+    size_t chunkCount;
+    size_t used;
+
+    /** Open addressing hash table of the ids, NONE when free */
+    vector<Id> table;
+    size_t count;
+
+    FastCriticalSection cs;
+};
+
+} // namespace dcpp
@@ -27,8 +27,7 @@ namespace dcpp {
  * A class that implements a fast substring search algo suited for matching
  * one pattern against many strings (currently Quick Search, a variant of
  * Boyer-Moore. Code based on "A very fast substring search algorithm" by
- * D. Sunday).
- * @todo Perhaps find an algo suitable for matching multiple substrings.
+ * D. Sunday). See MultiStringSearch for matching several substrings at once.
  */
 class StringSearch {
 public:
@@ -57,22 +56,33 @@ public:
 
     /** Match a text against the pattern */
     bool match(const string& aText) const noexcept {
-
         // Lower-case representation of UTF-8 string, since we no longer have that 1 char = 1 byte...
         string lower;
         Text::toLower(aText, lower);
+        return matchLower(lower);
+    }
+
+    /** Match a text that is already lower-case against the pattern, without allocating */
+    bool matchLower(const string& aLower) const noexcept {
+        return matchLower(aLower.c_str(), aLower.length());
+    }
+    bool matchLower(const char* aLower) const noexcept {
+        return matchLower(aLower, strlen(aLower));
+    }
 
+    /** @param aLower A nul-terminated lower-case text of aLength bytes */
+    bool matchLower(const char* aLower, size_t aLength) const noexcept {
         // uint8_t to avoid problems with signed char pointer arithmetic
-        uint8_t *tx = (uint8_t*)lower.c_str();
-        uint8_t *px = (uint8_t*)pattern.c_str();
+        const uint8_t *tx = (const uint8_t*)aLower;
+        const uint8_t *px = (const uint8_t*)pattern.c_str();
 
         string::size_type plen = pattern.length();
 
-        if(aText.length() < plen) {
+        if(aLength < plen) {
             return false;
         }
 
-        uint8_t *end = tx + aText.length() - plen + 1;
+        const uint8_t *end = tx + aLength - plen + 1;
         while(tx < end) {
             size_t i = 0;
             for(; px[i] && (px[i] == tx[i]); ++i)
@@ -111,4 +121,117 @@ private:
     }
 };
 
+/**
+ * Finds which of several patterns occur in a text in a single pass over it (Aho-Corasick).
+ * Patterns are lower-cased like StringSearch does; texts have to be lower-case already.
+ * At most MAX_PATTERNS patterns are kept, the results being reported as bit masks; any
+ * more are dropped and isTruncated() tells, as matching would then find too much.
+ */
+class MultiStringSearch {
+public:
+    typedef uint64_t Mask;
+    enum { MAX_PATTERNS = 64 };
+
+    MultiStringSearch() : truncated(false) { build(); }
+    explicit MultiStringSearch(const StringList& aPatterns) : truncated(false) {
+        for(auto i = aPatterns.begin(); i != aPatterns.end(); ++i) {
+            add(*i);
+        }
+        build();
+    }
+
+    /**
+     * Add a pattern; build() has to be called before matching again.
+     * @return False if the pattern was dropped, there being MAX_PATTERNS already
+     */
+    bool add(const string& aPattern) {
+        if(aPattern.empty())
+            return true;
+        if(patterns.size() == MAX_PATTERNS) {
+            truncated = true;
+            return false;
+        }
+        patterns.push_back(Text::toLower(aPattern));
+        return true;
+    }
+
+    void build() noexcept {
+        states.assign(ASIZE, 0);
+        found.assign(1, 0);
+
+        // Trie of the patterns; 0 doubles as "no transition" since nothing leads back to the root
+        for(size_t i = 0; i < patterns.size(); ++i) {
+            uint32_t s = 0;
+            for(auto c = patterns[i].begin(); c != patterns[i].end(); ++c) {
+                size_t t = s * ASIZE + (uint8_t)*c;
+                if(states[t] == 0) {
+                    states.resize(states.size() + ASIZE, 0);
+                    states[t] = (uint32_t)found.size();
+                    found.push_back(0);
+                }
+                s = states[t];
+            }
+            found[s] |= Mask(1) << i;
+        }
+
+        // Turn it into an automaton, breadth first so that failure states are complete before use
+        vector<uint32_t> fail(found.size(), 0), queue;
+        for(size_t c = 0; c < ASIZE; ++c) {
+            if(states[c] != 0)
+                queue.push_back(states[c]);
+        }
+        for(size_t q = 0; q < queue.size(); ++q) {
+            uint32_t s = queue[q];
+            found[s] |= found[fail[s]];
+            for(size_t c = 0; c < ASIZE; ++c) {
+                uint32_t& next = states[s * ASIZE + c];
+                if(next != 0) {
+                    fail[next] = states[fail[s] * ASIZE + c];
+                    queue.push_back(next);
+                } else {
+                    next = states[fail[s] * ASIZE + c];
+                }
+            }
+        }
+    }
+
+    size_t size() const { return patterns.size(); }
+    bool empty() const { return patterns.empty(); }
+    /** Whether patterns were dropped, see add() */
+    bool isTruncated() const { return truncated; }
+    const string& getPattern(size_t i) const { return patterns[i]; }
+    Mask getAll() const { return patterns.size() == MAX_PATTERNS ? ~Mask(0) : (Mask(1) << patterns.size()) - 1; }
+
+    /**
+     * Match a lower-case text against the patterns in wanted.
+     * @return The patterns of wanted found in the text
+     */
+    Mask matchLower(const string& aLower, Mask wanted) const noexcept {
+        return matchLower(aLower.c_str(), wanted);
+    }
+
+    /** @param aLower A nul-terminated lower-case text */
+    Mask matchLower(const char* aLower, Mask wanted) const noexcept {
+        Mask ret = 0;
+        uint32_t s = 0;
+        for(const char* c = aLower; *c; ++c) {
+            s = states[s * ASIZE + (uint8_t)*c];
+            ret |= found[s] & wanted;
+            if(ret == wanted)
+                break;
+        }
+        return ret;
+    }
+
+private:
+    enum { ASIZE = 256 };
+
+    StringList patterns;
+    /** Transition table, ASIZE entries per state */
+    vector<uint32_t> states;
+    /** Patterns ending in each state */
+    vector<Mask> found;
+    bool truncated;
+};
+
 } // namespace dcpp
@@ -23,8 +23,12 @@
 #include "sys/prctl.h"
 #endif
 
+#include "CriticalSection.h"
+#include "Semaphore.h"
 #include "format.h"
 
+#include <atomic>
+
 namespace dcpp {
 
 #ifdef _WIN32
@@ -44,6 +48,159 @@ void Thread::start() {
 }
 #endif
 
+unsigned Thread::getProcessorCount() {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return max(info.dwNumberOfProcessors, (DWORD)1);
+#elif defined(_SC_NPROCESSORS_ONLN)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+#else
+    return 1;
+#endif
+}
+
+namespace {
+
+/** One runParallel call; the pool threads that pick it up share its items with the caller */
+struct Batch {
+    Batch(size_t aN, const std::function<void (size_t)>& aF) : f(aF), n(aN), next(0), left(aN) { }
+
+    void work() {
+        for(size_t i; (i = next++) < n; ) {
+            f(i);
+            if(--left == 0)
+                finished.signal();
+        }
+    }
+
+    // Only called while items are left, i.e. while the caller still waits in runParallel
+    const std::function<void (size_t)>& f;
+    const size_t n;
+    std::atomic<size_t> next;
+    std::atomic<size_t> left;
+    Semaphore finished;
+};
+
+/** Threads kept between runParallel calls, so that hot paths don't create threads every time */
+class Pool {
+public:
+    Pool() : stop(false) { }
+
+    /** Offer the batch to up to helpers pool threads, starting them as needed */
+    void add(const shared_ptr<Batch>& batch, size_t helpers) {
+        Lock l(cs);
+        if(stop)
+            return;
+
+        const size_t wanted = min(helpers, (size_t)Thread::getProcessorCount());
+        while(workers.size() < wanted) {
+            workers.push_back(unique_ptr<Worker>(new Worker(*this)));
+            try {
+                workers.back()->start();
+            } catch(const ThreadException&) {
+                workers.pop_back();
+                break;
+            }
+        }
+
+        for(size_t i = 0; i < min(helpers, workers.size()); ++i) {
+            queue.push_back(batch);
+            s.signal();
+        }
+    }
+
+    void shutdown() {
+        {
+            Lock l(cs);
+            stop = true;
+            queue.clear();
+            for(size_t i = 0; i < workers.size(); ++i)
+                s.signal();
+        }
+        for(auto i = workers.begin(); i != workers.end(); ++i)
+            (*i)->join();
+        workers.clear();
+    }
+
+private:
+    class Worker : public Thread {
+    public:
+        Worker(Pool& aPool) : pool(aPool) { }
+    private:
+        virtual int run() {
+            setThreadName("Parallel");
+            for(;;) {
+                pool.s.wait();
+                shared_ptr<Batch> batch;
+                {
+                    Lock l(pool.cs);
+                    if(pool.stop)
+                        break;
+                    if(pool.queue.empty())
+                        continue;
+                    batch = pool.queue.front();
+                    pool.queue.pop_front();
+                }
+                batch->work();
+            }
+            return 0;
+        }
+        Pool& pool;
+    };
+
+    CriticalSection cs;
+    Semaphore s;
+    deque<shared_ptr<Batch> > queue;
+    vector<unique_ptr<Worker> > workers;
+    bool stop;
+};
+
+CriticalSection poolCs;
+Pool* pool = NULL;
+bool poolShutdown = false;
+
+} // unnamed namespace
+
+void Thread::runParallel(size_t n, size_t threads, const std::function<void (size_t)>& f) {
+    // The calling thread always works, so 0 threads means it alone
+    threads = max<size_t>(min(threads, n), 1);
+    if(threads == 1) {
+        for(size_t i = 0; i < n; ++i)
+            f(i);
+        return;
+    }
+
+    auto batch = make_shared<Batch>(n, f);
+    {
+        Lock l(poolCs);
+        if(!pool && !poolShutdown)
+            pool = new Pool;
+        if(pool)
+            pool->add(batch, threads - 1);
+    }
+
+    // The caller takes items too, so the batch completes even when no pool thread is free
+    batch->work();
+    if(batch->left > 0)
+        batch->finished.wait();
+}
+
+void Thread::shutdownParallel() {
+    Pool* p;
+    {
+        Lock l(poolCs);
+        p = pool;
+        pool = NULL;
+        poolShutdown = true;
+    }
+    if(p) {
+        p->shutdown();
+        delete p;
+    }
+}
+
 void Thread::setThreadName(const char* const threadName) const {
 #ifdef _DEBUG
 
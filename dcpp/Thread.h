@@ -26,6 +26,8 @@
 #include <sys/resource.h>
 #endif
 
+#include <functional>
+
 #include <boost/noncopyable.hpp>
 #include "Exception.h"
 
@@ -98,6 +100,18 @@ public:
 
 #endif
 
+    /** @return number of online processors, at least 1 */
+    static unsigned getProcessorCount();
+
+    /**
+     * Call f(0) to f(n - 1), spread over the calling thread and up to threads - 1 threads of a
+     * shared pool, and wait for all; threads of 0 counts as 1. The pool threads are kept until
+     * shutdownParallel().
+     */
+    static void runParallel(size_t n, size_t threads, const std::function<void (size_t)>& f);
+    /** Stop the threads kept by runParallel; later calls run on the calling thread only */
+    static void shutdownParallel();
+
 protected:
     void setThreadName(const char* const threadName) const;
     virtual int run() = 0;
@@ -20,94 +20,153 @@
 
 #include "ThrottleManager.h"
 
-#include "DownloadManager.h"
 #include "Singleton.h"
 #include "Socket.h"
-#include "Thread.h"
 #include "TimerManager.h"
-#include "UploadManager.h"
 #include "ClientManager.h"
 
 namespace dcpp {
-/**
- * Manager for throttling traffic flow.
- * Inspired by Token Bucket algorithm: http://en.wikipedia.org/wiki/Token_bucket
- */
 
-/*
- * Throttles traffic and reads a packet from the network
- */
-int ThrottleManager::read(Socket* sock, void* buffer, size_t len)
-{
-    int64_t readSize = -1;
-    size_t downs = DownloadManager::getInstance()->getDownloadCount();
-    auto downLimit = getDownLimit(); // avoid even intra-function races
-    if(!BOOLSETTING(THROTTLE_ENABLE) || !getCurThrottling() || downLimit == 0 || downs == 0)
-        return sock->read(buffer, len);
+namespace {
 
-    {
-        Lock l(downCS);
+/** Takes up to want tokens from a pool that other threads take from as well */
+int64_t takeFrom(std::atomic<int64_t>& tokens, int64_t want) {
+    int64_t cur = tokens.load();
+    while(cur > 0) {
+        int64_t n = min(cur, want);
+        if(tokens.compare_exchange_weak(cur, cur - n))
+            return n;
+    }
+    return 0;
+}
 
-        if(downTokens > 0)
-        {
-            int64_t slice = (downLimit * 1024) / downs;
-            readSize = min(slice, min(static_cast<int64_t>(len), downTokens));
+}
 
-            // read from socket
-            readSize = sock->read(buffer, static_cast<size_t>(readSize));
+void ThrottleManager::Bucket::release() {
+    if(limiter) {
+        FastLock l(limiter->cs);
+        limiter->buckets.erase(std::remove(limiter->buckets.begin(), limiter->buckets.end(), this), limiter->buckets.end());
+        limiter = 0;
+    }
+}
 
-            if(readSize > 0)
-                downTokens -= readSize;
-        }
+size_t ThrottleManager::take(Limiter& l, Bucket& bucket, int limit, size_t len, size_t& spared) {
+    if(!bucket.limiter) {
+        FastLock lock(l.cs);
+        l.buckets.push_back(&bucket);
+        bucket.limiter = &l;
     }
+    dcassert(bucket.limiter == &l);
+
+    if(!bucket.active.load(std::memory_order_relaxed))
+        bucket.active.store(true, std::memory_order_relaxed);
+
+    // Whoever comes first after the interval has passed does the refill
+    uint64_t now = GET_TICK();
+    uint64_t last = l.lastRefill.load();
+    if(now >= last + REFILL_INTERVAL && l.lastRefill.compare_exchange_strong(last, now))
+        refill(l, limit, min(now - last, (uint64_t)BURST));
+
+    int64_t want = static_cast<int64_t>(len);
+    int64_t got = takeFrom(bucket.credit, want);
+    int64_t extra = got < want ? takeFrom(l.spare, want - got) : 0;
+    spared = static_cast<size_t>(extra);
+    return static_cast<size_t>(got + extra);
+}
+
+void ThrottleManager::giveBack(Limiter& l, Bucket& bucket, size_t len, size_t spared) {
+    // Unused spare tokens go back to the pool, or a connection that takes often but sends little would keep them
+    size_t toSpare = min(len, spared);
+    if(toSpare > 0)
+        l.spare.fetch_add(static_cast<int64_t>(toSpare));
+    if(len > toSpare)
+        bucket.credit.fetch_add(static_cast<int64_t>(len - toSpare));
+}
 
-    if(readSize != -1)
-    {
-        Thread::yield(); // give a chance to other transfers to get a token
-        return readSize;
+void ThrottleManager::refill(Limiter& l, int limit, uint64_t elapsed) {
+    int64_t tokens = static_cast<int64_t>(limit) * 1024 * elapsed / 1000;
+    int64_t burst = static_cast<int64_t>(limit) * 1024 * BURST / 1000;
+
+    FastLock lock(l.cs);
+
+    // Whatever wasn't used of the last shares is up for grabs
+    int64_t spare = l.spare.exchange(0);
+    l.active.clear();
+    for(auto i = l.buckets.begin(); i != l.buckets.end(); ++i) {
+        spare += (*i)->credit.exchange(0);
+        if((*i)->active.exchange(false))
+            l.active.push_back(*i);
     }
 
-    waitToken();
-    return -1;  // from BufferedSocket: -1 = retry, 0 = connection close
+    if(!l.active.empty()) {
+        int64_t share = tokens / static_cast<int64_t>(l.active.size());
+        for(auto i = l.active.begin(); i != l.active.end(); ++i)
+            (*i)->credit.fetch_add(share);
+        tokens -= share * static_cast<int64_t>(l.active.size());
+    }
+
+    l.spare.store(min(spare + tokens, burst));
 }
 
 /*
- * Throttles traffic and writes a packet to the network
- * Handle this a little bit differently than downloads due to OpenSSL stupidity
+ * Throttles traffic and reads a packet from the network
  */
-int ThrottleManager::write(Socket* sock, void* buffer, size_t& len)
+int ThrottleManager::read(Bucket& bucket, Socket* sock, void* buffer, size_t len)
 {
-    bool gotToken = false;
-    size_t ups = UploadManager::getInstance()->getUploadCount();
-    auto upLimit = getUpLimit(); // avoid even intra-function races
-    if(!BOOLSETTING(THROTTLE_ENABLE) || !getCurThrottling() || upLimit == 0 || ups == 0)
-        return sock->write(buffer, len);
-
-    {
-        Lock l(upCS);
+    auto downLimit = getDownLimit(); // avoid even intra-function races
+    if(!BOOLSETTING(THROTTLE_ENABLE) || downLimit == 0)
+        return sock->read(buffer, len);
 
-        if(upTokens > 0)
-        {
-            size_t slice = (upLimit * 1024) / ups;
-            len = min(slice, min(len, static_cast<size_t>(upTokens)));
-            upTokens -= len;
+    size_t spared;
+    size_t allowed = take(down, bucket, downLimit, len, spared);
+    if(allowed == 0)
+        return THROTTLED;
 
-            gotToken = true; // token successfuly assigned
-        }
-    }
+    int readSize = sock->read(buffer, allowed);
+    if(readSize < static_cast<int>(allowed))
+        giveBack(down, bucket, allowed - max(readSize, 0), spared);
+    return readSize;    // from BufferedSocket: -1 = retry, 0 = connection close
+}
 
-    if(gotToken)
-    {
-        // write to socket
-        int sent = sock->write(buffer, len);
+/*
+ * Limits len to the upload tokens available and sends that much with send(),
+ * which is called with no tokens taken when throttling is off
+ */
+template<bool keepBlocked, typename F>
+int ThrottleManager::throttleWrite(Bucket& bucket, size_t& len, F send)
+{
+    auto upLimit = getUpLimit(); // avoid even intra-function races
+    if(!BOOLSETTING(THROTTLE_ENABLE) || upLimit == 0)
+        return send();
+
+    size_t spared;
+    size_t allowed = take(up, bucket, upLimit, len, spared);
+    if(allowed == 0)
+        return THROTTLED;
+
+    len = allowed;
+    int sent = send();
+    if(sent >= 0 ? sent < static_cast<int>(allowed) : !keepBlocked)
+        giveBack(up, bucket, allowed - max(sent, 0), spared);
+    return sent;    // from BufferedSocket: -1 = failed
+}
 
-        Thread::yield(); // give a chance to other transfers get a token
-        return sent;
-    }
+/*
+ * Throttles traffic and writes a packet to the network
+ * Handle this a little bit differently than downloads due to OpenSSL stupidity:
+ * a write that would block is repeated with the same size without coming here, so its tokens stay taken
+ */
+int ThrottleManager::write(Bucket& bucket, Socket* sock, void* buffer, size_t& len)
+{
+    return throttleWrite<true>(bucket, len, [&] { return sock->write(buffer, len); });
+}
 
-    waitToken();
-    return 0;   // from BufferedSocket: -1 = failed, 0 = retry
+#ifdef __linux__
+int ThrottleManager::sendFile(Bucket& bucket, Socket* sock, int fd, int64_t& offset, size_t& len)
+{
+    return throttleWrite<false>(bucket, len, [&] { return sock->sendFile(fd, offset, len); });
 }
+#endif
 
 SettingsManager::IntSetting ThrottleManager::getCurSetting(SettingsManager::IntSetting setting) {
     SettingsManager::IntSetting upLimit   = SettingsManager::MAX_UPLOAD_SPEED_MAIN;
@@ -154,66 +213,11 @@ void ThrottleManager::setSetting(SettingsManager::IntSetting setting, int value)
         ClientManager::getInstance()->infoUpdated();
 }
 
-bool ThrottleManager::getCurThrottling() {
-    Lock l(stateCS);
-    return activeWaiter != -1;
-}
-
-void ThrottleManager::waitToken() {
-    // no tokens, wait for them, so long as throttling still active
-    // avoid keeping stateCS lock on whole function
-    CriticalSection *curCS = 0;
-    {
-        Lock l(stateCS);
-        if (activeWaiter != -1)
-            curCS = &waitCS[activeWaiter];
-    }
-    // possible post-CS aW shifts: 0->1/1->0: lock lands in wrong place, will
-    // either fall through immediately or wait depending on whether in
-    // stateCS-protected transition elsewhere; 0/1-> -1: falls through. Both harmless.
-    if (curCS)
-        Lock l(*curCS);
-}
-
 ThrottleManager::~ThrottleManager(void)
 {
-    shutdown();
     TimerManager::getInstance()->removeListener(this);
 }
 
-#ifdef _WIN32
-
-void ThrottleManager::shutdown() {
-    Lock l(stateCS);
-    if (activeWaiter != -1) {
-        waitCS[activeWaiter].unlock();
-        activeWaiter = -1;
-    }
-}
-#else //*nix
-
-void ThrottleManager::shutdown()
-{
-    bool wait = false;
-    {
-        Lock l(stateCS);
-        if (activeWaiter != -1)
-        {
-            n_lock = activeWaiter;
-            activeWaiter = -1;
-            halt = 1;
-            wait = true;
-        }
-    }
-
-    // wait shutdown...
-    if (wait)
-    {
-        Lock l(shutdownCS);
-    }
-}
-#endif //*nix
-
 // TimerManagerListener
 void ThrottleManager::on(TimerManagerListener::Second, uint64_t /* aTick */) noexcept
 {
@@ -221,67 +225,6 @@ void ThrottleManager::on(TimerManagerListener::Second, uint64_t /* aTick */) noe
     if(newSlots != SETTING(SLOTS)) {
         setSetting(SettingsManager::SLOTS, newSlots);
     }
-
-    {
-        Lock l(stateCS);
-
-#ifndef _WIN32 //*nix
-
-        if (halt == 1)
-        {
-            halt = -1;
-
-            // unlock shutdown and token wait
-            dcassert(n_lock == 0 || n_lock == 1);
-            waitCS[n_lock].unlock();
-            shutdownCS.unlock();
-
-            return;
-        }
-        else if (halt == -1)
-        {
-            return;
-        }
-#endif
-        if (activeWaiter == -1)
-        {
-            // This will create slight weirdness for the read/write calls between
-            // here and the first activeWaiter-toggle below.
-            waitCS[activeWaiter = 0].lock();
-
-#ifndef _WIN32 //*nix
-
-            // lock shutdown
-            shutdownCS.lock();
-#endif
-        }
-    }
-
-    int downLimit = getDownLimit();
-    int upLimit   = getUpLimit();
-
-    // readd tokens
-    {
-        Lock l(downCS);
-        downTokens = downLimit * 1024;
-    }
-
-    {
-        Lock l(upCS);
-        upTokens = upLimit * 1024;
-    }
-
-    // let existing events drain out (fairness).
-    // www.cse.wustl.edu/~schmidt/win32-cv-1.html documents various
-    // fairer strategies, but when only broadcasting, irrelevant
-    {
-        Lock l(stateCS);
-
-        dcassert(activeWaiter == 0 || activeWaiter == 1);
-        waitCS[1-activeWaiter].lock();
-        activeWaiter = 1-activeWaiter;
-        waitCS[1-activeWaiter].unlock();
-    }
 }
 
 }   // namespace dcpp
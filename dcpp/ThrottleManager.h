@@ -18,32 +18,72 @@
 
 #pragma once
 
+#include <atomic>
+
 #include "Singleton.h"
 #include "Socket.h"
 #include "TimerManager.h"
 #include "SettingsManager.h"
+#include "CriticalSection.h"
 
 namespace dcpp
 {
 /**
  * Manager for throttling traffic flow.
  * Inspired by Token Bucket algorithm: http://en.wikipedia.org/wiki/Token_bucket
+ *
+ * Each direction has a bucket that is refilled every REFILL_INTERVAL, shared out evenly among the
+ * connections that used it since the last refill. What a connection leaves unused goes to a spare
+ * pool that any connection can draw on once its own share is gone, so the limit is used in full
+ * even when some peers are slower than their share. Taking tokens needs no lock; nothing blocks,
+ * a connection that is out of tokens is told to retry after the next refill.
  */
 class ThrottleManager :
     public Singleton<ThrottleManager>, private TimerManagerListener
 {
+    struct Limiter;
 public:
+    enum {
+        /** Returned by read and write when the connection has to wait for the next refill */
+        THROTTLED = -2,
+        /** Milliseconds between refills */
+        REFILL_INTERVAL = 25,
+        /** Milliseconds worth of tokens that may be saved up for a burst */
+        BURST = 100
+    };
+
+    /** The share of a connection in one direction; owned by the connection, used from one thread at a time */
+    class Bucket : boost::noncopyable {
+    public:
+        Bucket() : credit(0), active(false), limiter(0) { }
+        ~Bucket() { release(); }
+        /** Unregisters the bucket; it registers again when it is next throttled */
+        void release();
+    private:
+        friend class ThrottleManager;
+        std::atomic<int64_t> credit;
+        std::atomic<bool> active;
+        /** Where the bucket is registered, 0 until first throttled */
+        Limiter* limiter;
+    };
 
     /*
      * Throttles traffic and reads a packet from the network
      */
-    int read(Socket* sock, void* buffer, size_t len);
+    int read(Bucket& bucket, Socket* sock, void* buffer, size_t len);
 
     /*
      * Throttles traffic and writes a packet to the network
      * Handle this a little bit differently than downloads due to OpenSSL stupidity
      */
-    int write(Socket* sock, void* buffer, size_t& len);
+    int write(Bucket& bucket, Socket* sock, void* buffer, size_t& len);
+
+#ifdef __linux__
+    /*
+     * Throttles traffic and sends part of a file to the network without copying it, see Socket::sendFile
+     */
+    int sendFile(Bucket& bucket, Socket* sock, int fd, int64_t& offset, size_t& len);
+#endif
 
     static SettingsManager::IntSetting getCurSetting(SettingsManager::IntSetting setting);
 
@@ -52,41 +92,43 @@ public:
 
     static void setSetting(SettingsManager::IntSetting setting, int value);
 
-    void shutdown();
 private:
-    // stack up throttled read & write threads
-    CriticalSection stateCS;
-    CriticalSection waitCS[2];
-    long activeWaiter;
+    /** The tokens of one direction */
+    struct Limiter {
+        Limiter() : lastRefill(0), spare(0) { }
 
-#ifndef _WIN32 //*nix
+        std::atomic<uint64_t> lastRefill;
+        std::atomic<int64_t> spare;
 
-    // shutdown wait
-    CriticalSection shutdownCS;
-    long n_lock, halt;
-#endif
-    // download limiter
-    CriticalSection downCS;
-    int64_t         downTokens;
+        /** Guards the bucket list, taken once per refill and when a connection starts or ends */
+        FastCriticalSection cs;
+        vector<Bucket*> buckets;
+        /** The buckets used since the previous refill, kept to save allocating it every time */
+        vector<Bucket*> active;
+    };
 
-    // upload limiter
-    CriticalSection upCS;
-    int64_t         upTokens;
+    Limiter down;
+    Limiter up;
 
     friend class Singleton<ThrottleManager>;
 
-    ThrottleManager(void) : activeWaiter(-1), downTokens(0), upTokens(0)
+    ThrottleManager(void)
     {
-#ifndef _WIN32 //*nix
-        n_lock = halt = 0;
-#endif
         TimerManager::getInstance()->addListener(this);
     }
 
     ~ThrottleManager(void);
 
-    bool getCurThrottling();
-    void waitToken();
+    /**
+     * @param spared Set to how many of the tokens came from the spare pool
+     * @return Up to len bytes worth of tokens for the bucket, 0 when it has to wait
+     */
+    size_t take(Limiter& l, Bucket& bucket, int limit, size_t len, size_t& spared);
+    /** Returns tokens that were taken but not used, to the spare pool as far as they came from it */
+    void giveBack(Limiter& l, Bucket& bucket, size_t len, size_t spared);
+    void refill(Limiter& l, int limit, uint64_t elapsed);
+
+    template<bool keepBlocked, typename F> int throttleWrite(Bucket& bucket, size_t& len, F send);
 
     // TimerManagerListener
     void on(TimerManagerListener::Second, uint64_t /* aTick */) noexcept;
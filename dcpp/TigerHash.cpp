@@ -44,6 +44,13 @@
 #define TIGER_ARCH64
 #endif
 
+// AVX2 kernel, compiled for a separate target and selected at runtime
+#if (defined(__amd64__) || defined(__x86_64__)) && !defined(TIGER_BIG_ENDIAN) && \
+	(defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define TIGER_AVX2
+#include <immintrin.h>
+#endif
+
 namespace dcpp {
 
 using std::min;
@@ -253,6 +260,196 @@ uint8_t* TigerHash::finalize() {
 	return getResult();
 }
 
+/*
+ * Multi-buffer hashing. Tiger is one long chain of dependent table lookups, so a
+ * single message leaves most of a modern core idle; compressing several independent
+ * messages in lockstep lets their chains overlap. Tree leaves are short messages of
+ * identical length, which makes them a perfect fit. The lanes are compressed by AVX2
+ * gathers; on other CPUs transposing the blocks costs more than it gains, so the
+ * messages are simply hashed one after the other.
+ */
+
+#ifdef TIGER_AVX2
+
+#define avx_lookup(c,byte,t) \
+	_mm256_i64gather_epi64((const long long*)(t), _mm256_and_si256(_mm256_srli_epi64(c, (byte)*8), mask), 8)
+
+#define avx_mul5(b) _mm256_add_epi64(_mm256_slli_epi64(b, 2), b)
+#define avx_mul7(b) _mm256_sub_epi64(_mm256_slli_epi64(b, 3), b)
+#define avx_mul9(b) _mm256_add_epi64(_mm256_slli_epi64(b, 3), b)
+
+#define avx_round(a,b,c,x,mul) \
+	c = _mm256_xor_si256(c, x); \
+	a = _mm256_sub_epi64(a, _mm256_xor_si256( \
+		_mm256_xor_si256(avx_lookup(c,0,t1), avx_lookup(c,2,t2)), \
+		_mm256_xor_si256(avx_lookup(c,4,t3), avx_lookup(c,6,t4)))); \
+	b = _mm256_add_epi64(b, _mm256_xor_si256( \
+		_mm256_xor_si256(avx_lookup(c,1,t4), avx_lookup(c,3,t3)), \
+		_mm256_xor_si256(avx_lookup(c,5,t2), avx_lookup(c,7,t1)))); \
+	b = avx_mul##mul(b);
+
+#define avx_pass(a,b,c,mul) \
+	avx_round(a,b,c,x0,mul) \
+	avx_round(b,c,a,x1,mul) \
+	avx_round(c,a,b,x2,mul) \
+	avx_round(a,b,c,x3,mul) \
+	avx_round(b,c,a,x4,mul) \
+	avx_round(c,a,b,x5,mul) \
+	avx_round(a,b,c,x6,mul) \
+	avx_round(b,c,a,x7,mul)
+
+#define avx_not(x) _mm256_xor_si256(x, ones)
+
+#define avx_key_schedule \
+	x0 = _mm256_sub_epi64(x0, _mm256_xor_si256(x7, _mm256_set1_epi64x(_ULL(0xA5A5A5A5A5A5A5A5)))); \
+	x1 = _mm256_xor_si256(x1, x0); \
+	x2 = _mm256_add_epi64(x2, x1); \
+	x3 = _mm256_sub_epi64(x3, _mm256_xor_si256(x2, _mm256_slli_epi64(avx_not(x1), 19))); \
+	x4 = _mm256_xor_si256(x4, x3); \
+	x5 = _mm256_add_epi64(x5, x4); \
+	x6 = _mm256_sub_epi64(x6, _mm256_xor_si256(x5, _mm256_srli_epi64(avx_not(x4), 23))); \
+	x7 = _mm256_xor_si256(x7, x6); \
+	x0 = _mm256_add_epi64(x0, x7); \
+	x1 = _mm256_sub_epi64(x1, _mm256_xor_si256(x0, _mm256_slli_epi64(avx_not(x7), 19))); \
+	x2 = _mm256_xor_si256(x2, x1); \
+	x3 = _mm256_add_epi64(x3, x2); \
+	x4 = _mm256_sub_epi64(x4, _mm256_xor_si256(x3, _mm256_srli_epi64(avx_not(x2), 23))); \
+	x5 = _mm256_xor_si256(x5, x4); \
+	x6 = _mm256_add_epi64(x6, x5); \
+	x7 = _mm256_sub_epi64(x7, _mm256_xor_si256(x6, _mm256_set1_epi64x(_ULL(0x0123456789ABCDEF))));
+
+/** Compresses one block of each lane; data holds the 8 message words word-major (data[word][lane]) */
+__attribute__((target("avx2")))
+void TigerHash::compressLanesAvx2(const uint64_t data[8][LANES], uint64_t state[3][LANES]) {
+	const __m256i mask = _mm256_set1_epi64x(0xFF);
+	const __m256i ones = _mm256_set1_epi64x(-1);
+
+	__m256i a = _mm256_loadu_si256((const __m256i*)state[0]);
+	__m256i b = _mm256_loadu_si256((const __m256i*)state[1]);
+	__m256i c = _mm256_loadu_si256((const __m256i*)state[2]);
+	const __m256i aa = a, bb = b, cc = c;
+
+	__m256i x0 = _mm256_loadu_si256((const __m256i*)data[0]);
+	__m256i x1 = _mm256_loadu_si256((const __m256i*)data[1]);
+	__m256i x2 = _mm256_loadu_si256((const __m256i*)data[2]);
+	__m256i x3 = _mm256_loadu_si256((const __m256i*)data[3]);
+	__m256i x4 = _mm256_loadu_si256((const __m256i*)data[4]);
+	__m256i x5 = _mm256_loadu_si256((const __m256i*)data[5]);
+	__m256i x6 = _mm256_loadu_si256((const __m256i*)data[6]);
+	__m256i x7 = _mm256_loadu_si256((const __m256i*)data[7]);
+
+	avx_pass(a,b,c,5)
+	avx_key_schedule
+	avx_pass(c,a,b,7)
+	avx_key_schedule
+	avx_pass(b,c,a,9)
+
+	_mm256_storeu_si256((__m256i*)state[0], _mm256_xor_si256(a, aa));
+	_mm256_storeu_si256((__m256i*)state[1], _mm256_sub_epi64(b, bb));
+	_mm256_storeu_si256((__m256i*)state[2], _mm256_add_epi64(c, cc));
+}
+
+static bool hasAvx2() {
+	static const bool avx2 = __builtin_cpu_supports("avx2");
+	return avx2;
+}
+
+void TigerHash::hashMultiAvx2(const uint8_t* const* data, size_t len, uint8_t prefix, size_t count, uint8_t* out) {
+	const size_t total = len + 1;
+
+	for(size_t first = 0; first < count; first += LANES) {
+		const size_t n = min((size_t)LANES, count - first);
+		const uint8_t* lane[LANES];
+		for(int l = 0; l < LANES; ++l)
+			lane[l] = data[first + min((size_t)l, n - 1)];
+
+		uint64_t state[3][LANES];
+		for(int l = 0; l < LANES; ++l) {
+			state[0][l] = _ULL(0x0123456789ABCDEF);
+			state[1][l] = _ULL(0xFEDCBA9876543210);
+			state[2][l] = _ULL(0xF096A5B4C3B2E187);
+		}
+
+		uint64_t blocks[LANES][BLOCK_SIZE / 8];
+		uint64_t words[8][LANES];
+		size_t pos = 0;
+		bool last = false;
+		while(!last) {
+			// Gather the next block of every lane: the prefix byte shifts the data by one
+			size_t chunk = min(total - pos, (size_t)BLOCK_SIZE);
+			for(int l = 0; l < LANES; ++l) {
+				uint8_t* block = (uint8_t*)blocks[l];
+				if(pos == 0) {
+					block[0] = prefix;
+					memcpy(block + 1, lane[l], chunk - 1);
+				} else {
+					memcpy(block, lane[l] + pos - 1, chunk);
+				}
+			}
+			pos += chunk;
+
+			if(chunk < BLOCK_SIZE) {
+				// Padding: 0x01, zeros, and the bit length in the last word (possibly in an extra block)
+				for(int l = 0; l < LANES; ++l) {
+					uint8_t* block = (uint8_t*)blocks[l];
+					block[chunk] = 0x01;
+					memset(block + chunk + 1, 0, BLOCK_SIZE - chunk - 1);
+				}
+				if(chunk + 1 > BLOCK_SIZE - sizeof(uint64_t)) {
+					for(int w = 0; w < 8; ++w)
+						for(int l = 0; l < LANES; ++l)
+							words[w][l] = blocks[l][w];
+					compressLanesAvx2(words, state);
+					for(int l = 0; l < LANES; ++l)
+						memset(blocks[l], 0, BLOCK_SIZE);
+				}
+				for(int l = 0; l < LANES; ++l)
+					blocks[l][7] = (uint64_t)total << 3;
+				last = true;
+			} else if(pos == total) {
+				// Exact multiple of the block size; the padding goes in a block of its own
+				for(int w = 0; w < 8; ++w)
+					for(int l = 0; l < LANES; ++l)
+						words[w][l] = blocks[l][w];
+				compressLanesAvx2(words, state);
+				for(int l = 0; l < LANES; ++l) {
+					memset(blocks[l], 0, BLOCK_SIZE);
+					((uint8_t*)blocks[l])[0] = 0x01;
+					blocks[l][7] = (uint64_t)total << 3;
+				}
+				last = true;
+			}
+
+			for(int w = 0; w < 8; ++w)
+				for(int l = 0; l < LANES; ++l)
+					words[w][l] = blocks[l][w];
+			compressLanesAvx2(words, state);
+		}
+
+		for(size_t l = 0; l < n; ++l) {
+			uint64_t res[3] = { state[0][l], state[1][l], state[2][l] };
+			memcpy(out + (first + l) * BYTES, res, BYTES);
+		}
+	}
+}
+
+#endif // TIGER_AVX2
+
+void TigerHash::hashMulti(const uint8_t* const* data, size_t len, uint8_t prefix, size_t count, uint8_t* out) {
+#ifdef TIGER_AVX2
+	if(hasAvx2()) {
+		hashMultiAvx2(data, len, prefix, count, out);
+		return;
+	}
+#endif
+	for(size_t i = 0; i < count; ++i) {
+		TigerHash h;
+		h.update(&prefix, 1);
+		h.update(data[i], len);
+		memcpy(out + i * BYTES, h.finalize(), BYTES);
+	}
+}
+
 uint64_t TigerHash::table[4*256] = {
 	_ULL(0x02AAB17CF7E90C5E)   /*    0 */,    _ULL(0xAC424B03E243A8EC)   /*    1 */,
 		_ULL(0x72CD5BE30DD5FCD3)   /*    2 */,    _ULL(0x6D019B93F6F97F3A)   /*    3 */,
@@ -55,6 +55,17 @@ public:
 	uint8_t* finalize();
 
 	uint8_t* getResult() { return (uint8_t*) res; }
+
+	/** Number of messages hashMulti compresses side by side */
+	enum { LANES = 4 };
+
+	/**
+	 * Calculates the Tiger hashes of count independent messages at once; message i
+	 * is the byte prefix followed by len bytes at data[i]. This is the shape of
+	 * tree leaves, and hashing them together is considerably faster than one by one.
+	 * @param out Receives count consecutive hashes of BYTES each
+	 */
+	static void hashMulti(const uint8_t* const* data, size_t len, uint8_t prefix, size_t count, uint8_t* out);
 private:
 	enum { BLOCK_SIZE = 512/8 };
 	/** 512 bit blocks for the compress function */
@@ -67,6 +78,9 @@ private:
 	static uint64_t table[];
 
 	void tigerCompress(const uint64_t* data, uint64_t state[3]);
+
+	static void hashMultiAvx2(const uint8_t* const* data, size_t len, uint8_t prefix, size_t count, uint8_t* out);
+	static void compressLanesAvx2(const uint64_t data[8][LANES], uint64_t state[3][LANES]);
 };
 
 } // namespace dcpp
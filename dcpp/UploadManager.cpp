@@ -106,15 +106,11 @@ bool UploadManager::prepareFile(UserConnection& aSource, const string& aType, co
             sourceFile = ShareManager::getInstance()->toReal(aFile);
 
             if(aFile == Transfer::USER_LIST_NAME) {
-                // Unpack before sending...
-                string bz2 = File(sourceFile, File::READ, File::OPEN).read();
-                string xml;
-                CryptoManager::getInstance()->decodeBZ2(reinterpret_cast<const uint8_t*>(bz2.data()), bz2.size(), xml);
-                // Clear to save some memory...
-                string().swap(bz2);
-                is = new MemoryInputStream(xml);
+                // Unpacked once per list and shared by everyone downloading it
+                ShareManager::ListPtr xml = ShareManager::getInstance()->getXmlList();
+                is = new SharedInputStream(xml);
                 start = 0;
-                fileSize = size = xml.size();
+                fileSize = size = xml->size();
             } else {
                 {
                     ShareManager *SM = ShareManager::getInstance();
@@ -171,15 +167,15 @@ bool UploadManager::prepareFile(UserConnection& aSource, const string& aType, co
             type = Transfer::TYPE_TREE;
         } else if(aType == Transfer::names[Transfer::TYPE_PARTIAL_LIST]) {
             // Partial file list
-            MemoryInputStream* mis = ShareManager::getInstance()->generatePartialList(aFile, listRecursive);
-            if(mis == NULL) {
+            ShareManager::ListPtr xml = ShareManager::getInstance()->generatePartialList(aFile, listRecursive);
+            if(!xml) {
                 aSource.fileNotAvail();
                 return false;
             }
 
             start = 0;
-            fileSize = size = mis->getSize();
-            is = mis;
+            fileSize = size = xml->size();
+            is = new SharedInputStream(xml);
             free = true;
             type = Transfer::TYPE_PARTIAL_LIST;
         } else {
@@ -377,6 +373,11 @@ void UploadManager::on(UserConnectionListener::Get, UserConnection* aSource, con
         return;
     }
 
+    // Opening the file or generating a list blocks
+    aSource->offload([=] { get(aSource, aFile, aResume); });
+}
+
+void UploadManager::get(UserConnection* aSource, const string& aFile, int64_t aResume) {
     if(prepareFile(*aSource, Transfer::names[Transfer::TYPE_FILE], Util::toAdcFile(aFile), aResume, -1)) {
         aSource->setState(UserConnection::STATE_SEND);
         aSource->fileLength(Util::toString(aSource->getUpload()->getSize()));
@@ -405,6 +406,12 @@ void UploadManager::on(AdcCommand::GET, UserConnection* aSource, const AdcComman
         return;
     }
 
+    // Opening the file or generating a list blocks
+    AdcCommand cmd(c);
+    aSource->offload([=] { get(aSource, cmd); });
+}
+
+void UploadManager::get(UserConnection* aSource, const AdcCommand& c) {
     const string& type = c.getParam(0);
     const string& fname = c.getParam(1);
     int64_t aStartPos = Util::toInt64(c.getParam(2));
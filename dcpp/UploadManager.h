@@ -128,6 +128,10 @@ private:
     virtual void on(AdcCommand::GET, UserConnection*, const AdcCommand&) noexcept;
     virtual void on(AdcCommand::GFI, UserConnection*, const AdcCommand&) noexcept;
 
+    /** The parts of the Get and GET handlers that block, offloaded from the socket's thread */
+    void get(UserConnection* aSource, const string& aFile, int64_t aResume);
+    void get(UserConnection* aSource, const AdcCommand& c);
+
     bool prepareFile(UserConnection& aSource, const string& aType, const string& aFile, int64_t aResume, int64_t aBytes, bool listRecursive = false);
 };
 
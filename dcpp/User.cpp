@@ -27,12 +27,52 @@
 
 namespace dcpp {
 
-FastCriticalSection Identity::cs;
+namespace {
+
+/** Aligned, and so padded, to a cache line of its own so that neighbouring locks don't share one */
+struct alignas(64) IdentityLock {
+    FastCriticalSection cs;
+};
+
+}
 
 OnlineUser::OnlineUser(const UserPtr& ptr, ClientBase& client_, uint32_t sid_) : identity(ptr, sid_), client(client_) {
 
 }
 
+FastCriticalSection& Identity::getLock() const {
+    static IdentityLock locks[LOCKS];
+    return locks[(reinterpret_cast<uintptr_t>(this) / sizeof(Identity)) % LOCKS].cs;
+}
+
+Identity& Identity::operator=(const Identity& rhs) {
+    if(this == &rhs)
+        return *this;
+
+    // Copy first so that no two identity locks are ever held at once
+    UserPtr u;
+    InfMap i;
+    {
+        FastLock l(rhs.getLock());
+        u = rhs.user;
+        i = rhs.info;
+    }
+
+    FastLock l(getLock());
+    user.swap(u);
+    info.swap(i);
+    return *this;
+}
+
+Identity::InfIterC Identity::find(const char* name) const {
+    short key = *(short*)name;
+    for(InfIterC i = info.begin(); i != info.end(); ++i) {
+        if(i->first == key)
+            return i;
+    }
+    return info.end();
+}
+
 bool Identity::isTcpActive(const Client* c) const {
     if(c != NULL && user == ClientManager::getInstance()->getMe()) {
         return c->isActive(); // userlist should display our real mode
@@ -51,7 +91,7 @@ bool Identity::isUdpActive() const {
 
 void Identity::getParams(StringMap& sm, const string& prefix, bool compatibility, bool dht) const {
     {
-        FastLock l(cs);
+        FastLock l(getLock());
         for(InfMap::const_iterator i = info.begin(); i != info.end(); ++i) {
             sm[prefix + string((char*)(&i->first), 2)] = i->second;
         }
@@ -99,24 +139,30 @@ string Identity::getTag() const {
 }
 
 string Identity::get(const char* name) const {
-    FastLock l(cs);
-    InfMap::const_iterator i = info.find(*(short*)name);
+    FastLock l(getLock());
+    InfIterC i = find(name);
     return i == info.end() ? Util::emptyString : i->second;
 }
 
 bool Identity::isSet(const char* name) const {
-    FastLock l(cs);
-    InfMap::const_iterator i = info.find(*(short*)name);
-    return i != info.end();
+    FastLock l(getLock());
+    return find(name) != info.end();
 }
 
 
 void Identity::set(const char* name, const string& val) {
-    FastLock l(cs);
-    if(val.empty())
-        info.erase(*(short*)name);
-    else
-        info[*(short*)name] = val;
+    FastLock l(getLock());
+    InfIter i = info.begin() + (find(name) - info.begin());
+    if(val.empty()) {
+        if(i != info.end()) {
+            *i = move(info.back());
+            info.pop_back();
+        }
+    } else if(i != info.end()) {
+        i->second = val;
+    } else {
+        info.push_back(make_pair(*(short*)name, val));
+    }
 }
 
 bool Identity::supports(const string& name) const {
@@ -132,7 +178,7 @@ bool Identity::supports(const string& name) const {
 std::map<string, string> Identity::getInfo() const {
     std::map<string, string> ret;
 
-    FastLock l(cs);
+    FastLock l(getLock());
     for(InfIterC i = info.begin(); i != info.end(); ++i) {
         ret[string((char*)(&i->first), 2)] = i->second;
     }
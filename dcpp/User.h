@@ -130,7 +130,7 @@ public:
     Identity() { }
     Identity(const UserPtr& ptr, uint32_t aSID) : user(ptr) { setSID(aSID); }
     Identity(const Identity& rhs) { *this = rhs; } // Use operator= since we have to lock before reading...
-    Identity& operator=(const Identity& rhs) { FastLock l(cs); user = rhs.user; info = rhs.info; return *this; }
+    Identity& operator=(const Identity& rhs);
     ~Identity() { }
 // GS is already defined on some systems (e.g. OpenSolaris)
 #ifdef GS
@@ -178,12 +178,17 @@ public:
     GETSET(UserPtr, user, User);
     GETSET(uint32_t, sid, SID);
 private:
-    typedef std::unordered_map<short, string> InfMap;
+    /** An INF has a few dozen fields at most, so a linear scan beats hashing, at a fraction of the memory */
+    typedef std::vector<std::pair<short, string> > InfMap;
     typedef InfMap::iterator InfIter;
     typedef InfMap::const_iterator InfIterC;
     InfMap info;
 
-    static FastCriticalSection cs;
+    /** Identities are guarded by a lock from a small table, picked by address */
+    enum { LOCKS = 64 };
+    FastCriticalSection& getLock() const;
+
+    InfIterC find(const char* name) const;
 };
 
 class Client;
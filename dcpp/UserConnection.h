@@ -138,6 +138,8 @@ public:
 
     void setDataMode(int64_t aBytes = -1) { dcassert(socket); socket->setDataMode(aBytes); }
     void setLineMode(size_t rollback) { dcassert(socket); socket->setLineMode(rollback); }
+    void pauseReading() { dcassert(socket); socket->pauseReading(); }
+    void resumeReading() { dcassert(socket); socket->resumeReading(); }
 
     void connect(const string& aServer, uint16_t aPort, uint16_t localPort, const BufferedSocket::NatRoles natRole) throw(SocketException, ThreadException);
     void accept(const Socket& aServer) throw(SocketException, ThreadException);
@@ -146,6 +148,15 @@ public:
 
     void disconnect(bool graceless = false) { if(socket) socket->disconnect(graceless); }
     void transmitFile(InputStream* f) { socket->transmitFile(f); }
+    /** Runs f away from the socket's thread, see BufferedSocket::offload; called from a listener */
+    void offload(const std::function<void ()>& f) {
+        try {
+            socket->offload(f);
+        } catch(const ThreadException&) {
+            // Late rather than lost; the transfer state depends on it
+            f();
+        }
+    }
 
     const string& getDirectionString() {
         dcassert(isSet(FLAG_UPLOAD) ^ isSet(FLAG_DOWNLOAD));
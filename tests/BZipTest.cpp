@@ -0,0 +1,228 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Checks ParallelBZFilter and ParallelUnBZFilter against libbz2 on its own
+ * (BZFilter and UnBZFilter): each side has to decompress what the other
+ * compressed, for sizes around the block boundaries, and a single block has
+ * to come out exactly as libbz2 makes it. Also checked are streams whose
+ * block data holds the end of stream pattern, which the parallel
+ * decompressor first takes for the end. The throughput of both is reported.
+ *
+ * Usage: bzip-test [MiB]
+ */
+
+#include "dcpp/stdinc.h"
+#include "dcpp/BZUtils.h"
+#include "dcpp/FilteredFile.h"
+#include "dcpp/Streams.h"
+#include "dcpp/TimerManager.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+using namespace dcpp;
+
+namespace {
+
+const uint64_t END_MAGIC = 0x177245385090ULL;
+
+template<typename Filter>
+string compress(const string& data) {
+    string ret;
+    StringOutputStream sos(ret);
+    FilteredOutputStream<Filter, false> f(&sos);
+    // In pieces, as the file list is written
+    for(size_t pos = 0; pos < data.size(); pos += 100 * 1024)
+        f.write(data.data() + pos, min(data.size() - pos, (size_t)100 * 1024));
+    f.flush();
+    return ret;
+}
+
+template<typename Filter>
+string decompress(const string& data) {
+    MemoryInputStream mis(data);
+    FilteredInputStream<Filter, false> f(&mis);
+    string ret;
+    char buf[64 * 1024];
+    for(size_t n = sizeof(buf); (n = f.read(buf, n)) > 0; n = sizeof(buf))
+        ret.append(buf, n);
+    return ret;
+}
+
+/** @return How many times the end of stream pattern occurs in the stream, wherever it starts */
+size_t countEndPatterns(const string& stream) {
+    size_t n = 0;
+    uint64_t window = 0;
+    const uint64_t mask = (uint64_t(1) << 48) - 1;
+    for(size_t bit = 0; bit < stream.size() * 8; ++bit) {
+        window = ((window << 1) | ((stream[bit / 8] >> (7 - bit % 8)) & 1)) & mask;
+        if(bit >= 47 && window == END_MAGIC)
+            n++;
+    }
+    return n;
+}
+
+/** Text, with some repetition, as file lists are */
+string makeText(size_t size) {
+    static const char* words[] = { "<File Name=\"", "Track ", ".mp3\" Size=\"", "\" TTH=\"", "\"/>\r\n", "Artist - ",
+        "<Directory Name=\"", "Album ", "\">\r\n", "</Directory>\r\n" };
+    string ret;
+    ret.reserve(size + 32);
+    while(ret.size() < size) {
+        ret += words[rand() % 10];
+        ret += Util::toString(rand() % 10000);
+    }
+    ret.resize(size);
+    return ret;
+}
+
+string makeRandom(size_t size) {
+    string ret(size, 0);
+    for(size_t i = 0; i < size; ++i)
+        ret[i] = (char)rand();
+    return ret;
+}
+
+/**
+ * Data whose every bzip2 block starts with the end of stream pattern: right after the header, a
+ * block lists the bytes it uses, 16 bits for which groups of 16 byte values occur and then 16 bits
+ * for each of those groups, so the bytes are picked to spell 0x1772, 0x4538 and 0x5090 there.
+ * Runs are kept shorter than 4 so that the initial run-length encoding adds no other bytes.
+ */
+string makeEndPattern(size_t size) {
+    // Groups 3, 5, 6, 7, 9, 10, 11 and 14 (0x1772); in group 3 0x4538, in group 5 0x5090
+    const uint8_t bytes[] = { 49, 53, 55, 58, 59, 60, 81, 83, 88, 91, 96, 112, 144, 160, 176, 224 };
+    string ret(size, 0);
+    for(size_t i = 0; i < size; ++i) {
+        ret[i] = (char)bytes[rand() % sizeof(bytes)];
+        if(i >= 3 && ret[i] == ret[i - 1] && ret[i] == ret[i - 2] && ret[i] == ret[i - 3])
+            ret[i] = (char)(ret[i] == (char)bytes[0] ? bytes[1] : bytes[0]);
+    }
+    return ret;
+}
+
+int failures = 0;
+
+void check(const string& what, bool ok) {
+    if(!ok) {
+        printf("FAIL: %s\n", what.c_str());
+        failures++;
+    }
+}
+
+/** Compresses and decompresses the data every way there is */
+void roundTrips(const string& name, const string& data) {
+    try {
+        string single = compress<BZFilter>(data);
+        string parallel = compress<ParallelBZFilter>(data);
+
+        check(name + ": libbz2 decompressing its own", decompress<UnBZFilter>(single) == data);
+        check(name + ": libbz2 decompressing the parallel one", decompress<UnBZFilter>(parallel) == data);
+        check(name + ": parallel decompressing libbz2's", decompress<ParallelUnBZFilter>(single) == data);
+        check(name + ": parallel decompressing its own", decompress<ParallelUnBZFilter>(parallel) == data);
+
+        // A single block is made by libbz2 alone
+        if(data.size() < 700 * 1000)
+            check(name + ": a single block the same as libbz2's", parallel == single);
+    } catch(const Exception& e) {
+        check(name + ": " + e.getError(), false);
+    }
+}
+
+/** @return MiB/s */
+double throughput(size_t bytes, uint64_t ms) {
+    return bytes / (1024.0 * 1024.0) / (max(ms, (uint64_t)1) / 1000.0);
+}
+
+} // unnamed namespace
+
+int main(int argc, char** argv) {
+    int mib = argc > 1 ? atoi(argv[1]) : 32;
+
+    srand(1);
+
+    const size_t sizes[] = { 0, 1, 1000, 700 * 1000 - 1, 700 * 1000, 700 * 1000 + 1, 900 * 1000, 2 * 1024 * 1024 + 3 };
+    for(size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        roundTrips("text of " + Util::toString(sizes[i]) + " bytes", makeText(sizes[i]));
+        roundTrips("random data of " + Util::toString(sizes[i]) + " bytes", makeRandom(sizes[i]));
+    }
+
+    // The end of stream pattern in the data of one block and of several
+    const size_t patternSizes[] = { 100 * 1000, 3 * 1000 * 1000 };
+    for(size_t i = 0; i < sizeof(patternSizes) / sizeof(patternSizes[0]); ++i) {
+        string data = makeEndPattern(patternSizes[i]);
+        string name = "end pattern in " + Util::toString(patternSizes[i]) + " bytes";
+        string single = compress<BZFilter>(data);
+        string parallel = compress<ParallelBZFilter>(data);
+        // Once in each block and once at the end
+        check(name + ": the pattern isn't in the block data", countEndPatterns(single) > 1 && countEndPatterns(parallel) > 1);
+        roundTrips(name, data);
+    }
+
+    // A stream cut short or corrupted fails rather than producing something
+    {
+        string data = makeText(1500 * 1000);
+        string parallel = compress<ParallelBZFilter>(data);
+        bool threw = false;
+        try {
+            decompress<ParallelUnBZFilter>(parallel.substr(0, parallel.size() / 2));
+        } catch(const Exception&) {
+            threw = true;
+        }
+        check("a stream cut short", threw);
+
+        threw = false;
+        parallel[parallel.size() / 3] ^= 0x10;
+        try {
+            threw = decompress<ParallelUnBZFilter>(parallel) != data;
+        } catch(const Exception&) {
+            threw = true;
+        }
+        check("a corrupted stream", threw);
+    }
+
+    // Throughput
+    {
+        string data = makeText((size_t)mib * 1024 * 1024);
+
+        uint64_t start = GET_TICK();
+        string single = compress<BZFilter>(data);
+        uint64_t singleTook = GET_TICK() - start;
+
+        start = GET_TICK();
+        string parallel = compress<ParallelBZFilter>(data);
+        uint64_t parallelTook = GET_TICK() - start;
+
+        start = GET_TICK();
+        bool singleOk = decompress<UnBZFilter>(single) == data;
+        uint64_t unSingleTook = GET_TICK() - start;
+
+        start = GET_TICK();
+        bool parallelOk = decompress<ParallelUnBZFilter>(parallel) == data;
+        uint64_t unParallelTook = GET_TICK() - start;
+
+        check("throughput round trips", singleOk && parallelOk);
+        printf("%d MiB of text on %u threads: compressing %.1f MiB/s with libbz2, %.1f MiB/s in parallel; "
+            "decompressing %.1f MiB/s with libbz2, %.1f MiB/s in parallel\n", mib, Thread::getProcessorCount(),
+            throughput(data.size(), singleTook), throughput(data.size(), parallelTook),
+            throughput(data.size(), unSingleTook), throughput(data.size(), unParallelTook));
+    }
+
+    if(failures == 0)
+        printf("OK\n");
+    return failures == 0 ? 0 : 1;
+}
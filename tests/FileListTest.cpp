@@ -0,0 +1,356 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Checks the file list tokenizer of DirectoryListing against the loader it
+ * replaced, which went through SimpleXMLReader: entities, CDATA sections,
+ * tags and attributes split across reads and across the read buffer, and
+ * malformed lists, which have to throw. Then both parse a list of the names
+ * in a real directory tree, or a files.xml(.bz2) given, and have to build the
+ * same listing; how long each took is reported.
+ *
+ * Usage: filelist-test [directory or file list] [max files]
+ */
+
+#include "dcpp/stdinc.h"
+#include "dcpp/BZUtils.h"
+#include "dcpp/DirectoryListing.h"
+#include "dcpp/File.h"
+#include "dcpp/FilteredFile.h"
+#include "dcpp/SettingsManager.h"
+#include "dcpp/SimpleXML.h"
+#include "dcpp/SimpleXMLReader.h"
+#include "dcpp/StringTokenizer.h"
+#include "dcpp/TimerManager.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+using namespace dcpp;
+
+namespace {
+
+typedef DirectoryListing::Directory Directory;
+
+/** The loader as it was before the tokenizer, for lists that aren't updates */
+class ReferenceLoader : public SimpleXMLReader::CallBack {
+public:
+    ReferenceLoader(Directory* root) : cur(root), inListing(false), isMediaInfoList(false), checkedMediaInfo(false) { }
+
+    virtual void startTag(const string& name, StringPairList& attribs, bool simple) {
+        if(inListing) {
+            if(name == "File") {
+                const string& n = getAttrib(attribs, "Name", 0);
+                if(n.empty())
+                    return;
+                const string& s = getAttrib(attribs, "Size", 1);
+                if(s.empty())
+                    return;
+                const string& h = getAttrib(attribs, "TTH", 2);
+                if(h.empty())
+                    return;
+
+                DirectoryListing::File* f = new DirectoryListing::File(cur, n, Util::toInt64(s), TTHValue(h));
+
+                string ts;
+                if(!checkedMediaInfo) {
+                    checkedMediaInfo = true;
+                    ts = getAttrib(attribs, "TS", 3);
+                    isMediaInfoList = !ts.empty();
+                } else if(isMediaInfoList) {
+                    ts = getAttrib(attribs, "TS", 3);
+                }
+                if(!ts.empty()) {
+                    f->mediaInfo.video_info = getAttrib(attribs, "MV", 3);
+                    f->mediaInfo.audio_info = getAttrib(attribs, "MA", 3);
+                    f->mediaInfo.resolution = getAttrib(attribs, "WH", 3);
+                    f->mediaInfo.bitrate = atoi(getAttrib(attribs, "BR", 4).c_str());
+                }
+                cur->files.push_back(f);
+            } else if(name == "Directory") {
+                const string& n = getAttrib(attribs, "Name", 0);
+                if(n.empty())
+                    throw SimpleXMLException("Directory missing name attribute");
+                Directory* d = new Directory(cur, n, false, getAttrib(attribs, "Incomplete", 1) != "1");
+                cur->directories.push_back(d);
+                cur = d;
+                if(simple)
+                    endTag(name, Util::emptyString);
+            }
+        } else if(name == "FileListing") {
+            string base = getAttrib(attribs, "Base", 2);
+            if(base.empty() || base[0] != '/' || base[base.size() - 1] != '/')
+                base = "/";
+            StringList sl = StringTokenizer<string>(base.substr(1), '/').getTokens();
+            for(auto i = sl.begin(); i != sl.end(); ++i) {
+                Directory* d = new Directory(cur, *i, false, false);
+                cur->directories.push_back(d);
+                cur = d;
+            }
+            cur->setComplete(true);
+            inListing = true;
+            if(simple)
+                endTag(name, Util::emptyString);
+        }
+    }
+
+    virtual void endTag(const string& name, const string&) {
+        if(inListing) {
+            if(name == "Directory")
+                cur = cur->getParent();
+            else if(name == "FileListing")
+                inListing = false;
+        }
+    }
+
+private:
+    Directory* cur;
+    bool inListing;
+    bool isMediaInfoList;
+    bool checkedMediaInfo;
+};
+
+/** Hands out the list a few bytes at a time */
+class ChunkedInputStream : public InputStream {
+public:
+    ChunkedInputStream(const string& aData, size_t aChunk) : data(aData), chunk(aChunk), pos(0) { }
+
+    virtual size_t read(void* buf, size_t& len) {
+        len = min(min(len, chunk), data.size() - pos);
+        memcpy(buf, data.data() + pos, len);
+        pos += len;
+        return len;
+    }
+private:
+    const string& data;
+    size_t chunk;
+    size_t pos;
+};
+
+void dump(const Directory* d, string& out, const string& indent) {
+    out += indent + "D " + d->getName() + (d->getComplete() ? "" : " incomplete") + "\n";
+    for(auto i = d->files.begin(); i != d->files.end(); ++i) {
+        const DirectoryListing::File* f = *i;
+        out += indent + "  F " + f->getName() + " " + Util::toString(f->getSize()) + " " + f->getTTH().toBase32();
+        // The bitrate is only set along with the rest
+        if(!f->mediaInfo.video_info.empty() || !f->mediaInfo.audio_info.empty() || !f->mediaInfo.resolution.empty())
+            out += " [" + f->mediaInfo.video_info + "|" + f->mediaInfo.audio_info + "|" + f->mediaInfo.resolution + "|" +
+                Util::toString(f->mediaInfo.bitrate) + "]";
+        out += "\n";
+    }
+    for(auto i = d->directories.begin(); i != d->directories.end(); ++i)
+        dump(*i, out, indent + "  ");
+}
+
+/** @return The listing the tokenizer builds, or the error it throws */
+string parse(const string& xml, size_t chunk = string::npos, uint64_t* took = NULL) {
+    DirectoryListing dl(HintedUser(UserPtr(), Util::emptyString));
+    ChunkedInputStream is(xml, chunk);
+    try {
+        uint64_t start = GET_TICK();
+        dl.loadXML(is, false);
+        if(took)
+            *took = GET_TICK() - start;
+    } catch(const SimpleXMLException& e) {
+        return "error " + e.getError();
+    }
+    string ret;
+    dump(dl.getRoot(), ret, Util::emptyString);
+    return ret;
+}
+
+/** @return The listing the old loader builds, or the error it throws */
+string parseReference(const string& xml, uint64_t* took = NULL) {
+    Directory root(NULL, Util::emptyString, false, false);
+    ReferenceLoader loader(&root);
+    ChunkedInputStream is(xml, string::npos);
+    try {
+        uint64_t start = GET_TICK();
+        SimpleXMLReader(&loader).parse(is);
+        if(took)
+            *took = GET_TICK() - start;
+    } catch(const SimpleXMLException& e) {
+        return "error " + e.getError();
+    }
+    string ret;
+    dump(&root, ret, Util::emptyString);
+    return ret;
+}
+
+int failures = 0;
+
+void check(const string& what, const string& got, const string& expected) {
+    if(got != expected) {
+        printf("FAIL: %s: got\n%s\nwhere\n%s\nwas expected\n", what.c_str(), got.substr(0, 2000).c_str(),
+            expected.substr(0, 2000).c_str());
+        failures++;
+    }
+}
+
+const string HEADER = "<?xml version=\"1.0\" encoding=\"utf-8\" standalone=\"yes\"?>\r\n"
+    "<FileListing Version=\"1\" CID=\"AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA\" Base=\"/\" Generator=\"test\">\r\n";
+const string FOOTER = "</FileListing>\r\n";
+const string TTH = "LWPNACQDBZRYXW3VHJVCJ64QBZNGHOHHHZWCLNQ";
+
+string file(const string& name, int64_t size, const string& extra = Util::emptyString) {
+    string tmp;
+    return "<File Name=\"" + SimpleXML::escape(name, tmp, true) + "\" Size=\"" + Util::toString(size) + "\" TTH=\"" + TTH + "\"" +
+        extra + "/>\r\n";
+}
+
+/** Builds a list of the files and directories under path, up to files of them, not following links too deep */
+void listDirectory(const string& path, string& xml, int& files, int depth = 0) {
+    if(depth > 16)
+        return;
+
+    StringList entries = File::findFiles(path, "*");
+    sort(entries.begin(), entries.end());
+    for(auto i = entries.begin(); i != entries.end() && files > 0; ++i) {
+        string tmp;
+        if(i->back() == '/') {
+            string name = Util::getFileName(i->substr(0, i->size() - 1));
+            if(name == "." || name == "..")
+                continue;
+            xml += "<Directory Name=\"" + SimpleXML::escape(name, tmp, true) + "\">\r\n";
+            listDirectory(*i, xml, files, depth + 1);
+            xml += "</Directory>\r\n";
+        } else {
+            TigerHash h;
+            h.update(i->data(), i->size());
+            xml += "<File Name=\"" + SimpleXML::escape(Util::getFileName(*i), tmp, true) + "\" Size=\"" +
+                Util::toString(File::getSize(*i)) + "\" TTH=\"" + TTHValue(h.finalize()).toBase32() + "\"/>\r\n";
+            files--;
+        }
+    }
+}
+
+string readList(const string& path) {
+    ::dcpp::File f(path, ::dcpp::File::READ, ::dcpp::File::OPEN);
+    if(Util::getFileExt(path) != ".bz2")
+        return f.read();
+
+    FilteredInputStream<UnBZFilter, false> is(&f);
+    string ret;
+    char buf[64 * 1024];
+    for(size_t n = sizeof(buf); (n = is.read(buf, n)) > 0; n = sizeof(buf))
+        ret.append(buf, n);
+    return ret;
+}
+
+} // unnamed namespace
+
+int main(int argc, char** argv) {
+    string path = argc > 1 ? argv[1] : "/usr/share/";
+    int maxFiles = argc > 2 ? atoi(argv[2]) : 200000;
+
+    SettingsManager::newInstance();
+
+    // Entities, decoded the same way in names of files and directories
+    {
+        string xml = HEADER + "<Directory Name=\"R&amp;B &lt;live&gt;\">\r\n" +
+            "<File Name=\"a &amp; b &quot;c&quot; &apos;d&apos; &#65;.mp3\" Size=\"1\" TTH=\"" + TTH + "\"/>\r\n" +
+            file("plain.txt", 2) + "</Directory>\r\n" + FOOTER;
+        string got = parse(xml);
+        check("entities, compared with the old loader", got, parseReference(xml));
+        if(got.find("D R&B <live>") == string::npos || got.find("F a & b \"c\" 'd' ") == string::npos)
+            check("entities", got, "the names decoded");
+    }
+
+    // CDATA, which the old loader didn't take at all, is character data even when it looks like tags
+    {
+        string xml = HEADER + "<Directory Name=\"d\"><![CDATA[ a > b <File Name=\"fake\" Size=\"1\" TTH=\"" + TTH +
+            "\"/> ]] ]]>\r\n" + file("real", 3) + "</Directory>\r\n" + FOOTER;
+        string expected = "D \n  D d\n    F real 3 " + TTH + "\n";
+        check("CDATA", parse(xml), expected);
+        check("CDATA read a byte at a time", parse(xml, 1), expected);
+        check("unterminated CDATA", parse(HEADER + "<![CDATA[ x " + FOOTER).substr(0, 6), "error ");
+    }
+
+    // Tags and attributes split across reads of every size
+    {
+        string xml = HEADER + "<!-- comment -->\r\n<Directory Name=\"a\" Incomplete=\"1\">\r\n" +
+            file("one &amp; two", 12345, " TS=\"1\" MV=\"h264\" MA=\"aac\" WH=\"640x480\" BR=\"128\"") +
+            "<Directory Name='b'/>\r\n" + file("three", 3) + "</Directory>\r\n" + file("four", 4) + FOOTER;
+        string expected = parseReference(xml);
+        for(size_t chunk = 1; chunk <= 17; ++chunk)
+            check("read in chunks of " + Util::toString(chunk), parse(xml, chunk), expected);
+    }
+
+    // An attribute straddling the end of the 256 KiB read buffer, wherever exactly it ends
+    {
+        for(size_t shift = 0; shift < 40; shift += 3) {
+            string xml = HEADER;
+            xml += "<!-- " + string(256 * 1024 - xml.size() - 30 + shift, 'x') + " -->";
+            xml += file("across the buffer", 42) + file("after it", 43) + FOOTER;
+            check("across the read buffer, shifted by " + Util::toString(shift), parse(xml), parseReference(xml));
+        }
+    }
+
+    // Malformed lists throw, as they did
+    {
+        const string malformed[] = {
+            HEADER + "<Directory Name=\"a\"></File>" + FOOTER,
+            HEADER + "<Directory Name=\"a\">",
+            HEADER + "<File Name=a Size=\"1\" TTH=\"" + TTH + "\"/>" + FOOTER,
+            HEADER + "<File Name=\"a &bogus b\" Size=\"1\" TTH=\"" + TTH + "\"/>" + FOOTER,
+            HEADER + "<File Name=\"a\" Size=\"1\" TTH=\"" + TTH + "\"" + FOOTER,
+            HEADER + "<Directory Incomplete=\"1\"/>" + FOOTER,
+            HEADER + "<File Name=\"unterminated Size=\"1\"/>" + FOOTER,
+            HEADER + "< Directory Name=\"a\"/>" + FOOTER
+        };
+        for(size_t i = 0; i < sizeof(malformed) / sizeof(malformed[0]); ++i) {
+            string got = parse(malformed[i]);
+            if(got.compare(0, 6, "error ") != 0)
+                check("malformed list " + Util::toString(i), got, "an error");
+            if(parseReference(malformed[i]).compare(0, 6, "error ") != 0)
+                check("malformed list " + Util::toString(i) + " for the old loader", parseReference(malformed[i]), "an error");
+        }
+
+        string deep = HEADER;
+        for(int i = 0; i < 40; ++i)
+            deep += "<Directory Name=\"d\">";
+        check("nesting too deep", parse(deep).substr(0, 6), "error ");
+    }
+
+    // A real list
+    {
+        string xml;
+        int files = maxFiles;
+        if(Util::getFileExt(path) == ".xml" || Util::getFileExt(path) == ".bz2") {
+            xml = readList(path);
+        } else {
+            xml = HEADER;
+            listDirectory(path, xml, files);
+            xml += FOOTER;
+        }
+
+        uint64_t took = 0, referenceTook = 0;
+        string got = parse(xml, string::npos, &took);
+        string expected = parseReference(xml, &referenceTook);
+
+        check("the list of " + path, got, expected);
+        if(got.compare(0, 6, "error ") == 0)
+            check("the list of " + path, got, "a listing");
+        printf("%s (%.1f MiB): tokenizer %u ms, SimpleXMLReader %u ms\n", path.c_str(), xml.size() / (1024.0 * 1024.0),
+            (unsigned)took, (unsigned)referenceTook);
+    }
+
+    SettingsManager::deleteInstance();
+
+    if(failures == 0)
+        printf("OK\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,183 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Hashes files as the hasher does, through FileReader, which keeps several
+ * reads in flight with io_uring when built with liburing, and with plain
+ * File::read calls of the same size, as the hasher did before. Both have to
+ * hand on exactly the file, for sizes around the read size, and give the
+ * same tree. Reported is the throughput of both with the file in the page
+ * cache and, as far as the file's pages can be dropped, without.
+ *
+ * Usage: filereader-benchmark [MiB]
+ */
+
+#include "dcpp/stdinc.h"
+#include "dcpp/File.h"
+#include "dcpp/FileReader.h"
+#include "dcpp/HashManager.h"
+#include "dcpp/MerkleTree.h"
+#include "dcpp/TimerManager.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace dcpp;
+
+namespace {
+
+/** What the hasher reads with */
+const size_t BUF_SIZE = 256 * 1024;
+
+string makeData(size_t size) {
+    string ret(size, 0);
+    for(size_t i = 0; i < size; ++i)
+        ret[i] = (char)(i * 2654435761U >> 24);
+    return ret;
+}
+
+void write(const string& path, const string& data) {
+    File f(path, File::WRITE, File::CREATE | File::TRUNCATE);
+    f.write(data);
+    // Written back, so that its pages can be dropped
+    fsync(f.getDescriptor());
+}
+
+/** Asks the kernel to drop the file from the page cache; it only may */
+void evict(const string& path) {
+    File f(path, File::READ, File::OPEN);
+    posix_fadvise(f.getDescriptor(), 0, 0, POSIX_FADV_DONTNEED);
+}
+
+TTHValue hashReader(const string& path, string* data) {
+    File f(path, File::READ, File::OPEN);
+    TigerTree tt(max(TigerTree::calcBlockSize(f.getSize(), 10), HashManager::MIN_BLOCK_SIZE));
+    FileReader(BUF_SIZE).read(f, [&](const void* buf, size_t n) -> bool {
+        tt.update(buf, n);
+        if(data)
+            data->append(static_cast<const char*>(buf), n);
+        return true;
+    });
+    tt.finalize();
+    return tt.getRoot();
+}
+
+TTHValue hashPlain(const string& path) {
+    File f(path, File::READ, File::OPEN);
+    TigerTree tt(max(TigerTree::calcBlockSize(f.getSize(), 10), HashManager::MIN_BLOCK_SIZE));
+    boost::scoped_array<uint8_t> buf(new uint8_t[BUF_SIZE]);
+    for(;;) {
+        size_t n = BUF_SIZE;
+        if(f.read(&buf[0], n) == 0)
+            break;
+        tt.update(&buf[0], n);
+    }
+    tt.finalize();
+    return tt.getRoot();
+}
+
+/** @return MiB/s */
+double throughput(size_t bytes, uint64_t ms) {
+    return bytes / (1024.0 * 1024.0) / (max(ms, (uint64_t)1) / 1000.0);
+}
+
+} // unnamed namespace
+
+int main(int argc, char** argv) {
+    int mib = argc > 1 ? atoi(argv[1]) : 512;
+
+    string path = "/tmp/filereader-benchmark-" + Util::toString(getpid()) + ".bin";
+    bool ok = true;
+
+    try {
+        // The reads are a quarter of BUF_SIZE with io_uring, BUF_SIZE without
+        const size_t sizes[] = { 0, 1, 64 * 1024 - 1, 64 * 1024, 64 * 1024 + 1, BUF_SIZE + 7, 5 * BUF_SIZE, 3 * 1024 * 1024 + 5 };
+        for(size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+            string data = makeData(sizes[i]);
+            write(path, data);
+            string got;
+            if(hashReader(path, &got) != hashPlain(path) || got != data) {
+                printf("FAIL: %u bytes didn't come out as they were\n", (unsigned)sizes[i]);
+                ok = false;
+            }
+        }
+
+        // Starting halfway, as a file whose start was hashed already would
+        {
+            string data = makeData(3 * 1024 * 1024 + 5);
+            write(path, data);
+            File f(path, File::READ, File::OPEN);
+            f.setPos(data.size() / 2);
+            string got;
+            FileReader(BUF_SIZE).read(f, [&](const void* buf, size_t n) -> bool {
+                got.append(static_cast<const char*>(buf), n);
+                return true;
+            });
+            if(got != data.substr(data.size() / 2) || f.getPos() != (int64_t)data.size()) {
+                printf("FAIL: reading from the middle\n");
+                ok = false;
+            }
+        }
+
+        string data = makeData((size_t)mib * 1024 * 1024);
+        write(path, data);
+        data = string();
+        size_t size = (size_t)mib * 1024 * 1024;
+
+        uint64_t start = GET_TICK();
+        TTHValue plain = hashPlain(path);
+        uint64_t plainTook = GET_TICK() - start;
+
+        start = GET_TICK();
+        TTHValue reader = hashReader(path, nullptr);
+        uint64_t readerTook = GET_TICK() - start;
+
+        evict(path);
+        start = GET_TICK();
+        TTHValue plainCold = hashPlain(path);
+        uint64_t plainColdTook = GET_TICK() - start;
+
+        evict(path);
+        start = GET_TICK();
+        TTHValue readerCold = hashReader(path, nullptr);
+        uint64_t readerColdTook = GET_TICK() - start;
+
+        if(plain != reader || plain != plainCold || plain != readerCold) {
+            printf("FAIL: the trees differ\n");
+            ok = false;
+        }
+
+#ifdef USE_LIBURING
+        const char* how = "io_uring";
+#else
+        const char* how = "plain reads, built without liburing";
+#endif
+        printf("%d MiB hashed: cached %.0f MiB/s with File::read, %.0f MiB/s with FileReader (%s); "
+            "dropped from the cache %.0f MiB/s and %.0f MiB/s\n", mib, throughput(size, plainTook),
+            throughput(size, readerTook), how, throughput(size, plainColdTook), throughput(size, readerColdTook));
+    } catch(const Exception& e) {
+        printf("FAIL: %s\n", e.getError().c_str());
+        ok = false;
+    }
+
+    File::deleteFile(path);
+
+    if(ok)
+        printf("OK\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,150 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Concurrent INF updates and reads of Identity fields: each thread applies
+ * INFs to the users of its own hub and reads the fields of its own and of
+ * shared users, as hub threads and the UI do. Reported for growing numbers of
+ * threads, once as Identity does it and once with every call also going
+ * through one global lock, as all of them did before the locks were striped.
+ * The fields read back at the end have to be the ones last written.
+ *
+ * Usage: identity-benchmark [rounds]
+ */
+
+#include "dcpp/stdinc.h"
+#include "dcpp/User.h"
+#include "dcpp/Thread.h"
+#include "dcpp/TimerManager.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace dcpp;
+
+namespace {
+
+enum { USERS = 1000, SHARED = 1000, READS_PER_INF = 4 };
+
+FastCriticalSection globalCs;
+vector<Identity> shared(SHARED);
+
+class Hub : public Thread {
+public:
+    Hub(int aId, int aRounds, bool aGlobal) : id(aId), rounds(aRounds), global(aGlobal), users(USERS), reads(0) { }
+
+    int id;
+    int rounds;
+    bool global;
+    vector<Identity> users;
+    size_t reads;
+
+    string expected(size_t user, const char* field) const {
+        return Util::toString(id) + field + Util::toString(user) + "/" + Util::toString(rounds - 1);
+    }
+
+private:
+    void set(Identity& i, const char* name, const string& val) {
+        if(global) {
+            FastLock l(globalCs);
+            i.set(name, val);
+        } else {
+            i.set(name, val);
+        }
+    }
+
+    string get(const Identity& i, const char* name) {
+        if(global) {
+            FastLock l(globalCs);
+            return i.get(name);
+        }
+        return i.get(name);
+    }
+
+    virtual int run() {
+        const char* fields[] = { "NI", "DE", "SS", "SL", "HN", "VE" };
+        for(int r = 0; r < rounds; ++r) {
+            for(size_t u = 0; u < users.size(); ++u) {
+                // An INF of a few fields
+                for(size_t f = 0; f < sizeof(fields) / sizeof(fields[0]); ++f)
+                    set(users[u], fields[f], Util::toString(id) + fields[f] + Util::toString(u) + "/" + Util::toString(r));
+                set(shared[(u + id) % SHARED], "DE", Util::toString(id));
+
+                for(int k = 0; k < READS_PER_INF; ++k) {
+                    reads += get(users[(u * 7 + k) % USERS], "NI").size();
+                    reads += get(shared[(u * 13 + k) % SHARED], "DE").size();
+                }
+            }
+        }
+        return 0;
+    }
+};
+
+/** @return Whether the fields hold what was written last */
+bool run(int threads, int rounds, bool global, double& opsPerSec) {
+    vector<Hub*> hubs;
+    for(int i = 0; i < threads; ++i)
+        hubs.push_back(new Hub(i, rounds, global));
+
+    uint64_t start = GET_TICK();
+    for(auto i = hubs.begin(); i != hubs.end(); ++i)
+        (*i)->start();
+    for(auto i = hubs.begin(); i != hubs.end(); ++i)
+        (*i)->join();
+    uint64_t took = max(GET_TICK() - start, (uint64_t)1);
+
+    // Calls per INF: the fields, the shared user and the reads
+    double ops = (double)threads * rounds * USERS * (6 + 1 + 2 * READS_PER_INF);
+    opsPerSec = ops / (took / 1000.0);
+
+    bool ok = true;
+    for(auto i = hubs.begin(); i != hubs.end(); ++i) {
+        Hub& h = **i;
+        for(size_t u = 0; u < h.users.size(); ++u) {
+            if(h.users[u].getNick() != h.expected(u, "NI") || h.users[u].get("VE") != h.expected(u, "VE"))
+                ok = false;
+        }
+        delete *i;
+    }
+    for(auto i = shared.begin(); i != shared.end(); ++i) {
+        if(Util::toInt(i->getDescription()) >= threads)
+            ok = false;
+    }
+    return ok;
+}
+
+} // unnamed namespace
+
+int main(int argc, char** argv) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 50;
+
+    int failures = 0;
+    int maxThreads = max(4U, Thread::getProcessorCount());
+    for(int threads = 1; threads <= maxThreads; threads *= 2) {
+        double striped, global;
+        if(!run(threads, rounds, false, striped) || !run(threads, rounds, true, global)) {
+            printf("FAIL: fields lost with %d threads\n", threads);
+            failures++;
+        }
+        printf("%2d threads: striped locks %5.1f M calls/s, one global lock %5.1f M calls/s\n", threads,
+            striped / 1e6, global / 1e6);
+    }
+
+    if(failures == 0)
+        printf("OK\n");
+    return failures == 0 ? 0 : 1;
+}
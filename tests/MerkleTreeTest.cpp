@@ -0,0 +1,92 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Checks that the parallel MerkleTree::update builds exactly the tree of the
+ * sequential one, for sizes and read chunks that do and don't line up with
+ * the block and unit boundaries.
+ */
+
+#include "dcpp/stdinc.h"
+#include "dcpp/MerkleTree.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+using namespace dcpp;
+
+namespace {
+
+TigerTree hashSequential(const vector<uint8_t>& data, int64_t blockSize, size_t chunk) {
+    TigerTree tree(blockSize);
+    for(size_t pos = 0; pos < data.size(); pos += chunk)
+        tree.update(&data[pos], min(chunk, data.size() - pos));
+    tree.finalize();
+    return tree;
+}
+
+TigerTree hashParallel(const vector<uint8_t>& data, int64_t blockSize, size_t chunk, unsigned threads) {
+    TigerTree tree(blockSize);
+    for(size_t pos = 0; pos < data.size(); pos += chunk)
+        tree.update(&data[pos], min(chunk, data.size() - pos), threads);
+    tree.finalize();
+    return tree;
+}
+
+bool same(const TigerTree& a, const TigerTree& b) {
+    return a.getRoot() == b.getRoot() && a.getLeaves() == b.getLeaves() && a.getFileSize() == b.getFileSize();
+}
+
+} // unnamed namespace
+
+int main() {
+    const size_t KiB = 1024, MiB = 1024 * KiB;
+    const size_t sizes[] = { 0, 1, 1023, 1024, 2 * MiB, 2 * MiB + 1, 9 * MiB + 5 * KiB, 17 * MiB + 3 };
+    // Read chunks must be multiples of 1024 except for the last one
+    const size_t chunks[] = { 64 * KiB, 3 * MiB + 7 * KiB, 8 * MiB, 32 * MiB };
+    const unsigned threads[] = { 2, 3, 8 };
+
+    vector<uint8_t> data(17 * MiB + 3);
+    srand(1);
+    for(size_t i = 0; i < data.size(); ++i)
+        data[i] = (uint8_t)rand();
+
+    int failures = 0;
+    for(size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        vector<uint8_t> file(data.begin(), data.begin() + sizes[s]);
+        const int64_t blockSizes[] = { (int64_t)KiB, 64 * (int64_t)KiB, (int64_t)MiB, 4 * (int64_t)MiB,
+            max(TigerTree::calcBlockSize(file.size(), 10), (int64_t)(64 * KiB)) };
+
+        for(size_t b = 0; b < sizeof(blockSizes) / sizeof(blockSizes[0]); ++b) {
+            for(size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); ++c) {
+                TigerTree expected = hashSequential(file, blockSizes[b], chunks[c]);
+                for(size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); ++t) {
+                    if(!same(expected, hashParallel(file, blockSizes[b], chunks[c], threads[t]))) {
+                        printf("FAIL: size %u, block size %lld, chunk %u, %u threads\n", (unsigned)file.size(),
+                            (long long)blockSizes[b], (unsigned)chunks[c], threads[t]);
+                        failures++;
+                    }
+                }
+            }
+        }
+    }
+
+    Thread::shutdownParallel();
+
+    if(failures == 0)
+        printf("OK\n");
+    return failures == 0 ? 0 : 1;
+}
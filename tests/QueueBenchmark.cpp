@@ -0,0 +1,166 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Feeds search results to a large queue, as the hubs do: most of them for
+ * files that aren't queued, some for queued ones, which have to get the
+ * result's user as a source and nothing else. Reported is how many results
+ * per second the queue takes in, and how many per second going through the
+ * whole queue for each of them, as the lookups did before the queue was
+ * indexed by TTH, would manage.
+ *
+ * Usage: queue-benchmark [queued files] [results]
+ */
+
+#include "dcpp/stdinc.h"
+#include "dcpp/ClientManager.h"
+#include "dcpp/LogManager.h"
+#include "dcpp/QueueManager.h"
+#include "dcpp/ResourceManager.h"
+#include "dcpp/SearchManager.h"
+#include "dcpp/SearchResult.h"
+#include "dcpp/SettingsManager.h"
+#include "dcpp/TimerManager.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+using namespace dcpp;
+
+namespace {
+
+/** One result in HIT_EVERY is for a queued file; going through the queue is only timed for SCANS of them */
+enum { HIT_EVERY = 10, SCANS = 200, USERS = 50 };
+
+TTHValue tth(int i) {
+    TigerHash h;
+    h.update(&i, sizeof(i));
+    return TTHValue(h.finalize());
+}
+
+int64_t size(int i) {
+    return 1000000 + i;
+}
+
+UserPtr user(int i) {
+    uint8_t cid[CID::SIZE] = { (uint8_t)(i + 1), (uint8_t)((i + 1) >> 8) };
+    return ClientManager::getInstance()->getUser(CID(cid));
+}
+
+} // unnamed namespace
+
+int main(int argc, char** argv) {
+    int queued = argc > 1 ? atoi(argv[1]) : 80000;
+    int results = argc > 2 ? atoi(argv[2]) : 200000;
+
+    string root = "/tmp/queue-benchmark-" + Util::toString(getpid()) + "/";
+    Util::PathsMap paths;
+    paths[Util::PATH_USER_CONFIG] = root + "config/";
+    paths[Util::PATH_USER_LOCAL] = root + "config/";
+    Util::initialize(paths);
+
+    ResourceManager::newInstance();
+    SettingsManager::newInstance();
+    LogManager::newInstance();
+    TimerManager::newInstance();
+    SearchManager::newInstance();
+    ClientManager::newInstance();
+    QueueManager::newInstance();
+
+    SettingsManager::getInstance()->set(SettingsManager::DONT_DL_ALREADY_SHARED, false);
+    SettingsManager::getInstance()->set(SettingsManager::AUTO_SEARCH_AUTO_MATCH, false);
+
+    bool ok = true;
+    try {
+        QueueManager* qm = QueueManager::getInstance();
+        for(int i = 0; i < queued; ++i)
+            qm->add(root + "downloads/Folder " + Util::toString(i % 100) + "/File " + Util::toString(i), size(i), tth(i));
+
+        // Queued files at every HIT_EVERY'th result, ones that aren't queued in between
+        vector<SearchResultPtr> srs;
+        for(int i = 0; i < results; ++i) {
+            int file = i % HIT_EVERY == 0 ? i / HIT_EVERY % queued : queued + i;
+            srs.push_back(SearchResultPtr(new SearchResult(user(i % USERS), SearchResult::TYPE_FILE, 1, 1, size(file),
+                "File " + Util::toString(file), "Hub", "adc://hub:411", "127.0.0.1", tth(file), Util::emptyString)));
+        }
+
+        uint64_t start = GET_TICK();
+        for(auto i = srs.begin(); i != srs.end(); ++i)
+            SearchManager::getInstance()->fire(SearchManagerListener::SR(), *i);
+        uint64_t took = max(GET_TICK() - start, (uint64_t)1);
+
+        // The sources the results had to add
+        vector<set<UserPtr> > expected(queued);
+        for(int i = 0; i < results; i += HIT_EVERY)
+            expected[i / HIT_EVERY % queued].insert(user(i % USERS));
+
+        // The same lookups going through the whole queue
+        uint64_t scanStart = GET_TICK();
+        size_t scanned = 0, hits = 0, scanHits = 0;
+        QueueItem::StringMap& queue = qm->lockQueue();
+        for(size_t i = 0; i < srs.size(); i += max(srs.size() / SCANS, (size_t)1), ++scanned) {
+            if(i % HIT_EVERY == 0)
+                hits++;
+            for(auto j = queue.begin(); j != queue.end(); ++j) {
+                if(j->second->getTTH() == srs[i]->getTTH())
+                    scanHits++;
+            }
+        }
+        uint64_t scanTook = max(GET_TICK() - scanStart, (uint64_t)1);
+
+        for(auto i = queue.begin(); i != queue.end(); ++i) {
+            int file = Util::toInt(i->second->getTarget().substr(i->second->getTarget().rfind(' ') + 1));
+            set<UserPtr> sources;
+            for(auto j = i->second->getSources().begin(); j != i->second->getSources().end(); ++j)
+                sources.insert(j->getUser().user);
+            if(sources != expected[file]) {
+                printf("FAIL: %s has %u sources instead of %u\n", i->second->getTarget().c_str(), (unsigned)sources.size(),
+                    (unsigned)expected[file].size());
+                ok = false;
+                break;
+            }
+        }
+        qm->unlockQueue();
+
+        if(scanHits != hits) {
+            printf("FAIL: the scan found %u queued files instead of %u\n", (unsigned)scanHits, (unsigned)hits);
+            ok = false;
+        }
+
+        printf("%d queued files: %.0f results/s taken in, %.0f results/s looked up by going through the queue\n", queued,
+            results / (took / 1000.0), scanned / (scanTook / 1000.0));
+    } catch(const Exception& e) {
+        printf("FAIL: %s\n", e.getError().c_str());
+        ok = false;
+    }
+
+    QueueManager::deleteInstance();
+    ClientManager::deleteInstance();
+    SearchManager::deleteInstance();
+    TimerManager::deleteInstance();
+    LogManager::deleteInstance();
+    SettingsManager::deleteInstance();
+    ResourceManager::deleteInstance();
+
+    rmdir(Util::getListPath().c_str());
+    rmdir((root + "config/").c_str());
+    rmdir(root.c_str());
+
+    if(ok)
+        printf("OK\n");
+    return ok ? 0 : 1;
+}
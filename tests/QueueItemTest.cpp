@@ -0,0 +1,113 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Checks the segments QueueItem::getNextSegment hands out for a fixed set of
+ * partial sources: a partial source gets the part of what it has that the
+ * fewest sources have, never a block it lacks, and a full source simply the
+ * first block still needed.
+ */
+
+#include "dcpp/stdinc.h"
+#include "dcpp/QueueItem.h"
+#include "dcpp/SettingsManager.h"
+#include "dcpp/User.h"
+
+#include <cstdio>
+
+using namespace dcpp;
+
+namespace {
+
+const int64_t BLOCK = 1024 * 1024;
+const int64_t WANTED = 16 * BLOCK;
+
+int failures = 0;
+
+/** @param parts Begin and end block pairs the source has, empty for a full source */
+QueueItem::PartialSource::Ptr addSource(QueueItem& qi, uint8_t id, const PartsInfo& parts) {
+    uint8_t data[CID::SIZE] = { id };
+    QueueItem::Source source(HintedUser(UserPtr(new User(CID(data))), "adc://hub:411"));
+
+    QueueItem::PartialSource::Ptr ps;
+    if(!parts.empty()) {
+        ps = new QueueItem::PartialSource(Util::emptyString, Util::emptyString, Util::emptyString, 0);
+        ps->setPartialInfo(parts);
+        source.setFlag(QueueItem::Source::FLAG_PARTIAL);
+        source.setPartialSource(ps);
+    }
+    qi.getSources().push_back(source);
+    return ps;
+}
+
+void check(const char* what, const Segment& got, const Segment& expected) {
+    if(!(got == expected)) {
+        printf("FAIL: %s: got %lld+%lld, expected %lld+%lld\n", what, (long long)(got.getStart() / BLOCK),
+            (long long)(got.getSize() / BLOCK), (long long)(expected.getStart() / BLOCK), (long long)(expected.getSize() / BLOCK));
+        failures++;
+    }
+}
+
+} // unnamed namespace
+
+int main() {
+    SettingsManager::newInstance();
+
+    // Ten blocks, the first of which is done:
+    //   block  0 1 2 3 4 5 6 7 8 9
+    //   a      x x x x x x
+    //   b          x x     x x x x
+    //   c              x x
+    //   d      x x x x x x x x x x   (full source)
+    //   e      x
+    //   f                  x   x
+    QueueItem qi("target", 10 * BLOCK, QueueItem::NORMAL, QueueItem::FLAG_NORMAL, 0, TTHValue(string(39, 'A')));
+    qi.addSegment(Segment(0, BLOCK));
+
+    QueueItem::PartialSource::Ptr a = addSource(qi, 1, { 0, 6 });
+    QueueItem::PartialSource::Ptr b = addSource(qi, 2, { 2, 4, 6, 10 });
+    QueueItem::PartialSource::Ptr c = addSource(qi, 3, { 4, 6 });
+    addSource(qi, 4, PartsInfo());
+    QueueItem::PartialSource::Ptr e = addSource(qi, 5, { 0, 1 });
+
+    // Blocks 2-3 are on a, b and d, blocks 6-9 only on b and d
+    check("rarest of b", qi.getNextSegment(BLOCK, WANTED, 0, b), Segment(6 * BLOCK, 4 * BLOCK));
+    // Block 1 is rarer still, but c doesn't have it
+    check("rarest c has", qi.getNextSegment(BLOCK, WANTED, 0, c), Segment(4 * BLOCK, 2 * BLOCK));
+    check("everything a has", qi.getNextSegment(BLOCK, WANTED, 0, a), Segment(BLOCK, 5 * BLOCK));
+    // e only has what is done already
+    check("nothing needed from e", qi.getNextSegment(BLOCK, WANTED, 0, e), Segment(0, 0));
+    // A full source goes in order, whatever is rare
+    check("full source", qi.getNextSegment(BLOCK, WANTED, 0, nullptr), Segment(BLOCK, 9 * BLOCK));
+
+    // Blocks 6 and 8 are equally rare for f, so either will do
+    QueueItem::PartialSource::Ptr f = addSource(qi, 6, { 6, 7, 8, 9 });
+    for(int i = 0; i < 20; ++i) {
+        Segment s = qi.getNextSegment(BLOCK, WANTED, 0, f);
+        if(!(s == Segment(6 * BLOCK, BLOCK)) && !(s == Segment(8 * BLOCK, BLOCK)))
+            check("tie for f", s, Segment(6 * BLOCK, BLOCK));
+    }
+
+    // Once block 6 is done too, b gets the rest of its rarest range
+    qi.addSegment(Segment(6 * BLOCK, BLOCK));
+    check("rarest of b after block 6", qi.getNextSegment(BLOCK, WANTED, 0, b), Segment(7 * BLOCK, 3 * BLOCK));
+
+    SettingsManager::deleteInstance();
+
+    if(failures == 0)
+        printf("OK\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,242 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Saves a queue, journals a few changes to it and loads it back into a new
+ * QueueManager: intact, with the last journal record torn, with a record
+ * whose CRC doesn't match, and with a journal left over from before the
+ * last full save. The changes up to the first bad record have to be there
+ * and none after it; a saved replay has to load as it was.
+ */
+
+#include "dcpp/stdinc.h"
+#include "dcpp/ClientManager.h"
+#include "dcpp/File.h"
+#include "dcpp/LogManager.h"
+#include "dcpp/QueueManager.h"
+#include "dcpp/ResourceManager.h"
+#include "dcpp/SearchManager.h"
+#include "dcpp/SettingsManager.h"
+#include "dcpp/TimerManager.h"
+
+#include <cstdio>
+#include <unistd.h>
+
+using namespace dcpp;
+
+namespace {
+
+string root;
+string queueFile;
+string journalFile;
+int failures = 0;
+
+string target(const char* name) {
+    return root + "downloads/" + name;
+}
+
+TTHValue tth(const char* name) {
+    TigerHash h;
+    h.update(name, strlen(name));
+    return TTHValue(h.finalize());
+}
+
+void add(const char* name, int64_t size) {
+    uint8_t cid[CID::SIZE] = { (uint8_t)name[0] };
+    QueueManager::getInstance()->add(target(name), size, tth(name),
+        HintedUser(ClientManager::getInstance()->getUser(CID(cid)), "adc://hub:411"));
+}
+
+/** The size, priority and source count of every queued item, by file name */
+typedef map<string, string> Snapshot;
+
+Snapshot snapshot() {
+    Snapshot ret;
+    QueueItem::StringMap& queue = QueueManager::getInstance()->lockQueue();
+    for(auto i = queue.begin(); i != queue.end(); ++i) {
+        QueueItem* qi = i->second;
+        ret[Util::getFileName(qi->getTarget())] = Util::toString(qi->getSize()) + " " +
+            Util::toString((int)qi->getPriority()) + " " + Util::toString(qi->getSources().size());
+    }
+    QueueManager::getInstance()->unlockQueue();
+    return ret;
+}
+
+/** @return The items as they were before, except for the ones whose changes were applied */
+Snapshot applied(const Snapshot& before, const Snapshot& after, const StringList& changes) {
+    Snapshot ret = before;
+    for(auto i = changes.begin(); i != changes.end(); ++i) {
+        ret.erase(*i);
+        if(after.find(*i) != after.end())
+            ret[*i] = after.find(*i)->second;
+    }
+    return ret;
+}
+
+/** Starts over with a QueueManager that loads the files given */
+void restart(const string& queue, const string& journal) {
+    QueueManager::deleteInstance();
+    File(queueFile, File::WRITE, File::CREATE | File::TRUNCATE).write(queue);
+    File(journalFile, File::WRITE, File::CREATE | File::TRUNCATE).write(journal);
+    QueueManager::newInstance();
+    QueueManager::getInstance()->loadQueue();
+}
+
+string read(const string& path) {
+    return File(path, File::READ, File::OPEN).read();
+}
+
+void check(const char* what, const Snapshot& got, const Snapshot& expected) {
+    if(got != expected) {
+        printf("FAIL: %s:", what);
+        for(auto i = got.begin(); i != got.end(); ++i)
+            printf(" %s %s,", i->first.c_str(), i->second.c_str());
+        printf(" expected");
+        for(auto i = expected.begin(); i != expected.end(); ++i)
+            printf(" %s %s,", i->first.c_str(), i->second.c_str());
+        printf("\n");
+        failures++;
+    }
+}
+
+/** A journal record: where it starts and the file name of the item it is about */
+typedef pair<size_t, string> Record;
+
+vector<Record> records(const string& journal) {
+    vector<Record> ret;
+    // After the magic, version and generation: length, CRC, type and target of each record
+    size_t pos = 12;
+    while(pos + 13 <= journal.size()) {
+        uint32_t len, targetLen;
+        memcpy(&len, journal.data() + pos, sizeof(len));
+        memcpy(&targetLen, journal.data() + pos + 9, sizeof(targetLen));
+        ret.push_back(make_pair(pos, Util::getFileName(journal.substr(pos + 13, targetLen))));
+        pos += 8 + len;
+    }
+    return ret;
+}
+
+} // unnamed namespace
+
+int main() {
+    root = "/tmp/queue-journal-test-" + Util::toString(getpid()) + "/";
+    Util::PathsMap paths;
+    paths[Util::PATH_USER_CONFIG] = root + "config/";
+    paths[Util::PATH_USER_LOCAL] = root + "config/";
+    Util::initialize(paths);
+    File::ensureDirectory(root + "config/");
+    queueFile = root + "config/Queue.xml";
+    journalFile = queueFile + ".journal";
+
+    ResourceManager::newInstance();
+    SettingsManager::newInstance();
+    LogManager::newInstance();
+    TimerManager::newInstance();
+    SearchManager::newInstance();
+    ClientManager::newInstance();
+    QueueManager::newInstance();
+
+    SettingsManager::getInstance()->set(SettingsManager::DONT_DL_ALREADY_SHARED, false);
+
+    try {
+        // Queue.xml with a, b and c
+        add("a", 1000);
+        add("b", 2000);
+        add("c", 3000);
+        QueueManager::getInstance()->saveQueue(true);
+        Snapshot before = snapshot();
+
+        // Journaled in no particular order: b's priority, c's removal and d
+        QueueManager::getInstance()->setPriority(target("b"), QueueItem::HIGH);
+        QueueManager::getInstance()->remove(target("c"));
+        add("d", 4000);
+        QueueManager::getInstance()->saveQueue();
+        Snapshot after = snapshot();
+
+        string queue = read(queueFile);
+        string journal = read(journalFile);
+        vector<Record> recs = records(journal);
+        if(recs.size() != 3) {
+            printf("FAIL: %u journal records instead of 3\n", (unsigned)recs.size());
+            failures++;
+            throw Exception("can't go on without them");
+        }
+
+        restart(queue, journal.substr(0, recs[0].first));
+        check("without the journal", snapshot(), before);
+
+        restart(queue, journal);
+        check("replayed", snapshot(), after);
+
+        // The last record only got halfway to the disk
+        restart(queue, journal.substr(0, journal.size() - 3));
+        check("torn last record", snapshot(), applied(before, after, { recs[0].second, recs[1].second }));
+
+        // A bad CRC in the second record stops the replay right before it
+        string bad = journal;
+        bad[recs[1].first + 10] ^= 0x55;
+        restart(queue, bad);
+        check("bad CRC", snapshot(), applied(before, after, { recs[0].second }));
+
+        // Saving the replayed queue writes a new Queue.xml and an empty journal, which load as they were
+        restart(queue, journal);
+        QueueManager::getInstance()->saveQueue();
+        string saved = read(queueFile);
+        string savedJournal = read(journalFile);
+        if(!records(savedJournal).empty()) {
+            printf("FAIL: the journal isn't empty after a full save\n");
+            failures++;
+        }
+        restart(saved, savedJournal);
+        check("saved replay", snapshot(), after);
+
+        // Further changes go to the new journal
+        QueueManager::getInstance()->setPriority(target("a"), QueueItem::LOW);
+        QueueManager::getInstance()->saveQueue();
+        Snapshot changed = snapshot();
+        restart(read(queueFile), read(journalFile));
+        check("journaled after the save", snapshot(), changed);
+
+        // A journal from before the last full save doesn't apply to it
+        QueueManager::getInstance()->setPriority(target("b"), QueueItem::LOWEST);
+        QueueManager::getInstance()->saveQueue(true);
+        Snapshot compacted = snapshot();
+        restart(read(queueFile), journal);
+        check("stale generation", snapshot(), compacted);
+    } catch(const Exception& e) {
+        printf("FAIL: %s\n", e.getError().c_str());
+        failures++;
+    }
+
+    QueueManager::deleteInstance();
+    ClientManager::deleteInstance();
+    SearchManager::deleteInstance();
+    TimerManager::deleteInstance();
+    LogManager::deleteInstance();
+    SettingsManager::deleteInstance();
+    ResourceManager::deleteInstance();
+
+    File::deleteFile(queueFile);
+    File::deleteFile(queueFile + ".tmp");
+    File::deleteFile(journalFile);
+    rmdir(Util::getListPath().c_str());
+    rmdir((root + "config/").c_str());
+    rmdir(root.c_str());
+
+    if(failures == 0)
+        printf("OK\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,195 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Shares a synthetic tree of small, already hashed files, listing it on one
+ * thread and then on several. Both walks have to produce the same file list
+ * with every file in it; how long each took is reported, and how much the
+ * resident size grew per file while the first share tree was built.
+ *
+ * Usage: share-benchmark [files] [threads]
+ */
+
+#include "dcpp/stdinc.h"
+#include "dcpp/ClientManager.h"
+#include "dcpp/File.h"
+#include "dcpp/HashManager.h"
+#include "dcpp/LogManager.h"
+#include "dcpp/QueueManager.h"
+#include "dcpp/ResourceManager.h"
+#include "dcpp/SearchManager.h"
+#include "dcpp/SettingsManager.h"
+#include "dcpp/ShareManager.h"
+#include "dcpp/TimerManager.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+using namespace dcpp;
+
+namespace {
+
+/** Directories per level; the files are spread over the FANOUT^3 directories of the last level */
+enum { FANOUT = 10 };
+
+string root;
+
+string dirPath(int leaf, int depth) {
+    string path = root + "share/";
+    int div = FANOUT * FANOUT;
+    for(int level = 0; level < depth; ++level, div /= FANOUT)
+        path += "Folder " + Util::toString(leaf / div % FANOUT) + "/";
+    return path;
+}
+
+string filePath(int i) {
+    return dirPath(i % (FANOUT * FANOUT * FANOUT), 3) + "Artist " + Util::toString(i % 977) + " - Track " +
+        Util::toString(i) + ".mp3";
+}
+
+/** Creates the tree, handing the hash of every file to HashManager as if it had hashed it */
+void createShare(int files) {
+    for(int leaf = 0; leaf < FANOUT * FANOUT * FANOUT; ++leaf)
+        File::ensureDirectory(dirPath(leaf, 3));
+
+    for(int i = 0; i < files; ++i) {
+        string path = filePath(i);
+        string data = Util::toString(i);
+        {
+            File f(path, File::WRITE, File::CREATE | File::TRUNCATE);
+            f.write(data);
+        }
+
+        TigerTree tt(HashManager::MIN_BLOCK_SIZE);
+        tt.update(data.data(), data.size());
+        tt.finalize();
+        HashManager::getInstance()->addTree(path, File(path, File::READ, File::OPEN).getLastModified(), tt);
+    }
+}
+
+/** Removes the directory and everything in it */
+void removeAll(const string& dir) {
+    StringList entries = File::findFiles(dir, "*");
+    for(auto i = entries.begin(); i != entries.end(); ++i) {
+        string name = Util::getFileName(i->substr(0, i->size() - 1));
+        if(i->back() != '/')
+            File::deleteFile(*i);
+        else if(name != "." && name != "..")
+            removeAll(*i);
+    }
+    rmdir(dir.c_str());
+}
+
+/** @return The resident size of the process in bytes */
+int64_t residentSize() {
+    long pages = 0, resident = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if(f) {
+        if(fscanf(f, "%ld %ld", &pages, &resident) != 2)
+            resident = 0;
+        fclose(f);
+    }
+    return (int64_t)resident * sysconf(_SC_PAGESIZE);
+}
+
+/** @return How long sharing the tree took, in ms */
+uint64_t share(int threads, string& list, int64_t& memory) {
+    SettingsManager::getInstance()->set(SettingsManager::SHARE_SCAN_THREADS, threads);
+
+    int64_t before = residentSize();
+    uint64_t start = GET_TICK();
+    ShareManager::getInstance()->addDirectory(root + "share/", "Share");
+    uint64_t took = GET_TICK() - start;
+    memory = residentSize() - before;
+
+    list = *ShareManager::getInstance()->generatePartialList("/", true);
+    return took;
+}
+
+} // unnamed namespace
+
+int main(int argc, char** argv) {
+    int files = argc > 1 ? atoi(argv[1]) : 20000;
+    int threads = argc > 2 ? atoi(argv[2]) : max(4U, Thread::getProcessorCount());
+
+    root = "/tmp/share-benchmark-" + Util::toString(getpid()) + "/";
+    Util::PathsMap paths;
+    paths[Util::PATH_USER_CONFIG] = root + "config/";
+    paths[Util::PATH_USER_LOCAL] = root + "config/";
+    Util::initialize(paths);
+
+    ResourceManager::newInstance();
+    SettingsManager::newInstance();
+    LogManager::newInstance();
+    TimerManager::newInstance();
+    HashManager::newInstance();
+    SearchManager::newInstance();
+    ClientManager::newInstance();
+    QueueManager::newInstance();
+    ShareManager::newInstance();
+
+    // Not the files, which are of no interest here, but the changes to them
+    SettingsManager::getInstance()->set(SettingsManager::SHARE_MONITOR, false);
+
+    bool ok = true;
+    try {
+        uint64_t start = GET_TICK();
+        createShare(files);
+        printf("created %d files in %u ms\n", files, (unsigned)(GET_TICK() - start));
+
+        string serialList, parallelList;
+        int64_t memory, ignored;
+        uint64_t serial = share(1, serialList, memory);
+        size_t serialFiles = ShareManager::getInstance()->getSharedFiles();
+        ShareManager::getInstance()->removeDirectory(root + "share/");
+
+        uint64_t parallel = share(threads, parallelList, ignored);
+        size_t parallelFiles = ShareManager::getInstance()->getSharedFiles();
+        ShareManager::getInstance()->removeDirectory(root + "share/");
+
+        printf("sharing %d files: 1 thread %u ms, %d threads %u ms\n", files, (unsigned)serial, threads, (unsigned)parallel);
+        printf("share tree: %.1f MiB, %.0f bytes per file\n", memory / (1024.0 * 1024.0), (double)memory / max(files, 1));
+
+        if(serialFiles != (size_t)files || parallelFiles != (size_t)files) {
+            printf("FAIL: %u and %u files shared instead of %d\n", (unsigned)serialFiles, (unsigned)parallelFiles, files);
+            ok = false;
+        }
+        if(serialList != parallelList) {
+            printf("FAIL: the file lists differ\n");
+            ok = false;
+        }
+    } catch(const Exception& e) {
+        printf("FAIL: %s\n", e.getError().c_str());
+        ok = false;
+    }
+
+    ShareManager::deleteInstance();
+    QueueManager::deleteInstance();
+    ClientManager::deleteInstance();
+    SearchManager::deleteInstance();
+    HashManager::deleteInstance();
+    TimerManager::deleteInstance();
+    LogManager::deleteInstance();
+    SettingsManager::deleteInstance();
+    ResourceManager::deleteInstance();
+
+    removeAll(root);
+
+    if(ok)
+        printf("OK\n");
+    return ok ? 0 : 1;
+}
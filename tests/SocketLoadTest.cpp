@@ -0,0 +1,210 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Load test of the socket I/O threads: opens thousands of loopback connections
+ * and bounces lines over all of them at once, while every tenth connection
+ * asks for a slow reply, which the server offloads. Every round trip has to
+ * complete; how long the fast ones took shows whether they waited for the slow
+ * replies, but depends on the machine, so it is only checked with -strict.
+ *
+ * Usage: socket-load-test [connections] [rounds] [-strict]
+ */
+
+#include "dcpp/stdinc.h"
+#include "dcpp/BufferedSocket.h"
+#include "dcpp/ResourceManager.h"
+#include "dcpp/SettingsManager.h"
+#include "dcpp/TimerManager.h"
+#include "dcpp/ThrottleManager.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/resource.h>
+
+using namespace dcpp;
+
+namespace {
+
+enum { SLOW_EVERY = 10, SLOW_MS = 200, TIMEOUT = 120000 };
+/** Round trips this slow mean that an I/O thread waited for slow replies of other connections */
+enum { MAX_FAST_MS = SLOW_MS * SLOW_EVERY };
+
+std::atomic<int> done(0);
+std::atomic<int> failed(0);
+std::atomic<uint64_t> worstFast(0);
+
+/** One end of a connection; clients send rounds lines, servers echo them, slowly if asked to */
+class Peer : public BufferedSocketListener {
+public:
+    Peer(bool client_, bool slow_ = false, int rounds_ = 0) : sock(BufferedSocket::getSocket('\n')), client(client_),
+        slow(slow_), rounds(rounds_), sentAt(0)
+    {
+        sock->addListener(this);
+    }
+
+    BufferedSocket* sock;
+
+private:
+    bool client;
+    bool slow;
+    int rounds;
+    uint64_t sentAt;
+
+    void ping() {
+        sentAt = GET_TICK();
+        sock->write(slow ? "slow\n" : "fast\n");
+    }
+
+    virtual void on(Connected) noexcept {
+        ping();
+    }
+
+    virtual void on(Line, const string& aLine) noexcept {
+        if(!client) {
+            if(aLine == "slow") {
+                // As a listener reading a file from a busy disk would
+                BufferedSocket* s = sock;
+                sock->offload([s, aLine] {
+                    Thread::sleep(SLOW_MS);
+                    s->write(aLine + "\n");
+                });
+            } else {
+                sock->write(aLine + "\n");
+            }
+            return;
+        }
+
+        if(!slow) {
+            uint64_t took = GET_TICK() - sentAt;
+            uint64_t worst = worstFast;
+            while(took > worst && !worstFast.compare_exchange_weak(worst, took))
+                ;
+        }
+
+        if(--rounds > 0) {
+            ping();
+        } else {
+            ++done;
+        }
+    }
+
+    virtual void on(Failed, const string& aError) noexcept {
+        if(client && rounds > 0) {
+            fprintf(stderr, "connection failed: %s\n", aError.c_str());
+            ++failed;
+        }
+    }
+};
+
+/** @return How many connections the descriptor limit allows, two descriptors each */
+int raiseFileLimit() {
+    rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) != 0)
+        return 100;
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    getrlimit(RLIMIT_NOFILE, &rl);
+    return (int)min<rlim_t>((rl.rlim_cur - 64) / 2, 100000);
+}
+
+}
+
+int main(int argc, char** argv) {
+    int connections = argc > 1 ? atoi(argv[1]) : 2000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 20;
+    bool strict = argc > 3 && strcmp(argv[3], "-strict") == 0;
+
+    int maxConnections = raiseFileLimit();
+    if(connections > maxConnections) {
+        printf("Descriptor limit allows only %d connections\n", maxConnections);
+        connections = maxConnections;
+    }
+
+    Util::initialize();
+    ResourceManager::newInstance();
+    SettingsManager::newInstance();
+    TimerManager::newInstance();
+    ThrottleManager::newInstance();
+
+    Socket server;
+    server.create();
+    uint16_t port = server.bind(0, "127.0.0.1");
+    server.listen();
+
+    vector<Peer*> peers;
+    uint64_t start = GET_TICK();
+    int accepted = 0;
+    bool ok = true;
+
+    try {
+        for(int i = 0; i < connections; ++i) {
+            Peer* p = new Peer(true, i % SLOW_EVERY == 0, rounds);
+            peers.push_back(p);
+            p->sock->connect("127.0.0.1", port, false, false, false);
+
+            // Accept as we go, the listen backlog is short
+            while(accepted <= i && (server.wait(i + 1 == connections ? 1000 : 0, Socket::WAIT_READ) & Socket::WAIT_READ)) {
+                Peer* s = new Peer(false);
+                peers.push_back(s);
+                s->sock->accept(server, false, false);
+                ++accepted;
+            }
+        }
+        while(accepted < connections && GET_TICK() < start + TIMEOUT) {
+            if(server.wait(1000, Socket::WAIT_READ) & Socket::WAIT_READ) {
+                Peer* s = new Peer(false);
+                peers.push_back(s);
+                s->sock->accept(server, false, false);
+                ++accepted;
+            }
+        }
+    } catch(const Exception& e) {
+        fprintf(stderr, "setting up connections failed: %s\n", e.getError().c_str());
+        ok = false;
+    }
+
+    while(ok && done + failed < connections && GET_TICK() < start + TIMEOUT)
+        Thread::sleep(100);
+
+    uint64_t took = GET_TICK() - start;
+    printf("%d connections, %d rounds: %d done, %d failed in %u ms; slowest fast round trip %u ms\n",
+        connections, rounds, (int)done, (int)failed, (unsigned)took, (unsigned)worstFast);
+
+    for(auto i = peers.begin(); i != peers.end(); ++i)
+        BufferedSocket::putSocket((*i)->sock);
+    BufferedSocket::waitShutdown();
+    for(auto i = peers.begin(); i != peers.end(); ++i)
+        delete *i;
+
+    ThrottleManager::deleteInstance();
+    TimerManager::deleteInstance();
+    SettingsManager::deleteInstance();
+    ResourceManager::deleteInstance();
+
+    if(!ok || done != connections) {
+        printf("FAILED: not every connection finished its rounds\n");
+        return 1;
+    }
+    if(strict && worstFast >= MAX_FAST_MS) {
+        printf("FAILED: fast connections were held up by the slow ones\n");
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,206 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Simulates uploads through ThrottleManager to check how smooth and fair the
+ * limit is: greedy connections and peers slower than their share send to
+ * sockets that don't touch the network, each from a thread of its own. The
+ * total must not go over the limit and every connection has to get some of
+ * it. How close the total stays to the limit in every interval, how equal the
+ * greedy connections' shares are and whether the slow peers get all they can
+ * take depend on the scheduling of the machine, so they are only checked with
+ * -strict.
+ *
+ * Usage: throttle-simulation [seconds] [-strict]
+ */
+
+#include "dcpp/stdinc.h"
+#include "dcpp/ResourceManager.h"
+#include "dcpp/SettingsManager.h"
+#include "dcpp/Socket.h"
+#include "dcpp/Thread.h"
+#include "dcpp/ThrottleManager.h"
+#include "dcpp/TimerManager.h"
+
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace dcpp;
+
+namespace {
+
+enum {
+    LIMIT = 4096,           // KiB/s
+    GREEDY = 6,
+    SLOW = 2,
+    SLOW_RATE = LIMIT / 32, // KiB/s, well below a fair share
+    INTERVAL = 200,         // ms
+    WARMUP = 500            // ms
+};
+
+std::atomic<bool> stop(false);
+
+/** A socket that takes everything at once, or at most rate KiB/s for a slow peer */
+class SimSocket : public Socket {
+public:
+    SimSocket(int rate_) : rate(rate_), allowance(0), last(GET_TICK()) { }
+
+    virtual int write(const void*, int aLen) {
+        if(rate == 0)
+            return aLen;
+
+        uint64_t now = GET_TICK();
+        allowance = min(allowance + (int64_t)(now - last) * rate * 1024 / 1000, (int64_t)rate * 1024 / 10);
+        last = now;
+        int n = (int)min((int64_t)aLen, allowance);
+        allowance -= n;
+        return n > 0 ? n : -1;
+    }
+
+private:
+    int rate;
+    int64_t allowance;
+    uint64_t last;
+};
+
+/**
+ * One upload, sending as BufferedSocket::sendFile does: a blocked write is repeated with the same
+ * size and without taking tokens again, and the sender waits a tick when throttled
+ */
+class Sender : public Thread {
+public:
+    Sender(int rate) : sent(0), sock(rate) { }
+
+    std::atomic<int64_t> sent;
+
+private:
+    SimSocket sock;
+    ThrottleManager::Bucket bucket;
+
+    virtual int run() {
+        vector<uint8_t> buf(64 * 1024);
+        size_t retry = 0;
+        while(!stop) {
+            size_t len = retry != 0 ? retry : buf.size();
+            int n = retry != 0 ? sock.write(&buf[0], (int)retry) : ThrottleManager::getInstance()->write(bucket, &sock, &buf[0], len);
+            if(n > 0) {
+                retry = retry > (size_t)n ? retry - n : 0;
+                sent += n;
+            } else if(n == ThrottleManager::THROTTLED) {
+                Thread::sleep(ThrottleManager::REFILL_INTERVAL);
+            } else {
+                retry = len;
+                Thread::sleep(5);
+            }
+        }
+        bucket.release();
+        return 0;
+    }
+};
+
+}
+
+int main(int argc, char** argv) {
+    int seconds = argc > 1 ? atoi(argv[1]) : 5;
+    bool strict = argc > 2 && strcmp(argv[2], "-strict") == 0;
+
+    Util::initialize();
+    ResourceManager::newInstance();
+    SettingsManager::newInstance();
+    TimerManager::newInstance();
+    ThrottleManager::newInstance();
+
+    SettingsManager::getInstance()->set(SettingsManager::THROTTLE_ENABLE, true);
+    SettingsManager::getInstance()->set(SettingsManager::TIME_DEPENDENT_THROTTLE, false);
+    SettingsManager::getInstance()->set(SettingsManager::MAX_UPLOAD_SPEED_MAIN, LIMIT);
+
+    vector<Sender*> senders;
+    for(int i = 0; i < GREEDY + SLOW; ++i) {
+        senders.push_back(new Sender(i < GREEDY ? 0 : SLOW_RATE));
+        senders.back()->start();
+    }
+
+    Thread::sleep(WARMUP);
+
+    // Bytes per connection at the start of each interval
+    vector<vector<int64_t> > samples;
+    int intervals = seconds * 1000 / INTERVAL;
+    uint64_t start = GET_TICK();
+    for(int i = 0; i <= intervals; ++i) {
+        vector<int64_t> sample;
+        for(auto j = senders.begin(); j != senders.end(); ++j)
+            sample.push_back((*j)->sent);
+        samples.push_back(sample);
+        uint64_t next = start + (i + 1) * INTERVAL, now = GET_TICK();
+        if(i < intervals && next > now)
+            Thread::sleep(next - now);
+    }
+    double elapsed = (GET_TICK() - start) / 1000.0;
+
+    stop = true;
+    for(auto i = senders.begin(); i != senders.end(); ++i) {
+        (*i)->join();
+        delete *i;
+    }
+
+    // Smoothness: spread of the total rate over the intervals
+    double sum = 0, sumSq = 0, worst = 0;
+    for(int i = 0; i < intervals; ++i) {
+        int64_t total = 0;
+        for(size_t j = 0; j < samples[i].size(); ++j)
+            total += samples[i + 1][j] - samples[i][j];
+        double rate = total / 1024.0 * 1000 / INTERVAL;
+        sum += rate;
+        sumSq += rate * rate;
+        worst = max(worst, fabs(rate - LIMIT) / LIMIT);
+    }
+    double mean = sum / intervals;
+    double cv = sqrt(max(sumSq / intervals - mean * mean, 0.0)) / mean;
+
+    // Fairness: Jain's index of the greedy connections, and what the slow ones got
+    double greedySum = 0, greedySq = 0, slowWorst = 1, worstShare = LIMIT;
+    for(int j = 0; j < GREEDY + SLOW; ++j) {
+        double rate = (samples[intervals][j] - samples[0][j]) / 1024.0 / elapsed;
+        printf("connection %d (%s): %.0f KiB/s\n", j, j < GREEDY ? "greedy" : "slow", rate);
+        worstShare = min(worstShare, rate);
+        if(j < GREEDY) {
+            greedySum += rate;
+            greedySq += rate * rate;
+        } else {
+            slowWorst = min(slowWorst, rate / SLOW_RATE);
+        }
+    }
+    double jain = greedySum * greedySum / (GREEDY * greedySq);
+
+    printf("limit %d KiB/s: mean %.0f KiB/s, variation %.3f, worst interval off by %.1f%%\n",
+        (int)LIMIT, mean, cv, worst * 100);
+    printf("fairness %.3f among greedy connections, slow peers got %.0f%% of their rate\n", jain, slowWorst * 100);
+
+    ThrottleManager::deleteInstance();
+    TimerManager::deleteInstance();
+    SettingsManager::deleteInstance();
+    ResourceManager::deleteInstance();
+
+    // Tokens are only handed out at the limit, whatever the timing; a busy machine may use less of it
+    bool ok = mean < LIMIT * 1.1 && mean > LIMIT * 0.25 && worstShare > 0;
+    if(strict)
+        ok = ok && fabs(mean - LIMIT) < LIMIT * 0.05 && cv < 0.1 && jain > 0.95 && slowWorst > 0.8;
+    printf(ok ? "OK\n" : "FAILED\n");
+    return ok ? 0 : 1;
+}
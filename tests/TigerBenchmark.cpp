@@ -0,0 +1,108 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Compares TigerHash::hashMulti with hashing the same messages one by one:
+ * the hashes have to be identical for every message length around the block
+ * and padding boundaries, and the throughput of both is reported for tree
+ * leaves of 1024 bytes.
+ *
+ * Usage: tiger-benchmark [MiB]
+ */
+
+#include "dcpp/stdinc.h"
+#include "dcpp/TigerHash.h"
+#include "dcpp/TimerManager.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace dcpp;
+
+namespace {
+
+const size_t LEAF = 1024;
+
+void hashOneByOne(const uint8_t* const* data, size_t len, uint8_t prefix, size_t count, uint8_t* out) {
+    for(size_t i = 0; i < count; ++i) {
+        TigerHash h;
+        h.update(&prefix, 1);
+        h.update(data[i], len);
+        memcpy(out + i * TigerHash::BYTES, h.finalize(), TigerHash::BYTES);
+    }
+}
+
+/** @return Throughput in MiB/s */
+template<typename F>
+double measure(F hash, const vector<const uint8_t*>& msgs, uint8_t* out, int rounds) {
+    uint64_t start = GET_TICK();
+    for(int r = 0; r < rounds; ++r)
+        hash(&msgs[0], LEAF, 0, msgs.size(), out);
+    uint64_t took = max(GET_TICK() - start, (uint64_t)1);
+    return (double)msgs.size() * LEAF * rounds / (1024 * 1024) / (took / 1000.0);
+}
+
+} // unnamed namespace
+
+int main(int argc, char** argv) {
+    int mib = argc > 1 ? atoi(argv[1]) : 256;
+
+    vector<uint8_t> data(8 * 1024 * 1024);
+    srand(1);
+    for(size_t i = 0; i < data.size(); ++i)
+        data[i] = (uint8_t)rand();
+
+    int failures = 0;
+
+    // Lengths on either side of the block size and of the room left for the padding
+    const size_t lengths[] = { 0, 1, 54, 55, 56, 62, 63, 64, 118, 119, 120, 127, 128, 1000, LEAF, 1025 };
+    // Counts that do and don't fill the lanes
+    const size_t counts[] = { 1, TigerHash::LANES - 1, TigerHash::LANES, 2 * TigerHash::LANES + 1 };
+    for(size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); ++l) {
+        for(size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); ++c) {
+            vector<const uint8_t*> msgs;
+            for(size_t i = 0; i < counts[c]; ++i)
+                msgs.push_back(&data[i * 4099 % (data.size() - 2048)]);
+            for(int prefix = 0; prefix < 2; ++prefix) {
+                vector<uint8_t> expected(counts[c] * TigerHash::BYTES), got(expected.size());
+                hashOneByOne(&msgs[0], lengths[l], (uint8_t)prefix, msgs.size(), &expected[0]);
+                TigerHash::hashMulti(&msgs[0], lengths[l], (uint8_t)prefix, msgs.size(), &got[0]);
+                if(expected != got) {
+                    printf("FAIL: length %u, %u messages, prefix %d\n", (unsigned)lengths[l], (unsigned)counts[c], prefix);
+                    failures++;
+                }
+            }
+        }
+    }
+
+    // Throughput over leaves spread through the buffer, as the tree hands them over
+    vector<const uint8_t*> leaves;
+    for(size_t pos = 0; pos + LEAF <= data.size(); pos += LEAF)
+        leaves.push_back(&data[pos]);
+    vector<uint8_t> out(leaves.size() * TigerHash::BYTES);
+    int rounds = max(1, mib / (int)(data.size() / (1024 * 1024)));
+
+    double single = measure(hashOneByOne, leaves, &out[0], rounds);
+    double multi = measure(TigerHash::hashMulti, leaves, &out[0], rounds);
+    printf("leaves of %u bytes (%s): one by one %.0f MiB/s, %d lanes %.0f MiB/s (%.2fx)\n", (unsigned)LEAF,
+        __builtin_cpu_supports("avx2") ? "AVX2" : "no AVX2, scalar fallback", single, (int)TigerHash::LANES,
+        multi, multi / single);
+
+    if(failures == 0)
+        printf("OK\n");
+    return failures == 0 ? 0 : 1;
+}
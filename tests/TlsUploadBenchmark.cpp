@@ -0,0 +1,254 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Uploads a file over loopback connections, plain and encrypted, once
+ * straight from the file, as uploads of plain files go, and once through a
+ * stream that has to be read into a buffer. Encrypted, the file only goes
+ * straight to the socket when the kernel does the TLS record encryption
+ * (kTLS); otherwise it is written with SSL_write either way. What arrives
+ * has to be the file; reported is the throughput of each, and whether kTLS
+ * was in use.
+ *
+ * Usage: tls-upload-benchmark [MiB]
+ */
+
+#include "dcpp/stdinc.h"
+#include "dcpp/BufferedSocket.h"
+#include "dcpp/ClientManager.h"
+#include "dcpp/CryptoManager.h"
+#include "dcpp/File.h"
+#include "dcpp/LogManager.h"
+#include "dcpp/ResourceManager.h"
+#include "dcpp/SearchManager.h"
+#include "dcpp/SettingsManager.h"
+#include "dcpp/ThrottleManager.h"
+#include "dcpp/TimerManager.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+using namespace dcpp;
+
+namespace {
+
+enum { TIMEOUT = 120000 };
+
+string path;
+string contents;
+
+/** A stream that isn't a File, so that the upload has to read it into a buffer */
+class Buffered : public InputStream {
+public:
+    Buffered(const string& aPath) : f(aPath, File::READ, File::OPEN) { }
+    virtual size_t read(void* buf, size_t& len) { return f.read(buf, len); }
+private:
+    File f;
+};
+
+/** The uploading end: sends the file when asked for it */
+class Uploader : public BufferedSocketListener {
+public:
+    Uploader(bool buffered_) : sock(BufferedSocket::getSocket('\n')), buffered(buffered_), direct(false), done(false),
+        stream(nullptr)
+    {
+        sock->addListener(this);
+    }
+    ~Uploader() { delete stream; }
+
+    BufferedSocket* sock;
+    bool buffered;
+    /** Whether the file went straight to the socket; only that path reports read and sent bytes at once */
+    std::atomic<bool> direct;
+    std::atomic<bool> done;
+
+private:
+    /** Deleted with the uploader, after the socket is done with it */
+    InputStream* stream;
+
+    virtual void on(Line, const string&) noexcept {
+        try {
+            stream = buffered ? static_cast<InputStream*>(new Buffered(path)) : new File(path, File::READ, File::OPEN);
+            sock->transmitFile(stream);
+        } catch(const FileException& e) {
+            fprintf(stderr, "can't open the file: %s\n", e.getError().c_str());
+            done = true;
+        }
+    }
+    virtual void on(BytesSent, size_t read, size_t sent) noexcept {
+        if(read > 0 && sent > 0)
+            direct = true;
+    }
+    virtual void on(TransmitDone) noexcept { }
+    virtual void on(Failed, const string& aError) noexcept {
+        if(!done)
+            fprintf(stderr, "upload failed: %s\n", aError.c_str());
+        done = true;
+    }
+};
+
+/** The downloading end: takes in the file and compares it as it arrives */
+class Downloader : public BufferedSocketListener {
+public:
+    Downloader() : sock(BufferedSocket::getSocket(0)), received(0), ok(true), finished(0) {
+        sock->addListener(this);
+    }
+
+    BufferedSocket* sock;
+    std::atomic<size_t> received;
+    std::atomic<bool> ok;
+    std::atomic<uint64_t> finished;
+
+private:
+    virtual void on(Connected) noexcept {
+        sock->setDataMode(contents.size());
+        sock->write("get\n");
+    }
+    virtual void on(Data, uint8_t* buf, size_t len) noexcept {
+        size_t pos = received;
+        if(pos + len > contents.size() || memcmp(buf, contents.data() + pos, len) != 0)
+            ok = false;
+        received = pos + len;
+        if(received == contents.size())
+            finished = GET_TICK();
+    }
+    virtual void on(Failed, const string& aError) noexcept {
+        if(!finished) {
+            fprintf(stderr, "download failed: %s\n", aError.c_str());
+            ok = false;
+            finished = GET_TICK();
+        }
+    }
+};
+
+/** Uploads the file over a new connection; @return MiB/s, or 0 when it didn't arrive intact */
+double upload(bool secure, bool buffered, bool& direct) {
+    Socket server;
+    server.create();
+    uint16_t port = server.bind(0, "127.0.0.1");
+    server.listen();
+
+    Uploader up(buffered);
+    Downloader down;
+
+    uint64_t start = GET_TICK();
+    bool ok = true;
+    try {
+        down.sock->connect("127.0.0.1", port, secure, true, false);
+        if(!(server.wait(10000, Socket::WAIT_READ) & Socket::WAIT_READ))
+            throw SocketException("nobody connected");
+        up.sock->accept(server, secure, true);
+
+        while(!down.finished && GET_TICK() < start + TIMEOUT)
+            Thread::sleep(10);
+    } catch(const Exception& e) {
+        fprintf(stderr, "connecting failed: %s\n", e.getError().c_str());
+        ok = false;
+    }
+    uint64_t took = max((uint64_t)down.finished - start, (uint64_t)1);
+
+    ok = ok && down.ok && down.received == contents.size();
+    direct = up.direct;
+
+    up.done = true;
+    BufferedSocket::putSocket(up.sock);
+    BufferedSocket::putSocket(down.sock);
+    BufferedSocket::waitShutdown();
+
+    return ok ? contents.size() / (1024.0 * 1024.0) / (took / 1000.0) : 0;
+}
+
+} // unnamed namespace
+
+int main(int argc, char** argv) {
+    int mib = argc > 1 ? atoi(argv[1]) : 256;
+
+    string root = "/tmp/tls-upload-benchmark-" + Util::toString(getpid()) + "/";
+    Util::PathsMap paths;
+    paths[Util::PATH_USER_CONFIG] = root + "config/";
+    paths[Util::PATH_USER_LOCAL] = root + "config/";
+    Util::initialize(paths);
+    File::ensureDirectory(root + "config/");
+
+    ResourceManager::newInstance();
+    SettingsManager::newInstance();
+    LogManager::newInstance();
+    TimerManager::newInstance();
+    SearchManager::newInstance();
+    ClientManager::newInstance();
+    ThrottleManager::newInstance();
+    CryptoManager::newInstance();
+
+    bool ok = true;
+    try {
+        // Not too regular, or the comparison wouldn't catch misplaced data
+        contents.resize((size_t)mib * 1024 * 1024);
+        for(size_t i = 0; i < contents.size(); ++i)
+            contents[i] = (char)(i * 2654435761U >> 24);
+        path = root + "upload.bin";
+        File(path, File::WRITE, File::CREATE | File::TRUNCATE).write(contents);
+
+        // Generates the certificate in config/Certificates/
+        CryptoManager::getInstance()->loadCertificates();
+        if(!CryptoManager::getInstance()->TLSOk())
+            throw Exception("TLS could not be set up");
+
+        const char* names[] = { "plain, from the file", "plain, buffered", "TLS, from the file", "TLS, buffered" };
+        for(int i = 0; i < 4; ++i) {
+            bool direct = false;
+            double speed = upload(i >= 2, i % 2 == 1, direct);
+            if(speed == 0) {
+                printf("FAIL: %s: the file didn't arrive intact\n", names[i]);
+                ok = false;
+                continue;
+            }
+            if(i == 0 && !direct) {
+                printf("FAIL: %s: the file wasn't sent with sendfile\n", names[i]);
+                ok = false;
+            }
+            if(i % 2 == 1 && direct) {
+                printf("FAIL: %s: a stream was sent as a file\n", names[i]);
+                ok = false;
+            }
+            printf("%s: %.0f MiB/s%s\n", names[i], speed, i == 2 ? (direct ? " (kTLS)" : " (no kTLS, SSL_write)") : "");
+        }
+    } catch(const Exception& e) {
+        printf("FAIL: %s\n", e.getError().c_str());
+        ok = false;
+    }
+
+    CryptoManager::deleteInstance();
+    ThrottleManager::deleteInstance();
+    ClientManager::deleteInstance();
+    SearchManager::deleteInstance();
+    TimerManager::deleteInstance();
+    LogManager::deleteInstance();
+    SettingsManager::deleteInstance();
+    ResourceManager::deleteInstance();
+
+    File::deleteFile(path);
+    File::deleteFile(root + "config/Certificates/client.key");
+    File::deleteFile(root + "config/Certificates/client.crt");
+    rmdir((root + "config/Certificates/").c_str());
+    rmdir((root + "config/").c_str());
+    rmdir(root.c_str());
+
+    if(ok)
+        printf("OK\n");
+    return ok ? 0 : 1;
+}